@@ -33,6 +33,12 @@
 #include <errno.h>
 #include <stdarg.h>
 
+#if defined(__SSE2__)
+  #include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  #include <arm_neon.h>
+#endif
+
 #ifndef WIN32
   /* for inet_aton() IP validation
   */
@@ -739,24 +745,76 @@ append_msg_to_buf(char *buf, size_t buf_size, const char* msg, ...)
 }
 
 /* Determine if a buffer contains only characters from the base64
- * encoding set
+ * encoding set.  This only accepts ASCII, whatever the locale says
+ * isalnum() is, as b64_decode() does.  16 bytes are checked at a time
+ * with SSE2 (always there on x86_64) or NEON.
 */
+#define IS_B64_CHAR(c)  (((c) >= 'A' && (c) <= 'Z') \
+                        || ((c) >= 'a' && (c) <= 'z') \
+                        || ((c) >= '0' && (c) <= '9') \
+                        || (c) == '/' || (c) == '+' || (c) == '=')
+
+#if defined(__SSE2__)
+
+#define B64_IN_RANGE(c, lo, hi) _mm_and_si128( \
+        _mm_cmpgt_epi8((c), _mm_set1_epi8((lo) - 1)), \
+        _mm_cmplt_epi8((c), _mm_set1_epi8((hi) + 1)))
+
+static int
+is_base64_16(const unsigned char * const buf)
+{
+    __m128i c  = _mm_loadu_si128((const __m128i *)buf);
+    __m128i ok = _mm_or_si128(
+            _mm_or_si128(B64_IN_RANGE(c, 'A', 'Z'), B64_IN_RANGE(c, 'a', 'z')),
+            _mm_or_si128(B64_IN_RANGE(c, '0', '9'),
+                _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('/')),
+                    _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('+')),
+                        _mm_cmpeq_epi8(c, _mm_set1_epi8('='))))));
+
+    /* Bytes above 0x7f compare as negative, so never in range
+    */
+    return _mm_movemask_epi8(ok) == 0xffff;
+}
+#define HAVE_IS_BASE64_16 1
+
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+
+#define B64_IN_RANGE(c, lo, hi) vandq_u8(vcgeq_u8((c), vdupq_n_u8(lo)), \
+        vcleq_u8((c), vdupq_n_u8(hi)))
+
+static int
+is_base64_16(const unsigned char * const buf)
+{
+    uint8x16_t c  = vld1q_u8(buf);
+    uint8x16_t ok = vorrq_u8(
+            vorrq_u8(B64_IN_RANGE(c, 'A', 'Z'), B64_IN_RANGE(c, 'a', 'z')),
+            vorrq_u8(B64_IN_RANGE(c, '0', '9'),
+                vorrq_u8(vceqq_u8(c, vdupq_n_u8('/')),
+                    vorrq_u8(vceqq_u8(c, vdupq_n_u8('+')),
+                        vceqq_u8(c, vdupq_n_u8('='))))));
+
+    return vminvq_u8(ok) == 0xff;
+}
+#define HAVE_IS_BASE64_16 1
+
+#endif
+
 int
 is_base64(const unsigned char * const buf, const unsigned short int len)
 {
-    unsigned short int  i;
-    int                 rv = 1;
+    unsigned short int  i = 0;
 
-    for(i=0; i<len; i++)
-    {
-        if(!(isalnum(buf[i]) || buf[i] == '/' || buf[i] == '+' || buf[i] == '='))
-        {
-            rv = 0;
-            break;
-        }
-    }
+#if HAVE_IS_BASE64_16
+    for(; i + 16 <= len; i += 16)
+        if(! is_base64_16(buf + i))
+            return 0;
+#endif
+
+    for(; i<len; i++)
+        if(! IS_B64_CHAR(buf[i]))
+            return 0;
 
-    return rv;
+    return 1;
 }
 
 /**
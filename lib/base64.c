@@ -36,6 +36,29 @@
 #include "base64.h"
 #include "fko_common.h"
 
+/* The vector code is used for whole groups of input and hands the rest
+ * to the scalar code below, which stays the reference for what is valid.
+ * On x86 it needs SSSE3, checked once at run time.  NEON is always there
+ * on aarch64.
+*/
+#if !AFL_FUZZING
+  #if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) \
+          || (defined(__GNUC__) && (__GNUC__ > 4 \
+              || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+    #define B64_SSSE3 1
+    #include <cpuid.h>
+    #include <tmmintrin.h>
+  #elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(__AARCH64EB__)
+    #define B64_NEON 1
+    #include <arm_neon.h>
+  #endif
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+  #include "cunit_common.h"
+DECLARE_TEST_SUITE(base64, "Base64 test suite");
+#endif
+
 #if !AFL_FUZZING
 static unsigned char map2[] =
 {
@@ -52,6 +75,245 @@ static unsigned char map2[] =
 };
 #endif
 
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#if B64_SSSE3 || B64_NEON
+
+/* -1 until the CPU has been checked
+*/
+static int simd = -1;
+
+int
+b64_simd(void)
+{
+    int s = __atomic_load_n(&simd, __ATOMIC_RELAXED);
+
+    if(s < 0)
+    {
+#if B64_SSSE3
+        unsigned int a, b, c, d;
+
+        s = __get_cpuid(1, &a, &b, &c, &d) && (c & bit_SSSE3);
+#else
+        s = 1;
+#endif
+        __atomic_store_n(&simd, s, __ATOMIC_RELAXED);
+    }
+    return s;
+}
+
+int
+b64_set_simd(const int on)
+{
+    if(on)
+    {
+        __atomic_store_n(&simd, -1, __ATOMIC_RELAXED);
+        return b64_simd() ? 0 : -1;
+    }
+    __atomic_store_n(&simd, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+#else
+
+int
+b64_simd(void)
+{
+    return 0;
+}
+
+int
+b64_set_simd(const int on)
+{
+    return on ? -1 : 0;
+}
+
+#endif /* B64_SSSE3 || B64_NEON */
+
+#if B64_SSSE3
+
+#define SSSE3_TARGET    __attribute__((target("ssse3")))
+
+/* Decode 16 characters at a time for as long as they are all valid and
+ * none of them is '='.  Returns how many characters were done, always a
+ * multiple of 4, leaving 3 bytes of output for every 4 of them.
+ *
+ * Each character is checked by looking up one bit for its high nibble in
+ * a table indexed by its low nibble, then mapped by adding an offset
+ * picked by its high nibble ('/' being the one exception).
+*/
+SSSE3_TARGET static int
+decode_simd(const char *in, const int len, unsigned char *out)
+{
+    const __m128i   lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11,
+                        0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b,
+                        0x1b, 0x1a);
+    const __m128i   lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04,
+                        0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                        0x10, 0x10);
+    const __m128i   lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71,
+                        -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i   pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13,
+                        12, -1, -1, -1, -1);
+    const __m128i   nibble = _mm_set1_epi8(0x0f);
+    __m128i         c, hi, lo, v;
+    uint32_t        w;
+    int             i;
+
+    for(i=0; i + 16 <= len; i+=16)
+    {
+        c  = _mm_loadu_si128((const __m128i *)(in + i));
+        hi = _mm_and_si128(_mm_srli_epi32(c, 4), nibble);
+        lo = _mm_and_si128(c, nibble);
+
+        if(_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(
+                    _mm_shuffle_epi8(lut_lo, lo),
+                    _mm_shuffle_epi8(lut_hi, hi)), _mm_setzero_si128())))
+            break;
+
+        v = _mm_add_epi8(c, _mm_shuffle_epi8(lut_roll, _mm_add_epi8(hi,
+                        _mm_cmpeq_epi8(c, _mm_set1_epi8('/')))));
+
+        /* Four 6 bit values to three bytes in each 32 bit lane
+        */
+        v = _mm_maddubs_epi16(v, _mm_set1_epi32(0x01400140));
+        v = _mm_madd_epi16(v, _mm_set1_epi32(0x00011000));
+        v = _mm_shuffle_epi8(v, pack);
+
+        _mm_storel_epi64((__m128i *)out, v);
+        w = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+        memcpy(out + 8, &w, sizeof(w));
+        out += 12;
+    }
+    return i;
+}
+
+/* Encode 12 bytes at a time into 16 characters.  Every load reads 16
+ * bytes, so this stops while there are still at least 4 more.  Returns
+ * how many bytes were done, always a multiple of 3.
+*/
+SSSE3_TARGET static int
+encode_simd(const unsigned char *in, const int len, char *out)
+{
+    const __m128i   spread = _mm_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8,
+                        7, 10, 9, 11, 10);
+    const __m128i   lut = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52,
+                        '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                        '0' - 52, '0' - 52, '0' - 52, '+' - 62, '/' - 63, 'A',
+                        0, 0);
+    __m128i         v, idx;
+    int             i;
+
+    for(i=0; i + 16 <= len; i+=12)
+    {
+        v = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(in + i)),
+                spread);
+
+        /* The four 6 bit values of each 3 bytes, one per byte
+        */
+        v = _mm_or_si128(
+                _mm_mulhi_epu16(_mm_and_si128(v, _mm_set1_epi32(0x0fc0fc00)),
+                    _mm_set1_epi32(0x04000040)),
+                _mm_mullo_epi16(_mm_and_si128(v, _mm_set1_epi32(0x003f03f0)),
+                    _mm_set1_epi32(0x01000010)));
+
+        /* 0..25 to 13, 26..51 to 0, 52..61 to 1..10, 62 and 63 to 11
+         * and 12: which offset to add from lut
+        */
+        idx = _mm_subs_epu8(v, _mm_set1_epi8(51));
+        idx = _mm_or_si128(idx, _mm_and_si128(_mm_cmpgt_epi8(
+                        _mm_set1_epi8(26), v), _mm_set1_epi8(13)));
+        v   = _mm_add_epi8(v, _mm_shuffle_epi8(lut, idx));
+
+        _mm_storeu_si128((__m128i *)out, v);
+        out += 16;
+    }
+    return i;
+}
+
+#elif B64_NEON
+
+/* Decode 64 characters at a time for as long as they are all valid and
+ * none of them is '='.  Returns how many characters were done, leaving 3
+ * bytes of output for every 4 of them.  The lookup goes through map2[]
+ * itself.
+*/
+static int
+decode_simd(const char *in, const int len, unsigned char *out)
+{
+    uint8x16x4_t    t0, c;
+    uint8x16x2_t    t1;
+    uint8x16_t      v[4], bad;
+    uint8x16x3_t    o;
+    int             i, j;
+
+    for(j=0; j < 4; j++)
+        t0.val[j] = vld1q_u8(map2 + 16*j);
+    t1.val[0] = vld1q_u8(map2 + 64);
+    t1.val[1] = vdupq_n_u8(0xff);
+
+    for(i=0; i + 64 <= len; i+=64)
+    {
+        c   = vld4q_u8((const uint8_t *)in + i);
+        bad = vdupq_n_u8(0);
+        for(j=0; j < 4; j++)
+        {
+            uint8x16_t idx = vsubq_u8(c.val[j], vdupq_n_u8(43));
+
+            v[j] = vorrq_u8(vqtbl4q_u8(t0, idx),
+                    vqtbl2q_u8(t1, vsubq_u8(idx, vdupq_n_u8(64))));
+            bad  = vorrq_u8(bad, vorrq_u8(vceqq_u8(v[j], vdupq_n_u8(0xff)),
+                        vcgeq_u8(idx, vdupq_n_u8(sizeof(map2)))));
+        }
+        if(vmaxvq_u8(bad))
+            break;
+
+        o.val[0] = vorrq_u8(vshlq_n_u8(v[0], 2), vshrq_n_u8(v[1], 4));
+        o.val[1] = vorrq_u8(vshlq_n_u8(v[1], 4), vshrq_n_u8(v[2], 2));
+        o.val[2] = vorrq_u8(vshlq_n_u8(v[2], 6), v[3]);
+        vst3q_u8(out, o);
+        out += 48;
+    }
+    return i;
+}
+
+/* Encode 48 bytes at a time into 64 characters.  Returns how many bytes
+ * were done.
+*/
+static int
+encode_simd(const unsigned char *in, const int len, char *out)
+{
+    uint8x16x4_t    t, o;
+    uint8x16x3_t    b;
+    int             i, j;
+
+    for(j=0; j < 4; j++)
+        t.val[j] = vld1q_u8((const uint8_t *)b64 + 16*j);
+
+    for(i=0; i + 48 <= len; i+=48)
+    {
+        b = vld3q_u8(in + i);
+
+        o.val[0] = vshrq_n_u8(b.val[0], 2);
+        o.val[1] = vandq_u8(vorrq_u8(vshlq_n_u8(b.val[0], 4),
+                    vshrq_n_u8(b.val[1], 4)), vdupq_n_u8(0x3f));
+        o.val[2] = vandq_u8(vorrq_u8(vshlq_n_u8(b.val[1], 2),
+                    vshrq_n_u8(b.val[2], 6)), vdupq_n_u8(0x3f));
+        o.val[3] = vandq_u8(b.val[2], vdupq_n_u8(0x3f));
+
+        o.val[0] = vqtbl4q_u8(t, o.val[0]);
+        o.val[1] = vqtbl4q_u8(t, o.val[1]);
+        o.val[2] = vqtbl4q_u8(t, o.val[2]);
+        o.val[3] = vqtbl4q_u8(t, o.val[3]);
+        vst4q_u8((uint8_t *)out, o);
+        out += 64;
+    }
+    return i;
+}
+
+#endif /* B64_SSSE3 */
+
 int
 b64_decode(const char *in, unsigned char *out)
 {
@@ -68,6 +330,13 @@ b64_decode(const char *in, unsigned char *out)
     for (i = 0; in[i]; i++)
         *dst++ = in[i];
 #else
+#if B64_SSSE3 || B64_NEON
+    if (b64_simd()) {
+        i = decode_simd(in, strlen(in), dst);
+        in  += i;
+        dst += i / 4 * 3;
+    }
+#endif
     v = 0;
     for (i = 0; in[i] && in[i] != '='; i++) {
         unsigned int index= in[i]-43;
@@ -96,14 +365,22 @@ b64_decode(const char *in, unsigned char *out)
 int
 b64_encode(unsigned char *in, char *out, int in_len)
 {
-    static const char b64[] =
-        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
     unsigned i_bits = 0;
     int i_shift = 0;
     int bytes_remaining = in_len;
 
     char *dst = out;
 
+#if B64_SSSE3 || B64_NEON
+    if (in_len > 0 && b64_simd()) {
+        int done = encode_simd(in, in_len, dst);
+
+        in  += done;
+        dst += done / 3 * 4;
+        bytes_remaining -= done;
+    }
+#endif
+
     if (in_len > 0) { /* Special edge case, what should we really do here? */
         while (bytes_remaining) {
             i_bits = (i_bits << 8) + *in++;
@@ -136,4 +413,139 @@ strip_b64_eq(char *data)
         *ndx = '\0';
 }
 
+#ifdef HAVE_C_UNIT_TESTS
+
+#define FUZZ_ROUNDS     20000
+#define FUZZ_MAX_LEN    300
+
+static unsigned int fuzz_seed = 1;
+
+static unsigned int
+fuzz_rand(void)
+{
+    fuzz_seed = fuzz_seed * 1103515245 + 12345;
+    return fuzz_seed >> 8;
+}
+
+/* Mostly base64, now and then a byte that is not or padding, so that the
+ * vector code has to give up at every possible position.
+*/
+static int
+fuzz_b64_str(char *buf)
+{
+    int i, len = fuzz_rand() % FUZZ_MAX_LEN;
+
+    for(i=0; i < len; i++)
+    {
+        switch(fuzz_rand() % 200)
+        {
+            case 0:
+                buf[i] = '=';
+                break;
+            case 1:
+                buf[i] = fuzz_rand() & 0xff;
+                break;
+            default:
+                buf[i] = b64[fuzz_rand() % 64];
+                break;
+        }
+    }
+    buf[i] = '\0';
+    return len;
+}
+
+/* is_base64() as it was, with isalnum() in the C locale
+*/
+static int
+is_base64_ref(const unsigned char * const buf, const unsigned short int len)
+{
+    unsigned short int i;
+
+    for(i=0; i<len; i++)
+        if(!(isalnum(buf[i]) || buf[i] == '/' || buf[i] == '+' || buf[i] == '='))
+            return 0;
+    return 1;
+}
+
+DECLARE_UTEST(decode_fuzz, "SIMD and scalar base64 decoding agree")
+{
+    char            in[FUZZ_MAX_LEN+1];
+    unsigned char   out_simd[FUZZ_MAX_LEN+1], out_scalar[FUZZ_MAX_LEN+1];
+    int             i, len, res_simd, res_scalar, bad = 0;
+
+    if(! b64_simd())
+        return;
+
+    for(i=0; i < FUZZ_ROUNDS; i++)
+    {
+        len = fuzz_b64_str(in);
+
+        res_simd = b64_decode(in, out_simd);
+        CU_ASSERT(b64_set_simd(0) == 0);
+        res_scalar = b64_decode(in, out_scalar);
+        CU_ASSERT(b64_set_simd(1) == 0);
+
+        if(res_simd != res_scalar || (res_simd >= 0
+                    && memcmp(out_simd, out_scalar, res_simd + 1) != 0))
+            bad++;
+        CU_ASSERT(res_simd <= len);
+    }
+    CU_ASSERT(bad == 0);
+}
+
+DECLARE_UTEST(encode_fuzz, "SIMD and scalar base64 encoding agree")
+{
+    unsigned char   in[FUZZ_MAX_LEN], dec[FUZZ_MAX_LEN+1];
+    char            out_simd[FUZZ_MAX_LEN*2], out_scalar[FUZZ_MAX_LEN*2];
+    int             i, j, len, res_simd, res_scalar, bad = 0;
+
+    if(! b64_simd())
+        return;
+
+    for(i=0; i < FUZZ_ROUNDS; i++)
+    {
+        len = fuzz_rand() % FUZZ_MAX_LEN;
+        for(j=0; j < len; j++)
+            in[j] = fuzz_rand() & 0xff;
+
+        res_simd = b64_encode(in, out_simd, len);
+        CU_ASSERT(b64_set_simd(0) == 0);
+        res_scalar = b64_encode(in, out_scalar, len);
+        CU_ASSERT(b64_set_simd(1) == 0);
+
+        if(res_simd != res_scalar || strcmp(out_simd, out_scalar) != 0)
+            bad++;
+        if(b64_decode(out_simd, dec) != len || memcmp(dec, in, len) != 0)
+            bad++;
+    }
+    CU_ASSERT(bad == 0);
+}
+
+DECLARE_UTEST(is_base64_fuzz, "is_base64() agrees with the isalnum() check")
+{
+    char            in[FUZZ_MAX_LEN+1];
+    int             i, len, bad = 0;
+
+    for(i=0; i < FUZZ_ROUNDS; i++)
+    {
+        len = fuzz_b64_str(in);
+        if(is_base64((unsigned char *)in, len)
+                != is_base64_ref((unsigned char *)in, len))
+            bad++;
+    }
+    CU_ASSERT(bad == 0);
+}
+
+int register_ts_base64(void)
+{
+    ts_init(&TEST_SUITE(base64), TEST_SUITE_DESCR(base64), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(base64), UTEST_FCT(decode_fuzz), UTEST_DESCR(decode_fuzz));
+    ts_add_utest(&TEST_SUITE(base64), UTEST_FCT(encode_fuzz), UTEST_DESCR(encode_fuzz));
+    ts_add_utest(&TEST_SUITE(base64), UTEST_FCT(is_base64_fuzz), UTEST_DESCR(is_base64_fuzz));
+
+    return register_ts(&TEST_SUITE(base64));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
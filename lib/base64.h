@@ -37,6 +37,13 @@ int b64_encode(unsigned char *in, char *out, int in_len);
 int b64_decode(const char *in, unsigned char *out);
 void strip_b64_eq(char *data);
 
+/* Whether b64_decode() and b64_encode() use the SSSE3 or NEON code,
+ * and a switch back to the scalar code for tests and benchmarks
+ * (b64_set_simd() returns -1 if the CPU cannot do it).
+*/
+int b64_simd(void);
+int b64_set_simd(const int on);
+
 #endif /* BASE64_H */
 
 /***EOF***/
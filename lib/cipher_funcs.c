@@ -113,20 +113,21 @@ get_random_data(unsigned char *data, const size_t len)
 
 /* Rijndael function to generate initial salt and initialization vector
  * (iv).  This is is done to be compatible with the data produced via OpenSSL
+ * (it is the perl Crypt::CBC way, with a touch of fwknop).  The 48 bytes
+ * of key and iv are three chained MD5 digests of the password and salt,
+ * which are written straight into the context.
 */
 static void
 rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
         const int key_len, const unsigned char *data, const int mode_flag)
 {
-    char            pw_buf[RIJNDAEL_MAX_KEYSIZE] = {0};
-    unsigned char   tmp_buf[MD5_DIGEST_LEN+RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0};
-    unsigned char   kiv_buf[RIJNDAEL_MAX_KEYSIZE+RIJNDAEL_BLOCKSIZE] = {0}; /* Key and IV buffer */
-    unsigned char   md5_buf[MD5_DIGEST_LEN] = {0}; /* Buffer for computed md5 hash */
+    unsigned char   pw_buf[RIJNDAEL_MIN_KEYSIZE];
+    unsigned char  *pw = (unsigned char *)key;
+    unsigned char  *kiv[3] = { ctx->key, ctx->key + MD5_DIGEST_LEN, ctx->iv };
+    MD5Context      md5_ctx;
+    int             final_key_len = key_len, i;
 
-    int             final_key_len = 0;
-    size_t          kiv_len = 0;
-
-    if(mode_flag == FKO_ENC_MODE_CBC_LEGACY_IV)
+    if(mode_flag == FKO_ENC_MODE_CBC_LEGACY_IV && key_len < RIJNDAEL_MIN_KEYSIZE)
     {
         /* Pad the pw with '0' chars up to the minimum Rijndael key size.
          *
@@ -136,22 +137,10 @@ rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
          * other problems.  This code will be removed altogether in a future
          * version of fwknop.
         */
-        if(key_len < RIJNDAEL_MIN_KEYSIZE)
-        {
-            memcpy(pw_buf, key, key_len);
-            memset(pw_buf+key_len, '0', RIJNDAEL_MIN_KEYSIZE - key_len);
-            final_key_len = RIJNDAEL_MIN_KEYSIZE;
-        }
-        else
-        {
-            memcpy(pw_buf, key, key_len);
-            final_key_len = key_len;
-        }
-    }
-    else
-    {
         memcpy(pw_buf, key, key_len);
-        final_key_len = key_len;
+        memset(pw_buf+key_len, '0', RIJNDAEL_MIN_KEYSIZE - key_len);
+        pw = pw_buf;
+        final_key_len = RIJNDAEL_MIN_KEYSIZE;
     }
 
     /* If we are decrypting, data will contain the salt. Otherwise,
@@ -170,32 +159,26 @@ rij_salt_and_iv(RIJNDAEL_context *ctx, const char *key,
         get_random_data(ctx->salt, SALT_LEN);
     }
 
-    /* Now generate the key and initialization vector.
-     * (again it is the perl Crypt::CBC way, with a touch of
-     * fwknop).
+    /* Now generate the key and initialization vector, each digest being
+     * MD5(previous digest + password + salt).
     */
-    memcpy(tmp_buf+MD5_DIGEST_LEN, pw_buf, final_key_len);
-    memcpy(tmp_buf+MD5_DIGEST_LEN+final_key_len, ctx->salt, SALT_LEN);
-
-    while(kiv_len < sizeof(kiv_buf))
+    for(i=0; i < 3; i++)
     {
-        if(kiv_len == 0)
-            md5(md5_buf, tmp_buf+MD5_DIGEST_LEN, final_key_len+SALT_LEN);
-        else
-            md5(md5_buf, tmp_buf, MD5_DIGEST_LEN+final_key_len+SALT_LEN);
-
-        memcpy(tmp_buf, md5_buf, MD5_DIGEST_LEN);
-
-        memcpy(kiv_buf + kiv_len, md5_buf, MD5_DIGEST_LEN);
-
-        kiv_len += MD5_DIGEST_LEN;
+        MD5Init(&md5_ctx);
+        if(i > 0)
+            MD5Update(&md5_ctx, kiv[i-1], MD5_DIGEST_LEN);
+        MD5Update(&md5_ctx, pw, final_key_len);
+        MD5Update(&md5_ctx, ctx->salt, SALT_LEN);
+        MD5Final(kiv[i], &md5_ctx);
     }
 
-    memcpy(ctx->key, kiv_buf, RIJNDAEL_MAX_KEYSIZE);
-    memcpy(ctx->iv,  kiv_buf+RIJNDAEL_MAX_KEYSIZE, RIJNDAEL_BLOCKSIZE);
+    if(pw == pw_buf)
+        zero_buf((char *)pw_buf, sizeof(pw_buf));
+    zero_buf((char *)&md5_ctx, sizeof(md5_ctx));
 }
 
-/* Initialization entry point.
+/* Initialization entry point.  The inverse key schedule is only set up
+ * for decrypting in the modes that need it.
 */
 static void
 rijndael_init(RIJNDAEL_context *ctx, const char *key,
@@ -227,7 +210,11 @@ rijndael_init(RIJNDAEL_context *ctx, const char *key,
 
     /* Intialize our Rijndael context.
     */
-    rijndael_setup(ctx, RIJNDAEL_MAX_KEYSIZE, ctx->key);
+    if(data != NULL && (ctx->mode == MODE_ECB
+                || ctx->mode == MODE_CBC || ctx->mode == MODE_PCBC))
+        rijndael_setup(ctx, RIJNDAEL_MAX_KEYSIZE, ctx->key);
+    else
+        rijndael_setup_encrypt(ctx, RIJNDAEL_MAX_KEYSIZE, ctx->key);
 }
 
 /* Take a chunk of data, encrypt it in the same way OpenSSL would
@@ -281,18 +268,18 @@ rij_decrypt(unsigned char *in, size_t in_len,
     unsigned char      *pad_s;
     unsigned char      *ondx = out;
 
-    if(in == NULL || key == NULL || out == NULL)
+    if(in == NULL || key == NULL || out == NULL
+            || in_len < RIJNDAEL_BLOCKSIZE)
         return 0;
 
     rijndael_init(&ctx, key, key_len, in, encryption_mode);
 
-    /* Remove the first block since it contains the salt (it was consumed
+    /* Skip the first block since it contains the salt (it was consumed
      * by the rijndael_init() function above).
     */
     in_len -= RIJNDAEL_BLOCKSIZE;
-    memmove(in, in+RIJNDAEL_BLOCKSIZE, in_len);
 
-    block_decrypt(&ctx, in, in_len, out, ctx.iv);
+    block_decrypt(&ctx, in+RIJNDAEL_BLOCKSIZE, in_len, out, ctx.iv);
 
     ondx += in_len;
 
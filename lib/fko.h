@@ -324,6 +324,11 @@ typedef enum {
 struct fko_context;
 typedef struct fko_context *fko_ctx_t;
 
+/* A precomputed HMAC key (see fko_new_hmac_key()), also opaque.
+*/
+struct fko_hmac_key;
+typedef struct fko_hmac_key *fko_hmac_key_t;
+
 /* Function pointer for SPA packet field parsing
  */
 typedef int (*field_parser_ptr_t)(char *tbuf, char **ndx, int *t_size, fko_ctx_t ctx);
@@ -353,7 +358,17 @@ DLL_API int fko_new_with_data(fko_ctx_t *ctx, const char * const enc_msg,
     const char * const dec_key, const int dec_key_len, int encryption_mode,
     const char * const hmac_key, const int hmac_key_len, const int hmac_type,
     const uint32_t sdp_id);
+DLL_API int fko_new_with_data_hmac_key(fko_ctx_t *ctx, const char * const enc_msg,
+    const char * const dec_key, const int dec_key_len, int encryption_mode,
+    const fko_hmac_key_t hmac_key, const uint32_t sdp_id);
+DLL_API int fko_new_with_data_hmac_verified(fko_ctx_t *ctx,
+    const char * const enc_msg, const char * const dec_key,
+    const int dec_key_len, int encryption_mode, const int hmac_type,
+    const uint32_t sdp_id);
 DLL_API int fko_destroy(fko_ctx_t ctx);
+DLL_API int fko_new_hmac_key(fko_hmac_key_t *hmac_key, const char * const key,
+    const int key_len, const int hmac_type);
+DLL_API int fko_destroy_hmac_key(fko_hmac_key_t hmac_key);
 DLL_API int fko_spa_data_final(fko_ctx_t ctx, const char * const enc_key,
     const int enc_key_len, const char * const hmac_key, const int hmac_key_len);
 
@@ -405,6 +420,11 @@ DLL_API int fko_verify_hmac(fko_ctx_t ctx, const char * const hmac_key,
     const int hmac_key_len);
 DLL_API int fko_set_spa_hmac(fko_ctx_t ctx, const char * const hmac_key,
     const int hmac_key_len);
+DLL_API int fko_verify_hmac_data(const char * const data, const int data_len,
+    const char * const hmac_key, const int hmac_key_len, const int hmac_type);
+DLL_API int fko_verify_hmac_key(fko_ctx_t ctx, const fko_hmac_key_t hmac_key);
+DLL_API int fko_verify_hmac_data_key(const fko_hmac_key_t hmac_key,
+    const char * const data, const int data_len);
 DLL_API int fko_get_spa_hmac(fko_ctx_t ctx, char **enc_data);
 DLL_API int fko_get_encoded_sdp_id(fko_ctx_t ctx, char **encoded_sdp_id);
 DLL_API int fko_get_encoded_data(fko_ctx_t ctx, char **enc_data);
@@ -474,6 +494,10 @@ DLL_API int fko_gpg_signature_fpr_match(fko_ctx_t ctx, const char * const fpr,
 
 #ifdef HAVE_C_UNIT_TESTS
 int register_ts_fko_decode(void);
+int register_ts_fko_hmac(void);
+int register_ts_fko_encryption(void);
+int register_ts_rijndael_accel(void);
+int register_ts_base64(void);
 #endif
 
 #endif /* FKO_H */
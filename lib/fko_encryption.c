@@ -35,6 +35,10 @@
 #include "digest.h"
 #include "dbg.h"
 
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(fko_encryption, "FKO encryption test suite");
+#endif
+
 #if HAVE_LIBGPGME
   #include "gpgme_funcs.h"
   #if HAVE_SYS_STAT_H
@@ -1211,4 +1215,57 @@ fko_gpg_signature_fpr_match(fko_ctx_t ctx, const char * const id,
 #endif  /* HAVE_LIBGPGME */
 }
 
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_UTEST(decrypt_modes, "Decrypt SPA data in each Rijndael mode")
+{
+    const int       modes[] = { FKO_ENC_MODE_CBC, FKO_ENC_MODE_CTR,
+                        FKO_ENC_MODE_CFB, FKO_ENC_MODE_OFB, FKO_ENC_MODE_ECB,
+                        FKO_ENC_MODE_CBC_LEGACY_IV };
+    fko_ctx_t       ctx = NULL, dec_ctx = NULL;
+    char           *spa_data = NULL, *msg = NULL;
+    const char     *enc_key = "encryption test key";
+    int             i;
+
+    for(i=0; i < (int)(sizeof(modes)/sizeof(modes[0])); i++)
+    {
+        CU_ASSERT(fko_new(&ctx) == FKO_SUCCESS);
+        CU_ASSERT(fko_set_disable_sdp_mode(ctx, 1) == FKO_SUCCESS);
+        CU_ASSERT(fko_set_spa_message(ctx, "1.2.3.4,tcp/22") == FKO_SUCCESS);
+        CU_ASSERT(fko_set_spa_encryption_mode(ctx, modes[i]) == FKO_SUCCESS);
+        CU_ASSERT(fko_spa_data_final(ctx, enc_key, strlen(enc_key),
+                    NULL, 0) == FKO_SUCCESS);
+        CU_ASSERT(fko_get_spa_data(ctx, &spa_data) == FKO_SUCCESS);
+
+        /* a wrong key must not decrypt
+        */
+        CU_ASSERT(fko_new_with_data(&dec_ctx, spa_data, enc_key,
+                    strlen(enc_key) - 1, modes[i], NULL, 0,
+                    FKO_HMAC_UNKNOWN, 0) != FKO_SUCCESS);
+        fko_destroy(dec_ctx);
+        dec_ctx = NULL;
+
+        CU_ASSERT(fko_new_with_data(&dec_ctx, spa_data, enc_key,
+                    strlen(enc_key), modes[i], NULL, 0,
+                    FKO_HMAC_UNKNOWN, 0) == FKO_SUCCESS);
+        CU_ASSERT(fko_get_spa_message(dec_ctx, &msg) == FKO_SUCCESS);
+        CU_ASSERT(msg != NULL && strcmp(msg, "1.2.3.4,tcp/22") == 0);
+
+        fko_destroy(dec_ctx);
+        dec_ctx = NULL;
+        fko_destroy(ctx);
+        ctx = NULL;
+    }
+}
+
+int register_ts_fko_encryption(void)
+{
+    ts_init(&TEST_SUITE(fko_encryption), TEST_SUITE_DESCR(fko_encryption), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_encryption), UTEST_FCT(decrypt_modes), UTEST_DESCR(decrypt_modes));
+
+    return register_ts(&TEST_SUITE(fko_encryption));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
@@ -162,15 +162,61 @@ fko_new(fko_ctx_t *r_ctx)
     return(FKO_SUCCESS);
 }
 
+/* Chop the HMAC digest off of the encrypted message without checking it,
+ * for data the caller has verified already.
+*/
+static int
+strip_hmac_digest(fko_ctx_t ctx)
+{
+    int hmac_b64_digest_len, msg_len;
+
+    switch(ctx->hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            hmac_b64_digest_len = MD5_B64_LEN;
+            break;
+        case FKO_HMAC_SHA1:
+            hmac_b64_digest_len = SHA1_B64_LEN;
+            break;
+        case FKO_HMAC_SHA256:
+            hmac_b64_digest_len = SHA256_B64_LEN;
+            break;
+        case FKO_HMAC_SHA384:
+            hmac_b64_digest_len = SHA384_B64_LEN;
+            break;
+        case FKO_HMAC_SHA512:
+            hmac_b64_digest_len = SHA512_B64_LEN;
+            break;
+        default:
+            return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+    }
+
+    msg_len = ctx->encrypted_msg_len - hmac_b64_digest_len;
+    if(msg_len < MIN_SPA_ENCODED_MSG_SIZE)
+        return(FKO_ERROR_INVALID_DATA_HMAC_ENCMSGLEN_VALIDFAIL);
+
+    if(zero_buf(ctx->encrypted_msg + msg_len,
+                ctx->encrypted_msg_len - msg_len) != FKO_SUCCESS)
+        return(FKO_ERROR_ZERO_OUT_DATA);
+
+    ctx->encrypted_msg_len = msg_len;
+
+    return(FKO_SUCCESS);
+}
+
 /* Initialize an fko context with external (encrypted/encoded) data.
  * This is used to create a context with the purpose of decoding
- * and parsing the provided data into the context data.
+ * and parsing the provided data into the context data.  The HMAC is
+ * checked with hmac_sched if it is set, with hmac_key otherwise, and
+ * only chopped off if hmac_verified is set.
 */
-int
-fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
+static int
+new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     const char * const dec_key, const int dec_key_len,
     int encryption_mode, const char * const hmac_key,
-    const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
+    const int hmac_key_len, const int hmac_type,
+    const fko_hmac_key_t hmac_sched, const int hmac_verified,
+    const uint32_t sdp_id)
 {
     fko_ctx_t   ctx = NULL;
     int         res = FKO_SUCCESS; /* Are we optimistic or what? */
@@ -245,7 +291,27 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
 
     /* Check HMAC if the access stanza had an HMAC key
     */
-    if(hmac_key_len > 0 && hmac_key != NULL)
+    if(hmac_verified)
+    {
+        res = strip_hmac_digest(ctx);
+        if(res != FKO_SUCCESS)
+        {
+            fko_destroy(ctx);
+            ctx = NULL;
+            return res;
+        }
+    }
+    else if(hmac_sched != NULL)
+    {
+        res = fko_verify_hmac_key(ctx, hmac_sched);
+        if(res != FKO_SUCCESS)
+        {
+            fko_destroy(ctx);
+            ctx = NULL;
+            return res;
+        }
+    }
+    else if(hmac_key_len > 0 && hmac_key != NULL)
     {
         res = fko_verify_hmac(ctx, hmac_key, hmac_key_len);
 		if(res != FKO_SUCCESS)
@@ -306,6 +372,47 @@ fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
     return(res);
 }
 
+int
+fko_new_with_data(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const char * const hmac_key,
+    const int hmac_key_len, const int hmac_type, const uint32_t sdp_id)
+{
+    return(new_with_data(r_ctx, enc_msg, dec_key, dec_key_len,
+            encryption_mode, hmac_key, hmac_key_len, hmac_type, NULL, 0,
+            sdp_id));
+}
+
+/* Same as fko_new_with_data(), with the HMAC checked against a key set up
+ * beforehand with fko_new_hmac_key().  The HMAC type is the one of the key.
+*/
+int
+fko_new_with_data_hmac_key(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const fko_hmac_key_t hmac_key, const uint32_t sdp_id)
+{
+    if(hmac_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    return(new_with_data(r_ctx, enc_msg, dec_key, dec_key_len,
+            encryption_mode, NULL, 0, FKO_DEFAULT_HMAC_MODE, hmac_key, 0,
+            sdp_id));
+}
+
+/* Same as fko_new_with_data(), for data whose HMAC of type hmac_type has
+ * been checked already with fko_verify_hmac_data() or
+ * fko_verify_hmac_data_key().  The digest is chopped off, not computed
+ * a second time.
+*/
+int
+fko_new_with_data_hmac_verified(fko_ctx_t *r_ctx, const char * const enc_msg,
+    const char * const dec_key, const int dec_key_len,
+    int encryption_mode, const int hmac_type, const uint32_t sdp_id)
+{
+    return(new_with_data(r_ctx, enc_msg, dec_key, dec_key_len,
+            encryption_mode, NULL, 0, hmac_type, NULL, 1, sdp_id));
+}
+
 /* Destroy a context and free its resources
 */
 int
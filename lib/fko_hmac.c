@@ -34,6 +34,10 @@
 #include "hmac.h"
 #include "base64.h"
 
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(fko_hmac, "FKO hmac test suite");
+#endif
+
 int
 fko_verify_hmac(fko_ctx_t ctx,
     const char * const hmac_key, const int hmac_key_len)
@@ -328,4 +332,322 @@ int fko_set_spa_hmac(fko_ctx_t ctx,
     return FKO_SUCCESS;
 }
 
+/* A precomputed HMAC key, see fko_new_hmac_key()
+*/
+struct fko_hmac_key {
+    hmac_sched_t    sched;
+};
+
+/* Check the HMAC digest at the end of data against one computed with the
+ * given key schedule.  On success the length of the message in front of
+ * the digest is returned in msg_len.
+*/
+static int
+verify_hmac_sched(const hmac_sched_t * const sched, const char * const data,
+    const int data_len, int *msg_len)
+{
+    unsigned char   hmac[SHA512_DIGEST_LEN];
+    char            hmac_base64[SHA512_B64_LEN+4];
+    int             hmac_b64_digest_len, hmac_digest_len;
+
+    if (! is_valid_encoded_msg_len(data_len))
+        return(FKO_ERROR_INVALID_DATA_HMAC_MSGLEN_VALIDFAIL);
+
+    switch(sched->hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            hmac_b64_digest_len = MD5_B64_LEN;
+            hmac_digest_len     = MD5_DIGEST_LEN;
+            break;
+        case FKO_HMAC_SHA1:
+            hmac_b64_digest_len = SHA1_B64_LEN;
+            hmac_digest_len     = SHA1_DIGEST_LEN;
+            break;
+        case FKO_HMAC_SHA256:
+            hmac_b64_digest_len = SHA256_B64_LEN;
+            hmac_digest_len     = SHA256_DIGEST_LEN;
+            break;
+        case FKO_HMAC_SHA384:
+            hmac_b64_digest_len = SHA384_B64_LEN;
+            hmac_digest_len     = SHA384_DIGEST_LEN;
+            break;
+        case FKO_HMAC_SHA512:
+            hmac_b64_digest_len = SHA512_B64_LEN;
+            hmac_digest_len     = SHA512_DIGEST_LEN;
+            break;
+        default:
+            return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+    }
+
+    *msg_len = data_len - hmac_b64_digest_len;
+    if(*msg_len < MIN_SPA_ENCODED_MSG_SIZE)
+        return(FKO_ERROR_INVALID_DATA_HMAC_ENCMSGLEN_VALIDFAIL);
+
+    hmac_sched_digest(sched, data, *msg_len, hmac);
+
+    b64_encode(hmac, hmac_base64, hmac_digest_len);
+    strip_b64_eq(hmac_base64);
+
+    if(constant_runtime_cmp(data + *msg_len, hmac_base64,
+                hmac_b64_digest_len) != 0)
+        return(FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL);
+
+    return(FKO_SUCCESS);
+}
+
+/* Verify the HMAC at the end of SPA data as it came off the wire (the
+ * encoded message followed by the base64 HMAC digest) without setting up
+ * a context.  Nothing is allocated, and data does not have to be NUL
+ * terminated.
+*/
+int
+fko_verify_hmac_data(const char * const data, const int data_len,
+    const char * const hmac_key, const int hmac_key_len, const int hmac_type)
+{
+    hmac_sched_t    sched;
+    int             msg_len;
+
+    if(data == NULL || hmac_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(hmac_key_len < 0 || hmac_key_len > MAX_DIGEST_BLOCK_LEN)
+        return(FKO_ERROR_INVALID_HMAC_KEY_LEN);
+
+    if (! is_valid_encoded_msg_len(data_len))
+        return(FKO_ERROR_INVALID_DATA_HMAC_MSGLEN_VALIDFAIL);
+
+    if(hmac_sched_init(&sched, hmac_type, hmac_key, hmac_key_len) != 0)
+        return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+
+    return(verify_hmac_sched(&sched, data, data_len, &msg_len));
+}
+
+/* Set up an HMAC key for repeated use.  The padded key blocks are hashed
+ * here once, instead of for every message as fko_verify_hmac() and
+ * fko_verify_hmac_data() do, and the key itself is not kept.
+*/
+int
+fko_new_hmac_key(fko_hmac_key_t *r_key, const char * const hmac_key,
+    const int hmac_key_len, const int hmac_type)
+{
+    fko_hmac_key_t  key;
+
+    if(r_key == NULL || hmac_key == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    if(hmac_key_len < 0 || hmac_key_len > MAX_DIGEST_BLOCK_LEN)
+        return(FKO_ERROR_INVALID_HMAC_KEY_LEN);
+
+    if(hmac_type <= FKO_HMAC_UNKNOWN || hmac_type >= FKO_LAST_HMAC_MODE)
+        return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+
+    key = calloc(1, sizeof *key);
+    if(key == NULL)
+        return(FKO_ERROR_MEMORY_ALLOCATION);
+
+    if(hmac_sched_init(&key->sched, hmac_type, hmac_key, hmac_key_len) != 0)
+    {
+        free(key);
+        return(FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+    }
+
+    *r_key = key;
+
+    return(FKO_SUCCESS);
+}
+
+/* Wipe and free an HMAC key
+*/
+int
+fko_destroy_hmac_key(fko_hmac_key_t key)
+{
+    int res = FKO_SUCCESS;
+
+    if(key == NULL)
+        return(res);
+
+    if(zero_buf((char *)key, sizeof *key) != FKO_SUCCESS)
+        res = FKO_ERROR_ZERO_OUT_DATA;
+
+    free(key);
+
+    return(res);
+}
+
+/* fko_verify_hmac_data() with a precomputed HMAC key
+*/
+int
+fko_verify_hmac_data_key(const fko_hmac_key_t key, const char * const data,
+    const int data_len)
+{
+    int msg_len;
+
+    if(key == NULL || data == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    return(verify_hmac_sched(&key->sched, data, data_len, &msg_len));
+}
+
+/* fko_verify_hmac() with a precomputed HMAC key.  The digest is chopped
+ * off of the encrypted message in place, nothing is allocated, and unlike
+ * fko_verify_hmac() the digest is not kept in the context.
+*/
+int
+fko_verify_hmac_key(fko_ctx_t ctx, const fko_hmac_key_t key)
+{
+    int res, msg_len = 0;
+
+    /* Must be initialized
+    */
+    if(!CTX_INITIALIZED(ctx))
+        return(FKO_ERROR_CTX_NOT_INITIALIZED);
+
+    if(key == NULL || ctx->encrypted_msg == NULL)
+        return(FKO_ERROR_INVALID_DATA);
+
+    res = verify_hmac_sched(&key->sched, ctx->encrypted_msg,
+            ctx->encrypted_msg_len, &msg_len);
+    if(res != FKO_SUCCESS)
+        return(res);
+
+    if(zero_buf(ctx->encrypted_msg + msg_len,
+                ctx->encrypted_msg_len - msg_len) != FKO_SUCCESS)
+        return(FKO_ERROR_ZERO_OUT_DATA);
+
+    ctx->encrypted_msg_len = msg_len;
+    ctx->hmac_type         = key->sched.hmac_type;
+
+    return(FKO_SUCCESS);
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_UTEST(verify_hmac_data, "Verify an HMAC without a context")
+{
+    char            data[MIN_SPA_ENCODED_MSG_SIZE + SHA512_B64_LEN + 1];
+    unsigned char   hmac[SHA256_DIGEST_LEN];
+    const char     *key = "hmac test key";
+    int             msg_len = MIN_SPA_ENCODED_MSG_SIZE;
+
+    memset(data, 'A', msg_len);
+    hmac_sha256(data, msg_len, hmac, key, strlen(key));
+    b64_encode(hmac, data + msg_len, SHA256_DIGEST_LEN);
+    strip_b64_eq(data + msg_len);
+
+    CU_ASSERT(fko_verify_hmac_data(data, msg_len + SHA256_B64_LEN,
+                key, strlen(key), FKO_HMAC_SHA256) == FKO_SUCCESS);
+
+    /* wrong key, type, or a modified message
+    */
+    CU_ASSERT(fko_verify_hmac_data(data, msg_len + SHA256_B64_LEN,
+                key, strlen(key) - 1, FKO_HMAC_SHA256)
+            == FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL);
+    CU_ASSERT(fko_verify_hmac_data(data, msg_len + SHA256_B64_LEN,
+                key, strlen(key), FKO_HMAC_SHA512)
+            == FKO_ERROR_INVALID_DATA_HMAC_ENCMSGLEN_VALIDFAIL);
+    data[0] = 'B';
+    CU_ASSERT(fko_verify_hmac_data(data, msg_len + SHA256_B64_LEN,
+                key, strlen(key), FKO_HMAC_SHA256)
+            == FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL);
+
+    /* too short to hold a message and a digest
+    */
+    CU_ASSERT(fko_verify_hmac_data(data, SHA256_B64_LEN + 1,
+                key, strlen(key), FKO_HMAC_SHA256) != FKO_SUCCESS);
+}
+
+DECLARE_UTEST(verify_hmac_key, "Verify an HMAC with a precomputed key")
+{
+    char            data[MIN_SPA_ENCODED_MSG_SIZE + SHA512_B64_LEN + 1];
+    unsigned char   hmac[SHA512_DIGEST_LEN];
+    const char     *key = "hmac test key";
+    fko_hmac_key_t  hkey = NULL;
+    int             msg_len = MIN_SPA_ENCODED_MSG_SIZE;
+
+    memset(data, 'A', msg_len);
+    hmac_sha512(data, msg_len, hmac, key, strlen(key));
+    b64_encode(hmac, data + msg_len, SHA512_DIGEST_LEN);
+    strip_b64_eq(data + msg_len);
+
+    CU_ASSERT(fko_new_hmac_key(&hkey, key, strlen(key), FKO_HMAC_UNKNOWN)
+            == FKO_ERROR_UNSUPPORTED_HMAC_MODE);
+    CU_ASSERT(fko_new_hmac_key(&hkey, key, MAX_DIGEST_BLOCK_LEN + 1,
+                FKO_HMAC_SHA512) == FKO_ERROR_INVALID_HMAC_KEY_LEN);
+    CU_ASSERT(fko_new_hmac_key(&hkey, key, strlen(key), FKO_HMAC_SHA512)
+            == FKO_SUCCESS);
+
+    /* the key can be used over and over
+    */
+    CU_ASSERT(fko_verify_hmac_data_key(hkey, data, msg_len + SHA512_B64_LEN)
+            == FKO_SUCCESS);
+    CU_ASSERT(fko_verify_hmac_data_key(hkey, data, msg_len + SHA512_B64_LEN)
+            == FKO_SUCCESS);
+    data[1] = 'B';
+    CU_ASSERT(fko_verify_hmac_data_key(hkey, data, msg_len + SHA512_B64_LEN)
+            == FKO_ERROR_INVALID_DATA_HMAC_COMPAREFAIL);
+    data[1] = 'A';
+    CU_ASSERT(fko_verify_hmac_data_key(hkey, data, msg_len + SHA512_B64_LEN)
+            == FKO_SUCCESS);
+
+    CU_ASSERT(fko_destroy_hmac_key(hkey) == FKO_SUCCESS);
+}
+
+DECLARE_UTEST(new_with_data_hmac_verified, "Context for an HMAC verified beforehand")
+{
+    fko_ctx_t       ctx = NULL, vctx = NULL;
+    char           *spa_data = NULL, *msg = NULL, *vmsg = NULL;
+    char            data[MAX_SPA_ENCODED_MSG_SIZE];
+    const char     *enc_key = "enc test key";
+    const char     *key = "hmac test key";
+
+    CU_ASSERT(fko_new(&ctx) == FKO_SUCCESS);
+    CU_ASSERT(fko_set_disable_sdp_mode(ctx, 1) == FKO_SUCCESS);
+    CU_ASSERT(fko_set_spa_message(ctx, "1.2.3.4,tcp/22") == FKO_SUCCESS);
+    CU_ASSERT(fko_set_spa_hmac_type(ctx, FKO_HMAC_SHA256) == FKO_SUCCESS);
+    CU_ASSERT(fko_spa_data_final(ctx, enc_key, strlen(enc_key),
+                key, strlen(key)) == FKO_SUCCESS);
+    CU_ASSERT(fko_get_spa_data(ctx, &spa_data) == FKO_SUCCESS);
+    strlcpy(data, spa_data, sizeof(data));
+    fko_destroy(ctx);
+    ctx = NULL;
+
+    CU_ASSERT(fko_verify_hmac_data(data, strlen(data), key, strlen(key),
+                FKO_HMAC_SHA256) == FKO_SUCCESS);
+
+    /* the same message comes out as with the HMAC checked again
+    */
+    CU_ASSERT(fko_new_with_data(&ctx, data, enc_key, strlen(enc_key),
+                FKO_ENC_MODE_CBC, key, strlen(key), FKO_HMAC_SHA256, 0)
+            == FKO_SUCCESS);
+    CU_ASSERT(fko_new_with_data_hmac_verified(&vctx, data, enc_key,
+                strlen(enc_key), FKO_ENC_MODE_CBC, FKO_HMAC_SHA256, 0)
+            == FKO_SUCCESS);
+    CU_ASSERT(fko_get_spa_message(ctx, &msg) == FKO_SUCCESS);
+    CU_ASSERT(fko_get_spa_message(vctx, &vmsg) == FKO_SUCCESS);
+    CU_ASSERT(msg != NULL && vmsg != NULL && strcmp(msg, vmsg) == 0);
+    fko_destroy(ctx);
+    fko_destroy(vctx);
+    vctx = NULL;
+
+    /* an unknown type, or one with a longer digest than was sent
+    */
+    CU_ASSERT(fko_new_with_data_hmac_verified(&vctx, data, NULL, 0,
+                FKO_ENC_MODE_CBC, FKO_HMAC_UNKNOWN, 0) != FKO_SUCCESS);
+    CU_ASSERT(fko_new_with_data_hmac_verified(&vctx, data, enc_key,
+                strlen(enc_key), FKO_ENC_MODE_CBC, FKO_HMAC_SHA512, 0)
+            != FKO_SUCCESS);
+}
+
+int register_ts_fko_hmac(void)
+{
+    ts_init(&TEST_SUITE(fko_hmac), TEST_SUITE_DESCR(fko_hmac), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fko_hmac), UTEST_FCT(verify_hmac_data), UTEST_DESCR(verify_hmac_data));
+    ts_add_utest(&TEST_SUITE(fko_hmac), UTEST_FCT(verify_hmac_key), UTEST_DESCR(verify_hmac_key));
+    ts_add_utest(&TEST_SUITE(fko_hmac), UTEST_FCT(new_with_data_hmac_verified), UTEST_DESCR(new_with_data_hmac_verified));
+
+    return register_ts(&TEST_SUITE(fko_hmac));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
 /***EOF***/
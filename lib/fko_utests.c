@@ -11,6 +11,10 @@
 static void register_test_suites(void)
 {
     register_ts_fko_decode();
+    register_ts_fko_hmac();
+    register_ts_fko_encryption();
+    register_ts_rijndael_accel();
+    register_ts_base64();
 }
 
 /* The main() function for setting up and running the tests.
@@ -29,6 +29,7 @@
  *****************************************************************************
 */
 
+#include "fko.h"
 #include "hmac.h"
 
 typedef struct {
@@ -430,3 +431,112 @@ hmac_sha512(const char *msg, const unsigned int msg_len,
 
     return;
 }
+
+/* Begin HMAC key schedule functions
+*/
+int
+hmac_sched_init(hmac_sched_t *sched, const int hmac_type,
+        const char *hmac_key, const int hmac_key_len)
+{
+    hmac_md5_ctx    md5_ctx;
+    hmac_sha1_ctx   sha1_ctx;
+    hmac_sha256_ctx sha256_ctx;
+    hmac_sha384_ctx sha384_ctx;
+    hmac_sha512_ctx sha512_ctx;
+
+    memset(sched, 0, sizeof(*sched));
+    sched->hmac_type = hmac_type;
+
+    switch(hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            memset(&md5_ctx, 0, sizeof(md5_ctx));
+            hmac_md5_init(&md5_ctx, hmac_key, hmac_key_len);
+            sched->ctx_inside.md5  = md5_ctx.ctx_inside;
+            sched->ctx_outside.md5 = md5_ctx.ctx_outside;
+            memset(&md5_ctx, 0, sizeof(md5_ctx));
+            break;
+        case FKO_HMAC_SHA1:
+            memset(&sha1_ctx, 0, sizeof(sha1_ctx));
+            hmac_sha1_init(&sha1_ctx, hmac_key, hmac_key_len);
+            sched->ctx_inside.sha1  = sha1_ctx.ctx_inside;
+            sched->ctx_outside.sha1 = sha1_ctx.ctx_outside;
+            memset(&sha1_ctx, 0, sizeof(sha1_ctx));
+            break;
+        case FKO_HMAC_SHA256:
+            memset(&sha256_ctx, 0, sizeof(sha256_ctx));
+            hmac_sha256_init(&sha256_ctx, hmac_key, hmac_key_len);
+            sched->ctx_inside.sha256  = sha256_ctx.ctx_inside;
+            sched->ctx_outside.sha256 = sha256_ctx.ctx_outside;
+            memset(&sha256_ctx, 0, sizeof(sha256_ctx));
+            break;
+        case FKO_HMAC_SHA384:
+            memset(&sha384_ctx, 0, sizeof(sha384_ctx));
+            hmac_sha384_init(&sha384_ctx, hmac_key, hmac_key_len);
+            sched->ctx_inside.sha384  = sha384_ctx.ctx_inside;
+            sched->ctx_outside.sha384 = sha384_ctx.ctx_outside;
+            memset(&sha384_ctx, 0, sizeof(sha384_ctx));
+            break;
+        case FKO_HMAC_SHA512:
+            memset(&sha512_ctx, 0, sizeof(sha512_ctx));
+            hmac_sha512_init(&sha512_ctx, hmac_key, hmac_key_len);
+            sched->ctx_inside.sha512  = sha512_ctx.ctx_inside;
+            sched->ctx_outside.sha512 = sha512_ctx.ctx_outside;
+            memset(&sha512_ctx, 0, sizeof(sha512_ctx));
+            break;
+        default:
+            return(-1);
+    }
+
+    return(0);
+}
+
+/* Same result as the hmac_*() function for the type the schedule was set
+ * up with, the key schedule itself is left as it was.
+*/
+void
+hmac_sched_digest(const hmac_sched_t *sched, const char *msg,
+        const unsigned int msg_len, unsigned char *hmac)
+{
+    hmac_md5_ctx    md5_ctx;
+    hmac_sha1_ctx   sha1_ctx;
+    hmac_sha256_ctx sha256_ctx;
+    hmac_sha384_ctx sha384_ctx;
+    hmac_sha512_ctx sha512_ctx;
+
+    switch(sched->hmac_type)
+    {
+        case FKO_HMAC_MD5:
+            md5_ctx.ctx_inside  = sched->ctx_inside.md5;
+            md5_ctx.ctx_outside = sched->ctx_outside.md5;
+            hmac_md5_update(&md5_ctx, msg, msg_len);
+            hmac_md5_final(&md5_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA1:
+            sha1_ctx.ctx_inside  = sched->ctx_inside.sha1;
+            sha1_ctx.ctx_outside = sched->ctx_outside.sha1;
+            hmac_sha1_update(&sha1_ctx, msg, msg_len);
+            hmac_sha1_final(&sha1_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA256:
+            sha256_ctx.ctx_inside  = sched->ctx_inside.sha256;
+            sha256_ctx.ctx_outside = sched->ctx_outside.sha256;
+            hmac_sha256_update(&sha256_ctx, msg, msg_len);
+            hmac_sha256_final(&sha256_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA384:
+            sha384_ctx.ctx_inside  = sched->ctx_inside.sha384;
+            sha384_ctx.ctx_outside = sched->ctx_outside.sha384;
+            hmac_sha384_update(&sha384_ctx, msg, msg_len);
+            hmac_sha384_final(&sha384_ctx, hmac);
+            break;
+        case FKO_HMAC_SHA512:
+            sha512_ctx.ctx_inside  = sched->ctx_inside.sha512;
+            sha512_ctx.ctx_outside = sched->ctx_outside.sha512;
+            hmac_sha512_update(&sha512_ctx, msg, msg_len);
+            hmac_sha512_final(&sha512_ctx, hmac);
+            break;
+    }
+
+    return;
+}
@@ -46,6 +46,27 @@ void hmac_sha384(const char *msg, const unsigned int msg_len,
 void hmac_sha512(const char *msg, const unsigned int msg_len,
         unsigned char *hmac, const char *hmac_key, const int hmac_key_len);
 
+/* An HMAC key schedule holds the digest states left after the inner and
+ * outer padded key blocks have been hashed.  It is set up once per key,
+ * and every digest computed with it starts from copies of these states,
+ * so the key itself is not touched again.
+*/
+typedef struct hmac_sched {
+    int hmac_type;
+    union {
+        MD5Context  md5;
+        SHA1_INFO   sha1;
+        SHA256_CTX  sha256;
+        SHA384_CTX  sha384;
+        SHA512_CTX  sha512;
+    } ctx_inside, ctx_outside;
+} hmac_sched_t;
+
+int hmac_sched_init(hmac_sched_t *sched, const int hmac_type,
+        const char *hmac_key, const int hmac_key_len);
+void hmac_sched_digest(const hmac_sched_t *sched, const char *msg,
+        const unsigned int msg_len, unsigned char *hmac);
+
 #endif /* HMAC_H */
 
 /***EOF***/
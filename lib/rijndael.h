@@ -79,6 +79,14 @@ void
 rijndael_setup(RIJNDAEL_context *ctx,
     const size_t keysize, const uint8_t *key);
 
+/* Only the part of rijndael_setup() that rijndael_encrypt() needs, which
+ * is enough for the CFB, OFB and CTR modes both ways.  The inverse key
+ * schedule for rijndael_decrypt() is left out.
+ */
+void
+rijndael_setup_encrypt(RIJNDAEL_context *ctx,
+    const size_t keysize, const uint8_t *key);
+
 /*
  * rijndael_encrypt()
  *
@@ -124,4 +132,33 @@ void
 block_decrypt(RIJNDAEL_context *ctx, uint8_t *input, int inputlen,
 	      uint8_t *output, uint8_t *iv);
 
+/* Hardware AES, see rijndael_accel.c.  rijndael_accel() tells which path
+ * block_encrypt() and block_decrypt() take, checking the CPU the first
+ * time it is called.  rijndael_set_accel() switches between the portable
+ * code and what the CPU supports, for tests and benchmarks.
+ */
+#define     RIJNDAEL_ACCEL_NONE     0
+#define     RIJNDAEL_ACCEL_AESNI    1
+#define     RIJNDAEL_ACCEL_ARMV8    2
+
+int
+rijndael_accel(void);
+
+int
+rijndael_set_accel(const int which);
+
+const char *
+rijndael_accel_name(void);
+
+/* Called by rijndael.c, these return 0 when the portable code has to do
+ * the work.
+ */
+int
+rijndael_accel_inverse_keys(RIJNDAEL_context *ctx);
+
+int
+rijndael_accel_block(RIJNDAEL_context *ctx, const uint8_t *input,
+    const int inputlen, uint8_t *output, const uint8_t *iv,
+    const int decrypt);
+
 #endif /* RIJNDAEL_H */
@@ -0,0 +1,629 @@
+/*
+ *****************************************************************************
+ *
+ * File:    rijndael_accel.c
+ *
+ * Purpose: Hardware AES (AES-NI on x86, the ARMv8 Crypto Extensions on
+ *          aarch64) for the Rijndael block modes in rijndael.c.  The
+ *          instructions are only used when the CPU has them, checked once
+ *          at run time; rijndael.c falls back to its own tables otherwise.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fko_common.h"
+#include "rijndael.h"
+#include <string.h>
+
+/* The x86 code is built for any x86 target with a compiler that can
+ * switch on AES-NI per function.  The aarch64 code needs the crypto
+ * extensions enabled for the whole file (-march=armv8-a+crypto), and the
+ * round keys in rijndael.c are only laid out as the instructions expect
+ * them on little endian systems.
+*/
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__clang__) \
+        || (defined(__GNUC__) && (__GNUC__ > 4 \
+            || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))))
+  #define RIJNDAEL_AESNI 1
+  #include <cpuid.h>
+  #include <wmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRYPTO) \
+        && !defined(__AARCH64EB__) && defined(__linux__)
+  #define RIJNDAEL_ARMV8 1
+  #include <arm_neon.h>
+  #include <sys/auxv.h>
+  #ifndef HWCAP_AES
+    #define HWCAP_AES   (1 << 3)
+  #endif
+#endif
+
+#ifdef HAVE_C_UNIT_TESTS
+DECLARE_TEST_SUITE(rijndael_accel, "Rijndael hardware AES test suite");
+#endif
+
+#define MAX_ROUNDS      14
+#define ACCEL_WAYS      4   /* blocks in flight in the parallel modes */
+
+/* Which path is in use, -1 until the CPU has been checked.
+*/
+static int accel = -1;
+
+static int
+accel_detect(void)
+{
+#if RIJNDAEL_AESNI
+    unsigned int a, b, c, d;
+
+    if(__get_cpuid(1, &a, &b, &c, &d) && (c & bit_AES) && (d & bit_SSE2))
+        return RIJNDAEL_ACCEL_AESNI;
+#elif RIJNDAEL_ARMV8
+    if(getauxval(AT_HWCAP) & HWCAP_AES)
+        return RIJNDAEL_ACCEL_ARMV8;
+#endif
+    return RIJNDAEL_ACCEL_NONE;
+}
+
+int
+rijndael_accel(void)
+{
+    int a = __atomic_load_n(&accel, __ATOMIC_RELAXED);
+
+    if(a < 0)
+    {
+        a = accel_detect();
+        __atomic_store_n(&accel, a, __ATOMIC_RELAXED);
+    }
+    return a;
+}
+
+int
+rijndael_set_accel(const int which)
+{
+    if(which != RIJNDAEL_ACCEL_NONE && which != accel_detect())
+        return -1;
+
+    __atomic_store_n(&accel, which, __ATOMIC_RELAXED);
+    return 0;
+}
+
+const char *
+rijndael_accel_name(void)
+{
+    switch(rijndael_accel())
+    {
+        case RIJNDAEL_ACCEL_AESNI:
+            return "AES-NI";
+        case RIJNDAEL_ACCEL_ARMV8:
+            return "ARMv8 Crypto Extensions";
+        default:
+            return "portable";
+    }
+}
+
+#if RIJNDAEL_AESNI || RIJNDAEL_ARMV8
+
+/* The per architecture primitives.  Everything past them is shared, so
+ * the mode handling below is the same code on both.
+*/
+#if RIJNDAEL_AESNI
+
+typedef __m128i blk_t;
+
+#define ACCEL_TARGET    __attribute__((target("aes,sse2")))
+#define LOAD(p)         _mm_loadu_si128((const __m128i *)(const void *)(p))
+#define STORE(p, b)     _mm_storeu_si128((__m128i *)(void *)(p), (b))
+#define XOR(a, b)       _mm_xor_si128((a), (b))
+#define INV_MIX(b)      _mm_aesimc_si128(b)
+
+ACCEL_TARGET static inline blk_t
+encrypt1(const blk_t *rk, const int nr, blk_t b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, rk[0]);
+    for(r=1; r < nr; r++)
+        b = _mm_aesenc_si128(b, rk[r]);
+    return _mm_aesenclast_si128(b, rk[nr]);
+}
+
+ACCEL_TARGET static inline void
+encrypt4(const blk_t *rk, const int nr, blk_t *b)
+{
+    blk_t   b0, b1, b2, b3;
+    int     r;
+
+    b0 = _mm_xor_si128(b[0], rk[0]);
+    b1 = _mm_xor_si128(b[1], rk[0]);
+    b2 = _mm_xor_si128(b[2], rk[0]);
+    b3 = _mm_xor_si128(b[3], rk[0]);
+    for(r=1; r < nr; r++)
+    {
+        b0 = _mm_aesenc_si128(b0, rk[r]);
+        b1 = _mm_aesenc_si128(b1, rk[r]);
+        b2 = _mm_aesenc_si128(b2, rk[r]);
+        b3 = _mm_aesenc_si128(b3, rk[r]);
+    }
+    b[0] = _mm_aesenclast_si128(b0, rk[nr]);
+    b[1] = _mm_aesenclast_si128(b1, rk[nr]);
+    b[2] = _mm_aesenclast_si128(b2, rk[nr]);
+    b[3] = _mm_aesenclast_si128(b3, rk[nr]);
+}
+
+/* dk[] is the inverse key schedule in the order it is used, last round
+ * key first.
+*/
+ACCEL_TARGET static inline blk_t
+decrypt1(const blk_t *dk, const int nr, blk_t b)
+{
+    int r;
+
+    b = _mm_xor_si128(b, dk[0]);
+    for(r=1; r < nr; r++)
+        b = _mm_aesdec_si128(b, dk[r]);
+    return _mm_aesdeclast_si128(b, dk[nr]);
+}
+
+ACCEL_TARGET static inline void
+decrypt4(const blk_t *dk, const int nr, blk_t *b)
+{
+    blk_t   b0, b1, b2, b3;
+    int     r;
+
+    b0 = _mm_xor_si128(b[0], dk[0]);
+    b1 = _mm_xor_si128(b[1], dk[0]);
+    b2 = _mm_xor_si128(b[2], dk[0]);
+    b3 = _mm_xor_si128(b[3], dk[0]);
+    for(r=1; r < nr; r++)
+    {
+        b0 = _mm_aesdec_si128(b0, dk[r]);
+        b1 = _mm_aesdec_si128(b1, dk[r]);
+        b2 = _mm_aesdec_si128(b2, dk[r]);
+        b3 = _mm_aesdec_si128(b3, dk[r]);
+    }
+    b[0] = _mm_aesdeclast_si128(b0, dk[nr]);
+    b[1] = _mm_aesdeclast_si128(b1, dk[nr]);
+    b[2] = _mm_aesdeclast_si128(b2, dk[nr]);
+    b[3] = _mm_aesdeclast_si128(b3, dk[nr]);
+}
+
+#else /* RIJNDAEL_ARMV8 */
+
+typedef uint8x16_t blk_t;
+
+#define ACCEL_TARGET
+#define LOAD(p)         vld1q_u8((const uint8_t *)(const void *)(p))
+#define STORE(p, b)     vst1q_u8((uint8_t *)(void *)(p), (b))
+#define XOR(a, b)       veorq_u8((a), (b))
+#define INV_MIX(b)      vaesimcq_u8(b)
+
+/* AESE adds the round key before SubBytes and ShiftRows, so the rounds
+ * are shifted by one compared to AES-NI and the last key is a plain XOR.
+*/
+static inline blk_t
+encrypt1(const blk_t *rk, const int nr, blk_t b)
+{
+    int r;
+
+    for(r=0; r < nr-1; r++)
+        b = vaesmcq_u8(vaeseq_u8(b, rk[r]));
+    return veorq_u8(vaeseq_u8(b, rk[nr-1]), rk[nr]);
+}
+
+static inline void
+encrypt4(const blk_t *rk, const int nr, blk_t *b)
+{
+    blk_t   b0 = b[0], b1 = b[1], b2 = b[2], b3 = b[3];
+    int     r;
+
+    for(r=0; r < nr-1; r++)
+    {
+        b0 = vaesmcq_u8(vaeseq_u8(b0, rk[r]));
+        b1 = vaesmcq_u8(vaeseq_u8(b1, rk[r]));
+        b2 = vaesmcq_u8(vaeseq_u8(b2, rk[r]));
+        b3 = vaesmcq_u8(vaeseq_u8(b3, rk[r]));
+    }
+    b[0] = veorq_u8(vaeseq_u8(b0, rk[nr-1]), rk[nr]);
+    b[1] = veorq_u8(vaeseq_u8(b1, rk[nr-1]), rk[nr]);
+    b[2] = veorq_u8(vaeseq_u8(b2, rk[nr-1]), rk[nr]);
+    b[3] = veorq_u8(vaeseq_u8(b3, rk[nr-1]), rk[nr]);
+}
+
+static inline blk_t
+decrypt1(const blk_t *dk, const int nr, blk_t b)
+{
+    int r;
+
+    for(r=0; r < nr-1; r++)
+        b = vaesimcq_u8(vaesdq_u8(b, dk[r]));
+    return veorq_u8(vaesdq_u8(b, dk[nr-1]), dk[nr]);
+}
+
+static inline void
+decrypt4(const blk_t *dk, const int nr, blk_t *b)
+{
+    blk_t   b0 = b[0], b1 = b[1], b2 = b[2], b3 = b[3];
+    int     r;
+
+    for(r=0; r < nr-1; r++)
+    {
+        b0 = vaesimcq_u8(vaesdq_u8(b0, dk[r]));
+        b1 = vaesimcq_u8(vaesdq_u8(b1, dk[r]));
+        b2 = vaesimcq_u8(vaesdq_u8(b2, dk[r]));
+        b3 = vaesimcq_u8(vaesdq_u8(b3, dk[r]));
+    }
+    b[0] = veorq_u8(vaesdq_u8(b0, dk[nr-1]), dk[nr]);
+    b[1] = veorq_u8(vaesdq_u8(b1, dk[nr-1]), dk[nr]);
+    b[2] = veorq_u8(vaesdq_u8(b2, dk[nr-1]), dk[nr]);
+    b[3] = veorq_u8(vaesdq_u8(b3, dk[nr-1]), dk[nr]);
+}
+
+#endif /* RIJNDAEL_AESNI */
+
+/* Up to ACCEL_WAYS blocks at once, so that the rounds of a full group
+ * overlap in the pipeline.
+*/
+ACCEL_TARGET static inline void
+encrypt_blocks(const blk_t *rk, const int nr, blk_t *b, const int n)
+{
+    int j;
+
+    if(n == ACCEL_WAYS)
+        encrypt4(rk, nr, b);
+    else
+        for(j=0; j < n; j++)
+            b[j] = encrypt1(rk, nr, b[j]);
+}
+
+ACCEL_TARGET static inline void
+decrypt_blocks(const blk_t *dk, const int nr, blk_t *b, const int n)
+{
+    int j;
+
+    if(n == ACCEL_WAYS)
+        decrypt4(dk, nr, b);
+    else
+        for(j=0; j < n; j++)
+            b[j] = decrypt1(dk, nr, b[j]);
+}
+
+ACCEL_TARGET static void
+load_keys(const uint32_t *keys, const int nr, const int reverse, blk_t *rk)
+{
+    int i;
+
+    for(i=0; i <= nr; i++)
+        rk[i] = LOAD(&keys[4 * (reverse ? nr - i : i)]);
+}
+
+/* Big endian increment of the whole counter block, as block_encrypt()
+ * does it.
+*/
+static void
+ctr_inc(uint8_t *ctr)
+{
+    int j;
+
+    for(j=RIJNDAEL_BLOCKSIZE-1; j >= 0; j--)
+        if(++ctr[j] != 0)
+            break;
+}
+
+ACCEL_TARGET static void
+accel_inverse_keys(RIJNDAEL_context *ctx)
+{
+    int i, last = 4 * ctx->nrounds;
+
+    for(i=0; i < 4; i++)
+    {
+        ctx->ikeys[i] = ctx->keys[i];
+        ctx->ikeys[last + i] = ctx->keys[last + i];
+    }
+    for(i=4; i < last; i+=4)
+        STORE(&ctx->ikeys[i], INV_MIX(LOAD(&ctx->keys[i])));
+}
+
+ACCEL_TARGET static int
+accel_block(RIJNDAEL_context *ctx, const uint8_t *in, const int inputlen,
+        uint8_t *out, const uint8_t *iv, const int decrypt)
+{
+    blk_t       rk[MAX_ROUNDS+1], b[ACCEL_WAYS], c[ACCEL_WAYS], prev;
+    uint8_t     ctr[RIJNDAEL_BLOCKSIZE];
+    const int   nr = ctx->nrounds;
+    int         i, j, n, nblocks = inputlen / RIJNDAEL_BLOCKSIZE;
+
+    if(nr > MAX_ROUNDS)
+        return 0;
+
+    switch(ctx->mode)
+    {
+        case MODE_ECB:
+            load_keys(decrypt ? ctx->ikeys : ctx->keys, nr, decrypt, rk);
+            for(i=0; i < nblocks; i+=n)
+            {
+                n = nblocks - i < ACCEL_WAYS ? nblocks - i : ACCEL_WAYS;
+                for(j=0; j < n; j++)
+                    b[j] = LOAD(in + RIJNDAEL_BLOCKSIZE*(i+j));
+                if(decrypt)
+                    decrypt_blocks(rk, nr, b, n);
+                else
+                    encrypt_blocks(rk, nr, b, n);
+                for(j=0; j < n; j++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+j), b[j]);
+            }
+            break;
+
+        case MODE_CBC:
+            prev = LOAD(iv);
+            if(! decrypt)
+            {
+                load_keys(ctx->keys, nr, 0, rk);
+                for(i=0; i < nblocks; i++)
+                {
+                    prev = XOR(prev, LOAD(in + RIJNDAEL_BLOCKSIZE*i));
+                    prev = encrypt1(rk, nr, prev);
+                    STORE(out + RIJNDAEL_BLOCKSIZE*i, prev);
+                }
+                break;
+            }
+            load_keys(ctx->ikeys, nr, 1, rk);
+            for(i=0; i < nblocks; i+=n)
+            {
+                n = nblocks - i < ACCEL_WAYS ? nblocks - i : ACCEL_WAYS;
+                for(j=0; j < n; j++)
+                    b[j] = c[j] = LOAD(in + RIJNDAEL_BLOCKSIZE*(i+j));
+                decrypt_blocks(rk, nr, b, n);
+                for(j=0; j < n; j++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+j),
+                            XOR(b[j], j ? c[j-1] : prev));
+                prev = c[n-1];
+            }
+            break;
+
+        case MODE_CFB:
+            load_keys(ctx->keys, nr, 0, rk);
+            prev = LOAD(iv);
+            if(! decrypt)
+            {
+                for(i=0; i < nblocks; i++)
+                {
+                    prev = encrypt1(rk, nr, prev);
+                    prev = XOR(prev, LOAD(in + RIJNDAEL_BLOCKSIZE*i));
+                    STORE(out + RIJNDAEL_BLOCKSIZE*i, prev);
+                }
+                break;
+            }
+            for(i=0; i < nblocks; i+=n)
+            {
+                n = nblocks - i < ACCEL_WAYS ? nblocks - i : ACCEL_WAYS;
+                for(j=0; j < n; j++)
+                {
+                    c[j] = LOAD(in + RIJNDAEL_BLOCKSIZE*(i+j));
+                    b[j] = j ? c[j-1] : prev;
+                }
+                encrypt_blocks(rk, nr, b, n);
+                for(j=0; j < n; j++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+j), XOR(b[j], c[j]));
+                prev = c[n-1];
+            }
+            break;
+
+        case MODE_OFB:
+            load_keys(ctx->keys, nr, 0, rk);
+            prev = LOAD(iv);
+            for(i=0; i < nblocks; i++)
+            {
+                prev = encrypt1(rk, nr, prev);
+                STORE(out + RIJNDAEL_BLOCKSIZE*i,
+                        XOR(prev, LOAD(in + RIJNDAEL_BLOCKSIZE*i)));
+            }
+            break;
+
+        case MODE_CTR:
+            load_keys(ctx->keys, nr, 0, rk);
+            memcpy(ctr, iv, RIJNDAEL_BLOCKSIZE);
+            for(i=0; i < nblocks; i+=n)
+            {
+                n = nblocks - i < ACCEL_WAYS ? nblocks - i : ACCEL_WAYS;
+                for(j=0; j < n; j++)
+                {
+                    b[j] = LOAD(ctr);
+                    ctr_inc(ctr);
+                }
+                encrypt_blocks(rk, nr, b, n);
+                for(j=0; j < n; j++)
+                    STORE(out + RIJNDAEL_BLOCKSIZE*(i+j),
+                            XOR(b[j], LOAD(in + RIJNDAEL_BLOCKSIZE*(i+j))));
+            }
+            break;
+
+        default:
+            return 0;
+    }
+    return 1;
+}
+
+#endif /* RIJNDAEL_AESNI || RIJNDAEL_ARMV8 */
+
+int
+rijndael_accel_inverse_keys(RIJNDAEL_context *ctx)
+{
+#if RIJNDAEL_AESNI || RIJNDAEL_ARMV8
+    if(rijndael_accel() != RIJNDAEL_ACCEL_NONE && ctx->nrounds <= MAX_ROUNDS)
+    {
+        accel_inverse_keys(ctx);
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+int
+rijndael_accel_block(RIJNDAEL_context *ctx, const uint8_t *input,
+        const int inputlen, uint8_t *output, const uint8_t *iv,
+        const int decrypt)
+{
+#if RIJNDAEL_AESNI || RIJNDAEL_ARMV8
+    if(rijndael_accel() != RIJNDAEL_ACCEL_NONE)
+        return accel_block(ctx, input, inputlen, output, iv, decrypt);
+#endif
+    return 0;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+/* FIPS-197 appendix C: the key is 00 01 02 ..., the plaintext is the same
+ * for all three key sizes.
+*/
+static const uint8_t kat_pt[RIJNDAEL_BLOCKSIZE] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+    0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+
+static const struct {
+    int     keysize;
+    uint8_t ct[RIJNDAEL_BLOCKSIZE];
+} kat[] = {
+    { 16, { 0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+            0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a } },
+    { 24, { 0xdd, 0xa9, 0x7c, 0xa4, 0x86, 0x4c, 0xdf, 0xe0,
+            0x6e, 0xaf, 0x70, 0xa0, 0xec, 0x0d, 0x71, 0x91 } },
+    { 32, { 0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+            0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 } },
+};
+
+static const int test_modes[] = {
+    MODE_ECB, MODE_CBC, MODE_CFB, MODE_OFB, MODE_CTR
+};
+
+#define TEST_BLOCKS     19
+
+static void
+fill(uint8_t *buf, const int len, unsigned int seed)
+{
+    int i;
+
+    for(i=0; i < len; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[i] = seed >> 16;
+    }
+}
+
+DECLARE_UTEST(fips197, "FIPS-197 known answers, portable and hardware")
+{
+    RIJNDAEL_context    ctx;
+    uint8_t             key[RIJNDAEL_MAX_KEYSIZE], iv[RIJNDAEL_BLOCKSIZE];
+    uint8_t             ct[RIJNDAEL_BLOCKSIZE], pt[RIJNDAEL_BLOCKSIZE];
+    const int           hw = rijndael_accel();
+    int                 i, pass;
+
+    for(i=0; i < RIJNDAEL_MAX_KEYSIZE; i++)
+        key[i] = i;
+    memset(iv, 0x0, sizeof(iv));
+
+    for(pass=0; pass < 2; pass++)
+    {
+        CU_ASSERT(rijndael_set_accel(pass ? hw : RIJNDAEL_ACCEL_NONE) == 0);
+        for(i=0; i < (int)(sizeof(kat)/sizeof(kat[0])); i++)
+        {
+            memset(&ctx, 0x0, sizeof(ctx));
+            rijndael_setup(&ctx, kat[i].keysize, key);
+            ctx.mode = MODE_ECB;
+
+            block_encrypt(&ctx, (uint8_t *)kat_pt, RIJNDAEL_BLOCKSIZE, ct, iv);
+            CU_ASSERT(memcmp(ct, kat[i].ct, RIJNDAEL_BLOCKSIZE) == 0);
+            block_decrypt(&ctx, ct, RIJNDAEL_BLOCKSIZE, pt, iv);
+            CU_ASSERT(memcmp(pt, kat_pt, RIJNDAEL_BLOCKSIZE) == 0);
+        }
+    }
+    CU_ASSERT(rijndael_set_accel(hw) == 0);
+}
+
+DECLARE_UTEST(accel_matches_portable, "Hardware AES matches the tables in every mode")
+{
+    RIJNDAEL_context    ctx;
+    uint8_t             key[RIJNDAEL_MAX_KEYSIZE], iv[RIJNDAEL_BLOCKSIZE];
+    uint8_t             in[TEST_BLOCKS * RIJNDAEL_BLOCKSIZE];
+    uint8_t             sw[sizeof(in)], out[sizeof(in)];
+    uint32_t            ikeys[60];
+    const int           hw = rijndael_accel();
+    int                 m, ks, nblocks, len;
+
+    if(hw == RIJNDAEL_ACCEL_NONE)
+        return;
+
+    for(ks=16; ks <= RIJNDAEL_MAX_KEYSIZE; ks+=8)
+    {
+        fill(key, sizeof(key), ks);
+        fill(iv, sizeof(iv), ks + 1);
+        fill(in, sizeof(in), ks + 2);
+
+        /* The inverse key schedule comes out the same both ways
+        */
+        memset(&ctx, 0x0, sizeof(ctx));
+        CU_ASSERT(rijndael_set_accel(RIJNDAEL_ACCEL_NONE) == 0);
+        rijndael_setup(&ctx, ks, key);
+        memcpy(ikeys, ctx.ikeys, sizeof(ikeys));
+        CU_ASSERT(rijndael_set_accel(hw) == 0);
+        memset(&ctx, 0x0, sizeof(ctx));
+        rijndael_setup(&ctx, ks, key);
+        CU_ASSERT(memcmp(ikeys, ctx.ikeys, sizeof(ikeys)) == 0);
+
+        for(m=0; m < (int)(sizeof(test_modes)/sizeof(test_modes[0])); m++)
+        {
+            ctx.mode = test_modes[m];
+            for(nblocks=1; nblocks <= TEST_BLOCKS; nblocks++)
+            {
+                len = nblocks * RIJNDAEL_BLOCKSIZE;
+
+                CU_ASSERT(rijndael_set_accel(RIJNDAEL_ACCEL_NONE) == 0);
+                block_encrypt(&ctx, in, len, sw, iv);
+                CU_ASSERT(rijndael_set_accel(hw) == 0);
+                block_encrypt(&ctx, in, len, out, iv);
+                CU_ASSERT(memcmp(sw, out, len) == 0);
+
+                block_decrypt(&ctx, sw, len, out, iv);
+                CU_ASSERT(memcmp(in, out, len) == 0);
+
+                /* And in place
+                */
+                memcpy(out, sw, len);
+                block_decrypt(&ctx, out, len, out, iv);
+                CU_ASSERT(memcmp(in, out, len) == 0);
+            }
+        }
+    }
+}
+
+int register_ts_rijndael_accel(void)
+{
+    ts_init(&TEST_SUITE(rijndael_accel), TEST_SUITE_DESCR(rijndael_accel), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(rijndael_accel), UTEST_FCT(fips197), UTEST_DESCR(fips197));
+    ts_add_utest(&TEST_SUITE(rijndael_accel), UTEST_FCT(accel_matches_portable), UTEST_DESCR(accel_matches_portable));
+
+    return register_ts(&TEST_SUITE(rijndael_accel));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
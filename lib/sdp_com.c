@@ -16,6 +16,8 @@
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <ctype.h>
+#include <errno.h>
+#include <poll.h>
 
 
 static void sdp_com_free_argv(char **argv_new, int *argc_new)
@@ -491,6 +493,28 @@ int sdp_com_init(sdp_com_t com)
     return SDP_SUCCESS;
 }
 
+/**
+ * @brief Forget the message being received
+ */
+static void sdp_com_reset_recv(sdp_com_t com)
+{
+    free(com->recv_msg);
+    com->recv_msg = NULL;
+
+    if(com->recv_jmsg != NULL)
+        json_object_put(com->recv_jmsg);
+    com->recv_jmsg = NULL;
+
+    if(com->recv_tok != NULL)
+        json_tokener_reset(com->recv_tok);
+
+    com->recv_header_bytes = 0;
+    com->recv_msg_len = 0;
+    com->recv_msg_bytes = 0;
+    com->recv_error = 0;
+}
+
+
 int sdp_com_new(sdp_com_t *r_com)
 {
     sdp_com_t com = NULL;
@@ -535,6 +559,11 @@ void sdp_com_destroy(sdp_com_t com)
     if(com->ssl != NULL)
         SSL_free(com->ssl);
 
+    sdp_com_reset_recv(com);
+
+    if(com->recv_tok != NULL)
+        json_tokener_free(com->recv_tok);
+
     if(com->ssl_ctx != NULL)
         SSL_CTX_free(com->ssl_ctx);
 
@@ -681,6 +710,9 @@ int sdp_com_disconnect(sdp_com_t com)
 
     com->conn_state = SDP_COM_DISCONNECTED;
 
+    // a partly received message will not be continued
+    sdp_com_reset_recv(com);
+
     log_msg(LOG_DEBUG, "Exiting sdp_com_disconnect");
 
     return SDP_SUCCESS;
@@ -799,98 +831,273 @@ int sdp_com_send_msg(sdp_com_t com, const char *msg)
 }
 
 
-int sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes)
+/**
+ * @brief Read what is available, up to len bytes
+ *
+ * Sets r_bytes to 0 if nothing arrived before the read timeout
+ */
+static int sdp_com_read(sdp_com_t com, void *buf, int len, int *r_bytes)
 {
+    char ssl_error_string[SDP_MAX_LINE_LEN];
+    int ssl_error = 0;
     int bytes = 0;
-    int total_bytes = 0;
-    char *msg = NULL;
-    unsigned int data_length = 0;
-    sdp_header header;
 
-    if(com == NULL || !com->initialized)
-        return SDP_ERROR_UNINITIALIZED;
+    *r_bytes = 0;
 
-    if(com->conn_state == SDP_COM_DISCONNECTED)
-        return SDP_ERROR_CONN_DOWN;
-
-    /* Always returns 0, even when data is available
-    if((bytes = SSL_pending(com->ssl)) == 0)
+    errno = 0;
+    if((bytes = SSL_read(com->ssl, buf, len)) > 0)
     {
-        log_msg(LOG_DEBUG, "No data waiting to be retrieved from socket");
-        *r_bytes = 0;
-        *r_msg = NULL;
+        *r_bytes = bytes;
         return SDP_SUCCESS;
     }
-    */
 
-    if((bytes = SSL_read(com->ssl, &header, SDP_COM_HEADER_LEN)) <= 0) {
-        log_msg(LOG_DEBUG, "No data to read right now");
-        *r_bytes = 0;
+    ssl_error = sdp_com_get_ssl_error(com->ssl, bytes, ssl_error_string);
+
+    if(ssl_error == SSL_ERROR_WANT_READ || ssl_error == SSL_ERROR_WANT_WRITE
+       || (ssl_error == SSL_ERROR_SYSCALL
+           && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)))
         return SDP_SUCCESS;
-    }
 
-    if (bytes != SDP_COM_HEADER_LEN) {
-        log_msg(LOG_ERR, "Header found was shorter than minimum message size");
-        return SDP_ERROR_INVALID_MSG_SHORT;
-    }
+    log_msg(LOG_ERR, "Error from SSL_read: %s", ssl_error_string);
+    return SDP_ERROR_SOCKET_READ;
+}
 
-    data_length = ntohl(header.length);
 
-    if (data_length > SDP_COM_MAX_MSG_BLOCK_LEN) {
-        log_msg(LOG_ERR, "Header length field indicates message sizes longer than the maximum");
-        log_msg(LOG_ERR, "Length field: %u; maximum: %d", data_length, SDP_COM_MAX_MSG_BLOCK_LEN);
-        return SDP_ERROR_INVALID_MSG_LONG;
-    }
+/**
+ * @brief Hand a block of the message body to the json parser or buffer
+ */
+static int sdp_com_recv_block(sdp_com_t com, int as_json, const char *block, int len)
+{
+    json_object *jmsg = NULL;
+    enum json_tokener_error jerr;
 
-    if((bytes = SSL_read(com->ssl, com->recv_buffer, data_length)) <= 0)
+    if(com->recv_error)
+        return SDP_SUCCESS;
+
+    if(!as_json)
     {
-        log_msg(LOG_ERR, "Data found was shorter than minimum message size");
-        return SDP_ERROR_INVALID_MSG_SHORT;
+        memcpy(com->recv_msg + com->recv_msg_bytes, block, len);
+        return SDP_SUCCESS;
     }
 
-    if (bytes != data_length) {
-        log_msg(LOG_ERR, "Data read was short %d of %d", bytes, data_length);
-        return SDP_ERROR_INVALID_MSG_SHORT;
-    }
+    // anything after the complete message is ignored, as
+    // json_tokener_parse() would
+    if(com->recv_jmsg != NULL)
+        return SDP_SUCCESS;
 
-    log_msg(LOG_DEBUG, "Initial socket read returned %d bytes", bytes);
+    if(com->recv_tok == NULL && (com->recv_tok = json_tokener_new()) == NULL)
+        return SDP_ERROR_MEMORY_ALLOCATION;
 
-    if(bytes < SDP_MSG_MIN_LEN)
+    if((jmsg = json_tokener_parse_ex(com->recv_tok, block, len)) != NULL)
     {
-        log_msg(LOG_ERR, "Data found was shorter than minimum message size");
-        return SDP_ERROR_INVALID_MSG_SHORT;
+        com->recv_jmsg = jmsg;
+    }
+    else if((jerr = json_tokener_get_error(com->recv_tok)) != json_tokener_continue)
+    {
+        log_msg(LOG_ERR, "Failed to parse message from controller: %s",
+                json_tokener_error_desc(jerr));
+        com->recv_error = SDP_ERROR_INVALID_MSG;
     }
 
-    if((msg = strndup(com->recv_buffer, (size_t)bytes)) == NULL)
-        return SDP_ERROR_MEMORY_ALLOCATION;
+    return SDP_SUCCESS;
+}
 
-    total_bytes = bytes;
 
-    // if necessary, keep reading input from controller
-    while(bytes >= SDP_COM_MAX_MSG_BLOCK_LEN)
+/**
+ * @brief Read as much of the next message as is available
+ *
+ * The length header is read first, then the body in blocks of at most
+ * SDP_COM_MAX_MSG_BLOCK_LEN.  Each block is either copied into a buffer
+ * allocated once at the size given in the header, or, if as_json is set,
+ * fed straight to the json parser so the body is never held as text.
+ * A message that has not fully arrived is continued on the next call, so
+ * a caller must not mix the string and json forms on one connection.
+ *
+ * Sets r_done once the whole message has been read.  A message that
+ * turned out to be invalid is reported only then, so the stream stays
+ * in step with the controller.
+ */
+static int sdp_com_recv(sdp_com_t com, int as_json, int *r_done)
+{
+    int rv = SDP_SUCCESS;
+    int bytes = 0;
+    uint32_t want = 0;
+
+    *r_done = 0;
+
+    while(com->recv_header_bytes < SDP_COM_HEADER_LEN)
     {
-        log_msg(LOG_DEBUG, "Checking for additional data waiting in stream");
-        if((bytes = SSL_read(com->ssl, com->recv_buffer, SDP_COM_MAX_MSG_BLOCK_LEN)) > 0)
+        if((rv = sdp_com_read(com, com->recv_header + com->recv_header_bytes,
+                        SDP_COM_HEADER_LEN - com->recv_header_bytes, &bytes)) != SDP_SUCCESS
+           && com->recv_header_bytes == 0)
         {
-            if((msg = strncat(msg, com->recv_buffer, (size_t)bytes)) == NULL)
-                return SDP_ERROR_MEMORY_ALLOCATION;
+            // the controller closed the connection or it failed, which is
+            // left for the caller to notice as a lost connection rather
+            // than reported as an error here
+            log_msg(LOG_WARNING, "Connection to controller lost");
+            sdp_com_disconnect(com);
+            return SDP_SUCCESS;
+        }
 
-            if((total_bytes += bytes) > SDP_MSG_MAX_LEN)
-            {
-                log_msg(LOG_ERR,
-                        "Socket read resulted in too much data: %d bytes. Possible attack.",
-                        total_bytes);
-                free(msg);
-                return SDP_ERROR_INVALID_MSG_LONG;
-            }
+        if(rv != SDP_SUCCESS)
+            goto lost;
+
+        if(!bytes)
+            return SDP_SUCCESS;
+
+        if((com->recv_header_bytes += bytes) < SDP_COM_HEADER_LEN)
+            continue;
+
+        com->recv_msg_len = ((uint32_t)com->recv_header[0] << 24)
+                          | ((uint32_t)com->recv_header[1] << 16)
+                          | ((uint32_t)com->recv_header[2] << 8)
+                          |  (uint32_t)com->recv_header[3];
+
+        if(com->recv_msg_len > SDP_COM_MAX_MSG_LEN)
+        {
+            log_msg(LOG_ERR, "Header length field indicates message sizes longer than the maximum");
+            log_msg(LOG_ERR, "Length field: %u; maximum: %d", com->recv_msg_len, SDP_COM_MAX_MSG_LEN);
+            rv = SDP_ERROR_INVALID_MSG_LONG;
+            goto lost;
+        }
+
+        if(com->recv_msg_len < SDP_MSG_MIN_LEN)
+        {
+            log_msg(LOG_ERR, "Data found was shorter than minimum message size");
+            com->recv_error = SDP_ERROR_INVALID_MSG_SHORT;
+        }
+        else if(!as_json && (com->recv_msg = malloc(com->recv_msg_len + 1)) == NULL)
+        {
+            sdp_com_reset_recv(com);
+            return SDP_ERROR_MEMORY_ALLOCATION;
         }
     }
 
-    *r_msg = msg;
-    *r_bytes = total_bytes;
+    while(com->recv_msg_bytes < com->recv_msg_len)
+    {
+        want = com->recv_msg_len - com->recv_msg_bytes;
+        if(want > SDP_COM_MAX_MSG_BLOCK_LEN)
+            want = SDP_COM_MAX_MSG_BLOCK_LEN;
+
+        if((rv = sdp_com_read(com, com->recv_buffer, (int)want, &bytes)) != SDP_SUCCESS)
+            goto lost;
+
+        if(!bytes)
+        {
+            log_msg(LOG_DEBUG, "Read %u of %u message bytes so far",
+                    com->recv_msg_bytes, com->recv_msg_len);
+            return SDP_SUCCESS;
+        }
+
+        if((rv = sdp_com_recv_block(com, as_json, com->recv_buffer, bytes)) != SDP_SUCCESS)
+        {
+            sdp_com_reset_recv(com);
+            return rv;
+        }
+
+        com->recv_msg_bytes += bytes;
+    }
+
+    *r_done = 1;
+
+    if((rv = com->recv_error) == SDP_SUCCESS && as_json && com->recv_jmsg == NULL)
+    {
+        log_msg(LOG_ERR, "Message from controller ended before the json did");
+        rv = SDP_ERROR_INVALID_MSG;
+    }
+
+    if(rv != SDP_SUCCESS)
+        sdp_com_reset_recv(com);
+
+    return rv;
+
+lost:
+    // the stream can no longer be split into messages, start over
+    sdp_com_reset_recv(com);
+    sdp_com_disconnect(com);
+    return rv;
+}
+
+
+/**
+ * @brief Whether reading now would return data without waiting
+ *
+ * True if the socket is readable or OpenSSL already holds decrypted
+ * data, which poll() on the socket would not show.
+ */
+int sdp_com_msg_waiting(sdp_com_t com)
+{
+    struct pollfd pfd;
+
+    if(com == NULL || !com->initialized || com->ssl == NULL
+       || com->conn_state == SDP_COM_DISCONNECTED)
+        return 0;
+
+    if(SSL_pending(com->ssl) > 0)
+        return 1;
+
+    pfd.fd = com->socket_descriptor;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
+
+int sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes)
+{
+    int rv = SDP_SUCCESS;
+    int done = 0;
+
+    if(com == NULL || !com->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    if(com->conn_state == SDP_COM_DISCONNECTED)
+        return SDP_ERROR_CONN_DOWN;
+
+    *r_bytes = 0;
+
+    if((rv = sdp_com_recv(com, 0, &done)) != SDP_SUCCESS || !done)
+        return rv;
+
+    com->recv_msg[com->recv_msg_len] = '\0';
+
+    *r_msg = com->recv_msg;
+    *r_bytes = (int)com->recv_msg_len;
+
+    com->recv_msg = NULL;
+    sdp_com_reset_recv(com);
     return SDP_SUCCESS;
 }
 
 
+/**
+ * @brief Get the next message, already parsed
+ *
+ * Like sdp_com_get_msg(), but the message is parsed as it is read and
+ * handed back as a json object, which the caller must release with
+ * json_object_put().  r_bytes is the length of the message.
+ */
+int sdp_com_get_json_msg(sdp_com_t com, json_object **r_jmsg, int *r_bytes)
+{
+    int rv = SDP_SUCCESS;
+    int done = 0;
+
+    if(com == NULL || !com->initialized)
+        return SDP_ERROR_UNINITIALIZED;
 
+    if(com->conn_state == SDP_COM_DISCONNECTED)
+        return SDP_ERROR_CONN_DOWN;
+
+    *r_bytes = 0;
+
+    if((rv = sdp_com_recv(com, 1, &done)) != SDP_SUCCESS || !done)
+        return rv;
+
+    *r_jmsg = com->recv_jmsg;
+    *r_bytes = (int)com->recv_msg_len;
 
+    com->recv_jmsg = NULL;
+    sdp_com_reset_recv(com);
+    return SDP_SUCCESS;
+}
@@ -12,6 +12,7 @@
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
+#include <json-c/json.h>
 
 
 
@@ -30,6 +31,7 @@ enum {
 	SDP_COM_MAX_PATH_LEN = 1024,
 	SDP_COM_MAX_LINE_LEN = 1024,
 	SDP_COM_MAX_MSG_BLOCK_LEN = 16384,
+	SDP_COM_MAX_MSG_LEN = 64 * 1024 * 1024,
 	SDP_COM_MAX_Q_LEN = 100,
 	SDP_COM_MAX_FWKNOP_ARGS = 6,
 	SDP_COM_MAX_FWKNOP_CMD_LEN = SDP_COM_MAX_PATH_LEN + SDP_COM_MAX_LINE_LEN + 100
@@ -68,6 +70,17 @@ struct sdp_com{
 	unsigned int conn_attempts;
 	unsigned int initial_conn_attempt_interval;
 	char recv_buffer[SDP_COM_MAX_MSG_BLOCK_LEN];
+
+	// state of the incoming message, kept across calls so that a message
+	// that has not fully arrived yet is picked up where it was left
+	unsigned char recv_header[SDP_COM_HEADER_LEN];
+	uint32_t recv_header_bytes;
+	uint32_t recv_msg_len;
+	uint32_t recv_msg_bytes;
+	int recv_error;
+	char *recv_msg;
+	json_tokener *recv_tok;
+	json_object *recv_jmsg;
 	//char **message_queue;
 	//unsigned int message_queue_len;
 };
@@ -83,5 +96,7 @@ int  sdp_com_disconnect(sdp_com_t com);
 int  sdp_com_show_certs(sdp_com_t com);
 int  sdp_com_send_msg(sdp_com_t com, const char *msg);
 int  sdp_com_get_msg(sdp_com_t com, char **r_msg, int *r_bytes);
+int  sdp_com_get_json_msg(sdp_com_t com, json_object **r_jmsg, int *r_bytes);
+int  sdp_com_msg_waiting(sdp_com_t com);
 
 #endif /* SDP_COM_H_ */
@@ -19,6 +19,8 @@
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sys/time.h>
 #include <json-c/json.h>
 #include <pthread.h>
 
@@ -240,6 +242,7 @@ int sdp_ctrl_client_listen(sdp_ctrl_client_t client, int max_time, int *r_action
     int rv = SDP_SUCCESS;
     void *data = NULL;
     time_t stop_time = time(NULL) + max_time;
+    time_t now = 0;
     int action = INVALID_CTRL_ACTION;
 
     if(client == NULL || !client->initialized)
@@ -271,26 +274,30 @@ int sdp_ctrl_client_listen(sdp_ctrl_client_t client, int max_time, int *r_action
         }
 
         // do not begin sending requests until controller is ready
-        if( !(client->controller_ready) )
-            continue;
-
-        // if new connection or just time, update credentials
-        if((rv = sdp_ctrl_client_consider_cred_update(client)) != SDP_SUCCESS)
-            break;
+        if(client->controller_ready)
+        {
+            // if new connection or just time, update credentials
+            if((rv = sdp_ctrl_client_consider_cred_update(client)) != SDP_SUCCESS)
+                break;
 
-        // if built for remote gateway, handle access updates
-        if((rv = sdp_ctrl_client_consider_access_refresh(client)) != SDP_SUCCESS)
-            break;
+            // if built for remote gateway, handle access updates
+            if((rv = sdp_ctrl_client_consider_access_refresh(client)) != SDP_SUCCESS)
+                break;
 
-        // is a keep alive due
-        if((rv = sdp_ctrl_client_consider_keep_alive(client)) != SDP_SUCCESS)
-            break;
+            // is a keep alive due
+            if((rv = sdp_ctrl_client_consider_keep_alive(client)) != SDP_SUCCESS)
+                break;
+        }
 
         // watch the time
-        if( max_time && (time(NULL) > stop_time) )
+        if( max_time && ((now = time(NULL)) > stop_time) )
             break;
 
-        sleep(1);
+        if((rv = sdp_ctrl_client_wait(client,
+                SDP_CTRL_CLIENT_TIMER_KEEP_ALIVE | SDP_CTRL_CLIENT_TIMER_CRED_UPDATE
+                    | SDP_CTRL_CLIENT_TIMER_ACCESS_REFRESH,
+                max_time ? (int)(stop_time - now + 1) * 1000 : -1, NULL, 0)) != SDP_SUCCESS)
+            break;
     }
 
     return rv;
@@ -592,16 +599,25 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
 {
     int rv = SDP_SUCCESS;
     int bytes, msg_cnt = 0;
-    char *msg = NULL;
+    json_object *jmsg = NULL;
     void *data = NULL;
     ctrl_action_t action = INVALID_CTRL_ACTION;
 
     while(msg_cnt < client->message_queue_len)
     {
-        free(msg);
-        msg = NULL;
+        if(jmsg != NULL)
+            json_object_put(jmsg);
+        jmsg = NULL;
 
-        if((rv = sdp_com_get_msg(client->com, &msg, &bytes)) != SDP_SUCCESS)
+        // do not sit out the socket read timeout when nothing came in
+        if(client->com->conn_state == SDP_COM_CONNECTED
+           && !sdp_com_msg_waiting(client->com))
+        {
+            log_msg(LOG_DEBUG, "No more incoming data to retrieve from com");
+            break;
+        }
+
+        if((rv = sdp_com_get_json_msg(client->com, &jmsg, &bytes)) != SDP_SUCCESS)
         {
             log_msg(LOG_ERR, "Error when trying to retrieve message from com.");
             goto cleanup;
@@ -615,7 +631,7 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
 
         msg_cnt++;
 
-        if((rv = sdp_message_process(msg, &action, &data)) != SDP_SUCCESS)
+        if((rv = sdp_message_process_json(jmsg, &action, &data)) != SDP_SUCCESS)
         {
             log_msg(LOG_ERR, "Message processing failed");
             goto cleanup;
@@ -691,11 +707,156 @@ int sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **
     }  // END while(msg_cnt < q_len)
 
 cleanup:
-    free(msg);
+    if(jmsg != NULL)
+        json_object_put(jmsg);
     return rv;
 }
 
 
+static void sdp_ctrl_client_earliest(time_t *next, time_t t)
+{
+    if(*next == 0 || t < *next)
+        *next = t;
+}
+
+
+/**
+ * @brief When the next of the given timers is due
+ *
+ * Mirrors the checks in the sdp_ctrl_client_consider_*() functions.
+ * Returns 0 if none of them can fire in the current state.
+ */
+static time_t sdp_ctrl_client_next_timer(sdp_ctrl_client_t client, int timers)
+{
+    time_t next = 0;
+    time_t retry = client->last_req_time + client->req_retry_interval;
+
+    if(!client->controller_ready)
+        return 0;
+
+    switch(client->client_state)
+    {
+        case SDP_CTRL_CLIENT_STATE_READY:
+            if(timers & SDP_CTRL_CLIENT_TIMER_KEEP_ALIVE)
+                sdp_ctrl_client_earliest(&next, client->last_contact + client->keep_alive_interval);
+            if(timers & SDP_CTRL_CLIENT_TIMER_CRED_UPDATE)
+                sdp_ctrl_client_earliest(&next, client->last_cred_update + client->cred_update_interval);
+            if(timers & SDP_CTRL_CLIENT_TIMER_SERVICE_REFRESH)
+                sdp_ctrl_client_earliest(&next, client->last_service_refresh + client->service_refresh_interval);
+            if(timers & SDP_CTRL_CLIENT_TIMER_ACCESS_REFRESH)
+                sdp_ctrl_client_earliest(&next, client->last_access_refresh + client->access_refresh_interval);
+            break;
+
+        case SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_REQUESTING:
+        case SDP_CTRL_CLIENT_STATE_KEEP_ALIVE_UNFULFILLED:
+            if(timers & SDP_CTRL_CLIENT_TIMER_KEEP_ALIVE)
+                next = retry;
+            break;
+
+        case SDP_CTRL_CLIENT_STATE_CRED_REQUESTING:
+        case SDP_CTRL_CLIENT_STATE_CRED_UNFULFILLED:
+            if(timers & SDP_CTRL_CLIENT_TIMER_CRED_UPDATE)
+                next = retry;
+            break;
+
+        case SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_REQUESTING:
+        case SDP_CTRL_CLIENT_STATE_SERVICE_REFRESH_UNFULFILLED:
+            if(timers & SDP_CTRL_CLIENT_TIMER_SERVICE_REFRESH)
+                next = retry;
+            break;
+
+        case SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_REQUESTING:
+        case SDP_CTRL_CLIENT_STATE_ACCESS_REFRESH_UNFULFILLED:
+            if(timers & SDP_CTRL_CLIENT_TIMER_ACCESS_REFRESH)
+                next = retry;
+            break;
+
+        default:
+            break;
+    }
+
+    return next;
+}
+
+
+/**
+ * @brief Sleep until there is something for the client to do
+ *
+ * Returns once a message from the controller is waiting, one of the
+ * caller's fds is readable (see their revents), a signal arrives, or the
+ * next of the given timers is due, whichever comes first.  max_wait_ms
+ * caps the wait for callers with deadlines of their own, -1 for none.
+ * Returns at once if the connection is down.
+ *
+ * @param timers - SDP_CTRL_CLIENT_TIMER_* flags for the consider
+ *                 functions the caller runs after waking up
+ *
+ * @return SDP_SUCCESS or an error code.
+ */
+int sdp_ctrl_client_wait(sdp_ctrl_client_t client, int timers, int max_wait_ms,
+        struct pollfd *fds, int num_fds)
+{
+    struct pollfd pfds[SDP_CTRL_CLIENT_MAX_WAIT_FDS + 1];
+    struct timeval now;
+    time_t next = 0;
+    long long timer_ms = 0;
+    int i, wait_ms = max_wait_ms;
+
+    if(client == NULL || !client->initialized)
+        return SDP_ERROR_UNINITIALIZED;
+
+    if(num_fds < 0 || num_fds > SDP_CTRL_CLIENT_MAX_WAIT_FDS || (num_fds && fds == NULL))
+        return SDP_ERROR_BAD_ARG;
+
+    for(i = 0; i < num_fds; i++)
+        fds[i].revents = 0;
+
+    if(client->com->conn_state == SDP_COM_DISCONNECTED || client->com->ssl == NULL)
+        return SDP_SUCCESS;
+
+    if(sdp_com_msg_waiting(client->com))
+        return SDP_SUCCESS;
+
+    if((next = sdp_ctrl_client_next_timer(client, timers)) > 0)
+    {
+        gettimeofday(&now, NULL);
+
+        // a timer already due was not acted on (e.g. its request could
+        // not be made), so try again in a second as the old loop did
+        if(next <= now.tv_sec)
+            timer_ms = 1000;
+        else
+            timer_ms = (long long)(next - now.tv_sec) * 1000 - now.tv_usec / 1000;
+
+        if(timer_ms > INT_MAX)
+            timer_ms = INT_MAX;
+
+        if(wait_ms < 0 || timer_ms < wait_ms)
+            wait_ms = (int)timer_ms;
+    }
+
+    pfds[0].fd = client->com->socket_descriptor;
+    pfds[0].events = POLLIN;
+    pfds[0].revents = 0;
+    for(i = 0; i < num_fds; i++)
+        pfds[i+1] = fds[i];
+
+    if(poll(pfds, num_fds + 1, wait_ms) < 0)
+    {
+        if(errno == EINTR)
+            return SDP_SUCCESS;
+
+        log_msg(LOG_ERR, "poll() failed: %s", strerror(errno));
+        return SDP_ERROR_SOCKET;
+    }
+
+    for(i = 0; i < num_fds; i++)
+        fds[i].revents = pfds[i+1].revents;
+
+    return SDP_SUCCESS;
+}
+
+
 int sdp_ctrl_client_request_keep_alive(sdp_ctrl_client_t client)
 {
     //int bytes = 0;
@@ -1535,26 +1696,30 @@ int sdp_ctrl_client_loop(sdp_ctrl_client_t client)
             break;
 
         // do not begin sending requests until controller is ready
-        if( !(client->controller_ready) )
-            continue;
+        if(client->controller_ready)
+        {
+            // if new connection or just time, update credentials
+            if((rv = sdp_ctrl_client_consider_cred_update(client)) != SDP_SUCCESS)
+                break;
 
-        // if new connection or just time, update credentials
-        if((rv = sdp_ctrl_client_consider_cred_update(client)) != SDP_SUCCESS)
-            break;
+            // if configured to disconnect after update, do so
+            if(!client->remain_connected && client->last_cred_update > 0)
+                break;
 
-        // if configured to disconnect after update, do so
-        if(!client->remain_connected && client->last_cred_update > 0)
-            break;
+            // handle any signals that may have come in
+            if((rv = sdp_ctrl_client_handle_signals(client)) != SDP_SUCCESS)
+                break;
 
-        // handle any signals that may have come in
-        if((rv = sdp_ctrl_client_handle_signals(client)) != SDP_SUCCESS)
-            break;
+            // is a keep alive due
+            if((rv = sdp_ctrl_client_consider_keep_alive(client)) != SDP_SUCCESS)
+                break;
+        }
 
-        // is a keep alive due
-        if((rv = sdp_ctrl_client_consider_keep_alive(client)) != SDP_SUCCESS)
+        // signals cut the wait short
+        if((rv = sdp_ctrl_client_wait(client,
+                SDP_CTRL_CLIENT_TIMER_KEEP_ALIVE | SDP_CTRL_CLIENT_TIMER_CRED_UPDATE,
+                -1, NULL, 0)) != SDP_SUCCESS)
             break;
-
-        sleep(1);
     }
 
     sdp_com_disconnect(client->com);
@@ -10,6 +10,7 @@
 
 #include <signal.h>
 #include <sys/socket.h>
+#include <poll.h>
 #include <openssl/ssl.h>
 #include <openssl/crypto.h>
 #include <openssl/err.h>
@@ -147,6 +148,18 @@ struct sdp_ctrl_client{
 
 typedef struct sdp_ctrl_client *sdp_ctrl_client_t;
 
+// Timers sdp_ctrl_client_wait() wakes up for, one for each of the
+// sdp_ctrl_client_consider_*() functions the caller's loop runs
+enum {
+    SDP_CTRL_CLIENT_TIMER_KEEP_ALIVE      = 0x1,
+    SDP_CTRL_CLIENT_TIMER_CRED_UPDATE     = 0x2,
+    SDP_CTRL_CLIENT_TIMER_SERVICE_REFRESH = 0x4,
+    SDP_CTRL_CLIENT_TIMER_ACCESS_REFRESH  = 0x8,
+    SDP_CTRL_CLIENT_TIMER_ALL             = 0xF
+};
+
+#define SDP_CTRL_CLIENT_MAX_WAIT_FDS 4
+
 int  sdp_ctrl_client_new(const char *config_file, const char *fwknoprc_file, const int foreground, sdp_ctrl_client_t *r_client);
 void sdp_ctrl_client_destroy(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_listen(sdp_ctrl_client_t client, int max_time, int *r_action, void **r_data);
@@ -162,6 +175,7 @@ void sdp_ctrl_client_describe(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_get_port(sdp_ctrl_client_t client, int *r_port);
 int  sdp_ctrl_client_get_addr(sdp_ctrl_client_t client, char **r_addr);
 int  sdp_ctrl_client_check_inbox(sdp_ctrl_client_t client, int *r_action, void **r_data);
+int  sdp_ctrl_client_wait(sdp_ctrl_client_t client, int timers, int max_wait_ms, struct pollfd *fds, int num_fds);
 int  sdp_ctrl_client_request_keep_alive(sdp_ctrl_client_t client);
 void sdp_ctrl_client_process_keep_alive(sdp_ctrl_client_t client);
 int  sdp_ctrl_client_request_cred_update(sdp_ctrl_client_t client);
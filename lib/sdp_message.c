@@ -218,14 +218,32 @@ int  sdp_message_make(const char *action, const json_object *data, char **r_out_
 
 int sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data)
 {
-    json_object *jmsg, *jdata;
+    json_object *jmsg;
     int rv = SDP_ERROR_INVALID_MSG;
-    //ctrl_response_result_t result = BAD_RESULT;
-    ctrl_action_t action = INVALID_CTRL_ACTION;
 
     // parse the msg string into json objects
     jmsg = json_tokener_parse(msg);
 
+    rv = sdp_message_process_json(jmsg, r_action, r_data);
+
+    // free the main json message object
+    // if the message was good, jdata already
+    // holds a ref to just the data portion
+	if(jmsg != NULL && json_object_get_type(jmsg) != json_type_null) json_object_put(jmsg);
+
+    return rv;
+}
+
+
+// same as sdp_message_process() for a message that is already parsed,
+// jmsg still belongs to the caller
+int sdp_message_process_json(json_object *jmsg, ctrl_action_t *r_action, void **r_data)
+{
+    json_object *jdata;
+    int rv = SDP_ERROR_INVALID_MSG;
+    //ctrl_response_result_t result = BAD_RESULT;
+    ctrl_action_t action = INVALID_CTRL_ACTION;
+
     // find and interpret the message action
     if((rv = sdp_get_message_action(jmsg, &action)) != SDP_SUCCESS)
         goto cleanup;
@@ -291,11 +309,6 @@ int sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data)
 
 cleanup:
 
-    // free the main json message object
-    // if the message was good, jdata already
-    // holds a ref to just the data portion
-	if(jmsg != NULL && json_object_get_type(jmsg) != json_type_null) json_object_put(jmsg);
-
     if(rv == SDP_SUCCESS)
     {
         *r_action = action;
@@ -86,6 +86,7 @@ int  sdp_get_json_string_field(const char *key, json_object *jdata, char **r_fie
 int  sdp_get_json_int_field(const char *key, json_object *jdata, int *r_field);
 int  sdp_message_make(const char *subject, const json_object *data, char **r_out_msg);
 int  sdp_message_process(const char *msg, ctrl_action_t *r_action, void **r_data); //json_object **r_jdata);
+int  sdp_message_process_json(json_object *jmsg, ctrl_action_t *r_action, void **r_data);
 int  sdp_message_parse_cred_fields(json_object *jdata, void **r_creds);
 void sdp_message_destroy_creds(sdp_creds_t creds);
 
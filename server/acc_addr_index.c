@@ -0,0 +1,511 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_addr_index.c
+ *
+ * Purpose: SOURCE / DESTINATION address index over the access stanzas for
+ *          legacy (non-SDP) mode.  Instead of walking the address list
+ *          of every stanza for each SPA packet, fwknopd looks up the
+ *          packet addresses here and only tries the stanzas that can
+ *          match.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "acc_addr_index.h"
+
+/* Below this many ids the candidate list is sorted with an insertion sort
+*/
+#define ACC_ADDR_ISORT_MAX      32
+
+static uint32_t
+prefix_mask(const int len)
+{
+    return len == 0 ? 0 : 0xFFFFFFFF << (32 - len);
+}
+
+/* Prefix length of a mask, or -1 if the mask is not contiguous
+*/
+static int
+mask_prefix_len(const uint32_t mask)
+{
+    const uint32_t  inv = ~mask;
+
+    if((inv & (inv + 1)) != 0)
+        return -1;
+
+    return __builtin_popcount(mask);
+}
+
+static int
+cmp_ent(const void *a, const void *b)
+{
+    const acc_addr_ent_t *x = (const acc_addr_ent_t *)a;
+    const acc_addr_ent_t *y = (const acc_addr_ent_t *)b;
+
+    /* Contiguous masks sort by prefix length when compared as integers
+    */
+    if(x->mask != y->mask)
+        return x->mask < y->mask ? -1 : 1;
+    if(x->net != y->net)
+        return x->net < y->net ? -1 : 1;
+    if(x->id != y->id)
+        return x->id < y->id ? -1 : 1;
+    return 0;
+}
+
+static int
+cmp_id(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : (x > y);
+}
+
+static int
+grow(void **arr, uint32_t *alloc, const uint32_t need, const size_t size)
+{
+    uint32_t    n = *alloc ? *alloc : 16;
+    void       *p;
+
+    if(need <= *alloc)
+        return 0;
+
+    while(n < need)
+        n *= 2;
+
+    if((p = realloc(*arr, n * size)) == NULL)
+        return -1;
+
+    *arr   = p;
+    *alloc = n;
+    return 0;
+}
+
+static int
+table_add(acc_addr_table_t *t, const uint32_t maddr, const uint32_t mask,
+        const uint32_t id)
+{
+    acc_addr_ent_t  *e;
+
+    if(mask_prefix_len(mask) < 0)
+    {
+        if(grow((void **)&t->odd, &t->alloc_odd, t->num_odd + 1,
+                    sizeof(acc_addr_ent_t)) != 0)
+            return -1;
+        e = &t->odd[t->num_odd++];
+    }
+    else
+    {
+        if(grow((void **)&t->ents, &t->alloc_ents, t->num_ents + 1,
+                    sizeof(acc_addr_ent_t)) != 0)
+            return -1;
+        e = &t->ents[t->num_ents++];
+    }
+
+    e->net  = maddr & mask;
+    e->mask = mask;
+    e->id   = id;
+    return 0;
+}
+
+static void
+table_finish(acc_addr_table_t *t)
+{
+    uint32_t    i;
+    int         len, last = -1;
+
+    if(t->num_ents > 1)
+        qsort(t->ents, t->num_ents, sizeof(acc_addr_ent_t), cmp_ent);
+
+    /* start[len] is the first entry with a prefix length of at least len
+    */
+    t->num_lens = 0;
+    for(i=0; i < t->num_ents; i++)
+    {
+        len = mask_prefix_len(t->ents[i].mask);
+        while(last < len)
+            t->start[++last] = i;
+        if(t->num_lens == 0 || t->lens[t->num_lens-1] != len)
+            t->lens[t->num_lens++] = len;
+    }
+    while(last < 33)
+        t->start[++last] = t->num_ents;
+    return;
+}
+
+/* Sort and de-duplicate ids[0..n), return the new count
+*/
+static int
+sort_unique(uint32_t *ids, const int n)
+{
+    uint32_t    v;
+    int         i, j, u;
+
+    if(n < 2)
+        return n;
+
+    if(n <= ACC_ADDR_ISORT_MAX)
+    {
+        for(i=1; i < n; i++)
+        {
+            v = ids[i];
+            for(j=i; j > 0 && ids[j-1] > v; j--)
+                ids[j] = ids[j-1];
+            ids[j] = v;
+        }
+    }
+    else
+        qsort(ids, n, sizeof(uint32_t), cmp_id);
+
+    for(i=1, u=1; i < n; i++)
+        if(ids[i] != ids[u-1])
+            ids[u++] = ids[i];
+    return u;
+}
+
+/* Collect the ids of the ranges in the table that contain ip.  Returns the
+ * number of distinct ids, or the number of ranges that matched if that is
+ * more than max_ids (ids is then incomplete).
+*/
+static int
+table_lookup(const acc_addr_table_t *t, const uint32_t ip, uint32_t *ids,
+        const int max_ids)
+{
+    const acc_addr_ent_t   *e;
+    uint32_t                key, lo, hi, mid;
+    int                     i, n = 0;
+
+    for(i=0; i < t->num_lens; i++)
+    {
+        key = ip & prefix_mask(t->lens[i]);
+        lo  = t->start[t->lens[i]];
+        hi  = t->start[t->lens[i]+1];
+
+        while(lo < hi)
+        {
+            mid = lo + (hi - lo) / 2;
+            if(t->ents[mid].net < key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for(e = &t->ents[lo]; lo < t->start[t->lens[i]+1]
+                && e->net == key; e++, lo++)
+        {
+            if(n < max_ids)
+                ids[n] = e->id;
+            n++;
+        }
+    }
+
+    for(e = t->odd; e < t->odd + t->num_odd; e++)
+    {
+        if((ip & e->mask) == e->net)
+        {
+            if(n < max_ids)
+                ids[n] = e->id;
+            n++;
+        }
+    }
+
+    if(n > max_ids)
+        return n;
+
+    return sort_unique(ids, n);
+}
+
+static void
+table_free(acc_addr_table_t *t)
+{
+    free(t->ents);
+    free(t->odd);
+    return;
+}
+
+static int
+dst_match(const acc_addr_index_t *idx, const uint32_t id, const uint32_t ip)
+{
+    const acc_addr_ent_t   *e   = idx->dst + idx->dst_start[id];
+    const acc_addr_ent_t   *end = idx->dst + idx->dst_start[id+1];
+
+    for(; e < end; e++)
+        if((ip & e->mask) == e->net)
+            return 1;
+    return 0;
+}
+
+/**
+ * Create an empty index.  Returns NULL if out of memory.
+ */
+acc_addr_index_t *
+acc_addr_index_create(void)
+{
+    return calloc(1, sizeof(acc_addr_index_t));
+}
+
+/**
+ * Add the next access stanza with its SOURCE and DESTINATION lists.  The
+ * stanza gets the next id.  Without a SOURCE list the stanza never matches,
+ * without a DESTINATION list it matches any destination (the same as
+ * src_dst_check() does).  Returns 0, or -1 if out of memory.
+ */
+int
+acc_addr_index_add(acc_addr_index_t *idx, struct acc_stanza *acc,
+        const struct acc_int_list *src_list,
+        const struct acc_int_list *dst_list)
+{
+    const struct acc_int_list  *l;
+    const uint32_t              id = idx->num_stanzas;
+    uint32_t                    n = 0;
+
+    for(l = dst_list; l != NULL; l = l->next)
+        n++;
+
+    if(grow((void **)&idx->stanzas, &idx->alloc_stanzas, id + 1,
+                sizeof(struct acc_stanza *)) != 0
+            || grow((void **)&idx->dst_start, &idx->alloc_dst_start, id + 2,
+                sizeof(uint32_t)) != 0
+            || grow((void **)&idx->dst, &idx->alloc_dst,
+                idx->num_dst + (n ? n : 1), sizeof(acc_addr_ent_t)) != 0)
+        return -1;
+
+    for(l = src_list; l != NULL; l = l->next)
+        if(table_add(&idx->src, l->maddr, l->mask, id) != 0)
+            return -1;
+
+    if(dst_list == NULL)
+    {
+        idx->dst[idx->num_dst].net  = 0;
+        idx->dst[idx->num_dst].mask = 0;
+        idx->dst[idx->num_dst].id   = id;
+        idx->num_dst++;
+    }
+    for(l = dst_list; l != NULL; l = l->next)
+    {
+        idx->dst[idx->num_dst].net  = l->maddr & l->mask;
+        idx->dst[idx->num_dst].mask = l->mask;
+        idx->dst[idx->num_dst].id   = id;
+        idx->num_dst++;
+    }
+
+    idx->dst_start[id]   = idx->num_dst - (n ? n : 1);
+    idx->dst_start[id+1] = idx->num_dst;
+    idx->stanzas[idx->num_stanzas++] = acc;
+    return 0;
+}
+
+/**
+ * Sort the tables once all stanzas are added.  Must be called before the
+ * first lookup.
+ */
+void
+acc_addr_index_finish(acc_addr_index_t *idx)
+{
+    table_finish(&idx->src);
+    return;
+}
+
+/**
+ * Find the stanzas whose SOURCE list contains src_ip and whose DESTINATION
+ * list contains dst_ip (both in host byte order).  Their ids are written to
+ * ids in ascending (access.conf) order and their number is returned.
+ * If the SOURCE matches do not fit in max_ids, a number larger than
+ * max_ids is returned instead and the caller should retry with at least
+ * that much room.
+ */
+int
+acc_addr_index_lookup(const acc_addr_index_t *idx, const uint32_t src_ip,
+        const uint32_t dst_ip, uint32_t *ids, const int max_ids)
+{
+    int     ns, i, n = 0;
+
+    if((ns = table_lookup(&idx->src, src_ip, ids, max_ids)) > max_ids)
+        return ns;
+
+    for(i=0; i < ns; i++)
+        if(dst_match(idx, ids[i], dst_ip))
+            ids[n++] = ids[i];
+    return n;
+}
+
+void
+acc_addr_index_free(acc_addr_index_t *idx)
+{
+    if(idx == NULL)
+        return;
+
+    table_free(&idx->src);
+    free(idx->dst);
+    free(idx->dst_start);
+    free(idx->stanzas);
+    free(idx);
+    return;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_TEST_SUITE(acc_addr_index, "Access address index test suite");
+
+#define UTEST_STANZAS   500
+#define UTEST_MAX_RANGES  4
+
+static uint32_t utest_rand_state = 0x9e3779b9;
+
+static uint32_t
+utest_rand(void)
+{
+    utest_rand_state ^= utest_rand_state << 13;
+    utest_rand_state ^= utest_rand_state >> 17;
+    utest_rand_state ^= utest_rand_state << 5;
+    return utest_rand_state;
+}
+
+/* Addresses come from a small pool of networks so that ranges overlap
+ * and packets hit them.
+*/
+static uint32_t
+utest_addr(void)
+{
+    return ((10 + (utest_rand() % 4)) << 24) | (utest_rand() & 0x0003ffff);
+}
+
+static acc_int_list_t *
+utest_list(acc_int_list_t *ents)
+{
+    int         i, n = utest_rand() % (UTEST_MAX_RANGES + 1);
+    uint32_t    len;
+
+    for(i=0; i < n; i++)
+    {
+        len = utest_rand() % 40;
+        if(len > 32)
+            ents[i].mask = 0xff00ff00;  /* non-contiguous */
+        else if(len < 4)
+            ents[i].mask = 0;           /* ANY */
+        else
+            ents[i].mask = prefix_mask(len);
+        ents[i].maddr = utest_addr() & ents[i].mask;
+        ents[i].next  = (i + 1 < n) ? &ents[i+1] : NULL;
+    }
+    return n ? ents : NULL;
+}
+
+static int
+utest_list_match(const acc_int_list_t *l, const uint32_t ip)
+{
+    for(; l != NULL; l = l->next)
+        if((ip & l->mask) == l->maddr)
+            return 1;
+    return 0;
+}
+
+DECLARE_UTEST(matches_linear, "lookup matches a walk over all stanzas")
+{
+    static acc_int_list_t   src[UTEST_STANZAS][UTEST_MAX_RANGES];
+    static acc_int_list_t   dst[UTEST_STANZAS][UTEST_MAX_RANGES];
+    acc_int_list_t         *src_l[UTEST_STANZAS], *dst_l[UTEST_STANZAS];
+    uint32_t                ids[UTEST_STANZAS];
+    uint32_t                want[UTEST_STANZAS];
+    uint32_t                s, d;
+    acc_addr_index_t       *idx;
+    int                     i, k, n, nw, same = 1;
+
+    CU_ASSERT((idx = acc_addr_index_create()) != NULL);
+
+    for(i=0; i < UTEST_STANZAS; i++)
+    {
+        src_l[i] = utest_list(src[i]);
+        dst_l[i] = utest_list(dst[i]);
+        CU_ASSERT(acc_addr_index_add(idx, (struct acc_stanza *)&src[i],
+                    src_l[i], dst_l[i]) == 0);
+    }
+    acc_addr_index_finish(idx);
+    CU_ASSERT(idx->num_stanzas == UTEST_STANZAS);
+
+    for(k=0; k < 20000; k++)
+    {
+        s = utest_addr();
+        d = (k & 1) ? utest_addr() : utest_rand();
+
+        for(i=0, nw=0; i < UTEST_STANZAS; i++)
+            if(utest_list_match(src_l[i], s)
+                    && (dst_l[i] == NULL || utest_list_match(dst_l[i], d)))
+                want[nw++] = i;
+
+        n = acc_addr_index_lookup(idx, s, d, ids, UTEST_STANZAS);
+        if(n != nw || memcmp(ids, want, n * sizeof(uint32_t)) != 0)
+            same = 0;
+    }
+    CU_ASSERT(same == 1);
+    CU_ASSERT(idx->stanzas[7] == (struct acc_stanza *)&src[7]);
+
+    acc_addr_index_free(idx);
+}
+
+DECLARE_UTEST(short_buffer, "lookup asks for more room when ids do not fit")
+{
+    acc_int_list_t      any = {0, 0, NULL};
+    acc_int_list_t      host = {0x0a000001, 0xffffffff, NULL};
+    uint32_t            ids[8];
+    acc_addr_index_t   *idx;
+    int                 i, n;
+
+    CU_ASSERT((idx = acc_addr_index_create()) != NULL);
+    for(i=0; i < 12; i++)
+        CU_ASSERT(acc_addr_index_add(idx, NULL, (i % 4) ? &host : &any,
+                    NULL) == 0);
+    acc_addr_index_finish(idx);
+
+    n = acc_addr_index_lookup(idx, 0x0a000002, 0, ids, 8);
+    CU_ASSERT(n == 3);
+    CU_ASSERT(ids[0] == 0 && ids[1] == 4 && ids[2] == 8);
+
+    n = acc_addr_index_lookup(idx, 0x0a000001, 0, ids, 8);
+    CU_ASSERT(n > 8);
+
+    acc_addr_index_free(idx);
+
+    /* An empty index matches nothing
+    */
+    CU_ASSERT((idx = acc_addr_index_create()) != NULL);
+    acc_addr_index_finish(idx);
+    CU_ASSERT(acc_addr_index_lookup(idx, 0x0a000001, 0, ids, 8) == 0);
+    acc_addr_index_free(idx);
+}
+
+int register_ts_acc_addr_index(void)
+{
+    ts_init(&TEST_SUITE(acc_addr_index), TEST_SUITE_DESCR(acc_addr_index), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(acc_addr_index), UTEST_FCT(matches_linear), UTEST_DESCR(matches_linear));
+    ts_add_utest(&TEST_SUITE(acc_addr_index), UTEST_FCT(short_buffer), UTEST_DESCR(short_buffer));
+
+    return register_ts(&TEST_SUITE(acc_addr_index));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
@@ -0,0 +1,109 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_addr_index.h
+ *
+ * Purpose: Header file for fwknopd acc_addr_index.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ACC_ADDR_INDEX_H
+#define ACC_ADDR_INDEX_H
+
+#include <stdint.h>
+
+struct acc_stanza;
+struct acc_int_list;
+
+/* Candidate stanza ids process_spa_pkt() keeps on the stack before it
+ * has to allocate a bigger buffer
+*/
+#define ACC_ADDR_INDEX_STACK_IDS    64
+
+/* One address range of one stanza.  For contiguous masks only net and
+ * id are used; the table for the prefix length supplies the mask.
+*/
+typedef struct acc_addr_ent
+{
+    uint32_t            net;
+    uint32_t            mask;
+    uint32_t            id;
+} acc_addr_ent_t;
+
+/* All SOURCE ranges of all stanzas.  Ranges with a
+ * contiguous mask are kept sorted by network address in one array per
+ * prefix length, so a lookup is a binary search per prefix length in
+ * use.  Ranges with a non-contiguous mask (a dotted mask like
+ * 255.0.255.0) are checked one by one.
+*/
+typedef struct acc_addr_table
+{
+    acc_addr_ent_t     *ents;
+    uint32_t            num_ents;
+    uint32_t            alloc_ents;
+    uint32_t            start[34];  /* ents[start[len]..start[len+1]) have prefix len */
+    uint8_t             lens[33];   /* prefix lengths in use */
+    uint8_t             num_lens;
+    acc_addr_ent_t     *odd;        /* non-contiguous masks */
+    uint32_t            num_odd;
+    uint32_t            alloc_odd;
+} acc_addr_table_t;
+
+/* Access stanza lookup by packet source and destination address for
+ * legacy (non-SDP) mode.  Stanza ids are positions in the access.conf
+ * order, starting at 0.  The SOURCE ranges are indexed; the DESTINATION
+ * ranges of a stanza (usually none or a few) sit next to each other in
+ * dst[dst_start[id]..dst_start[id+1]] and are only checked for the
+ * stanzas whose SOURCE matched.  Built once per access.conf (re)load and
+ * only read afterwards.
+*/
+typedef struct acc_addr_index
+{
+    acc_addr_table_t    src;
+    acc_addr_ent_t     *dst;
+    uint32_t            num_dst;
+    uint32_t            alloc_dst;
+    uint32_t           *dst_start;  /* num_stanzas + 1 entries */
+    uint32_t            alloc_dst_start;
+    struct acc_stanza **stanzas;    /* id -> stanza */
+    uint32_t            num_stanzas;
+    uint32_t            alloc_stanzas;
+} acc_addr_index_t;
+
+/* Prototypes
+*/
+acc_addr_index_t *acc_addr_index_create(void);
+int   acc_addr_index_add(acc_addr_index_t *idx, struct acc_stanza *acc,
+        const struct acc_int_list *src_list,
+        const struct acc_int_list *dst_list);
+void  acc_addr_index_finish(acc_addr_index_t *idx);
+int   acc_addr_index_lookup(const acc_addr_index_t *idx, const uint32_t src_ip,
+        const uint32_t dst_ip, uint32_t *ids, const int max_ids);
+void  acc_addr_index_free(acc_addr_index_t *idx);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_acc_addr_index(void);
+#endif
+
+#endif  /* ACC_ADDR_INDEX_H */
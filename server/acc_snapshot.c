@@ -0,0 +1,382 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_snapshot.c
+ *
+ * Purpose: Read-mostly SDP ID -> access stanza lookup table.  The control
+ *          client thread builds a new immutable snapshot every time the
+ *          access data changes and publishes it with a single pointer
+ *          swap.  SPA processing threads look stanzas up without taking
+ *          any lock; they only mark the span during which they use a
+ *          stanza with an epoch, and the control client waits for those
+ *          readers before freeing an old snapshot or stanza.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "common.h"
+#include "acc_snapshot.h"
+
+#include <time.h>
+
+/* How long the writer sleeps between checks while waiting for readers
+*/
+#define ACC_EPOCH_WAIT_NSEC     1000000L
+
+static uint32_t
+sdp_id_slot(const uint32_t sdp_id, const uint32_t mask)
+{
+    uint32_t    h = sdp_id * 2654435761U;
+
+    return (h ^ (h >> 16)) & mask;
+}
+
+/**
+ * Reset the epoch state.  Must be done before any reader registers.
+ */
+void
+acc_epoch_init(acc_epoch_t *epoch)
+{
+    memset(epoch, 0x0, sizeof(acc_epoch_t));
+    epoch->global = 1;
+    return;
+}
+
+/**
+ * Claim a reader slot for the calling thread.  Returns the slot number,
+ * or -1 if all slots are taken.
+ */
+int
+acc_epoch_register(acc_epoch_t *epoch)
+{
+    unsigned int    slot;
+
+    slot = __atomic_fetch_add(&epoch->num_readers, 1, __ATOMIC_SEQ_CST);
+    if(slot >= ACC_EPOCH_MAX_READERS)
+    {
+        __atomic_fetch_sub(&epoch->num_readers, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    return (int)slot;
+}
+
+/**
+ * Start a read section.  Any stanza or snapshot found after this call
+ * stays valid until the matching acc_epoch_exit().
+ */
+void
+acc_epoch_enter(acc_epoch_t *epoch, const int slot)
+{
+    uint64_t    e;
+
+    if(slot < 0 || slot >= ACC_EPOCH_MAX_READERS)
+        return;
+
+    e = __atomic_load_n(&epoch->global, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&epoch->readers[slot].epoch, e, __ATOMIC_SEQ_CST);
+
+    /* The snapshot pointer must not be loaded before the writer can see
+     * that we are reading.
+    */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return;
+}
+
+void
+acc_epoch_exit(acc_epoch_t *epoch, const int slot)
+{
+    if(slot < 0 || slot >= ACC_EPOCH_MAX_READERS)
+        return;
+
+    __atomic_store_n(&epoch->readers[slot].epoch, 0, __ATOMIC_RELEASE);
+    return;
+}
+
+/**
+ * Wait for a grace period: every reader that might still be using
+ * something unpublished before this call has left its read section.
+ * Readers that enter afterwards are not waited for.
+ */
+void
+acc_epoch_synchronize(acc_epoch_t *epoch)
+{
+    struct timespec wait = {0, ACC_EPOCH_WAIT_NSEC};
+    uint64_t        target, e;
+    unsigned int    i, num_readers;
+
+    target = __atomic_add_fetch(&epoch->global, 1, __ATOMIC_SEQ_CST);
+
+    num_readers = __atomic_load_n(&epoch->num_readers, __ATOMIC_SEQ_CST);
+    if(num_readers > ACC_EPOCH_MAX_READERS)
+        num_readers = ACC_EPOCH_MAX_READERS;
+
+    for(i=0; i < num_readers; i++)
+    {
+        while(1)
+        {
+            e = __atomic_load_n(&epoch->readers[i].epoch, __ATOMIC_SEQ_CST);
+            if(e == 0 || e >= target)
+                break;
+            nanosleep(&wait, NULL);
+        }
+    }
+    return;
+}
+
+/**
+ * Allocate an empty snapshot with room for expected_entries stanzas.
+ * Returns NULL on allocation failure.
+ */
+acc_snapshot_t *
+acc_snapshot_create(const uint32_t expected_entries)
+{
+    acc_snapshot_t *snap = NULL;
+    uint32_t        slots = ACC_SNAPSHOT_MIN_SLOTS;
+
+    /* Keep the table at most half full
+    */
+    while(slots / 2 < expected_entries && slots < (1U << 31))
+        slots <<= 1;
+
+    if((snap = calloc(1, sizeof(acc_snapshot_t))) == NULL)
+        return NULL;
+
+    if((snap->ents = calloc(slots, sizeof(acc_snapshot_ent_t))) == NULL)
+    {
+        free(snap);
+        return NULL;
+    }
+    snap->mask = slots - 1;
+
+    return snap;
+}
+
+/**
+ * Add a stanza to a snapshot that has not been published yet.  A second
+ * stanza for the same SDP ID replaces the first.  Returns 0 on success or
+ * -1 if the ID is invalid or the snapshot is full.
+ */
+int
+acc_snapshot_add(acc_snapshot_t *snap, struct acc_stanza *acc,
+        const uint32_t sdp_id)
+{
+    uint32_t    i;
+
+    if(snap == NULL || acc == NULL || sdp_id == 0)
+        return -1;
+
+    i = sdp_id_slot(sdp_id, snap->mask);
+    while(snap->ents[i].sdp_id != 0)
+    {
+        if(snap->ents[i].sdp_id == sdp_id)
+        {
+            snap->ents[i].acc = acc;
+            return 0;
+        }
+        i = (i + 1) & snap->mask;
+    }
+
+    if(snap->count >= (snap->mask + 1) / 2)
+        return -1;
+
+    snap->ents[i].sdp_id = sdp_id;
+    snap->ents[i].acc    = acc;
+    snap->count++;
+
+    return 0;
+}
+
+struct acc_stanza *
+acc_snapshot_find(const acc_snapshot_t *snap, const uint32_t sdp_id)
+{
+    uint32_t    i;
+
+    if(snap == NULL || sdp_id == 0)
+        return NULL;
+
+    i = sdp_id_slot(sdp_id, snap->mask);
+    while(snap->ents[i].sdp_id != 0)
+    {
+        if(snap->ents[i].sdp_id == sdp_id)
+            return snap->ents[i].acc;
+        i = (i + 1) & snap->mask;
+    }
+    return NULL;
+}
+
+/**
+ * Get the currently published snapshot (may be NULL).  Readers must be
+ * inside a read section for as long as they use the result.
+ */
+acc_snapshot_t *
+acc_snapshot_current(acc_snapshot_t **snapp)
+{
+    return __atomic_load_n(snapp, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Atomically replace the published snapshot and return the old one.
+ * The old snapshot (and anything only it refers to) may only be freed
+ * after acc_epoch_synchronize().
+ */
+acc_snapshot_t *
+acc_snapshot_publish(acc_snapshot_t **snapp, acc_snapshot_t *snap)
+{
+    return __atomic_exchange_n(snapp, snap, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Free a snapshot.  The stanzas it points to are not touched.
+ */
+void
+acc_snapshot_free(acc_snapshot_t *snap)
+{
+    if(snap == NULL)
+        return;
+
+    free(snap->ents);
+    free(snap);
+    return;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+#include <pthread.h>
+
+DECLARE_TEST_SUITE(acc_snapshot, "Access snapshot test suite");
+
+typedef struct utest_reader
+{
+    acc_epoch_t        *epoch;
+    acc_snapshot_t    **snapp;
+    int                 slot;
+    volatile int        entered;
+    volatile int        done;
+    struct acc_stanza  *found;
+} utest_reader_t;
+
+static void *
+utest_reader_thread(void *arg)
+{
+    utest_reader_t     *r = (utest_reader_t *)arg;
+    struct timespec     wait = {0, 50000000L};
+
+    acc_epoch_enter(r->epoch, r->slot);
+    r->found = acc_snapshot_find(acc_snapshot_current(r->snapp), 42);
+    __atomic_store_n(&r->entered, 1, __ATOMIC_SEQ_CST);
+
+    nanosleep(&wait, NULL);
+
+    __atomic_store_n(&r->done, 1, __ATOMIC_SEQ_CST);
+    acc_epoch_exit(r->epoch, r->slot);
+    return NULL;
+}
+
+DECLARE_UTEST(add_find, "add and find stanzas by SDP ID")
+{
+    acc_snapshot_t *snap = NULL;
+    char            stanzas[3000];
+    int             i, found = 1;
+
+    snap = acc_snapshot_create(3000);
+    CU_ASSERT(snap != NULL);
+    CU_ASSERT(snap->mask + 1 >= 6000);
+
+    for(i=0; i < 3000; i++)
+        CU_ASSERT(acc_snapshot_add(snap,
+                    (struct acc_stanza *)&stanzas[i], i + 1) == 0);
+    CU_ASSERT(snap->count == 3000);
+
+    for(i=0; i < 3000; i++)
+        if(acc_snapshot_find(snap, i + 1) != (struct acc_stanza *)&stanzas[i])
+            found = 0;
+    CU_ASSERT(found == 1);
+
+    CU_ASSERT(acc_snapshot_find(snap, 0) == NULL);
+    CU_ASSERT(acc_snapshot_find(snap, 3001) == NULL);
+    CU_ASSERT(acc_snapshot_add(snap, (struct acc_stanza *)&stanzas[0], 0) == -1);
+
+    /* Same ID again replaces the stanza
+    */
+    CU_ASSERT(acc_snapshot_add(snap, (struct acc_stanza *)&stanzas[1], 1) == 0);
+    CU_ASSERT(acc_snapshot_find(snap, 1) == (struct acc_stanza *)&stanzas[1]);
+    CU_ASSERT(snap->count == 3000);
+
+    acc_snapshot_free(snap);
+
+    CU_ASSERT(acc_snapshot_find(NULL, 1) == NULL);
+}
+
+DECLARE_UTEST(grace_period, "synchronize waits for readers of the old snapshot")
+{
+    acc_epoch_t         epoch;
+    acc_snapshot_t     *snap = NULL, *old = NULL;
+    utest_reader_t      reader;
+    pthread_t           thread;
+    struct timespec     wait = {0, 1000000L};
+    char                stanza;
+
+    acc_epoch_init(&epoch);
+
+    snap = acc_snapshot_create(1);
+    acc_snapshot_add(snap, (struct acc_stanza *)&stanza, 42);
+    CU_ASSERT(acc_snapshot_publish(&old, snap) == NULL);
+
+    memset(&reader, 0x0, sizeof(reader));
+    reader.epoch = &epoch;
+    reader.snapp = &old;
+    reader.slot  = acc_epoch_register(&epoch);
+    CU_ASSERT(reader.slot == 0);
+
+    /* Nobody is reading yet, so this must not block
+    */
+    acc_epoch_synchronize(&epoch);
+
+    CU_ASSERT(pthread_create(&thread, NULL, utest_reader_thread, &reader) == 0);
+    while(! __atomic_load_n(&reader.entered, __ATOMIC_SEQ_CST))
+        nanosleep(&wait, NULL);
+
+    snap = acc_snapshot_publish(&old, acc_snapshot_create(1));
+    CU_ASSERT(acc_snapshot_find(acc_snapshot_current(&old), 42) == NULL);
+
+    acc_epoch_synchronize(&epoch);
+    CU_ASSERT(__atomic_load_n(&reader.done, __ATOMIC_SEQ_CST) == 1);
+    CU_ASSERT(reader.found == (struct acc_stanza *)&stanza);
+
+    pthread_join(thread, NULL);
+    acc_snapshot_free(snap);
+    acc_snapshot_free(old);
+}
+
+int register_ts_acc_snapshot(void)
+{
+    ts_init(&TEST_SUITE(acc_snapshot), TEST_SUITE_DESCR(acc_snapshot), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(acc_snapshot), UTEST_FCT(add_find), UTEST_DESCR(add_find));
+    ts_add_utest(&TEST_SUITE(acc_snapshot), UTEST_FCT(grace_period), UTEST_DESCR(grace_period));
+
+    return register_ts(&TEST_SUITE(acc_snapshot));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
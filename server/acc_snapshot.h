@@ -0,0 +1,99 @@
+/*
+ *****************************************************************************
+ *
+ * File:    acc_snapshot.h
+ *
+ * Purpose: Header file for fwknopd acc_snapshot.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef ACC_SNAPSHOT_H
+#define ACC_SNAPSHOT_H
+
+#include <stdint.h>
+
+struct acc_stanza;
+
+/* Threads that look up stanzas in the snapshot each get a reader slot
+*/
+#define ACC_EPOCH_MAX_READERS   16
+
+#define ACC_SNAPSHOT_MIN_SLOTS  16
+
+/* A reader slot holds the epoch the reader entered its read section in,
+ * or 0 while it is not reading.  Each slot gets its own cache line so
+ * readers never write to a line somebody else is writing to.
+*/
+typedef struct acc_epoch_reader
+{
+    uint64_t        epoch;
+    char            pad[64 - sizeof(uint64_t)];
+} acc_epoch_reader_t;
+
+typedef struct acc_epoch
+{
+    uint64_t            global;
+    unsigned int        num_readers;
+    acc_epoch_reader_t  readers[ACC_EPOCH_MAX_READERS];
+} acc_epoch_t;
+
+typedef struct acc_snapshot_ent
+{
+    uint32_t            sdp_id;     /* 0 marks an empty slot */
+    struct acc_stanza  *acc;
+} acc_snapshot_ent_t;
+
+/* An immutable SDP ID -> access stanza table.  Once published it is never
+ * modified, only replaced as a whole and freed after a grace period.
+*/
+typedef struct acc_snapshot
+{
+    uint32_t            mask;       /* number of slots - 1 (power of two) */
+    uint32_t            count;
+    acc_snapshot_ent_t *ents;
+} acc_snapshot_t;
+
+/* Prototypes
+*/
+void  acc_epoch_init(acc_epoch_t *epoch);
+int   acc_epoch_register(acc_epoch_t *epoch);
+void  acc_epoch_enter(acc_epoch_t *epoch, const int slot);
+void  acc_epoch_exit(acc_epoch_t *epoch, const int slot);
+void  acc_epoch_synchronize(acc_epoch_t *epoch);
+
+acc_snapshot_t *acc_snapshot_create(const uint32_t expected_entries);
+int   acc_snapshot_add(acc_snapshot_t *snap, struct acc_stanza *acc,
+        const uint32_t sdp_id);
+struct acc_stanza *acc_snapshot_find(const acc_snapshot_t *snap,
+        const uint32_t sdp_id);
+acc_snapshot_t *acc_snapshot_current(acc_snapshot_t **snapp);
+acc_snapshot_t *acc_snapshot_publish(acc_snapshot_t **snapp,
+        acc_snapshot_t *snap);
+void  acc_snapshot_free(acc_snapshot_t *snap);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_acc_snapshot(void);
+#endif
+
+#endif  /* ACC_SNAPSHOT_H */
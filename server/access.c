@@ -41,7 +41,6 @@
 #include "utils.h"
 #include "log_msg.h"
 #include "cmd_cycle.h"
-#include "bstrlib.h"
 #include <json-c/json.h>
 #include "fwknopd_errors.h"
 #include "sdp_ctrl_client.h"
@@ -248,7 +247,8 @@ add_acc_expire_time_epoch(time_t *access_expire_time, const char *val)
     return FWKNOPD_SUCCESS;
 }
 
-#if defined(FIREWALL_FIREWALLD) || defined(FIREWALL_IPTABLES)
+#if defined(FIREWALL_FIREWALLD) || defined(FIREWALL_IPTABLES) \
+        || defined(FIREWALL_NFTABLES)
 static int
 add_acc_force_nat(acc_stanza_t *curr_acc, const char *val)
 {
@@ -287,7 +287,9 @@ add_acc_force_nat(acc_stanza_t *curr_acc, const char *val)
 
     return FWKNOPD_SUCCESS;
 }
+#endif
 
+#if defined(FIREWALL_FIREWALLD) || defined(FIREWALL_IPTABLES)
 static int
 add_acc_force_snat(acc_stanza_t *curr_acc, const char *val)
 {
@@ -923,6 +925,111 @@ free_acc_port_list(acc_port_list_t *ple)
     }
 }
 
+/* Compiled service and port sets
+*/
+static int
+cmp_set_id(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+
+    return x < y ? -1 : (x > y);
+}
+
+static uint32_t
+port_set_id(const unsigned int proto, const unsigned int port)
+{
+    return (proto << 16) | (port & 0xffff);
+}
+
+static void
+free_acc_id_set(acc_id_set_t *set)
+{
+    free(set->ids);
+    set->ids   = NULL;
+    set->count = 0;
+}
+
+/* Sort the ids and drop duplicates
+*/
+static void
+finish_acc_id_set(acc_id_set_t *set)
+{
+    unsigned int    i, n;
+
+    if(set->count < 2)
+        return;
+
+    qsort(set->ids, set->count, sizeof(uint32_t), cmp_set_id);
+
+    for(i=1, n=1; i < set->count; i++)
+        if(set->ids[i] != set->ids[n-1])
+            set->ids[n++] = set->ids[i];
+    set->count = n;
+}
+
+static int
+build_service_set(acc_id_set_t *set, const acc_service_list_t *slist)
+{
+    const acc_service_list_t   *s;
+    unsigned int                n = 0;
+
+    free_acc_id_set(set);
+
+    for(s = slist; s != NULL; s = s->next)
+        n++;
+    if(n == 0)
+        return SUCCESS;
+
+    if((set->ids = calloc(n, sizeof(uint32_t))) == NULL)
+        return FATAL_ERR;
+
+    for(s = slist; s != NULL; s = s->next)
+        set->ids[set->count++] = s->service_id;
+
+    finish_acc_id_set(set);
+    return SUCCESS;
+}
+
+static int
+build_port_set(acc_id_set_t *set, const acc_port_list_t *plist)
+{
+    const acc_port_list_t  *p;
+    unsigned int            n = 0;
+
+    free_acc_id_set(set);
+
+    for(p = plist; p != NULL; p = p->next)
+        n++;
+    if(n == 0)
+        return SUCCESS;
+
+    if((set->ids = calloc(n, sizeof(uint32_t))) == NULL)
+        return FATAL_ERR;
+
+    for(p = plist; p != NULL; p = p->next)
+        set->ids[set->count++] = port_set_id(p->proto, p->port);
+
+    finish_acc_id_set(set);
+    return SUCCESS;
+}
+
+static int
+acc_id_set_has(const acc_id_set_t *set, const uint32_t id)
+{
+    unsigned int    lo = 0, hi = set->count, mid;
+
+    while(lo < hi)
+    {
+        mid = lo + (hi - lo) / 2;
+        if(set->ids[mid] < id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < set->count && set->ids[lo] == id;
+}
+
 /* Free a string_list
 */
 static void
@@ -982,18 +1089,21 @@ free_acc_stanza_data(acc_stanza_t *acc)
     {
         free_acc_service_list(acc->service_list);
     }
+    free_acc_id_set(&(acc->service_set));
 
     if(acc->open_ports != NULL)
     {
         free(acc->open_ports);
         free_acc_port_list(acc->oport_list);
     }
+    free_acc_id_set(&(acc->oport_set));
 
     if(acc->restrict_ports != NULL)
     {
         free(acc->restrict_ports);
         free_acc_port_list(acc->rport_list);
     }
+    free_acc_id_set(&(acc->rport_set));
 
     if(acc->force_nat_ip != NULL)
         free(acc->force_nat_ip);
@@ -1025,6 +1135,9 @@ free_acc_stanza_data(acc_stanza_t *acc)
         free(acc->hmac_key_base64);
     }
 
+    if(acc->hmac_key_sched != NULL)
+        fko_destroy_hmac_key(acc->hmac_key_sched);
+
     if(acc->cmd_sudo_exec_user != NULL)
         free(acc->cmd_sudo_exec_user);
 
@@ -1123,6 +1236,17 @@ expand_one_acc_ent_list(acc_stanza_t *acc)
         }
     }
 
+    /* Compile the permitted services and ports for the per-packet checks
+    */
+    if(build_service_set(&(acc->service_set), acc->service_list) != SUCCESS
+            || build_port_set(&(acc->oport_set), acc->oport_list) != SUCCESS
+            || build_port_set(&(acc->rport_set), acc->rport_list) != SUCCESS)
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error compiling access stanza service and port sets");
+        return 0;
+    }
+
     /* Expand the GPG_REMOTE_ID string.
     */
     if(acc->gpg_remote_id != NULL && strlen(acc->gpg_remote_id))
@@ -1152,7 +1276,7 @@ expand_one_acc_ent_list(acc_stanza_t *acc)
 
 
 static int
-traverse_expand_hash_cb(hash_table_node_t *node, void *arg)
+traverse_expand_hash_cb(int_hash_table_node_t *node, void *arg)
 {
     int res = SUCCESS;
     acc_stanza_t *acc = (acc_stanza_t *)(node->data);
@@ -1183,8 +1307,8 @@ expand_acc_ent_lists(fko_srv_options_t *opts)
     }
     else
     {
-        // hash_table_traverse returns 0 for success, unlike the functions in this file
-        if( hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_expand_hash_cb, NULL)    != 0 )
+        // int_hash_table_traverse returns 0 for success, unlike the functions in this file
+        if( int_hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_expand_hash_cb, NULL)    != 0 )
             clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
@@ -1212,22 +1336,203 @@ free_acc_stanzas(fko_srv_options_t *opts)
         free(last_acc);
     }
 
+    acc_addr_index_free(opts->acc_addr_index);
+    opts->acc_addr_index = NULL;
+
     return;
 }
 
+/* Index the SOURCE and DESTINATION lists of the legacy mode stanzas so
+ * incoming SPA packets are only tried against the stanzas that can match
+ * their addresses.  The stanza lists must already be expanded.
+*/
+static int
+build_acc_addr_index(fko_srv_options_t *opts)
+{
+    acc_addr_index_t   *idx = NULL;
+    acc_stanza_t       *acc = NULL;
+
+    if((idx = acc_addr_index_create()) == NULL)
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error building the access address index");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    for(acc = opts->acc_stanzas; acc != NULL; acc = acc->next)
+    {
+        if(acc_addr_index_add(idx, acc, acc->source_list,
+                    acc->destination_list) != 0)
+        {
+            log_msg(LOG_ERR,
+                "[*] Fatal memory allocation error building the access address index");
+            acc_addr_index_free(idx);
+            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        }
+    }
+    acc_addr_index_finish(idx);
+
+    acc_addr_index_free(opts->acc_addr_index);
+    opts->acc_addr_index = idx;
+
+    log_msg(LOG_DEBUG, "Indexed %u SOURCE ranges of %u access stanzas",
+            idx->src.num_ents + idx->src.num_odd, idx->num_stanzas);
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Stanzas dropped from the access stanza hash table.  The published
+ * snapshot may still point to them, so they are only freed once a new
+ * snapshot is out and the SPA readers have moved on (see
+ * publish_access_snapshot()).  Protected by acc_hash_tbl_mutex.
+*/
+static acc_stanza_t *retired_acc_stanzas = NULL;
+
 static void
-destroy_hash_node_cb(hash_table_node_t *node)
+destroy_hash_node_cb(int_hash_table_node_t *node)
 {
-  if(node->key != NULL) bdestroy((bstring)(node->key));
-  if(node->data != NULL)
+  acc_stanza_t *acc = (acc_stanza_t *)(node->data);
+
+  if(acc != NULL)
   {
-      free_acc_stanza_data((acc_stanza_t*)(node->data));
-      free(node->data);
+      acc->next = retired_acc_stanzas;
+      retired_acc_stanzas = acc;
   }
 }
 
+static void
+free_retired_acc_stanzas(acc_stanza_t *acc)
+{
+    acc_stanza_t *next;
+
+    while(acc)
+    {
+        next = acc->next;
+        free_acc_stanza_data(acc);
+        free(acc);
+        acc = next;
+    }
+}
+
+static int
+traverse_snapshot_acc_cb(int_hash_table_node_t *node, void *arg)
+{
+    acc_stanza_t *acc = (acc_stanza_t *)(node->data);
+
+    if(acc == NULL)
+        return 0;
+
+    if(acc_snapshot_add((acc_snapshot_t *)arg, acc, acc->sdp_id) != 0)
+    {
+        log_msg(LOG_ERR, "Could not add SDP ID %"PRIu32" to the access snapshot",
+                acc->sdp_id);
+        return 1;
+    }
+    return 0;
+}
+
+/* Build an SDP ID snapshot from an access stanza hash table.  Only reads
+ * the table, so the control thread may call it without holding
+ * acc_hash_tbl_mutex for a table that no other thread modifies.
+*/
+static int
+build_access_snapshot(int_hash_table_t *tbl, acc_snapshot_t **snap_r)
+{
+    acc_snapshot_t *snap = NULL;
+
+    *snap_r = NULL;
+
+    if(tbl == NULL)
+        return FWKNOPD_SUCCESS;
+
+    if((snap = acc_snapshot_create(tbl->count)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error creating access snapshot");
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if(int_hash_table_traverse(tbl, traverse_snapshot_acc_cb, snap) != 0)
+    {
+        acc_snapshot_free(snap);
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    *snap_r = snap;
+    return FWKNOPD_SUCCESS;
+}
+
+/* Publish an already built snapshot for the SPA processing thread.  Must
+ * be called with acc_hash_tbl_mutex held (or before any other thread is
+ * running).  The previous snapshot and the stanzas retired since the last
+ * publish are handed back; pass them to reclaim_access_snapshot() once the
+ * mutex has been released.
+*/
+static void
+swap_access_snapshot(fko_srv_options_t *opts, acc_snapshot_t *snap,
+        acc_snapshot_t **old_snap, acc_stanza_t **retired)
+{
+    *old_snap = acc_snapshot_publish(&(opts->acc_snapshot), snap);
+    *retired  = retired_acc_stanzas;
+    retired_acc_stanzas = NULL;
+}
+
+/* Build a new SDP ID snapshot from the access stanza hash table and
+ * publish it for the SPA processing thread.  Must be called with
+ * acc_hash_tbl_mutex held (or before any other thread is running).
+ *
+ * On success the previous snapshot and the stanzas retired since the
+ * last publish are handed back, see swap_access_snapshot().  On failure
+ * the old snapshot stays published and nothing is handed back.
+*/
+static int
+publish_access_snapshot(fko_srv_options_t *opts,
+        acc_snapshot_t **old_snap, acc_stanza_t **retired)
+{
+    acc_snapshot_t *snap = NULL;
+    int             rv;
+
+    *old_snap = NULL;
+    *retired  = NULL;
+
+    if((rv = build_access_snapshot(opts->acc_stanza_hash_tbl, &snap)) != FWKNOPD_SUCCESS)
+        return rv;
+
+    swap_access_snapshot(opts, snap, old_snap, retired);
+    return FWKNOPD_SUCCESS;
+}
+
+/* Wait until no SPA reader can still be using the old snapshot or the
+ * retired stanzas, then free them.  Must not be called with
+ * acc_hash_tbl_mutex held.
+*/
+static void
+reclaim_access_snapshot(fko_srv_options_t *opts,
+        acc_snapshot_t *old_snap, acc_stanza_t *retired)
+{
+    if(old_snap == NULL && retired == NULL)
+        return;
+
+    acc_epoch_synchronize(&(opts->acc_epoch));
+
+    acc_snapshot_free(old_snap);
+    free_retired_acc_stanzas(retired);
+}
+
+/* Free the published snapshot and anything still waiting to be freed.
+ * Only for use at shutdown, once the SPA readers are gone and the access
+ * stanza hash table has been destroyed.
+*/
+void
+free_acc_snapshot(fko_srv_options_t *opts)
+{
+    acc_snapshot_free(acc_snapshot_publish(&(opts->acc_snapshot), NULL));
+
+    free_retired_acc_stanzas(retired_acc_stanzas);
+    retired_acc_stanzas = NULL;
+}
+
 static int
-traverse_dump_hash_cb(hash_table_node_t *node, void *dest)
+traverse_dump_hash_cb(int_hash_table_node_t *node, void *dest)
 {
     acc_stanza_t *acc = (acc_stanza_t *)(node->data);
 
@@ -1341,12 +1646,11 @@ acc_stanza_init(fko_srv_options_t *opts)
  * location, yada-yada-yada.
 */
 static acc_stanza_t*
-acc_stanza_add(fko_srv_options_t *opts, char *val)
+acc_stanza_add(fko_srv_options_t *opts, const uint32_t sdp_id)
 {
     acc_stanza_t    *acc     = opts->acc_stanzas;
     acc_stanza_t    *new_acc = calloc(1, sizeof(acc_stanza_t));
     acc_stanza_t    *last_acc;
-    bstring          key     = NULL;
     int              hash_table_len = 0;
     int              is_err = 0;
 
@@ -1397,8 +1701,8 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
 
-            opts->acc_stanza_hash_tbl = hash_table_create(hash_table_len,
-                    NULL, NULL, destroy_hash_node_cb);
+            opts->acc_stanza_hash_tbl = int_hash_table_create(hash_table_len,
+                    destroy_hash_node_cb);
             if(opts->acc_stanza_hash_tbl == NULL)
             {
                 log_msg(LOG_ERR,
@@ -1410,24 +1714,13 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
             }
         }
 
-        if( val == NULL || (strnlen(val, SDP_MAX_CLIENT_ID_STR_LEN) < 1))
-        {
-            log_msg(LOG_ERR,
-                "[*] Fatal error - SDP_ID string invalid"
-            );
-            free_acc_stanza_data(new_acc);
-            free(new_acc);
-            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
-        }
+        new_acc->sdp_id = sdp_id;
 
-        key = bfromcstr(val);
-
-        if( hash_table_set(opts->acc_stanza_hash_tbl, key, new_acc) != FKO_SUCCESS )
+        if( int_hash_table_set(opts->acc_stanza_hash_tbl, sdp_id, new_acc) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "[*] Fatal error creating access stanza hash table node"
             );
-            bdestroy(key);
             free_acc_stanza_data(new_acc);
             free(new_acc);
             clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
@@ -1440,6 +1733,8 @@ acc_stanza_add(fko_srv_options_t *opts, char *val)
 static void
 set_one_acc_defaults(acc_stanza_t *acc)
 {
+    int res;
+
     access_counter_g++;
 
     /* set default fw_access_timeout if necessary
@@ -1509,11 +1804,30 @@ set_one_acc_defaults(acc_stanza_t *acc)
         acc->hmac_type = FKO_DEFAULT_HMAC_MODE;
     }
 
+    /* Hash the padded HMAC key blocks once here rather than for every
+     * incoming packet.  Without it the key is used as is, which reports
+     * any problem with it when a packet comes in.
+    */
+    if(acc->hmac_key_sched == NULL
+            && acc->hmac_key_len > 0 && acc->hmac_key != NULL)
+    {
+        res = fko_new_hmac_key(&(acc->hmac_key_sched), acc->hmac_key,
+                acc->hmac_key_len, acc->hmac_type);
+        if(res != FKO_SUCCESS)
+        {
+            log_msg(LOG_WARNING,
+                "Warning: could not set up HMAC key for stanza source: '%s': %s",
+                acc->source, fko_errstr(res)
+            );
+            acc->hmac_key_sched = NULL;
+        }
+    }
+
     return;
 }
 
 static int
-traverse_set_acc_defaults_cb(hash_table_node_t *node, void *arg)
+traverse_set_acc_defaults_cb(int_hash_table_node_t *node, void *arg)
 {
     acc_stanza_t *acc = (acc_stanza_t *)(node->data);
     if(acc)
@@ -1542,7 +1856,7 @@ set_acc_defaults(fko_srv_options_t *opts)
     }
     else
     {
-        hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_set_acc_defaults_cb, NULL);
+        int_hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_set_acc_defaults_cb, NULL);
     }
 
     access_opts_g = NULL;
@@ -2105,6 +2419,21 @@ make_acc_stanza_from_json(fko_srv_options_t *opts, json_object *jdata, acc_stanz
             free(tmp);
             goto cleanup;
         }
+#elif FIREWALL_NFTABLES
+        if(strncasecmp(opts->config[CONF_ENABLE_NFT_FORWARDING], "Y", 1) !=0
+            && (strncasecmp(opts->config[CONF_ENABLE_NFT_LOCAL_NAT], "Y", 1) !=0 ))
+        {
+            log_msg(LOG_ERR,
+                "[*] FORCE_NAT requires ENABLE_NFT_FORWARDING ENABLE_NFT_LOCAL_NAT in fwknopd.conf");
+            free(tmp);
+            rv = FWKNOPD_ERROR_BAD_STANZA_DATA;
+            goto cleanup;
+        }
+        if((rv = add_acc_force_nat(stanza, tmp)) != FWKNOPD_SUCCESS)
+        {
+            free(tmp);
+            goto cleanup;
+        }
 #else
         log_msg(LOG_ERR,
             "[*] FORCE_NAT not supported.");
@@ -2209,14 +2538,12 @@ cleanup:
  * remove stanzas from the hash table
  */
 static void
-remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object *jdata)
+remove_access_stanzas(int_hash_table_t *acc_table, int access_array_len, json_object *jdata)
 {
     int rv = FKO_SUCCESS;
     int idx;
     int sdp_id = 0;
     json_object *jentry = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_CLIENT_ID_STR_LEN + 1] = {0};
 
     // walk through the access array
     for(idx = 0; idx < access_array_len; idx++)
@@ -2228,11 +2555,7 @@ remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object
             continue;
         }
 
-        // convert the sdp id integer to a bstring
-        snprintf(id, SDP_MAX_CLIENT_ID_STR_LEN, "%d", sdp_id);
-        key = bfromcstr(id);
-
-        if( hash_table_delete(acc_table, key) != FKO_SUCCESS )
+        if( int_hash_table_delete(acc_table, (uint32_t)sdp_id) != FKO_SUCCESS )
         {
             log_msg(LOG_WARNING, "Did not find hash table node with SDP ID %d to remove. Continuing.", sdp_id);
         }
@@ -2240,29 +2563,202 @@ remove_access_stanzas(hash_table_t *acc_table, int access_array_len, json_object
         {
             log_msg(LOG_NOTICE, "Removed access stanza for SDP ID %d from access list.", sdp_id);
         }
+    }
+}
 
-        bdestroy(key);
+/* Content hash (64 bit FNV-1a) of a json access stanza, compared against
+ * acc->json_hash to spot stanzas the controller sends again unchanged.
+ * Never returns 0, which marks a stanza read from the access file.
+*/
+static uint64_t
+acc_stanza_json_hash(json_object *jstanza)
+{
+    const unsigned char *str = NULL;
+    uint64_t             hash = 0xcbf29ce484222325ULL;
+
+    str = (const unsigned char *)json_object_to_json_string_ext(jstanza,
+            JSON_C_TO_STRING_PLAIN);
+    if(str == NULL)
+        return 0;
+
+    while(*str)
+    {
+        hash ^= *str++;
+        hash *= 0x100000001b3ULL;
     }
+
+    return hash ? hash : 1;
 }
 
-/* Take a json data array from a controller message
- * add/replace stanzas in the hash table
+static void
+free_acc_stanza(acc_stanza_t *acc)
+{
+    free_acc_stanza_data(acc);
+    free(acc);
+}
+
+/* Drop the nodes whose stanza is also the one stored under the same SDP ID
+ * in the table passed as arg, so that destroying this table leaves those
+ * stanzas alone
+*/
+static int
+traverse_detach_shared_cb(int_hash_table_node_t *node, void *arg)
+{
+    if(node->data != NULL
+            && int_hash_table_get((int_hash_table_t *)arg, node->key) == node->data)
+        node->data = NULL;
+
+    return 0;
+}
+
+/* Free the stanzas of a table that was never published, other than the
+ * ones shared with the live table passed as arg (may be NULL)
+*/
+static int
+traverse_free_unshared_cb(int_hash_table_node_t *node, void *arg)
+{
+    if(arg != NULL)
+        traverse_detach_shared_cb(node, arg);
+
+    if(node->data != NULL)
+    {
+        free_acc_stanza((acc_stanza_t *)(node->data));
+        node->data = NULL;
+    }
+    return 0;
+}
+
+/* Move the stanzas of a staging table into the live table passed as arg.
+ * The stanzas they replace are retired by destroy_hash_node_cb().
+*/
+static int
+traverse_move_acc_cb(int_hash_table_node_t *node, void *arg)
+{
+    if(node->data == NULL)
+        return 0;
+
+    if(int_hash_table_set((int_hash_table_t *)arg, node->key, node->data) != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "Fatal error creating access stanza hash table node");
+        return 1;
+    }
+
+    node->data = NULL;
+    return 0;
+}
+
+/* Discard a table built by modify_access_table() that did not go live
+*/
+static void
+discard_access_table(int_hash_table_t *tbl, int_hash_table_t *cur)
+{
+    if(tbl == NULL)
+        return;
+
+    int_hash_table_traverse(tbl, traverse_free_unshared_cb, cur);
+    int_hash_table_destroy(tbl);
+}
+
+static int
+create_access_table(fko_srv_options_t *opts, int_hash_table_delete_cb delete_cb,
+        int_hash_table_t **tbl_r)
+{
+    int hash_table_len = 0;
+    int is_err = 0;
+
+    *tbl_r = NULL;
+
+    hash_table_len = strtol_wrapper(opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
+                           MIN_ACC_STANZA_HASH_TABLE_LENGTH,
+                           MAX_ACC_STANZA_HASH_TABLE_LENGTH,
+                           NO_EXIT_UPON_ERR,
+                           &is_err);
+
+    if(is_err != FKO_SUCCESS)
+    {
+        // this error should be impossible because the config variable
+        // is checked at startup
+
+        log_msg(LOG_ERR, "[*] var %s value '%s' not in the range %d-%d",
+                "ACC_STANZA_HASH_TABLE_LENGTH",
+                opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
+                MIN_ACC_STANZA_HASH_TABLE_LENGTH,
+                MAX_ACC_STANZA_HASH_TABLE_LENGTH);
+
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    if((*tbl_r = int_hash_table_create(hash_table_len, delete_cb)) == NULL)
+    {
+        log_msg(LOG_ERR,
+            "[*] Fatal memory allocation error creating access stanza hash table"
+        );
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Take a json data array from a controller message and parse the stanzas
+ * into tbl, a table no other thread can see yet.  cur is the live table
+ * (may be NULL); it is only read, so this runs without acc_hash_tbl_mutex
+ * as the control thread is its only writer.
+ *
+ * Stanzas whose json is unchanged from the one in cur (or from an earlier
+ * entry for the same SDP ID in this message) are not parsed again.  With
+ * carry_unchanged (a refresh) the existing stanza is put in tbl as well,
+ * so it is then shared by both tables; otherwise (an update) it is left
+ * out of tbl altogether.
+ *
+ * tbl must have no delete callback, stanzas replaced within it by a later
+ * entry for the same SDP ID are freed here.
  */
 static int
-modify_access_table(fko_srv_options_t *opts, int access_array_len, json_object *jdata)
+modify_access_table(fko_srv_options_t *opts, int_hash_table_t *tbl,
+        int_hash_table_t *cur, const int carry_unchanged,
+        int access_array_len, json_object *jdata)
 {
     int rv = FWKNOPD_SUCCESS;
-    acc_stanza_t *new_acc = NULL;
+    acc_stanza_t *new_acc = NULL, *cur_acc = NULL, *prev_acc = NULL, *base = NULL;
     int idx = 0;
     int nodes = 0;
+    int unchanged = 0;
+    int sdp_id = 0;
+    uint64_t hash = 0;
     json_object *jstanza = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_CLIENT_ID_STR_LEN + 1] = {0};
 
     // walk through the access array
     for(idx = 0; idx < access_array_len; idx++)
     {
         jstanza = json_object_array_get_idx(jdata, idx);
+        hash = acc_stanza_json_hash(jstanza);
+        cur_acc = prev_acc = NULL;
+
+        // a missing sdp_id is reported by make_acc_stanza_from_json()
+        if(sdp_get_json_int_field("sdp_id", jstanza, &sdp_id) == SDP_SUCCESS)
+        {
+            if(cur != NULL)
+                cur_acc = int_hash_table_get(cur, (uint32_t)sdp_id);
+            prev_acc = int_hash_table_get(tbl, (uint32_t)sdp_id);
+
+            base = (prev_acc != NULL) ? prev_acc : cur_acc;
+            if(base != NULL && hash != 0 && base->json_hash == hash)
+            {
+                if(carry_unchanged && prev_acc == NULL
+                        && int_hash_table_set(tbl, (uint32_t)sdp_id, cur_acc) != FKO_SUCCESS)
+                {
+                    log_msg(LOG_ERR,
+                        "Fatal error creating access stanza hash table node"
+                    );
+                    return FKO_ERROR_MEMORY_ALLOCATION;
+                }
+
+                log_msg(LOG_DEBUG, "Access entry for SDP ID %d is unchanged", sdp_id);
+                unchanged++;
+                continue;
+            }
+        }
+
         if((rv = make_acc_stanza_from_json(opts, jstanza, &new_acc)) != FWKNOPD_SUCCESS)
         {
             if(rv == FKO_ERROR_MEMORY_ALLOCATION)
@@ -2274,29 +2770,30 @@ modify_access_table(fko_srv_options_t *opts, int access_array_len, json_object *
             log_msg(LOG_ERR, "Failed to parse json stanza, attempting to carry on");
             continue;
         }
+        new_acc->json_hash = hash;
 
-        // convert the sdp id integer to a bstring
-        snprintf(id, SDP_MAX_CLIENT_ID_STR_LEN, "%d", new_acc->sdp_id);
-        key = bfromcstr(id);
-
-        if( hash_table_set(opts->acc_stanza_hash_tbl, key, new_acc) != FKO_SUCCESS )
+        if( int_hash_table_set(tbl, new_acc->sdp_id, new_acc) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "Fatal error creating access stanza hash table node"
             );
-            bdestroy(key);
-            free_acc_stanza_data(new_acc);
-            free(new_acc);
+            free_acc_stanza(new_acc);
             return FKO_ERROR_MEMORY_ALLOCATION;
         }
 
+        // an earlier entry in this message for the same SDP ID, unless
+        // it is the live stanza carried over
+        if(prev_acc != NULL && prev_acc != cur_acc)
+            free_acc_stanza(prev_acc);
+
         log_msg(LOG_NOTICE, "Added access entry for SDP ID %d", new_acc->sdp_id);
         nodes++;
     }
 
-    if(nodes > 0)
+    if(nodes + unchanged > 0)
     {
-        log_msg(LOG_INFO, "Created %d hash table nodes from %d json stanzas", nodes, access_array_len);
+        log_msg(LOG_INFO, "Created %d hash table nodes from %d json stanzas, %d unchanged",
+                nodes, access_array_len, unchanged);
         rv = FWKNOPD_SUCCESS;
     }
     else
@@ -2306,6 +2803,66 @@ modify_access_table(fko_srv_options_t *opts, int access_array_len, json_object *
 
 }
 
+/* Refresh: build the whole new table and its snapshot without holding
+ * acc_hash_tbl_mutex, so neither dump_access_list() nor the SPA thread
+ * waits on the parsing, then swap both in.  Unchanged stanzas move over
+ * to the new table as they are; the rest of the old table is retired and
+ * freed once the SPA readers have drained.
+*/
+static int
+refresh_access_table(fko_srv_options_t *opts, int access_array_len, json_object *jdata)
+{
+    int_hash_table_t *tbl = NULL, *old_tbl = opts->acc_stanza_hash_tbl;
+    acc_snapshot_t *snap = NULL, *old_snap = NULL;
+    acc_stanza_t *retired = NULL;
+    int rv = FWKNOPD_SUCCESS, build_rv = FWKNOPD_SUCCESS;
+
+    if((rv = create_access_table(opts, NULL, &tbl)) != FWKNOPD_SUCCESS)
+        return rv;
+
+    // as before, a refresh that yields no usable stanzas still replaces
+    // the table; only a fatal error keeps the old one
+    build_rv = modify_access_table(opts, tbl, old_tbl, 1, access_array_len, jdata);
+    if(build_rv == FKO_ERROR_MEMORY_ALLOCATION
+            || (rv = build_access_snapshot(tbl, &snap)) != FWKNOPD_SUCCESS)
+    {
+        log_msg(LOG_ERR, "modify_access_table was unsuccessful");
+        discard_access_table(tbl, old_tbl);
+        return FKO_ERROR_MEMORY_ALLOCATION;
+    }
+
+    // from here on, stanzas dropped from the table must wait for the
+    // readers like any other
+    tbl->delete_cb = destroy_hash_node_cb;
+
+    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
+    {
+        log_msg(LOG_ERR, "Mutex lock error.");
+        acc_snapshot_free(snap);
+        discard_access_table(tbl, old_tbl);
+        return FWKNOPD_ERROR_MUTEX;
+    }
+
+    opts->acc_stanza_hash_tbl = tbl;
+
+    if(old_tbl != NULL)
+    {
+        int_hash_table_traverse(old_tbl, traverse_detach_shared_cb, tbl);
+        int_hash_table_destroy(old_tbl);
+    }
+
+    swap_access_snapshot(opts, snap, &old_snap, &retired);
+
+    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+
+    reclaim_access_snapshot(opts, old_snap, retired);
+
+    if(build_rv != FWKNOPD_SUCCESS)
+        log_msg(LOG_ERR, "modify_access_table was unsuccessful");
+
+    return build_rv;
+}
+
 /* Take a json data array from a controller message
  * Alter/recreate the hash table based on the action
  */
@@ -2313,9 +2870,10 @@ int
 process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 {
     int rv = FWKNOPD_SUCCESS;
-    int hash_table_len = 0;
     int access_array_len = 0;
-    int is_err = 0;
+    int_hash_table_t *staged = NULL;
+    acc_snapshot_t *old_snap = NULL;
+    acc_stanza_t *retired = NULL;
 
     if(jdata == NULL || json_object_get_type(jdata) == json_type_null)
     {
@@ -2332,11 +2890,33 @@ process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 
     log_msg(LOG_DEBUG, "jdata contains %d objects", access_array_len);
 
+    if(action == CTRL_ACTION_ACCESS_REFRESH)
+        return refresh_access_table(opts, access_array_len, jdata);
+
+    // for an update, parse the new and changed stanzas before taking
+    // the lock; the live table is only read until then
+    if(action != CTRL_ACTION_ACCESS_REMOVE)
+    {
+        if((rv = create_access_table(opts, NULL, &staged)) != FWKNOPD_SUCCESS)
+            return rv;
+
+        if((rv = modify_access_table(opts, staged, opts->acc_stanza_hash_tbl, 0,
+                        access_array_len, jdata)) != FWKNOPD_SUCCESS)
+        {
+            log_msg(LOG_ERR, "modify_access_table was unsuccessful");
+            if(rv == FKO_ERROR_MEMORY_ALLOCATION)
+            {
+                discard_access_table(staged, opts->acc_stanza_hash_tbl);
+                return rv;
+            }
+        }
+    }
 
     // lock the hash table mutex
     if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
     {
         log_msg(LOG_ERR, "Mutex lock error.");
+        discard_access_table(staged, opts->acc_stanza_hash_tbl);
         return FWKNOPD_ERROR_MUTEX;
     }
 
@@ -2352,71 +2932,40 @@ process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata)
         }
 
         remove_access_stanzas(opts->acc_stanza_hash_tbl, access_array_len, jdata);
-        pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-        return FWKNOPD_SUCCESS;
-    }
-
-    // if this is an access data refresh, destroy the hash table
-    if(action == CTRL_ACTION_ACCESS_REFRESH)
-    {
-        if(opts->acc_stanza_hash_tbl != NULL)
-        {
-            // destroy the table
-            hash_table_destroy(opts->acc_stanza_hash_tbl);
-            opts->acc_stanza_hash_tbl = NULL;
-        }
+        goto publish;
     }
 
     // create the hash table if necessary
     if(opts->acc_stanza_hash_tbl == NULL)
     {
-        //need to initialize hash table
-        hash_table_len = strtol_wrapper(opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
-                               MIN_ACC_STANZA_HASH_TABLE_LENGTH,
-                               MAX_ACC_STANZA_HASH_TABLE_LENGTH,
-                               NO_EXIT_UPON_ERR,
-                               &is_err);
+        int create_rv = create_access_table(opts, destroy_hash_node_cb,
+                &(opts->acc_stanza_hash_tbl));
 
-        if(is_err != FKO_SUCCESS)
+        if(create_rv != FWKNOPD_SUCCESS)
         {
-            // this error should be impossible because the config variable
-            // is checked at startup
-
-            pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-            log_msg(LOG_ERR, "[*] var %s value '%s' not in the range %d-%d",
-                    "ACC_STANZA_HASH_TABLE_LENGTH",
-                    opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
-                    MIN_ACC_STANZA_HASH_TABLE_LENGTH,
-                    MAX_ACC_STANZA_HASH_TABLE_LENGTH);
-
-            return FWKNOPD_ERROR_BAD_CONFIG;
-        }
-
-        opts->acc_stanza_hash_tbl = hash_table_create(hash_table_len,
-                NULL, NULL, destroy_hash_node_cb);
-        if(opts->acc_stanza_hash_tbl == NULL)
-        {
-            pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-            log_msg(LOG_ERR,
-                "[*] Fatal memory allocation error creating access stanza hash table"
-            );
-            return FKO_ERROR_MEMORY_ALLOCATION;
+            rv = create_rv;
+            goto publish;
         }
     }
 
-    // control message is either REFRESH or UPDATE
-    // in either case, use data array to modify the table
-    if((rv = modify_access_table(opts, access_array_len, jdata)) != FWKNOPD_SUCCESS)
-    {
-        log_msg(LOG_ERR, "modify_access_table was unsuccessful");
-    }
+    if(int_hash_table_traverse(staged, traverse_move_acc_cb,
+                opts->acc_stanza_hash_tbl) != 0)
+        rv = FKO_ERROR_MEMORY_ALLOCATION;
+
+publish:
+    // whatever state the table is in now, the SPA thread must see it
+    // rather than stanzas that may have been dropped from it
+    if(publish_access_snapshot(opts, &old_snap, &retired) != FWKNOPD_SUCCESS)
+        rv = FKO_ERROR_MEMORY_ALLOCATION;
 
     // release lock on the table
     pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
 
+    // anything left in staged was never moved to the live table
+    discard_access_table(staged, opts->acc_stanza_hash_tbl);
+
+    reclaim_access_snapshot(opts, old_snap, retired);
+
     return rv;
 }
 
@@ -2431,6 +2980,7 @@ parse_access_file(fko_srv_options_t *opts)
     char           *ndx;
     int             got_source = 0, is_err;
     int             got_sdp_id=0;
+    uint32_t        sdp_id = 0;
     unsigned int    num_lines = 0;
 
     char            access_line_buf[MAX_LINE_LEN] = {0};
@@ -2442,6 +2992,8 @@ parse_access_file(fko_srv_options_t *opts)
     struct stat     st;
 
     acc_stanza_t   *curr_acc = NULL;
+    acc_stanza_t   *retired = NULL;
+    acc_snapshot_t *old_snap = NULL;
 
     /* First see if the access file exists.  If it doesn't, complain
      * and bail.
@@ -2550,7 +3102,7 @@ parse_access_file(fko_srv_options_t *opts)
 
                 /* Start new stanza.
                 */
-                curr_acc = acc_stanza_add(opts, NULL);
+                curr_acc = acc_stanza_add(opts, 0);
             }
             else if (curr_acc == NULL)
             {
@@ -2582,10 +3134,7 @@ parse_access_file(fko_srv_options_t *opts)
                 }
             }
 
-            /* Start new stanza.
-            */
-            curr_acc = acc_stanza_add(opts, val);
-            curr_acc->sdp_id = (uint32_t)strtol_wrapper(val, 0,
+            sdp_id = (uint32_t)strtol_wrapper(val, 0,
                                         UINT32_MAX, NO_EXIT_UPON_ERR, &is_err);
             if(is_err != FKO_SUCCESS)
             {
@@ -2595,6 +3144,10 @@ parse_access_file(fko_srv_options_t *opts)
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
+
+            /* Start new stanza.
+            */
+            curr_acc = acc_stanza_add(opts, sdp_id);
             got_sdp_id++;
         }
         else if (curr_acc == NULL)
@@ -2874,6 +3427,20 @@ parse_access_file(fko_srv_options_t *opts)
                 fclose(file_ptr);
                 clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
             }
+#elif FIREWALL_NFTABLES
+            if(strncasecmp(opts->config[CONF_ENABLE_NFT_FORWARDING], "Y", 1) !=0
+                && (strncasecmp(opts->config[CONF_ENABLE_NFT_LOCAL_NAT], "Y", 1) !=0 ))
+            {
+                log_msg(LOG_ERR,
+                    "[*] FORCE_NAT requires ENABLE_NFT_FORWARDING ENABLE_NFT_LOCAL_NAT in fwknopd.conf");
+                fclose(file_ptr);
+                clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+            }
+            if(add_acc_force_nat(curr_acc, val) != FWKNOPD_SUCCESS)
+            {
+                fclose(file_ptr);
+                clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+            }
 #else
             log_msg(LOG_ERR,
                 "[*] FORCE_NAT not supported.");
@@ -2972,6 +3539,19 @@ parse_access_file(fko_srv_options_t *opts)
     */
     set_acc_defaults(opts);
 
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
+    {
+        if(publish_access_snapshot(opts, &old_snap, &retired) != FWKNOPD_SUCCESS)
+            clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
+        /* Nobody else is running yet, nothing to wait for
+        */
+        acc_snapshot_free(old_snap);
+        free_retired_acc_stanzas(retired);
+    }
+    else if(build_acc_addr_index(opts) != FWKNOPD_SUCCESS)
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+
     return;
 }
 
@@ -2994,11 +3574,15 @@ compare_addr_list(acc_int_list_t *ip_list, const uint32_t ip)
     return(match);
 }
 
+#ifdef HAVE_C_UNIT_TESTS
 /* Compare the contents of 2 port lists.  Return true on a match.
  * Match depends on the match_any flag.  if match_any is 1 then any
  * entry in the incoming data need only match one item to return true.
  * Otherwise all entries in the incoming data must have a corresponding
  * match in the access port_list.
+ *
+ * Incoming requests are checked against the compiled port sets by
+ * acc_check_port_access(); this is kept as the reference for the tests.
 */
 static int
 compare_port_list(acc_port_list_t *in, acc_port_list_t *ac, const int match_any)
@@ -3027,156 +3611,118 @@ compare_port_list(acc_port_list_t *in, acc_port_list_t *ac, const int match_any)
 
     return(i_cnt == a_cnt);
 }
+#endif
 
-/* Take a service string (or mulitple comma-separated strings) and check
- * them against the list for the given access stanza.
- *
- * Return 1 if we are allowed
+/* Return 1 if the stanza permits the given service ID
 */
 int
-acc_check_service_access(acc_stanza_t *acc, char *service_str)
+acc_service_permitted(acc_stanza_t *acc, const uint32_t service_id)
 {
-    int             res = 1, this_res = 0;
+    return acc_id_set_has(&(acc->service_set), service_id);
+}
 
-    acc_service_list_t *in_service_list  = NULL;
-    acc_service_list_t *this_requested_service = NULL;
-    acc_service_list_t *this_permitted_service = NULL;
+/* Copy the next entry of a comma-separated list into buf, optionally
+ * skipping leading whitespace.  *start is advanced past the entry and its
+ * comma.  Returns 1 for an entry, 0 at the end of the list and -1 if the
+ * entry does not fit.
+*/
+static int
+next_list_ent(char **start, char *buf, const size_t buf_len,
+        const int skip_space)
+{
+    char   *ndx;
 
-    if((res = expand_acc_service_list(&in_service_list, service_str)) == 0 ||
-        in_service_list == NULL)
-    {
-        log_msg(LOG_ERR,
-            "[*] Unable to create acc_service_list from incoming data: %s",
-            service_str
-        );
-        return(0);
-    }
+    if(*start == NULL)
+        return 0;
 
-    this_requested_service = in_service_list;
+    while(skip_space && isspace(**start))
+        (*start)++;
 
-    while(this_requested_service != NULL)
-    {
-        this_res = 0;
-        this_permitted_service = acc->service_list;
+    for(ndx = *start; *ndx != ',' && *ndx != '\0'; ndx++)
+        ;
 
-        while(this_permitted_service != NULL)
-        {
-            if(this_permitted_service->service_id == this_requested_service->service_id)
-            {
-                this_res = 1;
-                break;
-            }
-            this_permitted_service = this_permitted_service->next;
-        }
+    if((size_t)((ndx - *start)+1) >= buf_len)
+        return -1;
+
+    strlcpy(buf, *start, (ndx - *start)+1);
+    *start = (*ndx == ',') ? ndx+1 : NULL;
+    return 1;
+}
 
-        if(this_res != 1)
+/* Take a service string (or mulitple comma-separated strings) and check
+ * them against the compiled service set of the given access stanza.
+ *
+ * Return 1 if we are allowed
+*/
+int
+acc_check_service_access(acc_stanza_t *acc, char *service_str)
+{
+    char            buf[ACCESS_BUF_LEN] = {0};
+    char           *start = service_str;
+    uint32_t        id = 0;
+    int             res, is_err = 0;
+
+    while((res = next_list_ent(&start, buf, sizeof(buf), 1)) != 0)
+    {
+        if(res < 0 || (id = strtoul_wrapper(buf, 0, UINT32_MAX,
+                        NO_EXIT_UPON_ERR, &is_err)) == 0)
         {
-            res = 0;
-            break;
+            log_msg(LOG_ERR,
+                "[*] Unable to parse service list from incoming data: %s",
+                service_str
+            );
+            return(0);
         }
 
-        this_requested_service = this_requested_service->next;
+        if(! acc_id_set_has(&(acc->service_set), id))
+            return(0);
     }
 
-    free_acc_service_list(in_service_list);
-    return(res);
+    return(1);
 }
 
-
-
 /* Take a proto/port string (or mulitple comma-separated strings) and check
- * them against the list for the given access stanza.
+ * them against the compiled port sets of the given access stanza.  Any
+ * requested port in RESTRICT_PORTS denies the request, and with
+ * OPEN_PORTS set every requested port must be in it.
  *
  * Return 1 if we are allowed
 */
 int
 acc_check_port_access(acc_stanza_t *acc, char *port_str)
 {
-    int             res = 1, ctr = 0;
-
     char            buf[ACCESS_BUF_LEN] = {0};
-    char           *ndx, *start;
-
-    acc_port_list_t *o_pl   = acc->oport_list;
-    acc_port_list_t *r_pl   = acc->rport_list;
+    char           *start = port_str;
+    uint32_t        id;
+    int             res, proto, port;
 
-    acc_port_list_t *in_pl  = NULL;
-
-    start = port_str;
-
-    /* Create our own internal port_list from the incoming SPA data
-     * for comparison.
-    */
-    for(ndx = start; *ndx != '\0'; ndx++)
+    while((res = next_list_ent(&start, buf, sizeof(buf), 0)) != 0)
     {
-        if(*ndx == ',')
+        if(res < 0)
         {
-            if((ctr >= ACCESS_BUF_LEN)
-                    || (((ndx-start)+1) >= ACCESS_BUF_LEN))
-            {
-                log_msg(LOG_ERR,
-                    "[*] Unable to create acc_port_list from incoming data: %s",
-                    port_str
-                );
-                free_acc_port_list(in_pl);
-                return(0);
-            }
-            strlcpy(buf, start, (ndx-start)+1);
-            if(add_port_list_ent(&in_pl, buf) == 0)
-            {
-                log_msg(LOG_ERR, "[*] Invalid proto/port string");
-                free_acc_port_list(in_pl);
-                return(0);
-            }
+            log_msg(LOG_ERR,
+                "[*] Unable to create acc_port_list from incoming data: %s",
+                port_str
+            );
+            return(0);
+        }
 
-            start = ndx+1;
-            ctr = 0;
+        if(parse_proto_and_port(buf, &proto, &port) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Invalid proto/port string");
+            return(0);
         }
-        ctr++;
-    }
-    if((ctr >= ACCESS_BUF_LEN)
-            || (((ndx-start)+1) >= ACCESS_BUF_LEN))
-    {
-        log_msg(LOG_ERR,
-            "[*] Unable to create acc_port_list from incoming data: %s",
-            port_str
-        );
-        free_acc_port_list(in_pl);
-        return(0);
-    }
-    strlcpy(buf, start, (ndx-start)+1);
-    if(add_port_list_ent(&in_pl, buf) == 0)
-    {
-        log_msg(LOG_ERR, "[*] Invalid proto/port string");
-        free_acc_port_list(in_pl);
-        return 0;
-    }
 
-    if(in_pl == NULL)
-    {
-        log_msg(LOG_ERR,
-            "[*] Unable to create acc_port_list from incoming data: %s", port_str
-        );
-        return(0);
-    }
+        id = port_set_id(proto, port);
 
-    /* Start with restricted ports (if any).  Any match (even if only one
-     * entry) means not allowed.
-    */
-    if((acc->rport_list != NULL) && (compare_port_list(in_pl, r_pl, 1)))
-    {
-        res = 0;
-        goto cleanup_and_bail;
-    }
+        if(acc->rport_list != NULL && acc_id_set_has(&(acc->rport_set), id))
+            return(0);
 
-    /* For open port list, all must match.
-    */
-    if((acc->oport_list != NULL) && (!compare_port_list(in_pl, o_pl, 0)))
-            res = 0;
+        if(acc->oport_list != NULL && ! acc_id_set_has(&(acc->oport_set), id))
+            return(0);
+    }
 
-cleanup_and_bail:
-    free_acc_port_list(in_pl);
-    return(res);
+    return(1);
 }
 
 /* Dump the configuration
@@ -3229,7 +3775,7 @@ dump_access_list(fko_srv_options_t *opts)
             return;
         }
 
-        hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_dump_hash_cb, dest);
+        int_hash_table_traverse(opts->acc_stanza_hash_tbl, traverse_dump_hash_cb, dest);
 
         pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
     }
@@ -3364,10 +3910,130 @@ DECLARE_UTEST(compare_port_list, "check compare_port_list function")
     CU_ASSERT(compare_port_list(acc_pl, in2_pl, 0) == 1);    /* All ports must match in2 port list - 2 */
 }
 
+DECLARE_UTEST(service_port_sets, "check requests against compiled service and port sets")
+{
+    acc_stanza_t    acc;
+    char            req[64];
+
+    memset(&acc, 0x0, sizeof(acc));
+    acc.source           = strdup("ANY");
+    acc.service_list_str = strdup("7, 3,1000000,3");
+    acc.open_ports       = strdup("tcp/22, udp/53,tcp/443");
+    acc.restrict_ports   = strdup("tcp/443");
+    CU_ASSERT(expand_one_acc_ent_list(&acc) == SUCCESS);
+
+    CU_ASSERT(acc.service_set.count == 3);
+    CU_ASSERT(acc.service_set.ids[0] == 3 && acc.service_set.ids[2] == 1000000);
+    CU_ASSERT(acc.oport_set.count == 3);
+    CU_ASSERT(acc.rport_set.count == 1);
+
+    CU_ASSERT(acc_service_permitted(&acc, 7) == 1);
+    CU_ASSERT(acc_service_permitted(&acc, 8) == 0);
+
+    strlcpy(req, "3", sizeof(req));
+    CU_ASSERT(acc_check_service_access(&acc, req) == 1);
+    strlcpy(req, "1000000, 7,3", sizeof(req));
+    CU_ASSERT(acc_check_service_access(&acc, req) == 1);
+    strlcpy(req, "3,4", sizeof(req));
+    CU_ASSERT(acc_check_service_access(&acc, req) == 0);
+    strlcpy(req, "3,", sizeof(req));
+    CU_ASSERT(acc_check_service_access(&acc, req) == 0);
+    strlcpy(req, "", sizeof(req));
+    CU_ASSERT(acc_check_service_access(&acc, req) == 0);
+    strlcpy(req, "0", sizeof(req));
+    CU_ASSERT(acc_check_service_access(&acc, req) == 0);
+
+    strlcpy(req, "tcp/22", sizeof(req));
+    CU_ASSERT(acc_check_port_access(&acc, req) == 1);
+    strlcpy(req, "tcp/22,udp/53", sizeof(req));
+    CU_ASSERT(acc_check_port_access(&acc, req) == 1);
+    strlcpy(req, "udp/22", sizeof(req));
+    CU_ASSERT(acc_check_port_access(&acc, req) == 0);     /* not open */
+    strlcpy(req, "tcp/22,tcp/443", sizeof(req));
+    CU_ASSERT(acc_check_port_access(&acc, req) == 0);     /* restricted */
+    strlcpy(req, "tcp/22,", sizeof(req));
+    CU_ASSERT(acc_check_port_access(&acc, req) == 0);
+    strlcpy(req, "tcp/22, udp/53", sizeof(req));
+    CU_ASSERT(acc_check_port_access(&acc, req) == 0);     /* no space allowed */
+
+    free_acc_stanza_data(&acc);
+    CU_ASSERT(acc.service_set.ids == NULL && acc.oport_set.count == 0);
+}
+
+static json_object *
+utest_access_json(const char *stanzas)
+{
+    char    buf[1024];
+
+    snprintf(buf, sizeof(buf), "[%s]", stanzas);
+    return json_tokener_parse(buf);
+}
+
+#define UTEST_STANZA(id, ports) \
+    "{\"sdp_id\": " #id ", \"source\": \"ANY\", \"open_ports\": \"" ports "\", " \
+    "\"spa_encryption_key\": \"enc_key_" #id "\", \"spa_hmac_key\": \"hmac_key_" #id "\"}"
+
+DECLARE_UTEST(refresh_delta, "check refresh and update reuse unchanged stanzas")
+{
+    fko_srv_options_t   opts;
+    json_object        *jdata;
+    acc_stanza_t       *acc1, *acc2, *acc4;
+    acc_snapshot_t     *snap;
+
+    memset(&opts, 0x0, sizeof(opts));
+    opts.config[CONF_ACC_STANZA_HASH_TABLE_LENGTH] = strdup("16");
+    pthread_mutex_init(&(opts.acc_hash_tbl_mutex), NULL);
+
+    jdata = utest_access_json(UTEST_STANZA(1, "tcp/22") ","
+            UTEST_STANZA(2, "tcp/22") "," UTEST_STANZA(3, "tcp/22"));
+    CU_ASSERT(process_access_msg(&opts, CTRL_ACTION_ACCESS_REFRESH, jdata) == FWKNOPD_SUCCESS);
+    json_object_put(jdata);
+    CU_ASSERT(opts.acc_stanza_hash_tbl->count == 3);
+    acc1 = int_hash_table_get(opts.acc_stanza_hash_tbl, 1);
+    acc2 = int_hash_table_get(opts.acc_stanza_hash_tbl, 2);
+    CU_ASSERT(acc1 != NULL && acc1->json_hash != 0);
+
+    /* 1 unchanged, 2 changed, 3 dropped, 4 new
+    */
+    jdata = utest_access_json(UTEST_STANZA(1, "tcp/22") ","
+            UTEST_STANZA(2, "tcp/443") "," UTEST_STANZA(4, "tcp/22"));
+    CU_ASSERT(process_access_msg(&opts, CTRL_ACTION_ACCESS_REFRESH, jdata) == FWKNOPD_SUCCESS);
+    json_object_put(jdata);
+    CU_ASSERT(opts.acc_stanza_hash_tbl->count == 3);
+    CU_ASSERT(int_hash_table_get(opts.acc_stanza_hash_tbl, 1) == acc1);
+    CU_ASSERT(int_hash_table_get(opts.acc_stanza_hash_tbl, 2) != acc2);
+    CU_ASSERT(int_hash_table_get(opts.acc_stanza_hash_tbl, 3) == NULL);
+    acc4 = int_hash_table_get(opts.acc_stanza_hash_tbl, 4);
+    CU_ASSERT(acc4 != NULL);
+
+    snap = acc_snapshot_current(&(opts.acc_snapshot));
+    CU_ASSERT(acc_snapshot_find(snap, 1) == acc1);
+    CU_ASSERT(acc_snapshot_find(snap, 3) == NULL);
+    CU_ASSERT(acc_snapshot_find(snap, 4) == acc4);
+
+    /* An update only replaces what changed
+    */
+    jdata = utest_access_json(UTEST_STANZA(1, "tcp/22") "," UTEST_STANZA(4, "udp/53"));
+    CU_ASSERT(process_access_msg(&opts, CTRL_ACTION_ACCESS_UPDATE, jdata) == FWKNOPD_SUCCESS);
+    json_object_put(jdata);
+    CU_ASSERT(opts.acc_stanza_hash_tbl->count == 3);
+    CU_ASSERT(int_hash_table_get(opts.acc_stanza_hash_tbl, 1) == acc1);
+    acc4 = int_hash_table_get(opts.acc_stanza_hash_tbl, 4);
+    CU_ASSERT(acc4 != NULL && strcmp(acc4->open_ports, "udp/53") == 0);
+    CU_ASSERT(acc_snapshot_find(acc_snapshot_current(&(opts.acc_snapshot)), 4) == acc4);
+
+    int_hash_table_destroy(opts.acc_stanza_hash_tbl);
+    free_acc_snapshot(&opts);
+    pthread_mutex_destroy(&(opts.acc_hash_tbl_mutex));
+    free(opts.config[CONF_ACC_STANZA_HASH_TABLE_LENGTH]);
+}
+
 int register_ts_access(void)
 {
     ts_init(&TEST_SUITE(access), TEST_SUITE_DESCR(access), NULL, NULL);
     ts_add_utest(&TEST_SUITE(access), UTEST_FCT(compare_port_list), UTEST_DESCR(compare_port_list));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(service_port_sets), UTEST_DESCR(service_port_sets));
+    ts_add_utest(&TEST_SUITE(access), UTEST_FCT(refresh_delta), UTEST_DESCR(refresh_delta));
 
     return register_ts(&TEST_SUITE(access));
 }
@@ -47,11 +47,13 @@ int process_access_msg(fko_srv_options_t *opts, int action, json_object *jdata);
 void parse_access_file(fko_srv_options_t *opts);
 int compare_addr_list(acc_int_list_t *source_list, const uint32_t ip);
 int acc_check_service_access(acc_stanza_t *acc, char *service_str);
+int acc_service_permitted(acc_stanza_t *acc, const uint32_t service_id);
 int acc_check_port_access(acc_stanza_t *acc, char *port_str);
 void dump_access_list(fko_srv_options_t *opts);
 int expand_acc_service_list(acc_service_list_t **slist, char *slist_str);
 int expand_acc_port_list(acc_port_list_t **plist, char *plist_str);
 void free_acc_stanzas(fko_srv_options_t *opts);
+void free_acc_snapshot(fko_srv_options_t *opts);
 void free_acc_service_list(acc_service_list_t *slist);
 void free_acc_port_list(acc_port_list_t *plist);
 
@@ -0,0 +1,658 @@
+/*
+ *****************************************************************************
+ *
+ * File:    afpacket_capture.c
+ *
+ * Purpose: Collect SPA packets from Linux AF_PACKET (TPACKET_V3) rings.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "afpacket_capture.h"
+
+#if HAVE_AF_PACKET_CAPTURE
+  #include <linux/if_packet.h>
+  #include <linux/filter.h>
+#endif
+
+#if defined(TPACKET3_HDRLEN)
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <net/if_arp.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+
+#include "process_packet.h"
+#include "incoming_spa.h"
+#include "log_msg.h"
+#include "fwknopd_errors.h"
+#include "fw_util.h"
+#include "sig_handler.h"
+#include "tcp_server.h"
+#include "pcap_capture.h"
+#include "utils.h"
+
+#if HAVE_SYS_WAIT_H
+  #include <sys/wait.h>
+#endif
+
+/* One ring, and the thread that reads and verifies the frames the fanout
+ * group hands to it.
+*/
+typedef struct afp_thread
+{
+    fko_srv_options_t  *opts;
+    afp_ring_t          ring;
+    spa_pkt_info_t      spa_pkt;
+    int                 reader_slot;
+    int                *stop;
+    int                *fatal;
+    pthread_t           thread;
+    int                 running;
+} afp_thread_t;
+
+/* Compile PCAP_FILTER into classic BPF for an Ethernet link.  The kernel
+ * runs the same code on the socket, so only matching frames are copied
+ * into the ring.
+*/
+int
+afp_compile_filter(const char *filter, const int snaplen,
+        struct bpf_program *fp)
+{
+    pcap_t     *pcap;
+    int         rv = FWKNOPD_SUCCESS;
+
+    if((pcap = pcap_open_dead(DLT_EN10MB, snaplen)) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] pcap_open_dead() error");
+        return FWKNOPD_ERROR;
+    }
+
+    if(pcap_compile(pcap, fp, (char *)filter, 1, 0) == -1)
+    {
+        log_msg(LOG_ERR, "[*] Error compiling pcap filter: %s",
+            pcap_geterr(pcap)
+        );
+        rv = FWKNOPD_ERROR;
+    }
+
+    pcap_close(pcap);
+    return rv;
+}
+
+/* Open a TPACKET_V3 ring on intf.  The filter (if any) is attached before
+ * the socket is bound, so no unfiltered frame gets in.  With fanout_id >= 0
+ * the socket joins that fanout group, and the kernel spreads flows over
+ * its members by hash.
+*/
+int
+afp_ring_open(afp_ring_t *ring, const char *intf,
+        const struct bpf_program *fp, const int promisc, const int in_only,
+        const unsigned int block_nr, const int fanout_id)
+{
+    struct tpacket_req3 req;
+    struct sockaddr_ll  sll;
+    struct packet_mreq  mr;
+    struct sock_fprog   prog;
+    struct ifreq        ifr;
+    unsigned int        fanout;
+    int                 ver = TPACKET_V3, ifindex;
+
+    memset(ring, 0x0, sizeof(afp_ring_t));
+    ring->map = MAP_FAILED;
+    ring->in_only = in_only;
+
+    /* Protocol 0 receives nothing until bind() below
+    */
+    if((ring->fd = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] AF_PACKET socket() error: %s", strerror(errno));
+        return FWKNOPD_ERROR;
+    }
+
+    if((ifindex = if_nametoindex(intf)) == 0)
+    {
+        log_msg(LOG_ERR, "[*] Unknown interface: %s", intf);
+        goto err;
+    }
+
+    /* process_packet() and the compiled filter expect an Ethernet header
+    */
+    memset(&ifr, 0x0, sizeof(ifr));
+    strlcpy(ifr.ifr_name, intf, sizeof(ifr.ifr_name));
+    if(ioctl(ring->fd, SIOCGIFHWADDR, &ifr) < 0)
+    {
+        log_msg(LOG_ERR, "[*] SIOCGIFHWADDR error on %s: %s",
+            intf, strerror(errno));
+        goto err;
+    }
+    if(ifr.ifr_hwaddr.sa_family != ARPHRD_ETHER
+            && ifr.ifr_hwaddr.sa_family != ARPHRD_LOOPBACK)
+    {
+        log_msg(LOG_ERR,
+            "[*] AF_PACKET capture needs an Ethernet interface, use CAPTURE_METHOD PCAP for %s",
+            intf);
+        goto err;
+    }
+
+    if(setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] TPACKET_V3 not supported: %s", strerror(errno));
+        goto err;
+    }
+
+    if(fp != NULL)
+    {
+        prog.len    = fp->bf_len;
+        prog.filter = (struct sock_filter *)fp->bf_insns;
+        if(setsockopt(ring->fd, SOL_SOCKET, SO_ATTACH_FILTER,
+                    &prog, sizeof(prog)) < 0)
+        {
+            log_msg(LOG_ERR, "[*] Error setting socket filter: %s",
+                strerror(errno));
+            goto err;
+        }
+    }
+
+    memset(&req, 0x0, sizeof(req));
+    req.tp_block_size       = AFP_BLOCK_SIZE;
+    req.tp_block_nr         = block_nr;
+    req.tp_frame_size       = AFP_FRAME_SIZE;
+    req.tp_frame_nr         = (AFP_BLOCK_SIZE / AFP_FRAME_SIZE) * block_nr;
+    req.tp_retire_blk_tov   = AFP_BLOCK_TIMEOUT_MS;
+
+    if(setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] Error setting up the AF_PACKET ring: %s",
+            strerror(errno));
+        goto err;
+    }
+
+    ring->block_nr = block_nr;
+    ring->map_len  = (size_t)AFP_BLOCK_SIZE * block_nr;
+    ring->map      = mmap(NULL, ring->map_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED, ring->fd, 0);
+    if(ring->map == MAP_FAILED)
+    {
+        log_msg(LOG_ERR, "[*] Error mapping the AF_PACKET ring: %s",
+            strerror(errno));
+        goto err;
+    }
+
+    memset(&sll, 0x0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex  = ifindex;
+    if(bind(ring->fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+    {
+        log_msg(LOG_ERR, "[*] AF_PACKET bind() error on %s: %s",
+            intf, strerror(errno));
+        goto err;
+    }
+
+    if(promisc)
+    {
+        memset(&mr, 0x0, sizeof(mr));
+        mr.mr_ifindex = ifindex;
+        mr.mr_type    = PACKET_MR_PROMISC;
+        if(setsockopt(ring->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP,
+                    &mr, sizeof(mr)) < 0)
+        {
+            log_msg(LOG_ERR, "[*] Error setting promiscuous mode on %s: %s",
+                intf, strerror(errno));
+            goto err;
+        }
+    }
+
+    /* Hash on the flow, and reassemble IP fragments first so all the
+     * pieces of an SPA packet go to the same thread.
+    */
+    if(fanout_id >= 0)
+    {
+        fanout = (unsigned int)(fanout_id & 0xffff)
+            | ((unsigned int)(PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if(setsockopt(ring->fd, SOL_PACKET, PACKET_FANOUT,
+                    &fanout, sizeof(fanout)) < 0)
+        {
+            log_msg(LOG_ERR, "[*] Error joining AF_PACKET fanout group: %s",
+                strerror(errno));
+            goto err;
+        }
+    }
+
+    return FWKNOPD_SUCCESS;
+
+err:
+    afp_ring_close(ring);
+    return FWKNOPD_ERROR;
+}
+
+/* Hand the frames of every block the kernel has retired to cb, waiting
+ * up to timeout_ms for the first one.  The frames are only valid during
+ * the callback: the block goes back to the kernel right after.  Returns
+ * the number of frames seen, or -1 with errno set.
+*/
+int
+afp_ring_read(afp_ring_t *ring, const int timeout_ms, afp_frame_cb cb,
+        void *arg)
+{
+    struct tpacket_block_desc  *bd;
+    struct tpacket3_hdr        *ppd;
+    struct sockaddr_ll         *sll;
+    struct pollfd               pfd;
+    socklen_t                   len;
+    unsigned int                i;
+    int                         n = 0, err;
+
+    bd = (struct tpacket_block_desc *)(ring->map
+            + (size_t)ring->next_block * AFP_BLOCK_SIZE);
+
+    if(! (__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+                & TP_STATUS_USER))
+    {
+        pfd.fd      = ring->fd;
+        pfd.events  = POLLIN | POLLERR;
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, timeout_ms) < 0)
+            return errno == EINTR ? 0 : -1;
+
+        if(pfd.revents & POLLERR)
+        {
+            err = 0;
+            len = sizeof(err);
+            getsockopt(ring->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if(err != 0)
+            {
+                errno = err;
+                return -1;
+            }
+        }
+    }
+
+    while(__atomic_load_n(&bd->hdr.bh1.block_status, __ATOMIC_ACQUIRE)
+            & TP_STATUS_USER)
+    {
+        ppd = (struct tpacket3_hdr *)((unsigned char *)bd
+                + bd->hdr.bh1.offset_to_first_pkt);
+
+        for(i=0; i < bd->hdr.bh1.num_pkts; i++)
+        {
+            sll = (struct sockaddr_ll *)((unsigned char *)ppd
+                    + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+
+            if(! (ring->in_only && sll->sll_pkttype == PACKET_OUTGOING))
+            {
+                cb((unsigned char *)ppd + ppd->tp_mac,
+                        ppd->tp_snaplen, ppd->tp_len, arg);
+                n++;
+            }
+
+            ppd = (struct tpacket3_hdr *)((unsigned char *)ppd
+                    + ppd->tp_next_offset);
+        }
+
+        __atomic_store_n(&bd->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                __ATOMIC_RELEASE);
+
+        ring->next_block = (ring->next_block + 1) % ring->block_nr;
+        bd = (struct tpacket_block_desc *)(ring->map
+                + (size_t)ring->next_block * AFP_BLOCK_SIZE);
+    }
+
+    return n;
+}
+
+/* Packets received and dropped by the kernel since the last call
+*/
+int
+afp_ring_stats(afp_ring_t *ring, unsigned int *packets, unsigned int *drops)
+{
+    struct tpacket_stats_v3 st;
+    socklen_t               len = sizeof(st);
+
+    if(getsockopt(ring->fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) < 0)
+        return FWKNOPD_ERROR;
+
+    *packets = st.tp_packets;
+    *drops   = st.tp_drops;
+    return FWKNOPD_SUCCESS;
+}
+
+void
+afp_ring_close(afp_ring_t *ring)
+{
+    if(ring->map != MAP_FAILED && ring->map != NULL)
+        munmap(ring->map, ring->map_len);
+    ring->map = MAP_FAILED;
+
+    if(ring->fd >= 0)
+        close(ring->fd);
+    ring->fd = -1;
+}
+
+static void
+afp_handle_frame(const unsigned char *frame, const unsigned int caplen,
+        const unsigned int len, void *arg)
+{
+    afp_thread_t   *t = (afp_thread_t *)arg;
+    spa_frame_t     f;
+
+    if(! spa_frame_parse(frame, caplen, len, ETHER_HDR_LEN, &f))
+        return;
+
+    if(! spa_frame_to_pkt(&f, &t->spa_pkt))
+        return;
+
+    process_spa_pkt(t->opts, &t->spa_pkt, t->reader_slot);
+}
+
+static void *
+afp_capture_thread(void *arg)
+{
+    afp_thread_t   *t = (afp_thread_t *)arg;
+    int             n, errcnt = 0;
+
+    while(! __atomic_load_n(t->stop, __ATOMIC_ACQUIRE))
+    {
+        if((n = afp_ring_read(&t->ring, AFP_POLL_MS, afp_handle_frame, t)) > 0)
+        {
+            /* Like pcap_dispatch(), count every frame that made it
+             * through the filter for --packet-limit.
+            */
+            __atomic_add_fetch(&t->opts->packet_ctr, n, __ATOMIC_RELAXED);
+            errcnt = 0;
+        }
+        else if(n < 0)
+        {
+            log_msg(LOG_ERR, "[*] Error reading AF_PACKET ring: %s",
+                strerror(errno));
+
+            if((strncasecmp(t->opts->config[CONF_EXIT_AT_INTF_DOWN], "Y", 1) == 0
+                        && errno == ENETDOWN)
+                    || errcnt++ > MAX_PCAP_ERRORS_BEFORE_BAIL)
+            {
+                __atomic_store_n(t->fatal, 1, __ATOMIC_RELEASE);
+                break;
+            }
+            usleep(AFP_POLL_MS * 1000);
+        }
+        else
+            errcnt = 0;
+    }
+
+    return NULL;
+}
+
+/* Number of AF_PACKET capture threads, or 0 if packets are read with
+ * libpcap.
+*/
+int
+afpacket_threads(const fko_srv_options_t *opts)
+{
+    int     n, is_err;
+
+    if(strcasecmp(opts->config[CONF_CAPTURE_METHOD], "AF_PACKET") != 0)
+        return 0;
+
+    /* Reading a pcap file always goes through libpcap
+    */
+    if(opts->config[CONF_PCAP_FILE] != NULL
+            && opts->config[CONF_PCAP_FILE][0] != '\0')
+        return 0;
+
+    n = strtol_wrapper(opts->config[CONF_AF_PACKET_THREADS],
+            1, RCHK_MAX_AF_PACKET_THREADS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        return 1;
+
+    return n;
+}
+
+/* The AF_PACKET capture routine.  Each thread reads its own ring and
+ * verifies the SPA packets in it.  Firewall changes go through the SPA
+ * pipeline's applier thread, which also does the housekeeping, so this
+ * thread only minds signals, the packet limit and the TCP server.
+*/
+int
+afpacket_capture(fko_srv_options_t *opts)
+{
+    afp_thread_t       *th;
+    struct bpf_program  fp;
+    sigset_t            all, old;
+    unsigned int        packets, drops, tot_packets = 0, tot_drops = 0;
+    int                 num_threads, block_nr, max_sniff_bytes, useconds;
+    int                 promisc = 0, have_filter = 0, stop = 0, fatal = 0;
+    int                 i, is_err, status, rv = 0;
+    pid_t               child_pid;
+
+    if(opts->spa_pipeline == NULL)
+    {
+        log_msg(LOG_ERR, "[*] afpacket_capture: the SPA applier thread is not running");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    num_threads = afpacket_threads(opts);
+
+    block_nr = strtol_wrapper(opts->config[CONF_AF_PACKET_RING_BLOCKS],
+            2, RCHK_MAX_AF_PACKET_RING_BLOCKS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid AF_PACKET_RING_BLOCKS value");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    useconds = strtol_wrapper(opts->config[CONF_PCAP_LOOP_SLEEP],
+            0, RCHK_MAX_PCAP_LOOP_SLEEP, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid PCAP_LOOP_SLEEP value");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    max_sniff_bytes = strtol_wrapper(opts->config[CONF_MAX_SNIFF_BYTES],
+            0, RCHK_MAX_SNIFF_BYTES, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid MAX_SNIFF_BYTES");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(strncasecmp(opts->config[CONF_ENABLE_PCAP_PROMISC], "Y", 1) == 0)
+        promisc = 1;
+
+    if (opts->config[CONF_PCAP_FILTER][0] != '\0')
+    {
+        if(afp_compile_filter(opts->config[CONF_PCAP_FILTER],
+                    max_sniff_bytes, &fp) != FWKNOPD_SUCCESS)
+            clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+
+        log_msg(LOG_INFO, "PCAP filter is: '%s'", opts->config[CONF_PCAP_FILTER]);
+        have_filter = 1;
+    }
+
+    if((th = calloc(num_threads, sizeof(afp_thread_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] afpacket_capture: memory allocation error");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    for(i=0; i < num_threads; i++)
+    {
+        th[i].ring.fd  = -1;
+        th[i].ring.map = MAP_FAILED;
+    }
+
+    log_msg(LOG_INFO, "Sniffing interface: %s (AF_PACKET, %d threads)",
+        opts->config[CONF_PCAP_INTF], num_threads);
+
+    for(i=0; i < num_threads; i++)
+    {
+        th[i].opts        = opts;
+        th[i].stop        = &stop;
+        th[i].fatal       = &fatal;
+        th[i].reader_slot = -1;
+
+        /* We are only interested in packets coming into the interface,
+         * unless ENABLE_PCAP_ANY_DIRECTION says otherwise.
+        */
+        if(afp_ring_open(&th[i].ring, opts->config[CONF_PCAP_INTF],
+                    have_filter ? &fp : NULL, promisc,
+                    opts->pcap_any_direction == 0, block_nr,
+                    num_threads > 1 ? (getpid() & 0xffff) : -1) != FWKNOPD_SUCCESS)
+        {
+            rv = -1;
+            goto cleanup;
+        }
+
+        if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0
+                && (th[i].reader_slot = acc_epoch_register(&(opts->acc_epoch))) < 0)
+        {
+            log_msg(LOG_ERR,
+                "[*] afpacket_capture: no access snapshot reader slot left for thread %d", i);
+            rv = -1;
+            goto cleanup;
+        }
+    }
+
+    /* Initialize our signal handlers, and keep the signals away from the
+     * capture threads.
+    */
+    if(set_sig_handlers() > 0)
+        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for(i=0; i < num_threads; i++)
+    {
+        if(pthread_create(&th[i].thread, NULL, afp_capture_thread, &th[i]) != 0)
+        {
+            log_msg(LOG_ERR, "[*] afpacket_capture: failed to start thread %d", i);
+            rv = -1;
+            break;
+        }
+        th[i].running = 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(rv == 0)
+        log_msg(LOG_INFO, "Starting fwknopd main event loop.");
+
+    while(rv == 0)
+    {
+        /* If we got a SIGCHLD and it was the tcp server, then handle it here.
+        */
+        if(got_sigchld)
+        {
+            if(opts->tcp_server_pid > 0)
+            {
+                child_pid = waitpid(0, &status, WNOHANG);
+
+                if(child_pid == opts->tcp_server_pid)
+                {
+                    if(WIFSIGNALED(status))
+                        log_msg(LOG_WARNING, "TCP server got signal: %i",  WTERMSIG(status));
+
+                    log_msg(LOG_WARNING,
+                        "TCP server exited with status of %i. Attempting restart.",
+                        WEXITSTATUS(status)
+                    );
+
+                    opts->tcp_server_pid = 0;
+
+                    /* Attempt to restart tcp server ? */
+                    usleep(1000000);
+                    run_tcp_server(opts);
+                }
+            }
+
+            got_sigchld = 0;
+        }
+
+        if(sig_do_stop(opts))
+        {
+            log_msg(LOG_INFO, "Gracefully leaving the fwknopd event loop.");
+            break;
+        }
+
+        if(__atomic_load_n(&fatal, __ATOMIC_ACQUIRE))
+        {
+            log_msg(LOG_ERR, "[*] Fatal AF_PACKET capture error, giving up");
+            rv = -1;
+            break;
+        }
+
+        if (opts->packet_ctr_limit
+                && __atomic_load_n(&opts->packet_ctr, __ATOMIC_RELAXED) >= opts->packet_ctr_limit)
+        {
+            log_msg(LOG_WARNING,
+                "* Incoming packet count limit of %i reached",
+                opts->packet_ctr_limit
+            );
+            break;
+        }
+
+        usleep(useconds);
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for(i=0; i < num_threads; i++)
+        if(th[i].running)
+            pthread_join(th[i].thread, NULL);
+
+    for(i=0; i < num_threads; i++)
+    {
+        if(th[i].ring.fd >= 0
+                && afp_ring_stats(&th[i].ring, &packets, &drops) == FWKNOPD_SUCCESS)
+        {
+            tot_packets += packets;
+            tot_drops   += drops;
+        }
+    }
+    log_msg(LOG_INFO, "AF_PACKET capture: %u packets received, %u dropped by the kernel",
+        tot_packets, tot_drops);
+
+cleanup:
+    for(i=0; i < num_threads; i++)
+        afp_ring_close(&th[i].ring);
+    free(th);
+
+    if(have_filter)
+        pcap_freecode(&fp);
+
+    if(rv < 0)
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+
+    return(0);
+}
+
+#endif /* TPACKET3_HDRLEN */
+
+/***EOF***/
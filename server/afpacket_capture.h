@@ -0,0 +1,87 @@
+/*
+ *****************************************************************************
+ *
+ * File:    afpacket_capture.h
+ *
+ * Purpose: Header file for afpacket_capture.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef AFPACKET_CAPTURE_H
+#define AFPACKET_CAPTURE_H
+
+#if USE_LIBPCAP && HAVE_LINUX_IF_PACKET_H
+  #define HAVE_AF_PACKET_CAPTURE 1
+#endif
+
+/* The receive ring is made of blocks of AFP_BLOCK_SIZE bytes.  The kernel
+ * hands a block over when it is full, or AFP_BLOCK_TIMEOUT_MS after the
+ * first packet went into it.
+*/
+#define AFP_BLOCK_SIZE          (1 << 18)
+#define AFP_FRAME_SIZE          2048
+#define AFP_BLOCK_TIMEOUT_MS    10
+
+/* How long a capture thread waits for a block before it looks at the
+ * stop flag again (milliseconds).
+*/
+#define AFP_POLL_MS             100
+
+#if HAVE_AF_PACKET_CAPTURE
+#include <pcap.h>
+
+typedef struct afp_ring
+{
+    int             fd;
+    unsigned char  *map;
+    size_t          map_len;
+    unsigned int    block_nr;
+    unsigned int    next_block;
+    int             in_only;    /* skip packets sent by this host */
+} afp_ring_t;
+
+/* Called for each captured frame, which points into the ring
+*/
+typedef void (*afp_frame_cb)(const unsigned char *frame,
+        const unsigned int caplen, const unsigned int len, void *arg);
+
+/* Prototypes
+*/
+int  afp_compile_filter(const char *filter, const int snaplen,
+        struct bpf_program *fp);
+int  afp_ring_open(afp_ring_t *ring, const char *intf,
+        const struct bpf_program *fp, const int promisc, const int in_only,
+        const unsigned int block_nr, const int fanout_id);
+int  afp_ring_read(afp_ring_t *ring, const int timeout_ms, afp_frame_cb cb,
+        void *arg);
+int  afp_ring_stats(afp_ring_t *ring, unsigned int *packets,
+        unsigned int *drops);
+void afp_ring_close(afp_ring_t *ring);
+int  afpacket_threads(const fko_srv_options_t *opts);
+int  afpacket_capture(fko_srv_options_t *opts);
+#endif
+
+#endif  /* AFPACKET_CAPTURE_H */
+
+/***EOF***/
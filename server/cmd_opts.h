@@ -48,11 +48,15 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "PCAP_DISPATCH_COUNT",
     "PCAP_LOOP_SLEEP",
     "ENABLE_PCAP_ANY_DIRECTION",
+    "CAPTURE_METHOD",
+    "AF_PACKET_THREADS",
+    "AF_PACKET_RING_BLOCKS",
     "EXIT_AT_INTF_DOWN",
     "MAX_SNIFF_BYTES",
     "ENABLE_SPA_PACKET_AGING",
     "MAX_SPA_PACKET_AGE",
     "ENABLE_DIGEST_PERSISTENCE",
+    "ENABLE_DIGEST_CACHE_EXPIRY",
     "RULES_CHECK_THRESHOLD",
     "CMD_EXEC_TIMEOUT",
     //"BLACKLIST",
@@ -62,6 +66,8 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "ENABLE_UDP_SERVER",
     "UDPSERV_PORT",
     "UDPSERV_SELECT_TIMEOUT",
+    "UDPSERV_SOCKETS",
+    "UDPSERV_RECV_BATCH",
     "LOCALE",
     "SYSLOG_IDENTITY",
     "SYSLOG_FACILITY",
@@ -102,6 +108,17 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "IPT_SNAT_ACCESS",
     "IPT_MASQUERADE_ACCESS",
     "ENABLE_IPT_COMMENT_CHECK",
+    "IPT_BATCH_WINDOW",
+#elif FIREWALL_NFTABLES
+    "ENABLE_NFT_FORWARDING",
+    "ENABLE_NFT_LOCAL_NAT",
+    "ENABLE_NFT_OUTPUT",
+    "FLUSH_NFT_AT_INIT",
+    "FLUSH_NFT_AT_EXIT",
+    "NFT_INPUT_ACCESS",
+    "NFT_OUTPUT_ACCESS",
+    "NFT_FORWARD_ACCESS",
+    "NFT_DNAT_ACCESS",
 #elif FIREWALL_IPFW
     "FLUSH_IPFW_AT_INIT",
     "FLUSH_IPFW_AT_EXIT",
@@ -123,6 +140,9 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
     "FWKNOP_PID_FILE",
 #if USE_FILE_CACHE
     "DIGEST_FILE",
+    "DIGEST_CACHE_SYNC_MODE",
+    "DIGEST_CACHE_FLUSH_INTERVAL",
+    "DIGEST_CACHE_BATCH_SIZE",
 #else
     "DIGEST_DB_FILE",
 #endif
@@ -143,6 +163,10 @@ static char *config_map[NUMBER_OF_CONFIG_ENTRIES] = {
 	"DISABLE_CONNECTION_TRACKING",
 	"CONN_ID_FILE",
 	"CONN_REPORT_INTERVAL",
+	"CONNTRACK_METHOD",
+	"CONNTRACK_EVENTS",
+	"SPA_VERIFY_WORKERS",
+	"SPA_QUEUE_SIZE",
 	"MAX_WAIT_ACC_DATA",
 	"SDP_CTRL_CLIENT_CONF",
 	"FWKNOP_CLIENT_CONF",
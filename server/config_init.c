@@ -36,6 +36,8 @@
 #include "cmd_opts.h"
 #include "utils.h"
 #include "log_msg.h"
+#include "afpacket_capture.h"
+#include "udp_server.h"
 #include <pthread.h>
 #include <time.h>
 
@@ -43,6 +45,8 @@
   #include "fw_util_firewalld.h"
 #elif FIREWALL_IPTABLES
   #include "fw_util_iptables.h"
+#elif FIREWALL_NFTABLES
+  #include "fw_util_nftables.h"
 #endif
 
 /* Check to see if an integer variable has a value that is within a
@@ -145,7 +149,8 @@ free_configs(fko_srv_options_t *opts)
         }
         else
         {
-            hash_table_destroy(opts->acc_stanza_hash_tbl);
+            int_hash_table_destroy(opts->acc_stanza_hash_tbl);
+            free_acc_snapshot(opts);
             pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
             pthread_mutex_destroy(&(opts->acc_hash_tbl_mutex));
         }
@@ -156,9 +161,52 @@ free_configs(fko_srv_options_t *opts)
             free(opts->config[i]);
 }
 
+/* Return 1 when the main thread verifies SPA packets itself and so takes
+ * an acc_epoch reader slot.  With several UDP server sockets the receiver
+ * threads do that instead (see run_udp_receivers()).
+*/
+static int
+main_thread_reads_acc(fko_srv_options_t *opts)
+{
+    if((opts->enable_udp_server
+            || strncasecmp(opts->config[CONF_ENABLE_UDP_SERVER], "Y", 1) == 0)
+            && udp_server_sockets(opts) > 1)
+        return 0;
+
+    return 1;
+}
+
+/* Return the number of threads besides the main one that take an
+ * acc_epoch reader slot, picked the same way spa_pipeline_start() does.
+*/
+static int
+acc_reader_threads(fko_srv_options_t *opts)
+{
+    int     n, is_err;
+
+    if(opts->enable_udp_server
+            || strncasecmp(opts->config[CONF_ENABLE_UDP_SERVER], "Y", 1) == 0)
+    {
+        if((n = udp_server_sockets(opts)) > 1)
+            return n;
+    }
+#if HAVE_AF_PACKET_CAPTURE
+    else if((n = afpacket_threads(opts)) > 0)
+        return n;
+#endif
+
+    n = strtol_wrapper(opts->config[CONF_SPA_VERIFY_WORKERS],
+            0, RCHK_MAX_SPA_VERIFY_WORKERS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        return 0;
+
+    return n;
+}
+
 static void
 validate_int_var_ranges(fko_srv_options_t *opts)
 {
+    int     n;
 #if FIREWALL_IPFW
     int     is_err = FKO_SUCCESS;
 #endif
@@ -169,6 +217,10 @@ validate_int_var_ranges(fko_srv_options_t *opts)
         1, RCHK_MAX_SPA_PACKET_AGE);
     range_check(opts, "MAX_SNIFF_BYTES", opts->config[CONF_MAX_SNIFF_BYTES],
         1, RCHK_MAX_SNIFF_BYTES);
+    range_check(opts, "AF_PACKET_THREADS", opts->config[CONF_AF_PACKET_THREADS],
+        1, RCHK_MAX_AF_PACKET_THREADS);
+    range_check(opts, "AF_PACKET_RING_BLOCKS", opts->config[CONF_AF_PACKET_RING_BLOCKS],
+        RCHK_MIN_AF_PACKET_RING_BLOCKS, RCHK_MAX_AF_PACKET_RING_BLOCKS);
     range_check(opts, "RULES_CHECK_THRESHOLD", opts->config[CONF_RULES_CHECK_THRESHOLD],
         0, RCHK_MAX_RULES_CHECK_THRESHOLD);
     range_check(opts, "TCPSERV_PORT", opts->config[CONF_TCPSERV_PORT],
@@ -177,12 +229,40 @@ validate_int_var_ranges(fko_srv_options_t *opts)
         1, RCHK_MAX_UDPSERV_PORT);
     range_check(opts, "UDPSERV_PORT", opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
         1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT);
+    range_check(opts, "UDPSERV_SOCKETS", opts->config[CONF_UDPSERV_SOCKETS],
+        1, RCHK_MAX_UDPSERV_SOCKETS);
+    range_check(opts, "UDPSERV_RECV_BATCH", opts->config[CONF_UDPSERV_RECV_BATCH],
+        1, RCHK_MAX_UDPSERV_RECV_BATCH);
     range_check(opts, "ACC_STANZA_HASH_TABLE_LENGTH", opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
         MIN_ACC_STANZA_HASH_TABLE_LENGTH, MAX_ACC_STANZA_HASH_TABLE_LENGTH);
     range_check(opts, "MAX_WAIT_ACC_DATA", opts->config[CONF_MAX_WAIT_ACC_DATA],
         1, RCHK_MAX_WAIT_ACC_DATA);
     range_check(opts, "SERVICE_HASH_TABLE_LENGTH", opts->config[CONF_SERVICE_HASH_TABLE_LENGTH],
         MIN_SERVICE_HASH_TABLE_LENGTH, MAX_SERVICE_HASH_TABLE_LENGTH);
+    range_check(opts, "SPA_VERIFY_WORKERS", opts->config[CONF_SPA_VERIFY_WORKERS],
+        0, RCHK_MAX_SPA_VERIFY_WORKERS);
+    range_check(opts, "SPA_QUEUE_SIZE", opts->config[CONF_SPA_QUEUE_SIZE],
+        RCHK_MIN_SPA_QUEUE_SIZE, RCHK_MAX_SPA_QUEUE_SIZE);
+
+    /* The capture threads or SPA workers share the acc_epoch reader
+     * slots with the main thread
+    */
+    if(strncmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0
+            && (n = acc_reader_threads(opts) + main_thread_reads_acc(opts)) > ACC_EPOCH_MAX_READERS)
+    {
+        log_msg(LOG_ERR,
+            "[*] %d SPA verification threads need more than the %d access snapshot reader slots",
+            n, ACC_EPOCH_MAX_READERS);
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+#if USE_FILE_CACHE
+    range_check(opts, "DIGEST_CACHE_FLUSH_INTERVAL",
+        opts->config[CONF_DIGEST_CACHE_FLUSH_INTERVAL],
+        1, RCHK_MAX_DIGEST_CACHE_FLUSH_INTERVAL);
+    range_check(opts, "DIGEST_CACHE_BATCH_SIZE",
+        opts->config[CONF_DIGEST_CACHE_BATCH_SIZE],
+        1, RCHK_MAX_DIGEST_CACHE_BATCH_SIZE);
+#endif
 
 #if FIREWALL_IPFW
     range_check(opts, "IPFW_START_RULE_NUM", opts->config[CONF_IPFW_START_RULE_NUM],
@@ -220,6 +300,10 @@ validate_int_var_ranges(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
+#elif FIREWALL_IPTABLES
+    range_check(opts, "IPT_BATCH_WINDOW", opts->config[CONF_IPT_BATCH_WINDOW],
+        0, RCHK_MAX_IPT_BATCH_WINDOW);
+
 #elif FIREWALL_PF
     range_check(opts, "PF_EXPIRE_INTERVAL", opts->config[CONF_PF_EXPIRE_INTERVAL],
         1, RCHK_MAX_PF_EXPIRE_INTERVAL);
@@ -432,6 +516,25 @@ validate_options(fko_srv_options_t *opts)
     if(opts->config[CONF_CONN_REPORT_INTERVAL] == NULL)
         set_config_entry(opts, CONF_CONN_REPORT_INTERVAL, DEF_CONN_REPORT_INTERVAL);
 
+    /* How connection tracking talks to conntrack, NETLINK falls back to
+     * the conntrack command if netlink turns out not to be usable.
+    */
+    if(opts->config[CONF_CONNTRACK_METHOD] == NULL)
+        set_config_entry(opts, CONF_CONNTRACK_METHOD, DEF_CONNTRACK_METHOD);
+
+    if(strcasecmp(opts->config[CONF_CONNTRACK_METHOD], "NETLINK") != 0
+            && strcasecmp(opts->config[CONF_CONNTRACK_METHOD], "CLI") != 0)
+    {
+        log_msg(LOG_ERR,
+            "Invalid CONNTRACK_METHOD '%s' (must be NETLINK or CLI)",
+            opts->config[CONF_CONNTRACK_METHOD]
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(opts->config[CONF_CONNTRACK_EVENTS] == NULL)
+        set_config_entry(opts, CONF_CONNTRACK_EVENTS, DEF_CONNTRACK_EVENTS);
+
     /* If the pid and digest cache files where not set in the config file or
      * via command-line, then grab the defaults. Start with RUN_DIR as the
      * files may depend on that.
@@ -497,6 +600,37 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_PCAP_LOOP_SLEEP,
             DEF_PCAP_LOOP_SLEEP);
 
+    /* Read packets with libpcap, or straight from AF_PACKET rings
+    */
+    if(opts->config[CONF_CAPTURE_METHOD] == NULL)
+        set_config_entry(opts, CONF_CAPTURE_METHOD, DEF_CAPTURE_METHOD);
+
+    if(strcasecmp(opts->config[CONF_CAPTURE_METHOD], "PCAP") != 0
+            && strcasecmp(opts->config[CONF_CAPTURE_METHOD], "AF_PACKET") != 0)
+    {
+        log_msg(LOG_ERR,
+            "Invalid CAPTURE_METHOD '%s' (must be PCAP or AF_PACKET)",
+            opts->config[CONF_CAPTURE_METHOD]
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+#if !HAVE_AF_PACKET_CAPTURE
+    if(strcasecmp(opts->config[CONF_CAPTURE_METHOD], "AF_PACKET") == 0)
+    {
+        log_msg(LOG_ERR,
+            "CAPTURE_METHOD AF_PACKET is not supported by this build of fwknopd");
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+#endif
+
+    if(opts->config[CONF_AF_PACKET_THREADS] == NULL)
+        set_config_entry(opts, CONF_AF_PACKET_THREADS, DEF_AF_PACKET_THREADS);
+
+    if(opts->config[CONF_AF_PACKET_RING_BLOCKS] == NULL)
+        set_config_entry(opts, CONF_AF_PACKET_RING_BLOCKS,
+            DEF_AF_PACKET_RING_BLOCKS);
+
     /* Control whether to exit if the interface where we're sniffing
      * goes down.
     */
@@ -537,6 +671,37 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_ENABLE_DIGEST_PERSISTENCE,
             DEF_ENABLE_DIGEST_PERSISTENCE);
 
+    /* Enable digest cache expiry.
+    */
+    if(opts->config[CONF_ENABLE_DIGEST_CACHE_EXPIRY] == NULL)
+        set_config_entry(opts, CONF_ENABLE_DIGEST_CACHE_EXPIRY,
+            DEF_ENABLE_DIGEST_CACHE_EXPIRY);
+
+#if USE_FILE_CACHE
+    /* Digest cache file write batching and durability.
+    */
+    if(opts->config[CONF_DIGEST_CACHE_SYNC_MODE] == NULL)
+        set_config_entry(opts, CONF_DIGEST_CACHE_SYNC_MODE,
+            DEF_DIGEST_CACHE_SYNC_MODE);
+
+    if(digest_journal_sync_mode(opts->config[CONF_DIGEST_CACHE_SYNC_MODE]) < 0)
+    {
+        log_msg(LOG_ERR,
+            "Invalid DIGEST_CACHE_SYNC_MODE '%s' (must be NONE, PERIODIC, or ALWAYS)",
+            opts->config[CONF_DIGEST_CACHE_SYNC_MODE]
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if(opts->config[CONF_DIGEST_CACHE_FLUSH_INTERVAL] == NULL)
+        set_config_entry(opts, CONF_DIGEST_CACHE_FLUSH_INTERVAL,
+            DEF_DIGEST_CACHE_FLUSH_INTERVAL);
+
+    if(opts->config[CONF_DIGEST_CACHE_BATCH_SIZE] == NULL)
+        set_config_entry(opts, CONF_DIGEST_CACHE_BATCH_SIZE,
+            DEF_DIGEST_CACHE_BATCH_SIZE);
+#endif
+
     /* Set firewall rule "deep" collection interval - this allows
      * fwknopd to remove rules with proper _exp_<time> expiration
      * times even when added by a different program.
@@ -842,6 +1007,97 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_ENABLE_IPT_COMMENT_CHECK,
             DEF_ENABLE_IPT_COMMENT_CHECK);
 
+    /* How long new rules are held back to go out in one iptables-restore
+     * run.
+    */
+    if(opts->config[CONF_IPT_BATCH_WINDOW] == NULL)
+        set_config_entry(opts, CONF_IPT_BATCH_WINDOW, DEF_IPT_BATCH_WINDOW);
+
+#elif FIREWALL_NFTABLES
+    /* Enable NFT forwarding.
+    */
+    if(opts->config[CONF_ENABLE_NFT_FORWARDING] == NULL)
+        set_config_entry(opts, CONF_ENABLE_NFT_FORWARDING,
+            DEF_ENABLE_NFT_FORWARDING);
+
+    /* Enable NFT local NAT.
+    */
+    if(opts->config[CONF_ENABLE_NFT_LOCAL_NAT] == NULL)
+        set_config_entry(opts, CONF_ENABLE_NFT_LOCAL_NAT,
+            DEF_ENABLE_NFT_LOCAL_NAT);
+
+    /* Enable NFT OUTPUT.
+    */
+    if(opts->config[CONF_ENABLE_NFT_OUTPUT] == NULL)
+        set_config_entry(opts, CONF_ENABLE_NFT_OUTPUT,
+            DEF_ENABLE_NFT_OUTPUT);
+
+    /* Flush NFT at init.
+    */
+    if(opts->config[CONF_FLUSH_NFT_AT_INIT] == NULL)
+        set_config_entry(opts, CONF_FLUSH_NFT_AT_INIT, DEF_FLUSH_NFT_AT_INIT);
+
+    /* Flush NFT at exit.
+    */
+    if(opts->config[CONF_FLUSH_NFT_AT_EXIT] == NULL)
+        set_config_entry(opts, CONF_FLUSH_NFT_AT_EXIT, DEF_FLUSH_NFT_AT_EXIT);
+
+    /* NFT input access.
+    */
+    if(opts->config[CONF_NFT_INPUT_ACCESS] == NULL)
+        set_config_entry(opts, CONF_NFT_INPUT_ACCESS,
+            DEF_NFT_INPUT_ACCESS);
+
+    if(validate_nft_access_conf(opts->config[CONF_NFT_INPUT_ACCESS]) != 1)
+    {
+        log_msg(LOG_ERR,
+            "Invalid NFT_INPUT_ACCESS specification, see fwknopd.conf comments"
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    /* NFT output access.
+    */
+    if(opts->config[CONF_NFT_OUTPUT_ACCESS] == NULL)
+        set_config_entry(opts, CONF_NFT_OUTPUT_ACCESS,
+            DEF_NFT_OUTPUT_ACCESS);
+
+    if(validate_nft_access_conf(opts->config[CONF_NFT_OUTPUT_ACCESS]) != 1)
+    {
+        log_msg(LOG_ERR,
+            "Invalid NFT_OUTPUT_ACCESS specification, see fwknopd.conf comments"
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    /* NFT forward access.
+    */
+    if(opts->config[CONF_NFT_FORWARD_ACCESS] == NULL)
+        set_config_entry(opts, CONF_NFT_FORWARD_ACCESS,
+            DEF_NFT_FORWARD_ACCESS);
+
+    if(validate_nft_access_conf(opts->config[CONF_NFT_FORWARD_ACCESS]) != 1)
+    {
+        log_msg(LOG_ERR,
+            "Invalid NFT_FORWARD_ACCESS specification, see fwknopd.conf comments"
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    /* NFT dnat access.
+    */
+    if(opts->config[CONF_NFT_DNAT_ACCESS] == NULL)
+        set_config_entry(opts, CONF_NFT_DNAT_ACCESS,
+            DEF_NFT_DNAT_ACCESS);
+
+    if(validate_nft_access_conf(opts->config[CONF_NFT_DNAT_ACCESS]) != 1)
+    {
+        log_msg(LOG_ERR,
+            "Invalid NFT_DNAT_ACCESS specification, see fwknopd.conf comments"
+        );
+        clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
+    }
+
 #elif FIREWALL_IPFW
 
     /* Flush ipfw rules at init.
@@ -963,6 +1219,23 @@ validate_options(fko_srv_options_t *opts)
         set_config_entry(opts, CONF_UDPSERV_SELECT_TIMEOUT,
             DEF_UDPSERV_SELECT_TIMEOUT);
 
+    /* UDP server sockets (SO_REUSEPORT) and datagrams read per call
+    */
+    if(opts->config[CONF_UDPSERV_SOCKETS] == NULL)
+        set_config_entry(opts, CONF_UDPSERV_SOCKETS, DEF_UDPSERV_SOCKETS);
+
+    if(opts->config[CONF_UDPSERV_RECV_BATCH] == NULL)
+        set_config_entry(opts, CONF_UDPSERV_RECV_BATCH, DEF_UDPSERV_RECV_BATCH);
+
+    /* SPA verification worker threads and their packet queue.
+    */
+    if(opts->config[CONF_SPA_VERIFY_WORKERS] == NULL)
+        set_config_entry(opts, CONF_SPA_VERIFY_WORKERS,
+            DEF_SPA_VERIFY_WORKERS);
+
+    if(opts->config[CONF_SPA_QUEUE_SIZE] == NULL)
+        set_config_entry(opts, CONF_SPA_QUEUE_SIZE, DEF_SPA_QUEUE_SIZE);
+
     /* Syslog identity.
     */
     if(opts->config[CONF_SYSLOG_IDENTITY] == NULL)
@@ -1022,6 +1295,13 @@ validate_options(fko_srv_options_t *opts)
         // initialize the hash table mutexes
         pthread_mutex_init(&(opts->acc_hash_tbl_mutex), NULL);
         pthread_mutex_init(&(opts->service_hash_tbl_mutex), NULL);
+
+        // the main thread looks up access stanzas for incoming SPA packets,
+        // unless the UDP server receiver threads do it
+        acc_epoch_init(&(opts->acc_epoch));
+        opts->acc_reader_slot = -1;
+        if(main_thread_reads_acc(opts))
+            opts->acc_reader_slot = acc_epoch_register(&(opts->acc_epoch));
     }
 
     if(opts->config[CONF_DISABLE_SDP_CTRL_CLIENT] == NULL)
@@ -1385,7 +1665,7 @@ config_init(fko_srv_options_t *opts, int argc, char **argv)
             case CONN_ID_FILE:
                 set_config_entry(opts, CONF_CONN_ID_FILE, optarg);
                 break;
-            case CONF_CONN_REPORT_INTERVAL:
+            case CONN_REPORT_INTERVAL:
                 set_config_entry(opts, CONF_CONN_REPORT_INTERVAL, optarg);
                 break;
             case MAX_WAIT_ACC_DATA:
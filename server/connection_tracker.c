@@ -14,12 +14,13 @@
 #include "log_msg.h"
 #include "extcmd.h"
 #include "access.h"
-#include "bstrlib.h"
-#include "hash_table.h"
+#include "int_hash_table.h"
 #include "sdp_ctrl_client.h"
 #include <json-c/json.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
 #include "service.h"
+#include "conntrack_nl.h"
 #include "connection_tracker.h"
 
 //const char *conn_id_key = "connection_id";
@@ -44,15 +45,36 @@ static int known_conns_deleted;
 
 
 static int msg_conn_list_count = 0;
-static hash_table_t *connection_hash_tbl = NULL;
-static hash_table_t *latest_connection_hash_tbl = NULL;
+static int_hash_table_t *connection_hash_tbl = NULL;
+static int_hash_table_t *latest_connection_hash_tbl = NULL;
 //static uint64_t last_conn_id = 0;
 static connection_t msg_conn_list = NULL;
+static connection_t msg_conn_list_tail = NULL;
 static int verbosity = 0;
 static time_t next_ctrl_msg_due = 0;
 static char conntrack_buf[CONNTRACK_CMD_OUT_BUFSIZE] = {0};
 
-static int close_connections(fko_srv_options_t *opts, char *criteria);
+// ctnetlink socket, NULL when the conntrack command is used instead
+static conntrack_nl_t *conntrack_nl = NULL;
+
+// ctnetlink event socket, NULL when every update compares a full dump
+static conntrack_nl_t *conntrack_ev = NULL;
+
+// when to compare a full dump again even though events are followed,
+// 0 forces it on the next update
+static time_t next_conntrack_resync = 0;
+
+// all known (or all current) connections of one SDP ID, this is what
+// the connection hash tables hold for each ID
+typedef struct conn_list{
+    connection_t head;
+    connection_t tail;
+    unsigned int count;
+    connection_t *slots;    // flow index by conn_key_t, linear probing
+    unsigned int mask;      // number of slots - 1, 0 before the first append
+} conn_list_t;
+
+static int close_connections(fko_srv_options_t *opts, conn_criteria_t *criteria);
 
 
 static void print_connection_item(connection_t this_conn)
@@ -131,7 +153,6 @@ static void destroy_connection_list(connection_t list)
 
 static int validate_connection(acc_stanza_t *acc, connection_t conn, int *valid_r)
 {
-    acc_service_list_t *open_service = NULL;
     acc_port_list_t *open_port = NULL;
 
     *valid_r = 0;
@@ -142,16 +163,10 @@ static int validate_connection(acc_stanza_t *acc, connection_t conn, int *valid_
         return FWKNOPD_ERROR_CONNTRACK;
     }
 
-    open_service = acc->service_list;
-
-    while(open_service != NULL)
+    if(acc_service_permitted(acc, conn->service_id))
     {
-        if(open_service->service_id == conn->service_id)
-        {
-            *valid_r = 1;
-            return FWKNOPD_SUCCESS;
-        }
-        open_service = open_service->next;
+        *valid_r = 1;
+        return FWKNOPD_SUCCESS;
     }
 
     // that didn't work, look for an open port
@@ -173,32 +188,313 @@ static int validate_connection(acc_stanza_t *acc, connection_t conn, int *valid_
 }
 
 
-static int add_to_connection_list(connection_t *list, connection_t new_guy)
+// fill in the binary key from the connection's strings
+static void set_connection_key(connection_t conn)
+{
+    struct in_addr addr;
+
+    memset(&(conn->key), 0x0, sizeof(conn->key));
+
+    conn->key.sdp_id = conn->sdp_id;
+
+    if(inet_pton(AF_INET, conn->src_ip_str, &addr) == 1)
+        conn->key.src_ip = addr.s_addr;
+    if(inet_pton(AF_INET, conn->dst_ip_str, &addr) == 1)
+        conn->key.dst_ip = addr.s_addr;
+    if(conn->nat_dst_ip_str[0] != 0x0
+            && inet_pton(AF_INET, conn->nat_dst_ip_str, &addr) == 1)
+        conn->key.nat_dst_ip = addr.s_addr;
+
+    conn->key.src_port     = conn->src_port;
+    conn->key.dst_port     = conn->dst_port;
+    conn->key.nat_dst_port = conn->nat_dst_port;
+
+    if(strncmp(conn->protocol, "tcp", 3) == 0)
+        conn->key.proto = PROTO_TCP;
+    else if(strncmp(conn->protocol, "udp", 3) == 0)
+        conn->key.proto = PROTO_UDP;
+}
+
+
+static int conn_keys_match(const conn_key_t *a, const conn_key_t *b)
 {
-    connection_t this_conn = *list;
+    return memcmp(a, b, sizeof(conn_key_t)) == 0;
+}
+
+
+static uint32_t conn_key_hash(const conn_key_t *k)
+{
+    uint64_t h;
+
+    h  = ((uint64_t)k->src_ip << 32 | k->dst_ip) * 0x9e3779b97f4a7c15ULL;
+    h ^= ((uint64_t)k->src_port << 48 | (uint64_t)k->dst_port << 32
+            | k->nat_dst_ip) * 0xc2b2ae3d27d4eb4fULL;
+    h ^= ((uint64_t)k->nat_dst_port << 40 | (uint64_t)k->proto << 32
+            | k->sdp_id) * 0x165667b19e3779f9ULL;
+
+    return (uint32_t)(h ^ (h >> 32));
+}
 
-    if(!new_guy)
+
+// slot in the flow index where the search for key starts
+static unsigned int conn_index_home(const conn_list_t *list, const conn_key_t *key)
+{
+    return conn_key_hash(key) & list->mask;
+}
+
+
+static void conn_index_insert(conn_list_t *list, connection_t conn)
+{
+    unsigned int i = conn_index_home(list, &(conn->key));
+
+    while(list->slots[i] != NULL)
+        i = (i + 1) & list->mask;
+
+    list->slots[i] = conn;
+}
+
+
+// take conn out of the flow index, later entries of the same probe run
+// are shifted back so lookups never have to skip over holes
+static void conn_index_remove(conn_list_t *list, connection_t conn)
+{
+    unsigned int i = conn_index_home(list, &(conn->key));
+    unsigned int j = 0, home = 0;
+
+    while(list->slots[i] != conn)
     {
-        log_msg(LOG_ERR,
-                "add_to_connection_list() Error: NULL argument passed");
-        return FWKNOPD_ERROR_CONNTRACK;
+        if(list->slots[i] == NULL)
+            return;
+        i = (i + 1) & list->mask;
     }
 
-    if(*list == NULL)
+    j = i;
+    while(1)
     {
-        *list = new_guy;
+        j = (j + 1) & list->mask;
+        if(list->slots[j] == NULL)
+            break;
+
+        // an entry whose home lies cyclically in (i, j] stays put
+        home = conn_index_home(list, &(list->slots[j]->key));
+        if(i <= j ? (i < home && home <= j) : (i < home || home <= j))
+            continue;
+
+        list->slots[i] = list->slots[j];
+        i = j;
+    }
+
+    list->slots[i] = NULL;
+}
+
+
+// make room in the flow index for count connections, at most half of
+// the slots are ever in use
+static int conn_index_reserve(conn_list_t *list, unsigned int count)
+{
+    unsigned int size = list->mask ? list->mask + 1 : 0;
+    connection_t *slots = NULL;
+    connection_t this_conn = NULL;
+
+    if(size >= count * 2)
         return FWKNOPD_SUCCESS;
+
+    if(size == 0)
+        size = CONN_INDEX_MIN_SLOTS;
+    while(size < count * 2)
+        size *= 2;
+
+    if( (slots = calloc(size, sizeof *slots)) == NULL)
+    {
+        log_msg(LOG_ERR, "conn_index_reserve() FATAL MEMORY ERROR");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
     }
 
-    while(this_conn->next != NULL)
-        this_conn = this_conn->next;
+    free(list->slots);
+    list->slots = slots;
+    list->mask = size - 1;
 
-    this_conn->next = new_guy;
+    for(this_conn = list->head; this_conn != NULL; this_conn = this_conn->next)
+        conn_index_insert(list, this_conn);
 
     return FWKNOPD_SUCCESS;
 }
 
 
+static conn_list_t *conn_list_create(void)
+{
+    conn_list_t *list = calloc(1, sizeof *list);
+
+    if(list == NULL)
+        log_msg(LOG_ERR, "conn_list_create() FATAL MEMORY ERROR");
+
+    return list;
+}
+
+
+static void conn_list_destroy(conn_list_t *list)
+{
+    if(list == NULL)
+        return;
+
+    destroy_connection_list(list->head);
+    free(list->slots);
+    free(list);
+}
+
+
+// append a chain of connections, the list keeps a tail pointer so this
+// costs the length of the chain, not of the list
+static int conn_list_append(conn_list_t *list, connection_t chain)
+{
+    int rv = FWKNOPD_SUCCESS;
+    unsigned int count = 0;
+    connection_t this_conn = NULL;
+
+    if(chain == NULL)
+    {
+        log_msg(LOG_ERR, "conn_list_append() Error: NULL argument passed");
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    for(this_conn = chain; this_conn != NULL; this_conn = this_conn->next)
+        count++;
+
+    if( (rv = conn_index_reserve(list, list->count + count)) != FWKNOPD_SUCCESS)
+        return rv;
+
+    if(list->tail == NULL)
+        list->head = chain;
+    else
+        list->tail->next = chain;
+
+    chain->prev = list->tail;
+
+    for(this_conn = chain; this_conn != NULL; this_conn = this_conn->next)
+    {
+        conn_index_insert(list, this_conn);
+
+        if(this_conn->next != NULL)
+            this_conn->next->prev = this_conn;
+        else
+            list->tail = this_conn;
+    }
+
+    list->count += count;
+    return rv;
+}
+
+
+// the first connection in the list with the given key, if any
+static connection_t conn_list_find(const conn_list_t *list, const conn_key_t *key)
+{
+    unsigned int i = 0;
+
+    if(list == NULL || list->mask == 0)
+        return NULL;
+
+    for(i = conn_index_home(list, key); list->slots[i] != NULL;
+            i = (i + 1) & list->mask)
+    {
+        if(conn_keys_match(&(list->slots[i]->key), key))
+            return list->slots[i];
+    }
+
+    return NULL;
+}
+
+
+// same as conn_list_find but passes over connections already paired up
+// during a diff, so duplicate flows still pair off one to one
+static connection_t conn_list_find_unmatched(const conn_list_t *list,
+                                             const conn_key_t *key)
+{
+    unsigned int i = 0;
+
+    if(list == NULL || list->mask == 0)
+        return NULL;
+
+    for(i = conn_index_home(list, key); list->slots[i] != NULL;
+            i = (i + 1) & list->mask)
+    {
+        if(!list->slots[i]->matched
+                && conn_keys_match(&(list->slots[i]->key), key))
+            return list->slots[i];
+    }
+
+    return NULL;
+}
+
+
+// take one connection out of the list, the caller owns it afterwards
+static void conn_list_unlink(conn_list_t *list, connection_t conn)
+{
+    if(conn->prev == NULL)
+        list->head = conn->next;
+    else
+        conn->prev->next = conn->next;
+
+    if(conn->next == NULL)
+        list->tail = conn->prev;
+    else
+        conn->next->prev = conn->prev;
+
+    conn_index_remove(list, conn);
+    conn->prev = NULL;
+    conn->next = NULL;
+    list->count--;
+}
+
+
+// take all connections out of the list, the caller owns the chain
+static connection_t conn_list_take(conn_list_t *list)
+{
+    connection_t chain = list->head;
+
+    list->head = NULL;
+    list->tail = NULL;
+    list->count = 0;
+
+    // drop the index too, it is sized again by the next append
+    free(list->slots);
+    list->slots = NULL;
+    list->mask = 0;
+
+    return chain;
+}
+
+
+// append a list of connections to the controller message list, the tail
+// is remembered so that adding connections one at a time doesn't walk
+// the whole message list every time
+static void add_to_msg_conn_list(connection_t list)
+{
+    if(list == NULL)
+        return;
+
+    if(msg_conn_list == NULL)
+        msg_conn_list = list;
+    else
+        msg_conn_list_tail->next = list;
+
+    while(list != NULL)
+    {
+        msg_conn_list_count++;
+        msg_conn_list_tail = list;
+        list = list->next;
+    }
+}
+
+
+static void clear_msg_conn_list(void)
+{
+    destroy_connection_list(msg_conn_list);
+    msg_conn_list = NULL;
+    msg_conn_list_tail = NULL;
+    msg_conn_list_count = 0;
+}
+
+
 static int create_connection_item( //uint64_t connection_id,
                                    uint32_t sdp_id,
                                    uint32_t service_id,
@@ -239,6 +535,8 @@ static int create_connection_item( //uint64_t connection_id,
 
     this_conn->nat_dst_port = nat_dst_port;
 
+    set_connection_key(this_conn);
+
     *this_conn_r = this_conn;
 
     return FWKNOPD_SUCCESS;
@@ -248,29 +546,32 @@ static int create_connection_item( //uint64_t connection_id,
 static int close_invalid_connection(fko_srv_options_t *opts, connection_t this_conn)
 {
     int rv = FWKNOPD_SUCCESS;
-    char criteria[CRITERIA_BUF_LEN];
-    int reply_src_port = 0;
+    conn_criteria_t criteria;
 
     // set the closing time
     this_conn->end_time = time(NULL);
 
     // create search criteria to close the connection
+    memset(&criteria, 0x0, sizeof(criteria));
+    criteria.sdp_id = this_conn->sdp_id;
+    criteria.match_tuple = 1;
+    strlcpy(criteria.protocol, this_conn->protocol, sizeof(criteria.protocol));
+    strlcpy(criteria.src_ip_str, this_conn->src_ip_str, sizeof(criteria.src_ip_str));
+    strlcpy(criteria.dst_ip_str, this_conn->dst_ip_str, sizeof(criteria.dst_ip_str));
+    criteria.src_port = this_conn->src_port;
+    criteria.dst_port = this_conn->dst_port;
+
     if(this_conn->nat_dst_port != 0)
     {
-        reply_src_port = this_conn->nat_dst_port;
+        criteria.reply_src_port = this_conn->nat_dst_port;
     }
     else
     {
-        reply_src_port = this_conn->dst_port;
+        criteria.reply_src_port = this_conn->dst_port;
     }
 
-    snprintf(criteria, CRITERIA_BUF_LEN-1, CONNMARK_SEARCH_ARGS,
-             this_conn->sdp_id, this_conn->protocol, this_conn->src_ip_str,
-             this_conn->src_port, this_conn->dst_ip_str, this_conn->dst_port,
-             reply_src_port);
-
     // close it
-    if( (rv = close_connections(opts, criteria)) != FWKNOPD_SUCCESS)
+    if( (rv = close_connections(opts, &criteria)) != FWKNOPD_SUCCESS)
     {
         return rv;
     }
@@ -281,16 +582,16 @@ static int close_invalid_connection(fko_srv_options_t *opts, connection_t this_c
     print_connection_list(this_conn);
 
     // add to the ctrl msg list
-    if( (rv = add_to_connection_list(&msg_conn_list, this_conn)) != FWKNOPD_SUCCESS)
-    {
-        return rv;
-    }
-    msg_conn_list_count++;
+    add_to_msg_conn_list(this_conn);
 
     return rv;
 }
 
 
+static int finish_connection_item(fko_srv_options_t *opts,
+                                  connection_t this_conn,
+                                  connection_t *this_conn_r);
+
 static int create_connection_item_from_line(fko_srv_options_t *opts,
                                             const char *line,
                                             time_t now,
@@ -397,6 +698,92 @@ static int create_connection_item_from_line(fko_srv_options_t *opts,
         this_conn->end_time = now;
     }
 
+    set_connection_key(this_conn);
+
+    return finish_connection_item(opts, this_conn, this_conn_r);
+}
+
+
+// fill in the connection fields that come straight from a conntrack entry
+static void fill_connection_from_nl(const conntrack_nl_entry_t *entry,
+                                    time_t now,
+                                    connection_t this_conn)
+{
+    struct in_addr addr;
+
+    strlcpy(this_conn->protocol, entry->proto == PROTO_TCP ? "tcp" : "udp",
+            sizeof(this_conn->protocol));
+
+    addr.s_addr = entry->orig_src;
+    inet_ntop(AF_INET, &addr, this_conn->src_ip_str, MAX_IPV4_STR_LEN);
+    addr.s_addr = entry->orig_dst;
+    inet_ntop(AF_INET, &addr, this_conn->dst_ip_str, MAX_IPV4_STR_LEN);
+    this_conn->src_port = entry->orig_sport;
+    this_conn->dst_port = entry->orig_dport;
+
+    this_conn->sdp_id = entry->mark;
+    this_conn->start_time = now;
+
+    // if dest address does not match returning source address
+    // then NAT is in use
+    if(entry->orig_dst != entry->reply_src)
+    {
+        addr.s_addr = entry->reply_src;
+        inet_ntop(AF_INET, &addr, this_conn->nat_dst_ip_str, MAX_IPV4_STR_LEN);
+        this_conn->nat_dst_port = entry->reply_sport;
+    }
+
+    // a TCP connection in TIME_WAIT is closed
+    if(entry->tcp_time_wait)
+    {
+        this_conn->end_time = now;
+    }
+
+    set_connection_key(this_conn);
+}
+
+
+static int create_connection_item_from_nl(fko_srv_options_t *opts,
+                                          const conntrack_nl_entry_t *entry,
+                                          time_t now,
+                                          connection_t *this_conn_r)
+{
+    connection_t this_conn = NULL;
+
+    *this_conn_r = NULL;
+
+    // same as the conntrack command, only marked entries are of interest
+    if(entry->mark == 0)
+        return FWKNOPD_SUCCESS;
+
+    if(entry->proto != PROTO_TCP && entry->proto != PROTO_UDP)
+    {
+        log_msg(LOG_ERR, "create_connection_item_from_nl() ERROR: unrecognized "
+                "protocol %u for conntrack entry with mark %"PRIu32,
+                entry->proto, entry->mark);
+        return FWKNOPD_SUCCESS;
+    }
+
+    if( (this_conn = calloc(1, sizeof *this_conn)) == NULL)
+    {
+        log_msg(LOG_ERR, "create_connection_item_from_nl() FATAL MEMORY ERROR. ABORTING.");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    fill_connection_from_nl(entry, now, this_conn);
+
+    return finish_connection_item(opts, this_conn, this_conn_r);
+}
+
+
+// look up the service for a freshly parsed connection, connections that
+// don't belong to any service are closed right away
+static int finish_connection_item(fko_srv_options_t *opts,
+                                  connection_t this_conn,
+                                  connection_t *this_conn_r)
+{
+    int res = FWKNOPD_SUCCESS;
+
     if((res = get_service_id_by_details(opts, this_conn->protocol,
                                         this_conn->dst_port,
                                         this_conn->nat_dst_ip_str,
@@ -459,10 +846,10 @@ static int handle_conntrack_print_issue(char **line, char *next_line, char *bad_
 }
 
 
-static int search_conntrack(fko_srv_options_t *opts,
-                            char *criteria,
-                            connection_t *conn_list_r,
-                            int *conn_count_r)
+static int search_conntrack_cli(fko_srv_options_t *opts,
+                                char *criteria,
+                                connection_t *conn_list_r,
+                                int *conn_count_r)
 {
     char   cmd_buf[CMD_BUFSIZE];
     int    conn_count = 0, res = FWKNOPD_SUCCESS;
@@ -474,6 +861,7 @@ static int search_conntrack(fko_srv_options_t *opts,
     int line_repaired = 0;
     connection_t this_conn = NULL;
     connection_t conn_list = NULL;
+    connection_t last_conn = NULL;
 
     time(&now);
 
@@ -492,13 +880,13 @@ static int search_conntrack(fko_srv_options_t *opts,
     if(!EXTCMD_IS_SUCCESS(res))
     {
         log_msg(LOG_ERR,
-                "search_conntrack() Error %i from cmd:'%s': %s",
+                "search_conntrack_cli() Error %i from cmd:'%s': %s",
                 res, cmd_buf, conntrack_buf);
         return FWKNOPD_ERROR_CONNTRACK;
     }
 
     line = strtok(conntrack_buf, "\n");
-    log_msg(LOG_DEBUG, "search_conntrack() first line from conntrack call: \n"
+    log_msg(LOG_DEBUG, "search_conntrack_cli() first line from conntrack call: \n"
             "    %s\n", line);
 
     // walk through each of the lines
@@ -535,12 +923,12 @@ static int search_conntrack(fko_srv_options_t *opts,
 
         if(this_conn != NULL)
         {
-            if( (res = add_to_connection_list(&conn_list, this_conn)) != FWKNOPD_SUCCESS)
-            {
-                destroy_connection_item(this_conn);
-                goto cleanup;
-            }
+            if(last_conn == NULL)
+                conn_list = this_conn;
+            else
+                last_conn->next = this_conn;
 
+            last_conn = this_conn;
             conn_count++;
         }
 
@@ -567,10 +955,237 @@ cleanup:
 }
 
 
-static int close_connections(fko_srv_options_t *opts, char *criteria)
+// render criteria as arguments for the conntrack command
+static void format_conn_criteria(const conn_criteria_t *criteria, char *buf, size_t len)
+{
+    if(criteria == NULL)
+        buf[0] = 0x0;
+    else if(criteria->match_tuple)
+        snprintf(buf, len, CONNMARK_SEARCH_ARGS,
+                 criteria->sdp_id, criteria->protocol, criteria->src_ip_str,
+                 criteria->src_port, criteria->dst_ip_str, criteria->dst_port,
+                 criteria->reply_src_port);
+    else if(criteria->sdp_id != 0)
+        snprintf(buf, len, "-m %"PRIu32, criteria->sdp_id);
+    else
+        buf[0] = 0x0;
+}
+
+
+static int conn_entry_matches(const conntrack_nl_entry_t *entry,
+                              const conn_criteria_t *criteria)
+{
+    struct in_addr addr;
+
+    if(entry->mark == 0)
+        return 0;
+
+    if(criteria == NULL)
+        return 1;
+
+    if(criteria->sdp_id != 0 && entry->mark != criteria->sdp_id)
+        return 0;
+
+    if(!criteria->match_tuple)
+        return 1;
+
+    if(entry->proto != (strncmp(criteria->protocol, "tcp", 3) == 0 ? PROTO_TCP : PROTO_UDP))
+        return 0;
+
+    if(inet_pton(AF_INET, criteria->src_ip_str, &addr) != 1 || addr.s_addr != entry->orig_src)
+        return 0;
+
+    if(inet_pton(AF_INET, criteria->dst_ip_str, &addr) != 1 || addr.s_addr != entry->orig_dst)
+        return 0;
+
+    return entry->orig_sport == criteria->src_port
+        && entry->orig_dport == criteria->dst_port
+        && entry->reply_sport == criteria->reply_src_port;
+}
+
+
+// matching entries are copied out of the dump first, because turning
+// them into connection items may itself need the netlink socket
+// (closing connections for unknown services)
+struct conntrack_nl_matches
+{
+    const conn_criteria_t *criteria;
+    conntrack_nl_entry_t *entries;
+    int count;
+    int size;
+    int error;
+};
+
+static int collect_conntrack_nl_cb(const conntrack_nl_entry_t *entry, void *arg)
+{
+    struct conntrack_nl_matches *m = (struct conntrack_nl_matches*)arg;
+    conntrack_nl_entry_t *new_entries = NULL;
+    int new_size = 0;
+
+    if(!conn_entry_matches(entry, m->criteria))
+        return 0;
+
+    if(m->count == m->size)
+    {
+        new_size = m->size ? m->size * 2 : CONNTRACK_NL_INIT_MATCHES;
+        if((new_entries = realloc(m->entries, new_size * sizeof *new_entries)) == NULL)
+        {
+            m->error = FWKNOPD_ERROR_MEMORY_ALLOCATION;
+            return 1;
+        }
+        m->entries = new_entries;
+        m->size = new_size;
+    }
+
+    m->entries[m->count++] = *entry;
+    return 0;
+}
+
+
+// netlink failed, use the conntrack command from now on
+static void conntrack_nl_fallback(const char *what)
+{
+    log_msg(LOG_WARNING, "%s via netlink failed, falling back to the "
+            "conntrack command", what);
+    conntrack_nl_close(conntrack_nl);
+    conntrack_nl = NULL;
+}
+
+
+static int collect_conntrack_nl(conn_criteria_t *criteria,
+                                struct conntrack_nl_matches *m)
+{
+    int rv = 0;
+
+    memset(m, 0x0, sizeof *m);
+    m->criteria = criteria;
+
+    rv = conntrack_nl_dump(conntrack_nl, criteria != NULL ? criteria->sdp_id : 0,
+                           collect_conntrack_nl_cb, m);
+
+    if(rv == CONNTRACK_NL_STOPPED && m->error != FWKNOPD_SUCCESS)
+    {
+        log_msg(LOG_ERR, "collect_conntrack_nl() fatal memory allocation error");
+        free(m->entries);
+        return m->error;
+    }
+
+    if(rv != CONNTRACK_NL_SUCCESS)
+    {
+        log_msg(LOG_ERR, "collect_conntrack_nl() conntrack dump failed: %s",
+                strerror(errno));
+        free(m->entries);
+        return FWKNOPD_ERROR_CONNTRACK;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+
+static int search_conntrack_nl(fko_srv_options_t *opts,
+                               conn_criteria_t *criteria,
+                               connection_t *conn_list_r,
+                               int *conn_count_r)
+{
+    struct conntrack_nl_matches m;
+    int    conn_count = 0, res = FWKNOPD_SUCCESS, idx = 0;
+    time_t now;
+    connection_t this_conn = NULL;
+    connection_t conn_list = NULL;
+    connection_t last_conn = NULL;
+
+    time(&now);
+
+    if((res = collect_conntrack_nl(criteria, &m)) != FWKNOPD_SUCCESS)
+    {
+        if(res == FWKNOPD_ERROR_CONNTRACK)
+            conntrack_nl_fallback("Listing connections");
+        return res;
+    }
+
+    for(idx = 0; idx < m.count; idx++)
+    {
+        if( (res = create_connection_item_from_nl(opts, &(m.entries[idx]), now, &this_conn)) != FWKNOPD_SUCCESS)
+        {
+            destroy_connection_list(conn_list);
+            free(m.entries);
+            return res;
+        }
+
+        // append at the tail, a full dump can hold a lot of connections
+        if(this_conn != NULL)
+        {
+            if(last_conn == NULL)
+                conn_list = this_conn;
+            else
+                last_conn->next = this_conn;
+
+            last_conn = this_conn;
+            conn_count++;
+        }
+    }
+
+    free(m.entries);
+
+    *conn_list_r = conn_list;
+    *conn_count_r = conn_count;
+
+    return res;
+}
+
+
+static int search_conntrack(fko_srv_options_t *opts,
+                            conn_criteria_t *criteria,
+                            connection_t *conn_list_r,
+                            int *conn_count_r)
+{
+    int  res = FWKNOPD_SUCCESS;
+    char criteria_str[CRITERIA_BUF_LEN];
+
+    if(conntrack_nl != NULL)
+    {
+        res = search_conntrack_nl(opts, criteria, conn_list_r, conn_count_r);
+
+        // only a failed netlink request closes the socket, anything
+        // else is an answer
+        if(conntrack_nl != NULL || res != FWKNOPD_ERROR_CONNTRACK)
+            return res;
+    }
+
+    format_conn_criteria(criteria, criteria_str, CRITERIA_BUF_LEN);
+
+    return search_conntrack_cli(opts, criteria != NULL ? criteria_str : NULL,
+                                conn_list_r, conn_count_r);
+}
+
+
+static int delete_conntrack_nl(conn_criteria_t *criteria)
+{
+    struct conntrack_nl_matches m;
+    int res = FWKNOPD_SUCCESS, idx = 0;
+
+    if((res = collect_conntrack_nl(criteria, &m)) != FWKNOPD_SUCCESS)
+        return res;
+
+    for(idx = 0; idx < m.count; idx++)
+    {
+        if(conntrack_nl_delete(conntrack_nl, &(m.entries[idx])) != CONNTRACK_NL_SUCCESS)
+        {
+            res = FWKNOPD_ERROR_CONNTRACK;
+            break;
+        }
+    }
+
+    free(m.entries);
+    return res;
+}
+
+
+static int close_connections(fko_srv_options_t *opts, conn_criteria_t *criteria)
 {
     char   cmd_buf[CMD_BUFSIZE];
     char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
+    char   criteria_str[CRITERIA_BUF_LEN];
     int    conn_count = 0, res = FWKNOPD_SUCCESS;
     int pid_status = 0;
     connection_t conn_list = NULL;
@@ -581,20 +1196,33 @@ static int close_connections(fko_srv_options_t *opts, char *criteria)
         return res;
     }
 
-    memset(cmd_buf, 0x0, CMD_BUFSIZE);
-    memset(cmd_out, 0x0, STANDARD_CMD_OUT_BUFSIZE);
-
-    snprintf(cmd_buf, CMD_BUFSIZE, "conntrack -D %s", criteria);
+    format_conn_criteria(criteria, criteria_str, CRITERIA_BUF_LEN);
 
-    res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE,
-                     WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
-    chop_newline(cmd_out);
+    if(conntrack_nl != NULL)
+    {
+        if( (res = delete_conntrack_nl(criteria)) == FWKNOPD_ERROR_CONNTRACK)
+            conntrack_nl_fallback("Closing connections");
+        else if(res != FWKNOPD_SUCCESS)
+            return res;
+    }
 
-    if(!EXTCMD_IS_SUCCESS(res))
+    if(conntrack_nl == NULL)
     {
-        log_msg(LOG_ERR, "close_connections() Error %i from cmd:'%s': %s",
-                res, cmd_buf, cmd_out);
-        return FWKNOPD_ERROR_CONNTRACK;
+        memset(cmd_buf, 0x0, CMD_BUFSIZE);
+        memset(cmd_out, 0x0, STANDARD_CMD_OUT_BUFSIZE);
+
+        snprintf(cmd_buf, CMD_BUFSIZE, "conntrack -D %s", criteria_str);
+
+        res = run_extcmd(cmd_buf, cmd_out, STANDARD_CMD_OUT_BUFSIZE,
+                         WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+        chop_newline(cmd_out);
+
+        if(!EXTCMD_IS_SUCCESS(res))
+        {
+            log_msg(LOG_ERR, "close_connections() Error %i from cmd:'%s': %s",
+                    res, cmd_buf, cmd_out);
+            return FWKNOPD_ERROR_CONNTRACK;
+        }
     }
 
     if( (res = search_conntrack(opts, criteria, &conn_list, &conn_count)) != FWKNOPD_SUCCESS)
@@ -607,11 +1235,12 @@ static int close_connections(fko_srv_options_t *opts, char *criteria)
     {
         log_msg(LOG_ERR, "close_connections() Failed to close the following connections:");
         print_connection_list(conn_list);
+        destroy_connection_list(conn_list);
         return FWKNOPD_ERROR_CONNTRACK;
     }
 
     log_msg(LOG_WARNING, "Gateway closed connections meeting the following criteria:\n"
-                         "     %s \n", criteria);
+                         "     %s \n", criteria_str);
 
     return res;
 }
@@ -688,32 +1317,35 @@ cleanup:
 }
 
 
-static int store_in_connection_hash_tbl(hash_table_t *tbl, connection_t this_conn)
+static int store_in_connection_hash_tbl(int_hash_table_t *tbl, connection_t this_conn)
 {
     int res = FWKNOPD_SUCCESS;
-    bstring key = NULL;
-    char id_str[SDP_MAX_CLIENT_ID_STR_LEN] = {0};
-    connection_t present_conns = NULL;
-
-    // convert the sdp id integer to a bstring
-    snprintf(id_str, SDP_MAX_CLIENT_ID_STR_LEN, "%"PRIu32, this_conn->sdp_id);
-    key = bfromcstr(id_str);
-    // key is not freed if hash_table_set is called,
-    // because the hash table keeps it
+    conn_list_t *present_conns = NULL;
 
     // if a node for this SDP ID doesn't yet exist in the table
     // gotta make it
-    if( (present_conns = hash_table_get(tbl, key)) == NULL)
+    if( (present_conns = int_hash_table_get(tbl, this_conn->sdp_id)) == NULL)
     {
         log_msg(LOG_DEBUG, "store_in_connection_hash_tbl() ID %"PRIu32
                 " not yet in table. \n", this_conn->sdp_id);
 
-        if( (res = hash_table_set(tbl, key, this_conn)) != FWKNOPD_SUCCESS)
+        if( (present_conns = conn_list_create()) == NULL)
+            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+
+        if( (res = conn_list_append(present_conns, this_conn)) != FWKNOPD_SUCCESS)
+        {
+            conn_list_destroy(present_conns);
+            return res;
+        }
+
+        if( (res = int_hash_table_set(tbl, this_conn->sdp_id, present_conns)) != FWKNOPD_SUCCESS)
         {
             log_msg(LOG_ERR,
                 "[*] Fatal memory allocation error updating 'latest' connection tracking hash table"
             );
-            bdestroy(key);
+            // the caller still owns this_conn
+            conn_list_take(present_conns);
+            conn_list_destroy(present_conns);
         }
     }
     else
@@ -721,11 +1353,7 @@ static int store_in_connection_hash_tbl(hash_table_t *tbl, connection_t this_con
         log_msg(LOG_DEBUG, "store_in_connection_hash_tbl() ID %"PRIu32
                 " already exists in table. \n", this_conn->sdp_id);
 
-        // key is no longer needed in this case, didn't create a new hash node
-        bdestroy(key);
-
-        // this one should be impossible to fail, but we will still return the res
-        res = add_to_connection_list(&present_conns, this_conn);
+        res = conn_list_append(present_conns, this_conn);
 
         log_msg(LOG_DEBUG, "store_in_connection_hash_tbl() Added conn to current "
                 "list for SDP ID: %"PRIu32" \n", this_conn->sdp_id);
@@ -781,107 +1409,78 @@ static int check_conntrack(fko_srv_options_t *opts, int *conn_count_r)
 }
 
 
-static void destroy_hash_node_cb(hash_table_node_t *node)
+static void destroy_hash_node_cb(int_hash_table_node_t *node)
 {
-  if(node->key != NULL) bdestroy((bstring)(node->key));
   if(node->data != NULL)
   {
       // this function takes care of all connection nodes (NOT hash table nodes)
       // for this SDP ID, including the very first one
-      destroy_connection_list((connection_t)(node->data));
+      conn_list_destroy((conn_list_t*)(node->data));
   }
 }
 
 
-static int connection_items_match(connection_t a, connection_t b)
-{
-    // make sure neither is NULL first
-    if(!(a && b))
-        return 0;
-
-    if( a->sdp_id   == b->sdp_id     &&
-        a->src_port == b->src_port   &&
-        a->dst_port == b->dst_port   &&
-        a->nat_dst_port == b->nat_dst_port   &&
-        strncmp(a->src_ip_str, b->src_ip_str, MAX_IPV4_STR_LEN) == 0 &&
-        strncmp(a->dst_ip_str, b->dst_ip_str, MAX_IPV4_STR_LEN) == 0 &&
-        strncmp(a->nat_dst_ip_str, b->nat_dst_ip_str, MAX_IPV4_STR_LEN) == 0)
-    {
-        return 1;
-    }
-    else
-    {
-        return 0;
-    }
-}
-
-
-static int compare_connection_lists(connection_t *known_conns,
+// diff the known connections of an SDP ID against the current ones from
+// conntrack, both matched by their binary key through the known list's
+// flow index, so this is linear in the number of connections
+static int compare_connection_lists(conn_list_t *known_conns,
                                     connection_t *current_conns,
                                     connection_t *closed_conns)
 {
     int rv = FWKNOPD_SUCCESS;
     int match = 0;
     int conn_closed = 0;
-    connection_t this_known_conn = *known_conns;
-    connection_t prev_known_conn = NULL;
+    connection_t this_known_conn = NULL;
     connection_t next_conn = NULL;
-    connection_t this_current_conn = NULL;
+    connection_t this_current_conn = *current_conns;
     connection_t prev_current_conn = NULL;
+    connection_t last_closed_conn = NULL;
     time_t now = time(NULL);
 
 #ifdef DEBUG_CONNECTION_TRACKER
-    int known_conns_count_pre = 0;
+    int known_conns_count_pre = known_conns->count;
     int known_conns_count_post = 0;
     int known_conns_del = 0;
-
-    while(this_known_conn != NULL)
-    {
-        known_conns_count_pre++;
-        this_known_conn = this_known_conn->next;
-    }
-
-    this_known_conn = *known_conns;
 #endif
 
     log_msg(LOG_DEBUG, "compare_connection_lists() entered");
 
-    while(this_known_conn != NULL)
+    // mark the known conns that are still in conntrack, each one takes
+    // at most one current conn, the matched ones are removed from
+    // current_conns
+    while(this_current_conn != NULL)
     {
-        match = 0;
-        conn_closed = 0;
-        this_current_conn = *current_conns;
-        prev_current_conn = NULL;
+        next_conn = this_current_conn->next;
+        this_known_conn = conn_list_find_unmatched(known_conns,
+                &(this_current_conn->key));
 
-        while(this_current_conn != NULL)
+        if(this_known_conn != NULL)
         {
-            if( (match = connection_items_match(this_known_conn, this_current_conn)) == 1 )
-            {
-                // got a match, remove from current_conns list
+            // if end_time was set, means TIME_WAIT flag was set
+            this_known_conn->matched = this_current_conn->end_time != 0 ? 2 : 1;
 
-                 // if very first connection item was the match
-                if(prev_current_conn == NULL)
-                {
-                    *current_conns = this_current_conn->next;
-                }
-                else
-                {
-                    prev_current_conn->next = this_current_conn->next;
-                }
+            if(prev_current_conn == NULL)
+                *current_conns = next_conn;
+            else
+                prev_current_conn->next = next_conn;
 
-                // if end_time was set, means TIME_WAIT flag was set
-                if(this_current_conn->end_time != 0)
-                    conn_closed = 1;
+            destroy_connection_item(this_current_conn);
+        }
+        else
+        {
+            prev_current_conn = this_current_conn;
+        }
 
-                destroy_connection_item(this_current_conn);
-                this_current_conn = NULL;
-                break;
-            }
+        this_current_conn = next_conn;
+    }
 
-            prev_current_conn = this_current_conn;
-            this_current_conn = this_current_conn->next;
+    this_known_conn = known_conns->head;
 
-        }   // END while(this_current_conn != NULL)
+    while(this_known_conn != NULL)
+    {
+        match = this_known_conn->matched != 0;
+        conn_closed = this_known_conn->matched == 2;
+        this_known_conn->matched = 0;
 
         next_conn = this_known_conn->next;
 
@@ -891,7 +1490,6 @@ static int compare_connection_lists(connection_t *known_conns,
             // then it's still live, so
             // the conn stays in the known conn list
             // just move to next known conn
-            prev_known_conn = this_known_conn;
 #ifdef DEBUG_CONNECTION_TRACKER
             known_conn_cnt_before_update_open++;
             known_conn_cnt_after_update_open++;
@@ -918,14 +1516,12 @@ static int compare_connection_lists(connection_t *known_conns,
                     goto cleanup;
                 }
 
-                this_current_conn->next = NULL;
+                if(last_closed_conn == NULL)
+                    *closed_conns = this_current_conn;
+                else
+                    last_closed_conn->next = this_current_conn;
 
-                if( (rv = add_to_connection_list(closed_conns, this_current_conn))
-                        != FWKNOPD_SUCCESS)
-                {
-                    destroy_connection_item(this_current_conn);
-                    goto cleanup;
-                }
+                last_closed_conn = this_current_conn;
             }
 #ifdef DEBUG_CONNECTION_TRACKER
             else
@@ -938,38 +1534,24 @@ static int compare_connection_lists(connection_t *known_conns,
             // can now remove from known connections
             if(!match)
             {
-                // the conn no longer exists, remove from known conns
-                // when removing a known conn, prev_known_conn should not be updated
-                this_known_conn->next = NULL;
-
-                // if we're removing the first conn in the known conn list
-                if(prev_known_conn == NULL)
-                {
-                    *known_conns = next_conn;
-                }
-                else
-                {
-                    prev_known_conn->next = next_conn;
-                }
-
 #ifdef DEBUG_CONNECTION_TRACKER
                 known_conns_deleted++;
                 known_conns_deleted_during_comp++;
                 known_conns_del++;
 #endif
 
+                conn_list_unlink(known_conns, this_known_conn);
                 destroy_connection_item(this_known_conn);
             }
+#ifdef DEBUG_CONNECTION_TRACKER
             else
             {
-                prev_known_conn = this_known_conn;
-#ifdef DEBUG_CONNECTION_TRACKER
                 if(conn_closed)
                         known_conn_cnt_after_update_closed++;
                 else
                         known_conn_cnt_after_update_open++;
-#endif
             }
+#endif
 
         }  // END if(match)
 
@@ -979,12 +1561,7 @@ static int compare_connection_lists(connection_t *known_conns,
     }  // END while(this_known_conn != NULL)
 
 #ifdef DEBUG_CONNECTION_TRACKER
-    this_known_conn = *known_conns;
-    while(this_known_conn != NULL)
-    {
-        known_conns_count_post++;
-        this_known_conn = this_known_conn->next;
-    }
+    known_conns_count_post = known_conns->count;
 
     log_msg(LOG_ALERT, " Known conns before:  %6d", known_conns_count_pre);
     log_msg(LOG_ALERT, " Known conns deleted: %6d", known_conns_del);
@@ -1004,6 +1581,10 @@ static int compare_connection_lists(connection_t *known_conns,
     return rv;
 
 cleanup:
+    for(this_known_conn = known_conns->head; this_known_conn != NULL;
+            this_known_conn = this_known_conn->next)
+        this_known_conn->matched = 0;
+
     destroy_connection_list(*closed_conns);
     *closed_conns = NULL;
 
@@ -1011,49 +1592,40 @@ cleanup:
 }
 
 
-static int traverse_print_conn_items_cb(hash_table_node_t *node, void *arg)
+static int traverse_print_conn_items_cb(int_hash_table_node_t *node, void *arg)
 {
-    print_connection_list((connection_t)(node->data));
+    print_connection_list(((conn_list_t*)(node->data))->head);
 
     return FWKNOPD_SUCCESS;
 }
 
 
-static int traverse_compare_latest_cb(hash_table_node_t *node, void *arg)
+static int traverse_compare_latest_cb(int_hash_table_node_t *node, void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
-    connection_t known_conns = NULL;
+    conn_list_t *known_conns = NULL;
+    conn_list_t *current_list = NULL;
     connection_t current_conns = NULL;
-    connection_t copy_current_conns = NULL;
     time_t *end_time = (time_t*)arg;
     connection_t closed_conns = NULL;
-    int closed_conn_count = 0;
+    connection_t last_closed_conn = NULL;
     connection_t temp_conn = NULL;
-    connection_t prev_conn = NULL;
     connection_t next_conn = NULL;
-    bstring key = NULL;
 
     // just a safety check, shouldn't be possible
     if(node->data == NULL)
     {
-        hash_table_delete(connection_hash_tbl, node->key);
+        int_hash_table_delete(connection_hash_tbl, node->key);
         return rv;
     }
 
-    if((key = bstrcpy((bstring)(node->key))) == NULL)
-    {
-        log_msg(LOG_ERR, "traverse_compare_latest_cb() Failed to duplicate key");
-        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
-    }
-
-    // going to manipulate this data directly and reset the data pointer
-    known_conns = (connection_t)(node->data);
+    known_conns = (conn_list_t*)(node->data);
 
     // check whether this SDP ID still has any current connections
-    if( (current_conns = hash_table_get(latest_connection_hash_tbl, key)) == NULL)
+    if( (current_list = int_hash_table_get(latest_connection_hash_tbl, node->key)) == NULL)
     {
         // only report those that haven't been reported yet
-        temp_conn = known_conns;
+        temp_conn = conn_list_take(known_conns);
         while(temp_conn != NULL)
         {
 #ifdef DEBUG_CONNECTION_TRACKER
@@ -1068,7 +1640,7 @@ static int traverse_compare_latest_cb(hash_table_node_t *node, void *arg)
 #ifdef DEBUG_CONNECTION_TRACKER
                 known_conn_cnt_before_update_closed++;
 #endif
-                prev_conn = temp_conn;
+                destroy_connection_item(temp_conn);
             }
             else
             {
@@ -1076,21 +1648,15 @@ static int traverse_compare_latest_cb(hash_table_node_t *node, void *arg)
                 known_conn_cnt_before_update_open++;
 #endif
                 temp_conn->end_time = *end_time;
-
-                if(prev_conn != NULL)
-                    prev_conn->next = temp_conn->next;
-                else
-                    node->data = (void*)(temp_conn->next);
-
                 temp_conn->next = NULL;
 
-                // add to closed_conns
-                closed_conn_count++;
-                if( (rv = add_to_connection_list(&closed_conns, temp_conn))
-                        != FWKNOPD_SUCCESS)
-                {
-                    goto cleanup;
-                }
+                // add to closed_conns
+                if(last_closed_conn == NULL)
+                    closed_conns = temp_conn;
+                else
+                    last_closed_conn->next = temp_conn;
+
+                last_closed_conn = temp_conn;
             }
 
             temp_conn = next_conn;
@@ -1101,75 +1667,54 @@ static int traverse_compare_latest_cb(hash_table_node_t *node, void *arg)
             if(verbosity >= LOG_DEBUG)
             {
                 log_msg(LOG_WARNING, "All connections closed for SDP ID %"PRIu32":",
-                        known_conns->sdp_id);
+                        closed_conns->sdp_id);
                 print_connection_list(closed_conns);
             }
 
 
             // add these closed connections to the ctrl message list
-            if( (rv = add_to_connection_list(&msg_conn_list, closed_conns))
-                    != FWKNOPD_SUCCESS)
-            {
-                goto cleanup;
-            }
-            msg_conn_list_count += closed_conn_count;
-
+            add_to_msg_conn_list(closed_conns);
             closed_conns = NULL;
         }
 
-        // set node->data to NULL so the list is not deleted with the node
-        //node->data = NULL;
-
         // this SDP ID no longer has connections, remove entirely from
         // known connection list, hash table traverser is fine with
         // deleting random nodes along the way
-        hash_table_delete(connection_hash_tbl, key);
-        goto cleanup;
+        int_hash_table_delete(connection_hash_tbl, node->key);
+        return rv;
     }
 
     // at this point, we know this ID has both known and current connections
-    // have to compare each connection in-depth
-
-    // first make a copy of current_conns to avoid data corruption
-    // because we'll be deleting the node from 'latest' conn hash table
-    if((rv = duplicate_connection_list(current_conns, &copy_current_conns)) != FWKNOPD_SUCCESS)
-        return rv;
-
-    // delete the entry in 'latest' conn hash table, we'll take it from here
-    hash_table_delete(latest_connection_hash_tbl, key);
+    // take the current ones out of the 'latest' list, we'll take it from here
+    current_conns = conn_list_take(current_list);
 
     // following function removes conns from known_conns if no longer in
     // conntrack - leaving only old, still-open conns and conns flagged as
     // closed but still in conntrack,
-    // removes previously known conns from copy_current_conns - leaving only
+    // removes previously known conns from current_conns - leaving only
     // entirely new conns,
     // puts closed conns in closed_conns
-    if( (rv = compare_connection_lists(&known_conns, &copy_current_conns,
+    if( (rv = compare_connection_lists(known_conns, &current_conns,
             &closed_conns)) != FWKNOPD_SUCCESS)
     {
-        goto cleanup;
+        destroy_connection_list(current_conns);
+        int_hash_table_delete(latest_connection_hash_tbl, node->key);
+        return rv;
     }
 
-    // any remaining conns in copy_current_conns list are totally new
-    if(copy_current_conns != NULL)
+    // any remaining conns in current_conns list are totally new,
+    // store them back to the 'latest' conn list for later
+    if(current_conns == NULL)
     {
-        // store the truly new conns back to the 'latest' conn hash table for later
-        if( (rv = hash_table_set(latest_connection_hash_tbl, key, copy_current_conns))
-                != FWKNOPD_SUCCESS)
-        {
-            log_msg(LOG_ERR, "Failed to store revised list of new conns in hash table");
-            goto cleanup;
-        }
-
-        copy_current_conns = NULL;
-        key = NULL;
+        int_hash_table_delete(latest_connection_hash_tbl, node->key);
     }
-
-    node->data = known_conns;
-
-    if(known_conns == NULL)
+    else if( (rv = conn_list_append(current_list, current_conns)) != FWKNOPD_SUCCESS)
     {
-        hash_table_delete(connection_hash_tbl, node->key);
+        log_msg(LOG_ERR, "Failed to store revised list of new conns in hash table");
+        destroy_connection_list(current_conns);
+        destroy_connection_list(closed_conns);
+        int_hash_table_delete(latest_connection_hash_tbl, node->key);
+        return rv;
     }
 
     // add closed conns to the ctrl message list
@@ -1182,52 +1727,27 @@ static int traverse_compare_latest_cb(hash_table_node_t *node, void *arg)
             print_connection_list(closed_conns);
         }
 
-        if( (rv = add_to_connection_list(&msg_conn_list, closed_conns))
-                != FWKNOPD_SUCCESS)
-        {
-            goto cleanup;
-        }
-
-        // count them too
-        temp_conn = closed_conns;
-        while(temp_conn != NULL)
-        {
-            msg_conn_list_count++;
-            temp_conn = temp_conn->next;
-        }
-
+        add_to_msg_conn_list(closed_conns);
     }
 
-    // this was a duplicate of the key from known conns table
-    // if it was used/stored back to latest conns table (new conns still to handle)
-    // then the pointer was set to NULL so that we don't destroy it
-    // if there were no new conns to store, need to destroy it
-    if(key != NULL)
-        bdestroy(key);
-
-    return rv;
+    if(known_conns->head == NULL)
+    {
+        int_hash_table_delete(connection_hash_tbl, node->key);
+    }
 
-cleanup:
-    if(key != NULL)
-        bdestroy(key);
-    destroy_connection_list(copy_current_conns);
-    destroy_connection_list(closed_conns);
     return rv;
 }
 
 
-static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t *node)
+static int validate_node_connections(fko_srv_options_t *opts, conn_list_t *list)
 {
     int rv = FWKNOPD_SUCCESS;
     acc_stanza_t *acc = NULL;
-    bstring key = (bstring)node->key;
-    connection_t this_conn = (connection_t)(node->data);
-    connection_t prev_conn = NULL;
+    connection_t this_conn = list->head;
     connection_t next_conn = NULL;
     connection_t temp_conn = NULL;
-    int closed_conn_count = 0;
     int conn_valid = 0;
-    char criteria[CRITERIA_BUF_LEN];
+    conn_criteria_t criteria;
     time_t now = time(NULL);
 
     // always double-check
@@ -1236,38 +1756,34 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
         return rv;
     }
 
-    memset(criteria, 0x0, CRITERIA_BUF_LEN);
-
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
-    {
-        log_msg(LOG_ERR, "Mutex lock error.");
-        return 0;
-    }
-
-    acc = hash_table_get(opts->acc_stanza_hash_tbl, key);
+    memset(&criteria, 0x0, sizeof(criteria));
 
-    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
+    // this runs in the control client thread, the only one that ever
+    // frees access stanzas, so no read section is needed here
+    acc = acc_snapshot_find(acc_snapshot_current(&(opts->acc_snapshot)),
+            this_conn->sdp_id);
 
     // see if sdp id still exists in access table
     if( acc == NULL )
     {
         // this sdp id is no longer authorized to access anything
         // remove all connections marked with this sdp id
-        snprintf(criteria, CRITERIA_BUF_LEN, "-m %"PRIu32, this_conn->sdp_id);
+        criteria.sdp_id = this_conn->sdp_id;
 
-        if( (rv = close_connections(opts, criteria)) != FWKNOPD_SUCCESS)
+        if( (rv = close_connections(opts, &criteria)) != FWKNOPD_SUCCESS)
         {
             return rv;
         }
 
+        // the list no longer owns the connections
+        this_conn = conn_list_take(list);
+
         // set the end time for all of the connections
         temp_conn = this_conn;
         while(temp_conn != NULL)
         {
             temp_conn->end_time = now;
             temp_conn = temp_conn->next;
-            closed_conn_count++;
         }
 
 
@@ -1277,15 +1793,7 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
         print_connection_list(this_conn);
 
         // pin the whole list onto the ctrl message list
-        if( (rv = add_to_connection_list(&msg_conn_list, node->data)) != FWKNOPD_SUCCESS)
-        {
-            return rv;
-        }
-        msg_conn_list_count += closed_conn_count;
-
-        // make sure the hash table node no longer points to the
-        // connection list
-        node->data = NULL;
+        add_to_msg_conn_list(this_conn);
         this_conn = NULL;
     }
 
@@ -1297,19 +1805,10 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
 
         next_conn = this_conn->next;
 
-        if(conn_valid == 1)
+        if(conn_valid != 1)
         {
-            prev_conn = this_conn;
-        }
-        else
-        {
-            // remove from node->data list
-            if(prev_conn == NULL)
-                node->data = this_conn->next;
-            else
-                prev_conn->next = this_conn->next;
-
-            this_conn->next = NULL;
+            // remove from the list
+            conn_list_unlink(list, this_conn);
 
             if( (rv = close_invalid_connection(opts, this_conn)) != FWKNOPD_SUCCESS)
             {
@@ -1324,134 +1823,123 @@ static int validate_node_connections(fko_srv_options_t *opts, hash_table_node_t
 }
 
 
-static int traverse_validate_connections_cb(hash_table_node_t *node, void *arg)
+static int traverse_validate_connections_cb(int_hash_table_node_t *node, void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
     fko_srv_options_t *opts = (fko_srv_options_t*)arg;
+    conn_list_t *list = (conn_list_t*)(node->data);
 
-    if(node->data == NULL)
+    if(list == NULL || list->head == NULL)
     {
         log_msg(LOG_ERR, "traverse_validate_connections_cb() node->data is NULL, shouldn't happen\n");
-        hash_table_delete(connection_hash_tbl, node->key);
+        int_hash_table_delete(connection_hash_tbl, node->key);
         return rv;
     }
 
-    if( (rv = validate_node_connections(opts, node)) != FWKNOPD_SUCCESS)
+    if( (rv = validate_node_connections(opts, list)) != FWKNOPD_SUCCESS)
     {
         return rv;
     }
 
     // if it happens that no connections are left open
     // delete the node from the known connections hash table
-    if(node->data == NULL)
-        hash_table_delete(connection_hash_tbl, node->key);
+    if(list->head == NULL)
+        int_hash_table_delete(connection_hash_tbl, node->key);
 
     return rv;
 }
 
 
-static int traverse_handle_new_conns_cb(hash_table_node_t *node, void *arg)
+static int traverse_handle_new_conns_cb(int_hash_table_node_t *node, void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
     fko_srv_options_t *opts = (fko_srv_options_t*)arg;
-    bstring key = NULL;
+    conn_list_t *list = (conn_list_t*)(node->data);
     connection_t temp_conn = NULL;
-    connection_t known_conns = NULL;
+    conn_list_t *known_conns = NULL;
+#ifdef DEBUG_CONNECTION_TRACKER
     connection_t new_conns = NULL;
+#endif
 
     log_msg(LOG_DEBUG, "traverse_handle_new_conns_cb() entered");
 
-    if(node->data == NULL)
+    if(list == NULL || list->head == NULL)
     {
         log_msg(LOG_ERR, "traverse_handle_new_conns_cb() node->data is NULL, shouldn't happen\n");
-        hash_table_delete(latest_connection_hash_tbl, node->key);
+        int_hash_table_delete(latest_connection_hash_tbl, node->key);
         return rv;
     }
 
-//    // assign connection ids
-//    temp_conn = (connection_t)(node->data);
-//    while(temp_conn != NULL)
-//    {
-//        last_conn_id++;
-//        temp_conn->connection_id = last_conn_id;
-//        temp_conn = temp_conn->next;
-//    }
-
-    temp_conn = (connection_t)(node->data);
     if(verbosity >= LOG_DEBUG)
     {
         log_msg(LOG_WARNING, "New connections from SDP ID %"PRIu32":",
-                temp_conn->sdp_id);
-        print_connection_list(temp_conn);
+                list->head->sdp_id);
+        print_connection_list(list->head);
     }
 
-    if( (rv = validate_node_connections(opts, node)) != FWKNOPD_SUCCESS)
+    if( (rv = validate_node_connections(opts, list)) != FWKNOPD_SUCCESS)
     {
         return rv;
     }
 
     // if it happens that no connections are left open (all were invalid)
     // delete the node from the 'latest' connections hash table
-    if(node->data == NULL)
+    if(list->head == NULL)
     {
-        hash_table_delete(latest_connection_hash_tbl, node->key);
+        int_hash_table_delete(latest_connection_hash_tbl, node->key);
         return rv;
     }
 
 
     // arriving here means there are new connections which we have validated
     // so we need to store in known conns list and ctrl message list
-    if((rv = duplicate_connection_list((connection_t)(node->data), &temp_conn)) != FWKNOPD_SUCCESS)
+    if((rv = duplicate_connection_list(list->head, &temp_conn)) != FWKNOPD_SUCCESS)
     {
         goto cleanup;
     }
 
     // this sdp id may have other connections already in the known conn table
-    if( (known_conns = hash_table_get(connection_hash_tbl, node->key)) != NULL)
+    if( (known_conns = int_hash_table_get(connection_hash_tbl, node->key)) != NULL)
     {
-        if( (rv = add_to_connection_list(&known_conns, temp_conn)) != FWKNOPD_SUCCESS)
+        if( (rv = conn_list_append(known_conns, temp_conn)) != FWKNOPD_SUCCESS)
             goto cleanup;
     }
     else
     {
         // need to create new hash table entry in known conns
-        // make a duplicate key to store in the hash table
-        if((key = bstrcpy((bstring)(node->key))) == NULL)
+        if( (known_conns = conn_list_create()) == NULL)
         {
-            log_msg(LOG_ERR, "traverse_handle_new_conns_cb() Failed to duplicate key");
             rv = FWKNOPD_ERROR_MEMORY_ALLOCATION;
             goto cleanup;
         }
 
         // copy all new conns to known conns hash table
-        if( (rv = hash_table_set(connection_hash_tbl, key, temp_conn)) != FWKNOPD_SUCCESS)
+        if( (rv = conn_list_append(known_conns, temp_conn)) != FWKNOPD_SUCCESS
+                || (rv = int_hash_table_set(connection_hash_tbl, node->key, known_conns)) != FWKNOPD_SUCCESS)
         {
-            bdestroy(key);
+            conn_list_take(known_conns);
+            conn_list_destroy(known_conns);
             goto cleanup;
         }
     }
 
     log_msg(LOG_DEBUG, "traverse_handle_new_conns_cb() adding new conns to msg list\n");
 
-    if( (rv = add_to_connection_list(&msg_conn_list, (connection_t)(node->data))) != FWKNOPD_SUCCESS)
-        return rv;
-
-    // count conns added to message list
-    new_conns = (connection_t)(node->data);
+#ifdef DEBUG_CONNECTION_TRACKER
+    new_conns = list->head;
     while(new_conns != NULL)
     {
-#ifdef DEBUG_CONNECTION_TRACKER
         if(new_conns->end_time)
                 new_unknown_conn_count_closed++;
         else
                 new_unknown_conn_count_open++;
-#endif
-        msg_conn_list_count++;
         new_conns = new_conns->next;
     }
+#endif
+
+    add_to_msg_conn_list(conn_list_take(list));
 
-    node->data = NULL;
-    hash_table_delete(latest_connection_hash_tbl, node->key);
+    int_hash_table_delete(latest_connection_hash_tbl, node->key);
     return rv;
 
 cleanup:
@@ -1460,6 +1948,252 @@ cleanup:
 }
 
 
+// find the known connection that matches conn, also hands back the known
+// list for its SDP ID
+static connection_t find_known_connection(uint32_t sdp_id,
+                                          connection_t conn,
+                                          conn_list_t **list_r)
+{
+    if( (*list_r = int_hash_table_get(connection_hash_tbl, sdp_id)) == NULL)
+        return NULL;
+
+    return conn_list_find(*list_r, &(conn->key));
+}
+
+
+// remove and free a known connection, along with the hash table node if
+// it was the last one for its SDP ID
+static void remove_known_connection(uint32_t sdp_id,
+                                    conn_list_t *list,
+                                    connection_t this_conn)
+{
+    conn_list_unlink(list, this_conn);
+    destroy_connection_item(this_conn);
+
+    if(list->head == NULL)
+        int_hash_table_delete(connection_hash_tbl, sdp_id);
+}
+
+
+// report a known connection as closed, it stays in the known list until
+// conntrack drops it
+static int report_closed_connection(connection_t this_conn, time_t now)
+{
+    int rv = FWKNOPD_SUCCESS;
+    connection_t copy = NULL;
+
+    this_conn->end_time = now;
+
+    if( (rv = duplicate_connection_item(this_conn, &copy)) != FWKNOPD_SUCCESS)
+        return rv;
+
+    add_to_msg_conn_list(copy);
+    return rv;
+}
+
+
+// a connection that is not known yet, validate it the same way as the
+// new connections found in a full dump
+static int handle_new_conntrack_entry(fko_srv_options_t *opts,
+                                      const conntrack_nl_entry_t *entry,
+                                      time_t now)
+{
+    int rv = FWKNOPD_SUCCESS;
+    connection_t this_conn = NULL;
+    connection_t copy = NULL;
+    conn_list_t *list = NULL;
+
+    // NULL means it was closed right away for not matching any service
+    if( (rv = create_connection_item_from_nl(opts, entry, now, &this_conn)) != FWKNOPD_SUCCESS
+            || this_conn == NULL)
+        return rv;
+
+    if(verbosity >= LOG_DEBUG)
+    {
+        log_msg(LOG_WARNING, "New connection from SDP ID %"PRIu32":",
+                this_conn->sdp_id);
+        print_connection_item(this_conn);
+    }
+
+    if( (list = conn_list_create()) == NULL)
+    {
+        destroy_connection_item(this_conn);
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    if( (rv = conn_list_append(list, this_conn)) != FWKNOPD_SUCCESS)
+    {
+        destroy_connection_item(this_conn);
+        conn_list_destroy(list);
+        return rv;
+    }
+
+    rv = validate_node_connections(opts, list);
+
+    // invalid connections are already closed and on the ctrl message list
+    this_conn = conn_list_take(list);
+    conn_list_destroy(list);
+
+    if(rv != FWKNOPD_SUCCESS || this_conn == NULL)
+    {
+        destroy_connection_list(this_conn);
+        return rv;
+    }
+
+    if( (rv = duplicate_connection_item(this_conn, &copy)) != FWKNOPD_SUCCESS)
+    {
+        destroy_connection_item(this_conn);
+        return rv;
+    }
+
+    if( (rv = store_in_connection_hash_tbl(connection_hash_tbl, copy)) != FWKNOPD_SUCCESS)
+    {
+        destroy_connection_item(copy);
+        destroy_connection_item(this_conn);
+        return rv;
+    }
+
+    add_to_msg_conn_list(this_conn);
+    return rv;
+}
+
+
+static int handle_conntrack_event(fko_srv_options_t *opts,
+                                  const conntrack_nl_entry_t *entry,
+                                  time_t now)
+{
+    int rv = FWKNOPD_SUCCESS;
+    struct connection probe;
+    connection_t known_conn = NULL;
+    conn_list_t *known_list = NULL;
+
+    // same filter as a dump, only marked TCP and UDP entries matter
+    if(entry->mark == 0 ||
+       (entry->proto != PROTO_TCP && entry->proto != PROTO_UDP))
+        return rv;
+
+    memset(&probe, 0x0, sizeof(probe));
+    fill_connection_from_nl(entry, now, &probe);
+
+    known_conn = find_known_connection(entry->mark, &probe, &known_list);
+
+    if(entry->event == CONNTRACK_NL_EVENT_DESTROY)
+    {
+        // unknown means never tracked or already closed by the gateway
+        if(known_conn != NULL)
+        {
+            if(known_conn->end_time == 0)
+                rv = report_closed_connection(known_conn, now);
+
+            remove_known_connection(entry->mark, known_list, known_conn);
+        }
+    }
+    else if(known_conn != NULL)
+    {
+        // the first update that shows TIME_WAIT closes the connection
+        if(entry->tcp_time_wait && known_conn->end_time == 0)
+            rv = report_closed_connection(known_conn, now);
+    }
+    else
+    {
+        // a new entry, or an update to one that only now carries a mark
+        rv = handle_new_conntrack_entry(opts, entry, now);
+    }
+
+    return rv;
+}
+
+
+struct conntrack_event_arg
+{
+    fko_srv_options_t *opts;
+    time_t now;
+    int rv;
+};
+
+static int conntrack_event_cb(const conntrack_nl_entry_t *entry, void *arg)
+{
+    struct conntrack_event_arg *ev = (struct conntrack_event_arg*)arg;
+
+    if( (ev->rv = handle_conntrack_event(ev->opts, entry, ev->now)) != FWKNOPD_SUCCESS)
+        return 1;
+
+    return 0;
+}
+
+
+static int discard_conntrack_event_cb(const conntrack_nl_entry_t *entry, void *arg)
+{
+    return 0;
+}
+
+
+// stop following events, every update compares a full dump from now on
+static void conntrack_events_fallback(void)
+{
+    log_msg(LOG_WARNING, "Reading conntrack events failed, comparing the "
+            "full conntrack table on every update from now on");
+    conntrack_nl_close(conntrack_ev);
+    conntrack_ev = NULL;
+}
+
+
+/*
+ * Apply the conntrack events queued since the last update to the known
+ * connections. Sets *resync_r if events were lost and the caller needs
+ * to compare a full dump instead.
+ */
+static int read_conntrack_events(fko_srv_options_t *opts, time_t now, int *resync_r)
+{
+    int rv = 0;
+    struct conntrack_event_arg ev;
+
+    *resync_r = 0;
+
+    ev.opts = opts;
+    ev.now = now;
+    ev.rv = FWKNOPD_SUCCESS;
+
+    rv = conntrack_nl_read_events(conntrack_ev, conntrack_event_cb, &ev);
+
+    if(rv == CONNTRACK_NL_SUCCESS)
+        return FWKNOPD_SUCCESS;
+
+    if(rv == CONNTRACK_NL_STOPPED)
+        return ev.rv;
+
+    if(rv == CONNTRACK_NL_OVERRUN)
+        log_msg(LOG_WARNING, "Conntrack events were lost, comparing the "
+                "full conntrack table");
+    else
+        conntrack_events_fallback();
+
+    *resync_r = 1;
+    return FWKNOPD_SUCCESS;
+}
+
+
+// events queued before a full dump are already reflected in it
+static void discard_conntrack_events(void)
+{
+    int rv = 0, tries = 0;
+
+    for(tries = 0; tries < CONNTRACK_EVENTS_MAX_DISCARD_READS; tries++)
+    {
+        rv = conntrack_nl_read_events(conntrack_ev, discard_conntrack_event_cb, NULL);
+
+        if(rv == CONNTRACK_NL_SUCCESS)
+            return;
+
+        if(rv != CONNTRACK_NL_OVERRUN)
+        {
+            conntrack_events_fallback();
+            return;
+        }
+    }
+}
+
+
 
 //static int conn_id_file_check(const char *file, int *exists)
 //{
@@ -1641,7 +2375,8 @@ int init_connection_tracker(fko_srv_options_t *opts)
 //    if( (is_err = get_set_last_conn_id(opts)) != FWKNOPD_SUCCESS)
 //        return is_err;
 
-    // connection table should be same length as access stanza hash table
+    // connection tables start out sized like the access stanza hash table,
+    // they grow on their own if there are more SDP IDs than that
     hash_table_len = strtol_wrapper(opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH],
                            MIN_ACC_STANZA_HASH_TABLE_LENGTH,
                            MAX_ACC_STANZA_HASH_TABLE_LENGTH,
@@ -1658,8 +2393,8 @@ int init_connection_tracker(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
-    connection_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_hash_node_cb);
+    connection_hash_tbl = int_hash_table_create(hash_table_len,
+            destroy_hash_node_cb);
 
     if(connection_hash_tbl == NULL)
     {
@@ -1669,8 +2404,8 @@ int init_connection_tracker(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
-    latest_connection_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_hash_node_cb);
+    latest_connection_hash_tbl = int_hash_table_create(hash_table_len,
+            destroy_hash_node_cb);
 
     if(latest_connection_hash_tbl == NULL)
     {
@@ -1680,6 +2415,30 @@ int init_connection_tracker(fko_srv_options_t *opts)
         clean_exit(opts, NO_FW_CLEANUP, EXIT_FAILURE);
     }
 
+    if(strncasecmp(opts->config[CONF_CONNTRACK_METHOD], "NETLINK", 7) == 0)
+    {
+        if((conntrack_nl = conntrack_nl_open(0)) == NULL)
+            log_msg(LOG_WARNING, "Netlink conntrack access is not available, "
+                    "using the conntrack command");
+        else
+            log_msg(LOG_INFO, "Connection tracking via netlink");
+    }
+
+    if(conntrack_nl != NULL
+            && strncasecmp(opts->config[CONF_CONNTRACK_EVENTS], "Y", 1) == 0)
+    {
+        conntrack_ev = conntrack_nl_open(CONNTRACK_NL_GROUP_NEW
+                | CONNTRACK_NL_GROUP_UPDATE | CONNTRACK_NL_GROUP_DESTROY);
+
+        if(conntrack_ev == NULL)
+            log_msg(LOG_WARNING, "Conntrack events are not available, "
+                    "comparing the full conntrack table on every update");
+        else
+            log_msg(LOG_INFO, "Following conntrack events for connection tracking");
+
+        next_conntrack_resync = 0;
+    }
+
     return is_err;
 }
 
@@ -1689,46 +2448,47 @@ void destroy_connection_tracker(fko_srv_options_t *opts)
 
     if(connection_hash_tbl != NULL)
     {
-        hash_table_destroy(connection_hash_tbl);
+        int_hash_table_destroy(connection_hash_tbl);
         connection_hash_tbl = NULL;
     }
 
     if(latest_connection_hash_tbl != NULL)
     {
-        hash_table_destroy(latest_connection_hash_tbl);
+        int_hash_table_destroy(latest_connection_hash_tbl);
         latest_connection_hash_tbl = NULL;
     }
 
-    if(msg_conn_list != NULL)
+    if(conntrack_nl != NULL)
+    {
+        conntrack_nl_close(conntrack_nl);
+        conntrack_nl = NULL;
+    }
+
+    if(conntrack_ev != NULL)
     {
-        destroy_connection_list(msg_conn_list);
-        msg_conn_list = NULL;
+        conntrack_nl_close(conntrack_ev);
+        conntrack_ev = NULL;
     }
+
+    clear_msg_conn_list();
 }
 
 #ifdef DEBUG_CONNECTION_TRACKER
-static int traverse_count_conns(hash_table_node_t *node, void *arg)
+static int traverse_count_conns(int_hash_table_node_t *node, void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
     int *count = (int*)arg;
-    connection_t temp_conn = NULL;
 
     log_msg(LOG_DEBUG, "traverse_count_conns() entered");
 
     if(node->data == NULL)
     {
         log_msg(LOG_ERR, "traverse_count_conns() node->data is NULL, shouldn't happen\n");
-        hash_table_delete(latest_connection_hash_tbl, node->key);
+        int_hash_table_delete(latest_connection_hash_tbl, node->key);
         return rv;
     }
 
-    temp_conn = (connection_t)(node->data);
-
-    while(temp_conn)
-    {
-        (*count)++;
-        temp_conn = temp_conn->next;
-    }
+    *count += ((conn_list_t*)(node->data))->count;
 
     return rv;
 }
@@ -1739,6 +2499,7 @@ int update_connections(fko_srv_options_t *opts)
 {
     int res = FWKNOPD_SUCCESS;
     int pres_conn_count = 0;
+    int resync = 0;
     time_t now = 0;
 
     // did someone init the conn tracking tables
@@ -1766,6 +2527,22 @@ int update_connections(fko_srv_options_t *opts)
     known_conns_deleted = 0;
 #endif
 
+    now = time(NULL);
+
+    // when following conntrack events, only what changed since the
+    // last update needs handling
+    if(conntrack_ev != NULL && now < next_conntrack_resync)
+    {
+        if( (res = read_conntrack_events(opts, now, &resync)) != FWKNOPD_SUCCESS)
+            return res;
+
+        if(!resync)
+            return FWKNOPD_SUCCESS;
+    }
+
+    if(conntrack_ev != NULL)
+        discard_conntrack_events();
+
     // first get list of current connections
     if( (res = check_conntrack(opts, &pres_conn_count)) != FWKNOPD_SUCCESS)
     {
@@ -1777,32 +2554,32 @@ int update_connections(fko_srv_options_t *opts)
     {
         log_msg(LOG_DEBUG, "After check_conntrack, dumping hash table "
                 "of current (i.e. latest) connection items:");
-        hash_table_traverse(latest_connection_hash_tbl, traverse_print_conn_items_cb, NULL);
+        int_hash_table_traverse(latest_connection_hash_tbl, traverse_print_conn_items_cb, NULL);
         log_msg(LOG_DEBUG, "\n\n");
     }
 
     now = time(NULL);
 
 #ifdef DEBUG_CONNECTION_TRACKER
-    if( hash_table_traverse(connection_hash_tbl, traverse_count_conns, &known_conn_cnt_before_update)  != FWKNOPD_SUCCESS )
+    if( int_hash_table_traverse(connection_hash_tbl, traverse_count_conns, &known_conn_cnt_before_update)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
 #endif
 
     // walk list of known connections
-    if( hash_table_traverse(connection_hash_tbl, traverse_compare_latest_cb, &now)  != FWKNOPD_SUCCESS )
+    if( int_hash_table_traverse(connection_hash_tbl, traverse_compare_latest_cb, &now)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
 
 #ifdef DEBUG_CONNECTION_TRACKER
-    if( hash_table_traverse(connection_hash_tbl, traverse_count_conns, &known_conn_cnt_after_update)  != FWKNOPD_SUCCESS )
+    if( int_hash_table_traverse(connection_hash_tbl, traverse_count_conns, &known_conn_cnt_after_update)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
 
-    if( hash_table_traverse(latest_connection_hash_tbl, traverse_count_conns, &new_unknown_conn_count_before_walk)  != FWKNOPD_SUCCESS )
+    if( int_hash_table_traverse(latest_connection_hash_tbl, traverse_count_conns, &new_unknown_conn_count_before_walk)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
@@ -1810,13 +2587,13 @@ int update_connections(fko_srv_options_t *opts)
 
     // what's left in 'latest' conns are new, unknown conns
     // validate and possibly add to known list and to report for ctrl
-    if( hash_table_traverse(latest_connection_hash_tbl, traverse_handle_new_conns_cb, opts)  != FWKNOPD_SUCCESS )
+    if( int_hash_table_traverse(latest_connection_hash_tbl, traverse_handle_new_conns_cb, opts)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
 
 #ifdef DEBUG_CONNECTION_TRACKER
-    if( hash_table_traverse(connection_hash_tbl, traverse_count_conns, &final_known_cnt)  != FWKNOPD_SUCCESS )
+    if( int_hash_table_traverse(connection_hash_tbl, traverse_count_conns, &final_known_cnt)  != FWKNOPD_SUCCESS )
     {
         return FWKNOPD_ERROR_CONNTRACK;
     }
@@ -1842,10 +2619,10 @@ int update_connections(fko_srv_options_t *opts)
         log_msg(LOG_DEBUG, "Finished updating all connections");
 
         log_msg(LOG_DEBUG, "Dumping known connections hash table:");
-        hash_table_traverse(connection_hash_tbl, traverse_print_conn_items_cb, NULL);
+        int_hash_table_traverse(connection_hash_tbl, traverse_print_conn_items_cb, NULL);
 
         log_msg(LOG_DEBUG, "\n\nDumping current connections hash table (should now be empty):");
-        hash_table_traverse(latest_connection_hash_tbl, traverse_print_conn_items_cb, NULL);
+        int_hash_table_traverse(latest_connection_hash_tbl, traverse_print_conn_items_cb, NULL);
 
         log_msg(LOG_DEBUG, "\n\nDumping message list for controller:");
         print_connection_list(msg_conn_list);
@@ -1853,12 +2630,16 @@ int update_connections(fko_srv_options_t *opts)
         log_msg(LOG_DEBUG, "\n\n");
     }
 
+    // the known connections match conntrack again, events take it from here
+    if(conntrack_ev != NULL)
+        next_conntrack_resync = now + CONNTRACK_EVENTS_RESYNC_INTERVAL;
+
     return FWKNOPD_SUCCESS;
 }
 
 int validate_connections(fko_srv_options_t *opts)
 {
-    return hash_table_traverse(connection_hash_tbl, traverse_validate_connections_cb, opts);
+    return int_hash_table_traverse(connection_hash_tbl, traverse_validate_connections_cb, opts);
 }
 
 
@@ -1969,6 +2750,43 @@ static int send_connection_report(fko_srv_options_t *opts, connection_t msg_list
 }
 
 
+// When update_connections() or consider_reporting_connections() next
+// has work to do, so the control client thread can sleep until then
+// (0 if never). *fd_r is set to the conntrack event socket to wait on
+// as well, or -1 when there is none and the table must be polled.
+void next_connection_tracker_event(time_t now, time_t *next_r, int *fd_r)
+{
+    time_t next = 0;
+
+    *next_r = 0;
+    *fd_r = -1;
+
+    if(connection_hash_tbl == NULL)
+        return;
+
+    if(conntrack_ev != NULL)
+    {
+        *fd_r = conntrack_ev->fd;
+        next = next_conntrack_resync;
+    }
+    else
+    {
+        // without events a full dump is compared every second, as before
+        next = now + 1;
+    }
+
+    if(msg_conn_list != NULL)
+    {
+        if(msg_conn_list_count >= MSG_CONN_LIST_COUNT_THRESHOLD)
+            next = now;
+        else if(next == 0 || next_ctrl_msg_due < next)
+            next = next_ctrl_msg_due;
+    }
+
+    *next_r = next;
+}
+
+
 int consider_reporting_connections(fko_srv_options_t *opts)
 {
     int rv = FWKNOPD_SUCCESS;
@@ -1998,7 +2816,7 @@ int consider_reporting_connections(fko_srv_options_t *opts)
         log_msg(LOG_DEBUG, "Time to send connection update");
 
         log_msg(LOG_DEBUG, "Dumping known connections hash table:");
-        hash_table_traverse(connection_hash_tbl, traverse_print_conn_items_cb, NULL);
+        int_hash_table_traverse(connection_hash_tbl, traverse_print_conn_items_cb, NULL);
 
         log_msg(LOG_DEBUG, "\n\nDumping message list for controller:");
         print_connection_list(msg_conn_list);
@@ -2021,9 +2839,7 @@ int consider_reporting_connections(fko_srv_options_t *opts)
     }
 
     // free message list
-    destroy_connection_list(msg_conn_list);
-    msg_conn_list = NULL;
-    msg_conn_list_count = 0;
+    clear_msg_conn_list();
 
     // update next_ctrl_msg_due
     next_ctrl_msg_due = now + interval;
@@ -2041,7 +2857,7 @@ int consider_reporting_connections(fko_srv_options_t *opts)
 
 
 
-static int traverse_copy_open_conns_cb(hash_table_node_t *node, void *arg)
+static int traverse_copy_open_conns_cb(int_hash_table_node_t *node, void *arg)
 {
     int rv = FWKNOPD_SUCCESS;
     connection_t temp_conn = NULL;
@@ -2051,29 +2867,22 @@ static int traverse_copy_open_conns_cb(hash_table_node_t *node, void *arg)
     if(node->data == NULL)
     {
         log_msg(LOG_ERR, "traverse_copy_open_conns_cb() node->data is NULL, shouldn't happen\n");
-        hash_table_delete(latest_connection_hash_tbl, node->key);
+        int_hash_table_delete(latest_connection_hash_tbl, node->key);
         return rv;
     }
 
     log_msg(LOG_DEBUG, "traverse_copy_open_conns_cb() node with open connections:");
     if(verbosity >= LOG_DEBUG)
     {
-        print_connection_list(node->data);
+        print_connection_list(((conn_list_t*)(node->data))->head);
     }
 
-    if((rv = duplicate_connection_list((connection_t)(node->data), &temp_conn)) != FWKNOPD_SUCCESS)
+    if((rv = duplicate_connection_list(((conn_list_t*)(node->data))->head, &temp_conn)) != FWKNOPD_SUCCESS)
     {
         return rv;
     }
 
-    if( (rv = add_to_connection_list(&msg_conn_list, temp_conn)) != FWKNOPD_SUCCESS)
-        destroy_connection_list(temp_conn);
-
-    while(temp_conn != NULL)
-    {
-        msg_conn_list_count++;
-        temp_conn = temp_conn->next;
-    }
+    add_to_msg_conn_list(temp_conn);
 
     if(msg_conn_list)
         log_msg(LOG_DEBUG, "traverse_copy_open_conns_cb() msg_conn_list is not null, which is good");
@@ -2104,12 +2913,10 @@ int report_open_connections(fko_srv_options_t *opts)
     }
 
     // gather copies of all open connections into msg_list
-    if( (rv = hash_table_traverse(connection_hash_tbl, traverse_copy_open_conns_cb, NULL))  != FWKNOPD_SUCCESS )
+    if( (rv = int_hash_table_traverse(connection_hash_tbl, traverse_copy_open_conns_cb, NULL))  != FWKNOPD_SUCCESS )
     {
         // free message list
-        destroy_connection_list(msg_conn_list);
-        msg_conn_list = NULL;
-        msg_conn_list_count = 0;
+        clear_msg_conn_list();
         return rv;
     }
 
@@ -2123,9 +2930,7 @@ int report_open_connections(fko_srv_options_t *opts)
     rv = send_connection_report(opts, msg_conn_list);
 
     // free message list
-    destroy_connection_list(msg_conn_list);
-    msg_conn_list = NULL;
-    msg_conn_list_count = 0;
+    clear_msg_conn_list();
 
     if(rv == SDP_ERROR_MEMORY_ALLOCATION)
     {
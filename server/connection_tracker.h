@@ -16,9 +16,27 @@
 #define CRITERIA_BUF_LEN                CMD_BUFSIZE - 20
 
 #define MSG_CONN_LIST_COUNT_THRESHOLD   100
+#define CONNTRACK_NL_INIT_MATCHES       256
+#define CONNTRACK_EVENTS_RESYNC_INTERVAL    300
+#define CONNTRACK_EVENTS_MAX_DISCARD_READS  16
+#define CONN_INDEX_MIN_SLOTS            8
 
 #define CONNMARK_SEARCH_ARGS "-m %"PRIu32" -p %s -s %s --sport %d -d %s --dport %d --reply-port-src %d"
 
+// binary flow key, two connection items are the same flow when their
+// keys are equal, addresses are in network byte order
+typedef struct conn_key{
+	uint32_t sdp_id;
+	uint32_t src_ip;
+	uint32_t dst_ip;
+	uint32_t nat_dst_ip;        // 0 when NAT is not in use
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint16_t nat_dst_port;
+	uint8_t  proto;
+	uint8_t  pad;               // always 0 so keys can be compared with memcmp
+} conn_key_t;
+
 struct connection{
 	uint32_t sdp_id;
 	uint32_t service_id;
@@ -32,15 +50,31 @@ struct connection{
 	time_t start_time;
 	time_t end_time;
 //	uint64_t connection_id;
+	conn_key_t key;
+	int matched;                // set while comparing against a dump
+	struct connection *prev;    // only kept up to date within a conn_list
 	struct connection *next;
 };
 typedef struct connection *connection_t;
 
+// what to look for in (or remove from) the conntrack table
+typedef struct conn_criteria{
+	uint32_t sdp_id;            // conntrack mark, 0 matches any marked entry
+	int match_tuple;            // also match the fields below
+	char protocol[MAX_PROTO_STR_LEN+1];
+	char src_ip_str[MAX_IPV4_STR_LEN];
+	char dst_ip_str[MAX_IPV4_STR_LEN];
+	unsigned int  src_port;
+	unsigned int  dst_port;
+	unsigned int  reply_src_port;
+} conn_criteria_t;
+
 int init_connection_tracker(fko_srv_options_t *opts);
 void destroy_connection_tracker(fko_srv_options_t *opts);
 int update_connections(fko_srv_options_t *opts);
 int validate_connections(fko_srv_options_t *opts);
 int consider_reporting_connections(fko_srv_options_t *opts);
+void next_connection_tracker_event(time_t now, time_t *next_r, int *fd_r);
 int report_open_connections(fko_srv_options_t *opts);
 
 #endif /* SERVER_CONNECTION_TRACKER_H_ */
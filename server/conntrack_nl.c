@@ -0,0 +1,578 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_nl.c
+ *
+ * Purpose: Minimal ctnetlink client.  Lists (optionally filtered by mark in
+ *          the kernel), deletes and follows IPv4 conntrack entries over an
+ *          NETLINK_NETFILTER socket, so connection tracking does not need
+ *          to run and parse the output of the conntrack CLI.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "conntrack_nl.h"
+#include "log_msg.h"
+
+#if HAVE_CONNTRACK_NETLINK
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+#include <linux/netfilter/nf_conntrack_tcp.h>
+
+#define CT_REQ_BUFSIZE  256
+
+/* Requests are small, build them on the stack (suitably aligned)
+*/
+typedef union ct_req_buf
+{
+    struct nlmsghdr nlh;
+    char            buf[CT_REQ_BUFSIZE];
+} ct_req_buf_t;
+
+#define NLA_DATA(a)     ((const char *)(a) + NLA_HDRLEN)
+#define NLA_PAYLOAD(a)  ((int)(a)->nla_len - NLA_HDRLEN)
+
+static void
+parse_attrs(const char *data, int len, const struct nlattr **tb, const int max)
+{
+    const struct nlattr *attr = (const struct nlattr *)data;
+    int                  type;
+
+    memset(tb, 0x0, sizeof(*tb) * (max + 1));
+
+    while(len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN
+            && attr->nla_len <= len)
+    {
+        type = attr->nla_type & NLA_TYPE_MASK;
+        if(type <= max)
+            tb[type] = attr;
+
+        len -= NLA_ALIGN(attr->nla_len);
+        attr = (const struct nlattr *)((const char *)attr + NLA_ALIGN(attr->nla_len));
+    }
+    return;
+}
+
+static int
+attr_u8(const struct nlattr *attr, uint8_t *val)
+{
+    if(attr == NULL || NLA_PAYLOAD(attr) < (int)sizeof(*val))
+        return 0;
+    memcpy(val, NLA_DATA(attr), sizeof(*val));
+    return 1;
+}
+
+static int
+attr_u16(const struct nlattr *attr, uint16_t *val)
+{
+    if(attr == NULL || NLA_PAYLOAD(attr) < (int)sizeof(*val))
+        return 0;
+    memcpy(val, NLA_DATA(attr), sizeof(*val));
+    return 1;
+}
+
+static int
+attr_u32(const struct nlattr *attr, uint32_t *val)
+{
+    if(attr == NULL || NLA_PAYLOAD(attr) < (int)sizeof(*val))
+        return 0;
+    memcpy(val, NLA_DATA(attr), sizeof(*val));
+    return 1;
+}
+
+/* Pull the IPv4 addresses, protocol and ports out of a CTA_TUPLE_* nest
+*/
+static int
+parse_tuple(const struct nlattr *nest, uint32_t *src, uint32_t *dst,
+        uint16_t *sport, uint16_t *dport, uint8_t *proto)
+{
+    const struct nlattr *tb[CTA_TUPLE_MAX + 1];
+    const struct nlattr *ip[CTA_IP_MAX + 1];
+    const struct nlattr *pr[CTA_PROTO_MAX + 1];
+
+    if(nest == NULL)
+        return 0;
+
+    parse_attrs(NLA_DATA(nest), NLA_PAYLOAD(nest), tb, CTA_TUPLE_MAX);
+    if(tb[CTA_TUPLE_IP] == NULL || tb[CTA_TUPLE_PROTO] == NULL)
+        return 0;
+
+    parse_attrs(NLA_DATA(tb[CTA_TUPLE_IP]), NLA_PAYLOAD(tb[CTA_TUPLE_IP]),
+            ip, CTA_IP_MAX);
+    if(! attr_u32(ip[CTA_IP_V4_SRC], src) || ! attr_u32(ip[CTA_IP_V4_DST], dst))
+        return 0;
+
+    parse_attrs(NLA_DATA(tb[CTA_TUPLE_PROTO]), NLA_PAYLOAD(tb[CTA_TUPLE_PROTO]),
+            pr, CTA_PROTO_MAX);
+    if(! attr_u8(pr[CTA_PROTO_NUM], proto))
+        return 0;
+
+    /* Ports are only there for protocols that have them
+    */
+    if(attr_u16(pr[CTA_PROTO_SRC_PORT], sport))
+        *sport = ntohs(*sport);
+    if(attr_u16(pr[CTA_PROTO_DST_PORT], dport))
+        *dport = ntohs(*dport);
+
+    return 1;
+}
+
+/* Fill an entry from a ctnetlink message.  Returns 0 for messages that do
+ * not describe an IPv4 conntrack entry.
+*/
+static int
+parse_ct_msg(const struct nlmsghdr *nlh, conntrack_nl_entry_t *entry)
+{
+    const struct nfgenmsg *nfg = NLMSG_DATA(nlh);
+    const struct nlattr   *tb[CTA_MAX + 1];
+    const struct nlattr   *pinfo[CTA_PROTOINFO_MAX + 1];
+    const struct nlattr   *tcp[CTA_PROTOINFO_TCP_MAX + 1];
+    uint8_t                reply_proto = 0, tcp_state = 0;
+    int                    len;
+
+    len = (int)nlh->nlmsg_len - NLMSG_SPACE(sizeof(struct nfgenmsg));
+    if(len < 0 || nfg->nfgen_family != AF_INET)
+        return 0;
+
+    memset(entry, 0x0, sizeof(conntrack_nl_entry_t));
+
+    switch(NFNL_MSG_TYPE(nlh->nlmsg_type))
+    {
+        case IPCTNL_MSG_CT_NEW:
+            if(nlh->nlmsg_flags & (NLM_F_CREATE|NLM_F_EXCL))
+                entry->event = CONNTRACK_NL_EVENT_NEW;
+            else
+                entry->event = CONNTRACK_NL_EVENT_UPDATE;
+            break;
+        case IPCTNL_MSG_CT_DELETE:
+            entry->event = CONNTRACK_NL_EVENT_DESTROY;
+            break;
+        default:
+            return 0;
+    }
+
+    parse_attrs((const char *)NLMSG_DATA(nlh) + NLMSG_ALIGN(sizeof(struct nfgenmsg)),
+            len, tb, CTA_MAX);
+
+    if(! parse_tuple(tb[CTA_TUPLE_ORIG], &entry->orig_src, &entry->orig_dst,
+                &entry->orig_sport, &entry->orig_dport, &entry->proto))
+        return 0;
+
+    if(! parse_tuple(tb[CTA_TUPLE_REPLY], &entry->reply_src, &entry->reply_dst,
+                &entry->reply_sport, &entry->reply_dport, &reply_proto))
+        return 0;
+
+    if(attr_u32(tb[CTA_MARK], &entry->mark))
+        entry->mark = ntohl(entry->mark);
+
+    if(tb[CTA_PROTOINFO] != NULL)
+    {
+        parse_attrs(NLA_DATA(tb[CTA_PROTOINFO]), NLA_PAYLOAD(tb[CTA_PROTOINFO]),
+                pinfo, CTA_PROTOINFO_MAX);
+        if(pinfo[CTA_PROTOINFO_TCP] != NULL)
+        {
+            parse_attrs(NLA_DATA(pinfo[CTA_PROTOINFO_TCP]),
+                    NLA_PAYLOAD(pinfo[CTA_PROTOINFO_TCP]),
+                    tcp, CTA_PROTOINFO_TCP_MAX);
+            if(attr_u8(tcp[CTA_PROTOINFO_TCP_STATE], &tcp_state)
+                    && tcp_state == TCP_CONNTRACK_TIME_WAIT)
+                entry->tcp_time_wait = 1;
+        }
+    }
+
+    return 1;
+}
+
+static struct nlmsghdr *
+req_init(conntrack_nl_t *nl, ct_req_buf_t *req, const uint16_t msg_type,
+        const uint16_t flags)
+{
+    struct nlmsghdr *nlh = &req->nlh;
+    struct nfgenmsg *nfg;
+
+    memset(req, 0x0, sizeof(ct_req_buf_t));
+
+    nlh->nlmsg_len   = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type  = (NFNL_SUBSYS_CTNETLINK << 8) | msg_type;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq   = ++nl->seq;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_INET;
+    nfg->version      = NFNETLINK_V0;
+    nfg->res_id       = 0;
+
+    return nlh;
+}
+
+static struct nlattr *
+req_put(struct nlmsghdr *nlh, const uint16_t type, const void *data,
+        const uint16_t len)
+{
+    struct nlattr  *attr = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    if(NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(NLA_HDRLEN + len) > CT_REQ_BUFSIZE)
+        return NULL;
+
+    attr->nla_type = type;
+    attr->nla_len  = NLA_HDRLEN + len;
+    if(len > 0)
+        memcpy((char *)attr + NLA_HDRLEN, data, len);
+
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(attr->nla_len);
+    return attr;
+}
+
+static void
+req_nest_end(struct nlmsghdr *nlh, struct nlattr *nest)
+{
+    nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+    return;
+}
+
+static int
+req_send(conntrack_nl_t *nl, struct nlmsghdr *nlh)
+{
+    struct sockaddr_nl  kernel;
+    ssize_t             res;
+
+    memset(&kernel, 0x0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    do {
+        res = sendto(nl->fd, nlh, nlh->nlmsg_len, 0,
+                (struct sockaddr *)&kernel, sizeof(kernel));
+    } while(res < 0 && errno == EINTR);
+
+    if(res != (ssize_t)nlh->nlmsg_len)
+    {
+        log_msg(LOG_ERR, "conntrack_nl: could not send request: %s", strerror(errno));
+        return CONNTRACK_NL_ERROR;
+    }
+    return CONNTRACK_NL_SUCCESS;
+}
+
+/* Read the replies to request 'seq' until the dump is done or the request
+ * is acknowledged.  Entries are passed to cb (if any); once cb asks to
+ * stop the rest of the dump is still read, just not handed out.
+*/
+static int
+recv_reply(conntrack_nl_t *nl, const uint32_t seq, conntrack_nl_cb cb, void *arg)
+{
+    const struct nlmsghdr  *nlh;
+    const struct nlmsgerr  *err;
+    conntrack_nl_entry_t    entry;
+    ssize_t                 n;
+    int                     len, rv = CONNTRACK_NL_SUCCESS;
+
+    while(1)
+    {
+        n = recv(nl->fd, nl->buf, CONNTRACK_NL_RECV_BUFSIZE, 0);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            log_msg(LOG_ERR, "conntrack_nl: recv() failed: %s", strerror(errno));
+            return CONNTRACK_NL_ERROR;
+        }
+
+        len = (int)n;
+        for(nlh = (const struct nlmsghdr *)nl->buf; NLMSG_OK(nlh, len);
+                nlh = NLMSG_NEXT(nlh, len))
+        {
+            if(nlh->nlmsg_seq != seq)
+                continue;
+
+            if(nlh->nlmsg_type == NLMSG_DONE)
+                return rv;
+
+            if(nlh->nlmsg_type == NLMSG_ERROR)
+            {
+                err = NLMSG_DATA(nlh);
+                if(err->error == 0)
+                    return rv;
+                errno = -err->error;
+                return CONNTRACK_NL_ERROR;
+            }
+
+            if(cb != NULL && rv == CONNTRACK_NL_SUCCESS
+                    && parse_ct_msg(nlh, &entry))
+            {
+                entry.event = CONNTRACK_NL_EVENT_NONE;
+                if(cb(&entry, arg) != 0)
+                    rv = CONNTRACK_NL_STOPPED;
+            }
+
+            if(! (nlh->nlmsg_flags & NLM_F_MULTI))
+                return rv;
+        }
+    }
+}
+
+/**
+ * Open a ctnetlink socket.  With event_groups set (CONNTRACK_NL_GROUP_*)
+ * the socket is non-blocking and receives conntrack events, otherwise it
+ * is used for dumps and deletes.  Returns NULL if ctnetlink is not
+ * available.
+ */
+conntrack_nl_t *
+conntrack_nl_open(const unsigned int event_groups)
+{
+    conntrack_nl_t     *nl = NULL;
+    struct sockaddr_nl  local;
+    socklen_t           addr_len = sizeof(local);
+    int                 rcvbuf = CONNTRACK_NL_EVENT_RCVBUF;
+
+    if((nl = calloc(1, sizeof(conntrack_nl_t))) == NULL
+            || (nl->buf = malloc(CONNTRACK_NL_RECV_BUFSIZE)) == NULL)
+    {
+        log_msg(LOG_ERR, "conntrack_nl_open: memory allocation error");
+        free(nl);
+        return NULL;
+    }
+
+    nl->fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_NETFILTER);
+    if(nl->fd < 0)
+    {
+        log_msg(LOG_WARNING, "conntrack_nl_open: could not open netlink socket: %s",
+            strerror(errno));
+        goto err;
+    }
+
+    /* Don't leak the socket into the commands we run
+    */
+    fcntl(nl->fd, F_SETFD, FD_CLOEXEC);
+
+    memset(&local, 0x0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+
+    if(event_groups)
+    {
+        if(event_groups & CONNTRACK_NL_GROUP_NEW)
+            local.nl_groups |= NF_NETLINK_CONNTRACK_NEW;
+        if(event_groups & CONNTRACK_NL_GROUP_UPDATE)
+            local.nl_groups |= NF_NETLINK_CONNTRACK_UPDATE;
+        if(event_groups & CONNTRACK_NL_GROUP_DESTROY)
+            local.nl_groups |= NF_NETLINK_CONNTRACK_DESTROY;
+
+        /* SO_RCVBUFFORCE lets root go beyond rmem_max
+        */
+        if(setsockopt(nl->fd, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)) != 0)
+            setsockopt(nl->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+        fcntl(nl->fd, F_SETFL, fcntl(nl->fd, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    if(bind(nl->fd, (struct sockaddr *)&local, sizeof(local)) != 0
+            || getsockname(nl->fd, (struct sockaddr *)&local, &addr_len) != 0)
+    {
+        log_msg(LOG_WARNING, "conntrack_nl_open: could not bind netlink socket: %s",
+            strerror(errno));
+        goto err;
+    }
+
+    nl->portid = local.nl_pid;
+    nl->groups = event_groups;
+    nl->seq    = (uint32_t)time(NULL);
+
+    return nl;
+
+err:
+    conntrack_nl_close(nl);
+    return NULL;
+}
+
+void
+conntrack_nl_close(conntrack_nl_t *nl)
+{
+    if(nl == NULL)
+        return;
+
+    if(nl->fd >= 0)
+        close(nl->fd);
+    free(nl->buf);
+    free(nl);
+    return;
+}
+
+/**
+ * Dump the IPv4 conntrack table, calling cb for every entry.  A nonzero
+ * mark asks the kernel to only return entries with exactly that mark.
+ */
+int
+conntrack_nl_dump(conntrack_nl_t *nl, const uint32_t mark,
+        conntrack_nl_cb cb, void *arg)
+{
+    ct_req_buf_t        req;
+    struct nlmsghdr    *nlh;
+    uint32_t            val;
+
+    if(nl == NULL || nl->groups != 0)
+        return CONNTRACK_NL_ERROR;
+
+    nlh = req_init(nl, &req, IPCTNL_MSG_CT_GET, NLM_F_DUMP);
+
+    if(mark != 0)
+    {
+        val = htonl(mark);
+        req_put(nlh, CTA_MARK, &val, sizeof(val));
+        val = htonl(0xffffffff);
+        req_put(nlh, CTA_MARK_MASK, &val, sizeof(val));
+    }
+
+    if(req_send(nl, nlh) != CONNTRACK_NL_SUCCESS)
+        return CONNTRACK_NL_ERROR;
+
+    return recv_reply(nl, nlh->nlmsg_seq, cb, arg);
+}
+
+/**
+ * Delete the conntrack entry with the original tuple of 'entry'.  An entry
+ * that is already gone is not an error.
+ */
+int
+conntrack_nl_delete(conntrack_nl_t *nl, const conntrack_nl_entry_t *entry)
+{
+    ct_req_buf_t        req;
+    struct nlmsghdr    *nlh;
+    struct nlattr      *tuple, *nest;
+    uint16_t            port;
+    int                 rv;
+
+    if(nl == NULL || entry == NULL || nl->groups != 0)
+        return CONNTRACK_NL_ERROR;
+
+    nlh = req_init(nl, &req, IPCTNL_MSG_CT_DELETE, NLM_F_ACK);
+
+    tuple = req_put(nlh, CTA_TUPLE_ORIG | NLA_F_NESTED, NULL, 0);
+
+    nest = req_put(nlh, CTA_TUPLE_IP | NLA_F_NESTED, NULL, 0);
+    req_put(nlh, CTA_IP_V4_SRC, &entry->orig_src, sizeof(entry->orig_src));
+    req_put(nlh, CTA_IP_V4_DST, &entry->orig_dst, sizeof(entry->orig_dst));
+    req_nest_end(nlh, nest);
+
+    nest = req_put(nlh, CTA_TUPLE_PROTO | NLA_F_NESTED, NULL, 0);
+    req_put(nlh, CTA_PROTO_NUM, &entry->proto, sizeof(entry->proto));
+    port = htons(entry->orig_sport);
+    req_put(nlh, CTA_PROTO_SRC_PORT, &port, sizeof(port));
+    port = htons(entry->orig_dport);
+    req_put(nlh, CTA_PROTO_DST_PORT, &port, sizeof(port));
+    req_nest_end(nlh, nest);
+
+    req_nest_end(nlh, tuple);
+
+    if(req_send(nl, nlh) != CONNTRACK_NL_SUCCESS)
+        return CONNTRACK_NL_ERROR;
+
+    rv = recv_reply(nl, nlh->nlmsg_seq, NULL, NULL);
+    if(rv == CONNTRACK_NL_ERROR && errno == ENOENT)
+        rv = CONNTRACK_NL_SUCCESS;
+
+    return rv;
+}
+
+/**
+ * Hand every event queued on an event socket to cb, without blocking.
+ * Returns CONNTRACK_NL_OVERRUN if the kernel had to drop events, in which
+ * case the caller has to rebuild its view of the table from a dump.
+ */
+int
+conntrack_nl_read_events(conntrack_nl_t *nl, conntrack_nl_cb cb, void *arg)
+{
+    const struct nlmsghdr  *nlh;
+    conntrack_nl_entry_t    entry;
+    ssize_t                 n;
+    int                     len;
+
+    if(nl == NULL || nl->groups == 0)
+        return CONNTRACK_NL_ERROR;
+
+    while(1)
+    {
+        n = recv(nl->fd, nl->buf, CONNTRACK_NL_RECV_BUFSIZE, MSG_DONTWAIT);
+        if(n < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONNTRACK_NL_SUCCESS;
+            if(errno == ENOBUFS)
+                return CONNTRACK_NL_OVERRUN;
+            log_msg(LOG_ERR, "conntrack_nl: recv() failed: %s", strerror(errno));
+            return CONNTRACK_NL_ERROR;
+        }
+
+        len = (int)n;
+        for(nlh = (const struct nlmsghdr *)nl->buf; NLMSG_OK(nlh, len);
+                nlh = NLMSG_NEXT(nlh, len))
+        {
+            if(parse_ct_msg(nlh, &entry) && cb(&entry, arg) != 0)
+                return CONNTRACK_NL_STOPPED;
+        }
+    }
+}
+
+#else /* !HAVE_CONNTRACK_NETLINK */
+
+conntrack_nl_t *
+conntrack_nl_open(const unsigned int event_groups)
+{
+    log_msg(LOG_WARNING,
+        "conntrack_nl_open: fwknopd was built without netlink conntrack support");
+    return NULL;
+}
+
+void
+conntrack_nl_close(conntrack_nl_t *nl)
+{
+    return;
+}
+
+int
+conntrack_nl_dump(conntrack_nl_t *nl, const uint32_t mark,
+        conntrack_nl_cb cb, void *arg)
+{
+    return CONNTRACK_NL_ERROR;
+}
+
+int
+conntrack_nl_delete(conntrack_nl_t *nl, const conntrack_nl_entry_t *entry)
+{
+    return CONNTRACK_NL_ERROR;
+}
+
+int
+conntrack_nl_read_events(conntrack_nl_t *nl, conntrack_nl_cb cb, void *arg)
+{
+    return CONNTRACK_NL_ERROR;
+}
+
+#endif /* HAVE_CONNTRACK_NETLINK */
+
+/***EOF***/
@@ -0,0 +1,115 @@
+/*
+ *****************************************************************************
+ *
+ * File:    conntrack_nl.h
+ *
+ * Purpose: Header file for fwknopd conntrack_nl.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef CONNTRACK_NL_H
+#define CONNTRACK_NL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if HAVE_LINUX_NETLINK_H && HAVE_LINUX_NETFILTER_NFNETLINK_H \
+        && HAVE_LINUX_NETFILTER_NFNETLINK_CONNTRACK_H
+  #define HAVE_CONNTRACK_NETLINK 1
+#endif
+
+/* Return codes
+*/
+#define CONNTRACK_NL_SUCCESS     0
+#define CONNTRACK_NL_ERROR      -1
+#define CONNTRACK_NL_OVERRUN    -2  /* events were lost, resync with a dump */
+#define CONNTRACK_NL_STOPPED    -3  /* a callback asked to stop */
+
+/* What happened to a conntrack entry (events only, dumps report
+ * CONNTRACK_NL_EVENT_NONE)
+*/
+enum {
+    CONNTRACK_NL_EVENT_NONE = 0,
+    CONNTRACK_NL_EVENT_NEW,
+    CONNTRACK_NL_EVENT_UPDATE,
+    CONNTRACK_NL_EVENT_DESTROY
+};
+
+/* Event groups for conntrack_nl_open(), 0 opens a socket for dumps and
+ * deletes only
+*/
+#define CONNTRACK_NL_GROUP_NEW      0x01
+#define CONNTRACK_NL_GROUP_UPDATE   0x02
+#define CONNTRACK_NL_GROUP_DESTROY  0x04
+
+#define CONNTRACK_NL_RECV_BUFSIZE   (64 * 1024)
+
+/* Event sockets ask the kernel for a receive buffer this large so that a
+ * burst of new flows between two reads does not overrun it.
+*/
+#define CONNTRACK_NL_EVENT_RCVBUF   (4 * 1024 * 1024)
+
+/* One IPv4 conntrack entry.  Addresses are in network byte order (like
+ * spa_pkt_info_t), ports in host byte order.
+*/
+typedef struct conntrack_nl_entry
+{
+    int             event;
+    uint8_t         proto;
+    uint8_t         tcp_time_wait;  /* TCP connection is in TIME_WAIT */
+    uint32_t        mark;
+    uint32_t        orig_src;
+    uint32_t        orig_dst;
+    uint16_t        orig_sport;
+    uint16_t        orig_dport;
+    uint32_t        reply_src;
+    uint32_t        reply_dst;
+    uint16_t        reply_sport;
+    uint16_t        reply_dport;
+} conntrack_nl_entry_t;
+
+/* Called for every entry in a dump or event batch.  A nonzero return
+ * stops the walk and is reported as CONNTRACK_NL_STOPPED.
+*/
+typedef int (*conntrack_nl_cb)(const conntrack_nl_entry_t *entry, void *arg);
+
+typedef struct conntrack_nl
+{
+    int             fd;
+    uint32_t        seq;
+    uint32_t        portid;
+    unsigned int    groups;
+    char           *buf;
+} conntrack_nl_t;
+
+/* Prototypes
+*/
+conntrack_nl_t *conntrack_nl_open(const unsigned int event_groups);
+void  conntrack_nl_close(conntrack_nl_t *nl);
+int   conntrack_nl_dump(conntrack_nl_t *nl, const uint32_t mark,
+        conntrack_nl_cb cb, void *arg);
+int   conntrack_nl_delete(conntrack_nl_t *nl, const conntrack_nl_entry_t *entry);
+int   conntrack_nl_read_events(conntrack_nl_t *nl, conntrack_nl_cb cb, void *arg);
+
+#endif  /* CONNTRACK_NL_H */
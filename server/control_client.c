@@ -15,6 +15,14 @@
 #include "connection_tracker.h"
 #include "sdp_ctrl_client.h"
 #include "control_client.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+
+// How long stop_control_client_thread() waits for the thread to exit on
+// its own before cancelling it, and how often it checks
+#define CTRL_CLIENT_STOP_WAIT_MS 2000
+#define CTRL_CLIENT_STOP_POLL_MS 10
 
 static int process_data_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 {
@@ -109,6 +117,69 @@ static int handle_data_msg(fko_srv_options_t *opts, int action, json_object *jda
 }
 
 
+// Milliseconds until t, for a poll() timeout. A deadline that has
+// passed without its work getting done is retried a second later, as
+// the loops did when they slept a second at a time.
+static int ms_until(time_t t, time_t now)
+{
+    if(t <= now)
+        return 1000;
+
+    if(t - now > INT_MAX / 1000)
+        return INT_MAX;
+
+    return (int)(t - now) * 1000;
+}
+
+
+// Sleep until the controller sends something, conntrack reports a
+// change, a timer of the control client or the connection tracker is
+// due, or the wake pipe says it is time to stop (*stop_r)
+static int wait_for_ctrl_client_event(fko_srv_options_t *opts, int *stop_r)
+{
+    struct pollfd fds[2];
+    int num_fds = 0, max_wait_ms = -1, conntrack_fd = -1;
+    time_t next = 0, now = time(NULL);
+    char buf[16];
+
+    *stop_r = 0;
+
+    fds[num_fds].fd = opts->ctrl_client_wake_fd[0];
+    fds[num_fds].events = POLLIN;
+    num_fds++;
+
+    // connections are only updated once the controller is ready
+    if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0
+       && sdp_ctrl_client_controller_status(opts->ctrl_client))
+    {
+        next_connection_tracker_event(now, &next, &conntrack_fd);
+
+        if(conntrack_fd >= 0)
+        {
+            fds[num_fds].fd = conntrack_fd;
+            fds[num_fds].events = POLLIN;
+            num_fds++;
+        }
+
+        if(next > 0)
+            max_wait_ms = ms_until(next, now);
+    }
+
+    if(sdp_ctrl_client_wait(opts->ctrl_client, SDP_CTRL_CLIENT_TIMER_ALL,
+                max_wait_ms, fds, num_fds) != SDP_SUCCESS)
+        return FWKNOPD_ERROR_CTRL_COM;
+
+    if(fds[0].revents)
+    {
+        while(read(opts->ctrl_client_wake_fd[0], buf, sizeof(buf)) > 0)
+            ;
+        *stop_r = 1;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+
 int get_management_data_from_controller(fko_srv_options_t *opts)
 {
     int rv = FWKNOPD_SUCCESS;
@@ -180,20 +251,20 @@ int get_management_data_from_controller(fko_srv_options_t *opts)
         action = INVALID_CTRL_ACTION;
 
         // do not begin sending requests until controller is ready
-        if( !(sdp_ctrl_client_controller_status(opts->ctrl_client)) )
-            continue;
-
-        // if new connection or just time, update credentials
-        if((rv = sdp_ctrl_client_consider_cred_update(opts->ctrl_client)) != SDP_SUCCESS)
-            break;
+        if(sdp_ctrl_client_controller_status(opts->ctrl_client))
+        {
+            // if new connection or just time, update credentials
+            if((rv = sdp_ctrl_client_consider_cred_update(opts->ctrl_client)) != SDP_SUCCESS)
+                break;
 
-        // if built for remote gateway, handle service updates
-        if((rv = sdp_ctrl_client_consider_service_refresh(opts->ctrl_client)) != SDP_SUCCESS)
-            break;
+            // if built for remote gateway, handle service updates
+            if((rv = sdp_ctrl_client_consider_service_refresh(opts->ctrl_client)) != SDP_SUCCESS)
+                break;
 
-        // if built for remote gateway, handle access updates
-        if((rv = sdp_ctrl_client_consider_access_refresh(opts->ctrl_client)) != SDP_SUCCESS)
-            break;
+            // if built for remote gateway, handle access updates
+            if((rv = sdp_ctrl_client_consider_access_refresh(opts->ctrl_client)) != SDP_SUCCESS)
+                break;
+        }
 
         // watch the time
         if( (time(NULL) > stop_time) )
@@ -203,7 +274,12 @@ int get_management_data_from_controller(fko_srv_options_t *opts)
             return FWKNOPD_ERROR_CTRL_COM;
         }
 
-        sleep(1);
+        // sleep until the controller sends something or a request is due
+        if((rv = sdp_ctrl_client_wait(opts->ctrl_client,
+                SDP_CTRL_CLIENT_TIMER_CRED_UPDATE | SDP_CTRL_CLIENT_TIMER_SERVICE_REFRESH
+                    | SDP_CTRL_CLIENT_TIMER_ACCESS_REFRESH,
+                ms_until(stop_time + 1, time(NULL)), NULL, 0)) != SDP_SUCCESS)
+            break;
     }
 
     return rv;
@@ -211,13 +287,13 @@ int get_management_data_from_controller(fko_srv_options_t *opts)
 
 
 
-void *control_client_thread_func(void *arg)
+static void run_control_client(fko_srv_options_t *opts)
 {
     int rv = FWKNOPD_SUCCESS;
     int action = INVALID_CTRL_ACTION;
     int send_open_conn_report = 0;
+    int stop = 0;
     json_object *jdata = NULL;
-    fko_srv_options_t *opts = (fko_srv_options_t*)arg;
 
     if(opts == NULL ||
        opts->ctrl_client == NULL ||
@@ -228,7 +304,7 @@ void *control_client_thread_func(void *arg)
 
         // send kill signal for main thread to catch and exit safely
         kill(getpid(), SIGTERM);
-        return NULL;
+        return;
     }
 
     // If connection tracking is enabled, initialize it
@@ -241,7 +317,7 @@ void *control_client_thread_func(void *arg)
 			);
 			// send kill signal for main thread to catch and exit safely
 			kill(getpid(), SIGTERM);
-			return NULL;
+			return;
 		}
     }
 
@@ -289,55 +365,143 @@ void *control_client_thread_func(void *arg)
         }
 
         // do not begin sending requests until controller is ready
-        if( !(sdp_ctrl_client_controller_status(opts->ctrl_client)) )
-            continue;
-
-        // after any loss of connection, the controller marks all of the
-        // gateway's connections as closed, so we need to resend just
-        // the open connections if there are any as soon as possible
-        if(send_open_conn_report)
+        if(sdp_ctrl_client_controller_status(opts->ctrl_client))
         {
-            send_open_conn_report = 0;
-
-            if((rv = report_open_connections(opts)) != FWKNOPD_SUCCESS)
+            // after any loss of connection, the controller marks all of the
+            // gateway's connections as closed, so we need to resend just
+            // the open connections if there are any as soon as possible
+            if(send_open_conn_report)
             {
-                break;
-            }
-        }
+                send_open_conn_report = 0;
 
-        // if new connection or just time, update credentials
-        if((rv = sdp_ctrl_client_consider_cred_update(opts->ctrl_client)) != SDP_SUCCESS)
-            break;
-
-        // if built for remote gateway, handle service updates
-        if((rv = sdp_ctrl_client_consider_service_refresh(opts->ctrl_client)) != SDP_SUCCESS)
-            break;
+                if((rv = report_open_connections(opts)) != FWKNOPD_SUCCESS)
+                {
+                    break;
+                }
+            }
 
-        // if built for remote gateway, handle access updates
-        if((rv = sdp_ctrl_client_consider_access_refresh(opts->ctrl_client)) != SDP_SUCCESS)
-            break;
+            // if new connection or just time, update credentials
+            if((rv = sdp_ctrl_client_consider_cred_update(opts->ctrl_client)) != SDP_SUCCESS)
+                break;
 
-        // is a keep alive due
-        if((rv = sdp_ctrl_client_consider_keep_alive(opts->ctrl_client)) != SDP_SUCCESS)
-            break;
+            // if built for remote gateway, handle service updates
+            if((rv = sdp_ctrl_client_consider_service_refresh(opts->ctrl_client)) != SDP_SUCCESS)
+                break;
 
-        // If connection tracking is enabled
-        if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0)
-        {
-            if((rv = update_connections(opts)) != FWKNOPD_SUCCESS)
+            // if built for remote gateway, handle access updates
+            if((rv = sdp_ctrl_client_consider_access_refresh(opts->ctrl_client)) != SDP_SUCCESS)
                 break;
 
-            if((rv = consider_reporting_connections(opts)) != FWKNOPD_SUCCESS)
+            // is a keep alive due
+            if((rv = sdp_ctrl_client_consider_keep_alive(opts->ctrl_client)) != SDP_SUCCESS)
                 break;
+
+            // If connection tracking is enabled
+            if(strncmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1) == 0)
+            {
+                if((rv = update_connections(opts)) != FWKNOPD_SUCCESS)
+                    break;
+
+                if((rv = consider_reporting_connections(opts)) != FWKNOPD_SUCCESS)
+                    break;
+            }
         }
 
-        sleep(1);
+        // sleep until there is something to do
+        if((rv = wait_for_ctrl_client_event(opts, &stop)) != FWKNOPD_SUCCESS)
+            break;
+
+        if(stop)
+        {
+            log_msg(LOG_INFO, "SDP Control Client thread stopping.");
+            return;
+        }
     }
 
     // send kill signal for main thread to catch and exit safely
     kill(getpid(), SIGTERM);
+}
+
+
+void *control_client_thread_func(void *arg)
+{
+    fko_srv_options_t *opts = (fko_srv_options_t*)arg;
+
+    run_control_client(opts);
+
+    // let stop_control_client_thread() know it can join without cancelling
+    if(opts != NULL)
+        __atomic_store_n(&opts->ctrl_client_done, 1, __ATOMIC_RELEASE);
 
     return NULL;
 }
 
 
+// Start the control client thread, with the pipe that lets
+// stop_control_client_thread() wake it
+int start_control_client_thread(fko_srv_options_t *opts)
+{
+    int i;
+
+    if(pipe(opts->ctrl_client_wake_fd) != 0)
+    {
+        log_msg(LOG_ERR, "Failed to create SDP Control Client wake pipe: %s",
+                strerror(errno));
+        return FWKNOPD_ERROR_CTRL_COM;
+    }
+
+    for(i = 0; i < 2; i++)
+    {
+        fcntl(opts->ctrl_client_wake_fd[i], F_SETFL,
+                fcntl(opts->ctrl_client_wake_fd[i], F_GETFL) | O_NONBLOCK);
+        fcntl(opts->ctrl_client_wake_fd[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    opts->ctrl_client_done = 0;
+
+    if(pthread_create(&(opts->ctrl_client_thread), NULL, control_client_thread_func, (void*)opts))
+    {
+        close(opts->ctrl_client_wake_fd[0]);
+        close(opts->ctrl_client_wake_fd[1]);
+        opts->ctrl_client_thread = 0;
+        return FWKNOPD_ERROR_CTRL_COM;
+    }
+
+    return FWKNOPD_SUCCESS;
+}
+
+
+// Wake the control client thread so it returns from its wait, and join it.
+// It is only cancelled if it has not exited within CTRL_CLIENT_STOP_WAIT_MS,
+// e.g. because it is busy connecting to the controller
+void stop_control_client_thread(fko_srv_options_t *opts)
+{
+    struct timespec poll_wait = {0, CTRL_CLIENT_STOP_POLL_MS * 1000000L};
+    int waited_ms = 0;
+
+    if(opts->ctrl_client_thread <= 0)
+        return;
+
+    if(write(opts->ctrl_client_wake_fd[1], "x", 1) != 1)
+        log_msg(LOG_WARNING, "Failed to wake SDP Control Client thread");
+
+    while(! __atomic_load_n(&opts->ctrl_client_done, __ATOMIC_ACQUIRE)
+          && waited_ms < CTRL_CLIENT_STOP_WAIT_MS)
+    {
+        nanosleep(&poll_wait, NULL);
+        waited_ms += CTRL_CLIENT_STOP_POLL_MS;
+    }
+
+    if(! __atomic_load_n(&opts->ctrl_client_done, __ATOMIC_ACQUIRE))
+    {
+        log_msg(LOG_WARNING, "SDP Control Client thread did not stop within "
+                "%d ms, cancelling it", CTRL_CLIENT_STOP_WAIT_MS);
+        pthread_cancel(opts->ctrl_client_thread);
+    }
+
+    pthread_join(opts->ctrl_client_thread, NULL);
+    opts->ctrl_client_thread = 0;
+
+    close(opts->ctrl_client_wake_fd[0]);
+    close(opts->ctrl_client_wake_fd[1]);
+}
@@ -10,5 +10,7 @@
 
 int get_management_data_from_controller(fko_srv_options_t *opts);
 void *control_client_thread_func(void *arg);
+int start_control_client_thread(fko_srv_options_t *opts);
+void stop_control_client_thread(fko_srv_options_t *opts);
 
 #endif /* SERVER_CONTROL_CLIENT_H_ */
@@ -0,0 +1,517 @@
+/*
+ *****************************************************************************
+ *
+ * File:    digest_file.c
+ *
+ * Purpose: Binary on-disk format for the file based digest cache.  The file
+ *          is a small header followed by fixed size records holding the raw
+ *          digest bytes, so it can be mapped at startup and the records used
+ *          in place instead of parsing and allocating every entry.  Digest
+ *          files in the older one-line-per-digest text format are converted
+ *          the first time they are loaded.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "digest_file.h"
+#include "log_msg.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#if HAVE_SYS_SOCKET_H
+  #include <sys/socket.h>
+#endif
+#include <arpa/inet.h>
+
+static void
+init_hdr(digest_file_hdr_t *hdr)
+{
+    memset(hdr, 0x0, sizeof(digest_file_hdr_t));
+    memcpy(hdr->magic, DIGEST_FILE_MAGIC, sizeof(hdr->magic));
+    hdr->version    = DIGEST_FILE_VERSION;
+    hdr->rec_size   = sizeof(digest_file_rec_t);
+    hdr->byte_order = DIGEST_FILE_BYTE_ORDER;
+    return;
+}
+
+static int
+b64_char_val(const char c)
+{
+    if(c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if(c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if(c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if(c == '+')
+        return 62;
+    if(c == '/')
+        return 63;
+    return -1;
+}
+
+/**
+ * Decode a base64 digest (as produced by libfko, with or without the
+ * trailing '=' padding) into raw bytes.  Returns the number of bytes
+ * written to 'raw', or -1 if the digest is invalid or does not fit.
+ */
+int
+digest_file_decode_digest(const char *digest, unsigned char *raw,
+        const int raw_size)
+{
+    unsigned int    acc = 0;
+    int             bits = 0, len = 0, val;
+
+    if(digest == NULL || raw == NULL)
+        return -1;
+
+    for(; *digest != '\0' && *digest != '='; digest++)
+    {
+        if((val = b64_char_val(*digest)) < 0)
+            return -1;
+
+        acc   = (acc << 6) | val;
+        bits += 6;
+
+        if(bits >= 8)
+        {
+            bits -= 8;
+            if(len >= raw_size)
+                return -1;
+            raw[len++] = (acc >> bits) & 0xff;
+        }
+    }
+
+    /* Only padding may follow.  A lone trailing character, or leftover
+     * bits that are not zero, mean the digest is not canonical base64 (and
+     * two different strings could decode to the same bytes).
+    */
+    for(; *digest == '='; digest++)
+        ;
+    if(*digest != '\0' || bits >= 6 || (acc & ((1U << bits) - 1)) != 0
+            || len == 0)
+        return -1;
+
+    return len;
+}
+
+/**
+ * Returns 1 if 'path' starts with a digest file header, 0 if it does not
+ * (a legacy text file or an empty file) and -1 if it cannot be read.
+ */
+int
+digest_file_is_binary(const char *path)
+{
+    char    magic[sizeof(DIGEST_FILE_MAGIC)];
+    ssize_t res;
+    int     fd;
+
+    if((fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    res = read(fd, magic, sizeof(magic));
+    close(fd);
+
+    if(res < 0)
+        return -1;
+
+    return (res == sizeof(magic)
+            && memcmp(magic, DIGEST_FILE_MAGIC, sizeof(magic)) == 0);
+}
+
+/**
+ * Create a new digest file that contains only the header.  Fails if the
+ * file already exists.
+ */
+int
+digest_file_create(const char *path)
+{
+    digest_file_hdr_t   hdr;
+    int                 fd, res = 0;
+
+    fd = open(path, O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+    if(fd < 0)
+    {
+        log_msg(LOG_WARNING, "Could not create digest cache: %s: %s",
+            path, strerror(errno));
+        return -1;
+    }
+
+    init_hdr(&hdr);
+    if(write(fd, &hdr, sizeof(hdr)) != sizeof(hdr))
+    {
+        log_msg(LOG_WARNING,
+            "Did not write expected number of bytes to digest cache: %s", path);
+        res = -1;
+    }
+    close(fd);
+
+    return res;
+}
+
+/**
+ * Map a digest file read-only after validating its header.  A partially
+ * written record at the end of the file (from a crash in the middle of an
+ * append) is truncated so that later appends stay aligned.
+ */
+int
+digest_file_map(const char *path, digest_file_map_t *map)
+{
+    digest_file_hdr_t   hdr, want;
+    struct stat         st;
+    size_t              data_len;
+    int                 fd;
+
+    memset(map, 0x0, sizeof(digest_file_map_t));
+
+    if((fd = open(path, O_RDWR)) < 0)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s: %s",
+            path, strerror(errno));
+        return -1;
+    }
+
+    init_hdr(&want);
+    if(read(fd, &hdr, sizeof(hdr)) != sizeof(hdr)
+            || memcmp(hdr.magic, want.magic, sizeof(hdr.magic)) != 0
+            || hdr.version != want.version
+            || hdr.rec_size != want.rec_size
+            || hdr.byte_order != want.byte_order)
+    {
+        log_msg(LOG_WARNING,
+            "Digest cache %s has an unsupported format (version %u)",
+            path, hdr.version);
+        close(fd);
+        return -1;
+    }
+
+    if(fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    data_len = st.st_size - sizeof(hdr);
+    if(data_len % sizeof(digest_file_rec_t) != 0)
+    {
+        log_msg(LOG_WARNING,
+            "Discarding partial record at the end of digest cache %s", path);
+        data_len -= data_len % sizeof(digest_file_rec_t);
+        if(ftruncate(fd, sizeof(hdr) + data_len) != 0)
+        {
+            log_msg(LOG_WARNING, "Could not truncate digest cache %s: %s",
+                path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+    }
+
+    if(data_len == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    map->len  = sizeof(hdr) + data_len;
+    map->addr = mmap(NULL, map->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if(map->addr == MAP_FAILED)
+    {
+        log_msg(LOG_WARNING, "Could not map digest cache %s: %s",
+            path, strerror(errno));
+        memset(map, 0x0, sizeof(digest_file_map_t));
+        return -1;
+    }
+
+    map->recs     = (const digest_file_rec_t *)((char *)map->addr + sizeof(hdr));
+    map->num_recs = data_len / sizeof(digest_file_rec_t);
+
+    return 0;
+}
+
+void
+digest_file_unmap(digest_file_map_t *map)
+{
+    if(map->addr != NULL)
+        munmap(map->addr, map->len);
+    memset(map, 0x0, sizeof(digest_file_map_t));
+    return;
+}
+
+int
+digest_file_writer_open(digest_file_writer_t *writer, const char *path)
+{
+    digest_file_hdr_t   hdr;
+    int                 fd;
+
+    memset(writer, 0x0, sizeof(digest_file_writer_t));
+    writer->path = path;
+
+    if(snprintf(writer->tmp_path, sizeof(writer->tmp_path), "%s.tmp", path)
+            >= sizeof(writer->tmp_path))
+        return -1;
+
+    fd = open(writer->tmp_path, O_WRONLY|O_CREAT|O_TRUNC, S_IRUSR|S_IWUSR);
+    if(fd < 0 || (writer->fp = fdopen(fd, "w")) == NULL)
+    {
+        log_msg(LOG_WARNING, "Could not create digest cache: %s: %s",
+            writer->tmp_path, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    init_hdr(&hdr);
+    if(fwrite(&hdr, sizeof(hdr), 1, writer->fp) != 1)
+        writer->error = 1;
+
+    return 0;
+}
+
+int
+digest_file_writer_add(digest_file_writer_t *writer,
+        const digest_file_rec_t *rec)
+{
+    if(writer->error)
+        return -1;
+
+    if(fwrite(rec, sizeof(digest_file_rec_t), 1, writer->fp) != 1)
+    {
+        writer->error = 1;
+        return -1;
+    }
+    writer->num_recs++;
+    return 0;
+}
+
+/**
+ * Sync the new file and rename it over the original.  On any earlier write
+ * error the new file is removed and the original is left alone.
+ */
+int
+digest_file_writer_commit(digest_file_writer_t *writer)
+{
+    if(fflush(writer->fp) != 0 || fsync(fileno(writer->fp)) != 0)
+        writer->error = 1;
+    if(fclose(writer->fp) != 0)
+        writer->error = 1;
+    writer->fp = NULL;
+
+    if(! writer->error && rename(writer->tmp_path, writer->path) != 0)
+        writer->error = 1;
+
+    if(writer->error)
+    {
+        log_msg(LOG_WARNING, "Could not write digest cache %s: %s",
+            writer->path, strerror(errno));
+        unlink(writer->tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Convert a legacy text digest file (one
+ * "<digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>" line per
+ * digest) to the binary format in place.  Returns the number of converted
+ * digests or -1 on error, in which case the text file is left untouched.
+ */
+int
+digest_file_convert_text(const char *path)
+{
+    FILE                   *digest_file_ptr = NULL;
+    digest_file_writer_t    writer;
+    digest_file_rec_t       rec;
+    unsigned int            num_lines = 0;
+    char                    line_buf[MAX_LINE_LEN]    = {0};
+    char                    digest[MAX_LINE_LEN]      = {0};
+    char                    src_ip[INET_ADDRSTRLEN+1] = {0};
+    char                    dst_ip[INET_ADDRSTRLEN+1] = {0};
+    unsigned char           proto;
+    unsigned short          src_port, dst_port;
+    long int                time_tmp;
+    int                     digest_len;
+
+    if((digest_file_ptr = fopen(path, "r")) == NULL)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache: %s", path);
+        return -1;
+    }
+
+    if(digest_file_writer_open(&writer, path) != 0)
+    {
+        fclose(digest_file_ptr);
+        return -1;
+    }
+
+    while((fgets(line_buf, MAX_LINE_LEN, digest_file_ptr)) != NULL)
+    {
+        num_lines++;
+        line_buf[MAX_LINE_LEN-1] = '\0';
+
+        if(IS_EMPTY_LINE(line_buf[0]))
+            continue;
+
+        if(sscanf(line_buf, "%64s %hhu %16s %hu %16s %hu %ld",
+                    digest, &proto, src_ip, &src_port, dst_ip, &dst_port,
+                    &time_tmp) != 7)
+        {
+            log_msg(LOG_INFO,
+                "*Skipping invalid digest file entry in %s at line %i.\n - %s",
+                path, num_lines, line_buf
+            );
+            continue;
+        }
+
+        memset(&rec, 0x0, sizeof(rec));
+
+        digest_len = digest_file_decode_digest(digest, rec.digest,
+                sizeof(rec.digest));
+        if(digest_len < 0
+                || inet_pton(AF_INET, src_ip, &(rec.src_ip)) != 1
+                || inet_pton(AF_INET, dst_ip, &(rec.dst_ip)) != 1)
+        {
+            log_msg(LOG_INFO,
+                "*Skipping invalid digest file entry in %s at line %i.\n - %s",
+                path, num_lines, line_buf
+            );
+            continue;
+        }
+
+        rec.digest_len = digest_len;
+        rec.proto      = proto;
+        rec.src_port   = src_port;
+        rec.dst_port   = dst_port;
+        rec.created    = time_tmp;
+
+        digest_file_writer_add(&writer, &rec);
+    }
+
+    fclose(digest_file_ptr);
+
+    if(digest_file_writer_commit(&writer) != 0)
+        return -1;
+
+    log_msg(LOG_INFO, "Converted digest cache %s to binary format (%u entries)",
+        path, writer.num_recs);
+
+    return writer.num_recs;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_TEST_SUITE(digest_file, "Digest file test suite");
+
+DECLARE_UTEST(decode_digest, "decode base64 digests")
+{
+    unsigned char   raw[DIGEST_FILE_MAX_RAW];
+
+    /* SHA256 of the empty string, as libfko encodes it (no padding)
+    */
+    const char     *digest = "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU";
+    const unsigned char want[] = {
+        0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14,
+        0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+        0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c,
+        0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55
+    };
+
+    CU_ASSERT(digest_file_decode_digest(digest, raw, sizeof(raw)) == 32);
+    CU_ASSERT(memcmp(raw, want, sizeof(want)) == 0);
+
+    CU_ASSERT(digest_file_decode_digest(
+                "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU=", raw, sizeof(raw)) == 32);
+    CU_ASSERT(digest_file_decode_digest("QUJD", raw, sizeof(raw)) == 3);
+    CU_ASSERT(memcmp(raw, "ABC", 3) == 0);
+
+    CU_ASSERT(digest_file_decode_digest("QUJD*", raw, sizeof(raw)) == -1);
+    CU_ASSERT(digest_file_decode_digest("QUJDR", raw, sizeof(raw)) == -1);
+    CU_ASSERT(digest_file_decode_digest("QUJDRB", raw, sizeof(raw)) == -1);
+    CU_ASSERT(digest_file_decode_digest("QUJDRA", raw, sizeof(raw)) == 4);
+    CU_ASSERT(digest_file_decode_digest("", raw, sizeof(raw)) == -1);
+    CU_ASSERT(digest_file_decode_digest("QUJD", raw, 2) == -1);
+}
+
+DECLARE_UTEST(convert_map, "convert a text digest file and map it")
+{
+    char                path[] = "/tmp/fwknopd_digest_utest.XXXXXX";
+    digest_file_map_t   map;
+    FILE               *fp;
+    int                 fd;
+
+    fd = mkstemp(path);
+    CU_ASSERT(fd >= 0);
+    fp = fdopen(fd, "w");
+    CU_ASSERT(fp != NULL);
+    fprintf(fp, "# <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>\n");
+    fprintf(fp, "47DEQpj8HBSa+/TImW+5JCeuQeRkm5NMpJWZG3hSuFU 17 127.0.0.1 40305 127.0.0.2 62201 1313283481\n");
+    fprintf(fp, "not a digest line\n");
+    fprintf(fp, "QUJD 6 10.0.0.1 1 10.0.0.2 2 1313283482\n");
+    fclose(fp);
+
+    CU_ASSERT(digest_file_is_binary(path) == 0);
+    CU_ASSERT(digest_file_convert_text(path) == 2);
+    CU_ASSERT(digest_file_is_binary(path) == 1);
+
+    CU_ASSERT(digest_file_map(path, &map) == 0);
+    CU_ASSERT(map.num_recs == 2);
+    if(map.num_recs == 2)
+    {
+        CU_ASSERT(map.recs[0].digest_len == 32);
+        CU_ASSERT(map.recs[0].proto == 17);
+        CU_ASSERT(map.recs[0].src_ip == inet_addr("127.0.0.1"));
+        CU_ASSERT(map.recs[0].dst_port == 62201);
+        CU_ASSERT(map.recs[0].created == 1313283481);
+        CU_ASSERT(map.recs[1].digest_len == 3);
+        CU_ASSERT(map.recs[1].dst_ip == inet_addr("10.0.0.2"));
+    }
+    digest_file_unmap(&map);
+
+    /* A torn append is cut off at the last whole record
+    */
+    fd = open(path, O_WRONLY|O_APPEND);
+    CU_ASSERT(write(fd, "torn", 4) == 4);
+    close(fd);
+    CU_ASSERT(digest_file_map(path, &map) == 0);
+    CU_ASSERT(map.num_recs == 2);
+    digest_file_unmap(&map);
+
+    unlink(path);
+}
+
+int register_ts_digest_file(void)
+{
+    ts_init(&TEST_SUITE(digest_file), TEST_SUITE_DESCR(digest_file), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(digest_file), UTEST_FCT(decode_digest), UTEST_DESCR(decode_digest));
+    ts_add_utest(&TEST_SUITE(digest_file), UTEST_FCT(convert_map), UTEST_DESCR(convert_map));
+
+    return register_ts(&TEST_SUITE(digest_file));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
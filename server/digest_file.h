@@ -0,0 +1,112 @@
+/*
+ *****************************************************************************
+ *
+ * File:    digest_file.h
+ *
+ * Purpose: Header file for fwknopd digest_file.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef DIGEST_FILE_H
+#define DIGEST_FILE_H
+
+#include "common.h"
+#include <stdint.h>
+
+#define DIGEST_FILE_MAGIC       "FKODGST"   /* 8 bytes with the NUL */
+#define DIGEST_FILE_VERSION     1
+#define DIGEST_FILE_BYTE_ORDER  0x01020304
+
+/* Replay digests are SHA256 sums of the raw SPA data
+*/
+#define DIGEST_FILE_MAX_RAW     32
+
+/* The digest file is a header followed by fixed size records.  Both are
+ * stored in host byte order (the byte_order field catches files copied
+ * between different hosts), except for the IP addresses which are kept in
+ * network byte order just as they are in spa_pkt_info_t.
+*/
+typedef struct digest_file_hdr
+{
+    char            magic[8];
+    uint32_t        version;
+    uint32_t        rec_size;
+    uint32_t        byte_order;
+    uint32_t        reserved;
+} digest_file_hdr_t;
+
+typedef struct digest_file_rec
+{
+    int64_t         created;
+    uint32_t        src_ip;
+    uint32_t        dst_ip;
+    uint16_t        src_port;
+    uint16_t        dst_port;
+    uint8_t         proto;
+    uint8_t         digest_len;
+    uint8_t         reserved[2];
+    unsigned char   digest[DIGEST_FILE_MAX_RAW];
+} digest_file_rec_t;
+
+/* A read-only mapping of a digest file
+*/
+typedef struct digest_file_map
+{
+    void               *addr;
+    size_t              len;
+    const digest_file_rec_t *recs;
+    unsigned int        num_recs;
+} digest_file_map_t;
+
+/* Writes a new digest file next to 'path' and renames it into place on
+ * commit.
+*/
+typedef struct digest_file_writer
+{
+    FILE               *fp;
+    char                tmp_path[MAX_PATH_LEN];
+    const char         *path;
+    unsigned int        num_recs;
+    int                 error;
+} digest_file_writer_t;
+
+/* Prototypes
+*/
+int  digest_file_decode_digest(const char *digest, unsigned char *raw,
+        const int raw_size);
+int  digest_file_is_binary(const char *path);
+int  digest_file_create(const char *path);
+int  digest_file_map(const char *path, digest_file_map_t *map);
+void digest_file_unmap(digest_file_map_t *map);
+int  digest_file_writer_open(digest_file_writer_t *writer, const char *path);
+int  digest_file_writer_add(digest_file_writer_t *writer,
+        const digest_file_rec_t *rec);
+int  digest_file_writer_commit(digest_file_writer_t *writer);
+int  digest_file_convert_text(const char *path);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_digest_file(void);
+#endif
+
+#endif  /* DIGEST_FILE_H */
@@ -0,0 +1,458 @@
+/*
+ *****************************************************************************
+ *
+ * File:    digest_index.c
+ *
+ * Purpose: Open addressing index of SPA packet digests used by the file
+ *          based replay cache.  Lookups hash the incoming digest with a
+ *          per-process secret SipHash key, so the cost is independent of
+ *          the number of cached digests and an attacker cannot steer
+ *          digests into the same probe sequence.  Digests are only ever
+ *          compared (in constant time) against entries whose full 64-bit
+ *          hash matches.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "common.h"
+#include "digest_index.h"
+
+#include <fcntl.h>
+#include <sys/time.h>
+
+#ifndef RAND_FILE
+  #define RAND_FILE "/dev/urandom"
+#endif
+
+/* Grow the table once it is more than 70% full.
+*/
+#define DIGEST_INDEX_LOAD_NUM   7
+#define DIGEST_INDEX_LOAD_DEN   10
+
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND                                                    \
+    do {                                                            \
+        v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; v0 = ROTL64(v0, 32); \
+        v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2;                    \
+        v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0;                    \
+        v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; v2 = ROTL64(v2, 32); \
+    } while(0)
+
+/* SipHash-2-4 of the digest string under the index key.
+*/
+static uint64_t
+siphash24(const uint64_t k0, const uint64_t k1,
+        const unsigned char *in, const size_t len)
+{
+    uint64_t    v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t    v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t    v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t    v3 = 0x7465646279746573ULL ^ k1;
+    uint64_t    m, b = ((uint64_t)len) << 56;
+    size_t      i, left = len & 7;
+    const unsigned char *end = in + len - left;
+
+    for(; in != end; in += 8)
+    {
+        m = 0;
+        for(i=0; i < 8; i++)
+            m |= ((uint64_t)in[i]) << (8 * i);
+
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    for(i=0; i < left; i++)
+        b |= ((uint64_t)in[i]) << (8 * i);
+
+    v3 ^= b;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Seed the SipHash key from /dev/urandom, falling back to time and pid
+ * values if that is not possible.
+*/
+static void
+digest_index_seed(digest_index_t *idx)
+{
+    uint64_t        seed[2] = {0, 0};
+    struct timeval  tv;
+    int             fd;
+
+    if((fd = open(RAND_FILE, O_RDONLY)) >= 0)
+    {
+        if(read(fd, seed, sizeof(seed)) != sizeof(seed))
+            seed[0] = seed[1] = 0;
+        close(fd);
+    }
+
+    if(seed[0] == 0 && seed[1] == 0)
+    {
+        gettimeofday(&tv, NULL);
+        seed[0] = ((uint64_t)tv.tv_sec << 32) ^ (uint64_t)tv.tv_usec;
+        seed[1] = ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)idx;
+    }
+
+    idx->k0 = seed[0];
+    idx->k1 = seed[1];
+    return;
+}
+
+static uint32_t
+slots_for_entries(uint32_t entries)
+{
+    uint64_t    want  = ((uint64_t)entries * DIGEST_INDEX_LOAD_DEN)
+                            / DIGEST_INDEX_LOAD_NUM + 1;
+    uint64_t    slots = DIGEST_INDEX_MIN_SLOTS;
+
+    while(slots < want && slots < DIGEST_INDEX_MAX_SLOTS)
+        slots <<= 1;
+
+    return (uint32_t)slots;
+}
+
+/* Place an entry whose hash is already known.  The caller guarantees that
+ * there is a free slot and that the digest is not already present.
+*/
+static void
+slot_insert(digest_index_slot_t *slots, const uint32_t mask,
+        const uint64_t hash, void *data)
+{
+    uint32_t    pos = (uint32_t)hash & mask;
+
+    while(slots[pos].data != NULL)
+        pos = (pos + 1) & mask;
+
+    slots[pos].hash = hash;
+    slots[pos].data = data;
+    return;
+}
+
+static int
+digest_index_grow(digest_index_t *idx)
+{
+    digest_index_slot_t *new_slots = NULL;
+    uint32_t             new_size, i;
+
+    if((uint64_t)idx->mask + 1 >= DIGEST_INDEX_MAX_SLOTS)
+        return DIGEST_INDEX_ERROR;
+
+    new_size  = (idx->mask + 1) << 1;
+    new_slots = calloc(new_size, sizeof(digest_index_slot_t));
+    if(new_slots == NULL)
+        return DIGEST_INDEX_ERROR;
+
+    for(i=0; i <= idx->mask; i++)
+        if(idx->slots[i].data != NULL)
+            slot_insert(new_slots, new_size - 1,
+                    idx->slots[i].hash, idx->slots[i].data);
+
+    free(idx->slots);
+    idx->slots = new_slots;
+    idx->mask  = new_size - 1;
+
+    return DIGEST_INDEX_SUCCESS;
+}
+
+/* Walk the probe sequence for the digest.  Returns the slot holding the
+ * matching entry, or the empty slot that ends the sequence.
+*/
+static uint32_t
+digest_index_probe(const digest_index_t *idx, const uint64_t hash,
+        const char *digest, const int digest_len)
+{
+    const char *key;
+    int         key_len;
+    uint32_t    pos = (uint32_t)hash & idx->mask;
+
+    while(idx->slots[pos].data != NULL)
+    {
+        if(idx->slots[pos].hash == hash)
+        {
+            key = idx->key_cb(idx->slots[pos].data, &key_len);
+            if(key != NULL && key_len == digest_len
+                    && constant_runtime_cmp(key, digest, digest_len) == 0)
+                break;
+        }
+        pos = (pos + 1) & idx->mask;
+    }
+
+    return pos;
+}
+
+/**
+ * Create a digest index sized for 'expected_entries' digests (it grows on
+ * demand).  The key_cb callback is required and must return the digest
+ * string of a stored entry.
+ */
+digest_index_t *
+digest_index_create(uint32_t expected_entries, digest_index_key_cb key_cb)
+{
+    digest_index_t *idx = NULL;
+    uint32_t        size;
+
+    if(key_cb == NULL)
+        return NULL;
+
+    if((idx = calloc(1, sizeof(digest_index_t))) == NULL)
+        return NULL;
+
+    size = slots_for_entries(expected_entries);
+
+    if((idx->slots = calloc(size, sizeof(digest_index_slot_t))) == NULL)
+    {
+        free(idx);
+        return NULL;
+    }
+
+    idx->mask   = size - 1;
+    idx->key_cb = key_cb;
+    digest_index_seed(idx);
+
+    return idx;
+}
+
+/**
+ * Free the index itself.  Entries referenced by the index are owned by the
+ * caller and are left untouched.
+ */
+void
+digest_index_destroy(digest_index_t *idx)
+{
+    if(idx == NULL)
+        return;
+
+    free(idx->slots);
+    free(idx);
+    return;
+}
+
+/**
+ * Add an entry under 'digest'.  Returns DIGEST_INDEX_EXISTS (without
+ * modifying the index) if the digest is already present.
+ */
+int
+digest_index_add(digest_index_t *idx, const char *digest,
+        int digest_len, void *data)
+{
+    uint64_t    hash;
+    uint32_t    pos;
+
+    if(idx == NULL || digest == NULL || digest_len <= 0 || data == NULL)
+        return DIGEST_INDEX_ERROR;
+
+    if(((uint64_t)idx->count + 1) * DIGEST_INDEX_LOAD_DEN
+            > ((uint64_t)idx->mask + 1) * DIGEST_INDEX_LOAD_NUM)
+    {
+        if(digest_index_grow(idx) != DIGEST_INDEX_SUCCESS)
+            return DIGEST_INDEX_ERROR;
+    }
+
+    hash = siphash24(idx->k0, idx->k1, (const unsigned char *)digest, digest_len);
+    pos  = digest_index_probe(idx, hash, digest, digest_len);
+
+    if(idx->slots[pos].data != NULL)
+        return DIGEST_INDEX_EXISTS;
+
+    idx->slots[pos].hash = hash;
+    idx->slots[pos].data = data;
+    idx->count++;
+
+    return DIGEST_INDEX_SUCCESS;
+}
+
+/**
+ * Return the entry stored under 'digest', or NULL if there is none.
+ */
+void *
+digest_index_find(const digest_index_t *idx, const char *digest,
+        int digest_len)
+{
+    uint64_t    hash;
+
+    if(idx == NULL || digest == NULL || digest_len <= 0)
+        return NULL;
+
+    hash = siphash24(idx->k0, idx->k1, (const unsigned char *)digest, digest_len);
+
+    return idx->slots[digest_index_probe(idx, hash, digest, digest_len)].data;
+}
+
+/**
+ * Remove the entry stored under 'digest' and return it, or NULL if there
+ * is none.  Later entries in the probe sequence are shifted back so that
+ * no tombstones are needed.
+ */
+void *
+digest_index_remove(digest_index_t *idx, const char *digest,
+        int digest_len)
+{
+    uint64_t    hash;
+    uint32_t    pos, next, home;
+    void       *data;
+
+    if(idx == NULL || digest == NULL || digest_len <= 0)
+        return NULL;
+
+    hash = siphash24(idx->k0, idx->k1, (const unsigned char *)digest, digest_len);
+    pos  = digest_index_probe(idx, hash, digest, digest_len);
+
+    if((data = idx->slots[pos].data) == NULL)
+        return NULL;
+
+    next = pos;
+    while(1)
+    {
+        next = (next + 1) & idx->mask;
+        if(idx->slots[next].data == NULL)
+            break;
+
+        /* Move the entry into the hole unless the hole lies before its
+         * home slot (cyclically), in which case it has to stay put.
+        */
+        home = (uint32_t)idx->slots[next].hash & idx->mask;
+        if(((next - home) & idx->mask) >= ((next - pos) & idx->mask))
+        {
+            idx->slots[pos] = idx->slots[next];
+            pos = next;
+        }
+    }
+
+    idx->slots[pos].hash = 0;
+    idx->slots[pos].data = NULL;
+    idx->count--;
+
+    return data;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_TEST_SUITE(digest_index, "Digest index test suite");
+
+static const char *
+utest_key_cb(const void *data, int *key_len)
+{
+    *key_len = strlen((const char *)data);
+    return (const char *)data;
+}
+
+DECLARE_UTEST(add_find, "add and find digests across table growth")
+{
+    digest_index_t *idx = NULL;
+    char            digests[4000][16];
+    int             i, found = 1;
+
+    idx = digest_index_create(0, utest_key_cb);
+    CU_ASSERT(idx != NULL);
+
+    for(i=0; i < 4000; i++)
+    {
+        snprintf(digests[i], sizeof(digests[i]), "digest%05d", i);
+        CU_ASSERT(digest_index_add(idx, digests[i],
+                    strlen(digests[i]), digests[i]) == DIGEST_INDEX_SUCCESS);
+    }
+    CU_ASSERT(idx->count == 4000);
+    CU_ASSERT(idx->mask + 1 > DIGEST_INDEX_MIN_SLOTS);
+
+    for(i=0; i < 4000; i++)
+        if(digest_index_find(idx, digests[i], strlen(digests[i])) != digests[i])
+            found = 0;
+    CU_ASSERT(found == 1);
+
+    CU_ASSERT(digest_index_find(idx, "digest04000", 11) == NULL);
+    CU_ASSERT(digest_index_find(idx, "digest0000", 10) == NULL);
+    CU_ASSERT(digest_index_add(idx, "digest00042", 11, digests[0])
+            == DIGEST_INDEX_EXISTS);
+    CU_ASSERT(idx->count == 4000);
+
+    digest_index_destroy(idx);
+}
+
+DECLARE_UTEST(remove, "remove digests and keep the rest reachable")
+{
+    digest_index_t *idx = NULL;
+    char            digests[4000][16];
+    int             i, found = 1;
+
+    idx = digest_index_create(4000, utest_key_cb);
+    CU_ASSERT(idx != NULL);
+
+    for(i=0; i < 4000; i++)
+    {
+        snprintf(digests[i], sizeof(digests[i]), "digest%05d", i);
+        digest_index_add(idx, digests[i], strlen(digests[i]), digests[i]);
+    }
+
+    /* Remove every third digest
+    */
+    for(i=0; i < 4000; i += 3)
+        if(digest_index_remove(idx, digests[i], strlen(digests[i])) != digests[i])
+            found = 0;
+    CU_ASSERT(found == 1);
+    CU_ASSERT(idx->count == 4000 - 1334);
+
+    for(i=0; i < 4000; i++)
+    {
+        if(i % 3 == 0)
+        {
+            if(digest_index_find(idx, digests[i], strlen(digests[i])) != NULL)
+                found = 0;
+        }
+        else if(digest_index_find(idx, digests[i], strlen(digests[i])) != digests[i])
+            found = 0;
+    }
+    CU_ASSERT(found == 1);
+
+    CU_ASSERT(digest_index_remove(idx, digests[0], strlen(digests[0])) == NULL);
+    CU_ASSERT(digest_index_add(idx, digests[0], strlen(digests[0]), digests[0])
+            == DIGEST_INDEX_SUCCESS);
+    CU_ASSERT(digest_index_find(idx, digests[0], strlen(digests[0])) == digests[0]);
+
+    digest_index_destroy(idx);
+}
+
+int register_ts_digest_index(void)
+{
+    ts_init(&TEST_SUITE(digest_index), TEST_SUITE_DESCR(digest_index), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(digest_index), UTEST_FCT(add_find), UTEST_DESCR(add_find));
+    ts_add_utest(&TEST_SUITE(digest_index), UTEST_FCT(remove), UTEST_DESCR(remove));
+
+    return register_ts(&TEST_SUITE(digest_index));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
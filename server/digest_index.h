@@ -0,0 +1,85 @@
+/*
+ *****************************************************************************
+ *
+ * File:    digest_index.h
+ *
+ * Purpose: Header file for fwknopd digest_index.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef DIGEST_INDEX_H
+#define DIGEST_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_INDEX_MIN_SLOTS      1024
+#define DIGEST_INDEX_MAX_SLOTS      (1U << 31)
+
+/* Return codes
+*/
+#define DIGEST_INDEX_SUCCESS        0
+#define DIGEST_INDEX_EXISTS         1
+#define DIGEST_INDEX_ERROR         -1
+
+/* The index does not own the digest strings or the data they belong to.
+ * Each slot only holds the (keyed) hash of the digest and a pointer to the
+ * caller's entry.  When two hashes collide, this callback is used to fetch
+ * the stored digest so it can be compared in constant time.
+*/
+typedef const char *(*digest_index_key_cb)(const void *data, int *key_len);
+
+typedef struct digest_index_slot
+{
+    uint64_t    hash;
+    void       *data;
+} digest_index_slot_t;
+
+typedef struct digest_index
+{
+    digest_index_slot_t *slots;
+    uint32_t             mask;      /* number of slots - 1 (power of two) */
+    uint32_t             count;
+    uint64_t             k0;        /* SipHash key */
+    uint64_t             k1;
+    digest_index_key_cb  key_cb;
+} digest_index_t;
+
+/* Prototypes
+*/
+digest_index_t *digest_index_create(uint32_t expected_entries,
+        digest_index_key_cb key_cb);
+void  digest_index_destroy(digest_index_t *idx);
+int   digest_index_add(digest_index_t *idx, const char *digest,
+        int digest_len, void *data);
+void *digest_index_find(const digest_index_t *idx, const char *digest,
+        int digest_len);
+void *digest_index_remove(digest_index_t *idx, const char *digest,
+        int digest_len);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_digest_index(void);
+#endif
+
+#endif  /* DIGEST_INDEX_H */
@@ -0,0 +1,485 @@
+/*
+ *****************************************************************************
+ *
+ * File:    digest_journal.c
+ *
+ * Purpose: Append-only writer for the on-disk digest cache.  The journal
+ *          file is opened once with O_APPEND and entries are handed to a
+ *          background writer thread, which writes them out in batches and
+ *          syncs them according to DIGEST_CACHE_SYNC_MODE.  In ALWAYS mode
+ *          concurrent appenders share a single fdatasync() (group commit).
+ *          The writer thread also runs requested rewrites of the file
+ *          (compaction) so that they stay off the packet path.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "digest_journal.h"
+#include "log_msg.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/time.h>
+
+static int
+journal_sync(const int fd)
+{
+#if HAVE_FDATASYNC
+    return fdatasync(fd);
+#else
+    return fsync(fd);
+#endif
+}
+
+static int
+write_all(const int fd, const char *buf, size_t len)
+{
+    ssize_t res;
+
+    while(len > 0)
+    {
+        res = write(fd, buf, len);
+        if(res < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += res;
+        len -= res;
+    }
+    return 0;
+}
+
+static void
+deadline_after(struct timespec *ts, const struct timespec *start, const int ms)
+{
+    ts->tv_sec  = start->tv_sec + ms / 1000;
+    ts->tv_nsec = start->tv_nsec + (long)(ms % 1000) * 1000000L;
+    if(ts->tv_nsec >= 1000000000L)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+    return;
+}
+
+static int
+deadline_passed(const struct timespec *ts)
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+    if(now.tv_sec != ts->tv_sec)
+        return now.tv_sec > ts->tv_sec;
+    return (long)now.tv_usec * 1000L >= ts->tv_nsec;
+}
+
+/* Run a pending rewrite without holding the lock.  Once the file has been
+ * replaced, everything still pending goes to the new file.  Called with
+ * the lock held.
+*/
+static void
+journal_run_rewrite(digest_journal_t *journal)
+{
+    digest_journal_rewrite_t    rewrite_fn = journal->rewrite_fn;
+    void                       *arg        = journal->rewrite_arg;
+    int                         fd, reopen_failed = 0;
+
+    journal->rewrite_fn  = NULL;
+    journal->rewrite_arg = NULL;
+
+    pthread_mutex_unlock(&journal->mutex);
+
+    if(rewrite_fn(journal->path, arg) == 0)
+    {
+        fd = open(journal->path, O_WRONLY|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR);
+        if(fd < 0)
+        {
+            log_msg(LOG_ERR,
+                "digest_journal: could not reopen '%s' after rewrite: %s",
+                journal->path, strerror(errno));
+            reopen_failed = 1;
+        }
+        else
+        {
+            close(journal->fd);
+            journal->fd = fd;
+        }
+    }
+
+    pthread_mutex_lock(&journal->mutex);
+
+    if(reopen_failed)
+        journal->write_errors++;
+
+    return;
+}
+
+/* Writer thread - waits until a batch is full, the flush interval has
+ * elapsed, or (in ALWAYS mode) anyone is waiting, then swaps out the
+ * pending buffer and writes it without holding the lock.  A requested
+ * rewrite is run before the next batch is taken.
+*/
+static void *
+journal_writer(void *arg)
+{
+    digest_journal_t   *journal = (digest_journal_t *)arg;
+    struct timespec     deadline;
+    char               *out_buf  = NULL, *swap_buf;
+    size_t              out_size = 0, out_len = 0, swap_size;
+    uint64_t            batch_seq;
+    int                 res;
+
+    pthread_mutex_lock(&journal->mutex);
+
+    while(1)
+    {
+        while(! journal->stop && journal->buf_len == 0
+                && journal->rewrite_fn == NULL)
+            pthread_cond_wait(&journal->wake_writer, &journal->mutex);
+
+        if(journal->rewrite_fn != NULL)
+        {
+            journal_run_rewrite(journal);
+            continue;
+        }
+
+        if(journal->buf_len == 0)
+            break;  /* stopping and nothing left to write */
+
+        if(journal->sync_mode != DIGEST_SYNC_ALWAYS)
+        {
+            deadline_after(&deadline, &journal->first_pending,
+                    journal->flush_interval_ms);
+
+            while(! journal->stop
+                    && journal->pending < journal->batch_size
+                    && journal->rewrite_fn == NULL
+                    && ! deadline_passed(&deadline))
+            {
+                if(pthread_cond_timedwait(&journal->wake_writer,
+                            &journal->mutex, &deadline) == ETIMEDOUT)
+                    break;
+            }
+        }
+
+        /* Entries appended after a rewrite was requested must not go to
+         * the old file
+        */
+        if(journal->rewrite_fn != NULL)
+            continue;
+
+        /* Swap buffers so appenders can keep going while we write
+        */
+        out_len           = journal->buf_len;
+        batch_seq         = journal->append_seq;
+        swap_buf          = out_buf;
+        swap_size         = out_size;
+        out_buf           = journal->buf;
+        out_size          = journal->buf_size;
+        journal->buf      = swap_buf;
+        journal->buf_size = swap_size;
+        journal->buf_len  = 0;
+        journal->pending  = 0;
+
+        pthread_mutex_unlock(&journal->mutex);
+
+        res = write_all(journal->fd, out_buf, out_len);
+        if(res == 0 && journal->sync_mode != DIGEST_SYNC_NONE)
+            res = journal_sync(journal->fd);
+
+        if(res != 0)
+            log_msg(LOG_WARNING,
+                "digest_journal: could not write %d bytes to digest cache: %s",
+                (int)out_len, strerror(errno));
+
+        pthread_mutex_lock(&journal->mutex);
+
+        if(res != 0)
+            journal->write_errors++;
+        journal->written_seq = batch_seq;
+        pthread_cond_broadcast(&journal->written);
+    }
+
+    pthread_mutex_unlock(&journal->mutex);
+
+    free(out_buf);
+    return NULL;
+}
+
+/**
+ * Map a DIGEST_CACHE_SYNC_MODE config string to one of the DIGEST_SYNC_*
+ * values.  Returns -1 for an unknown mode.
+ */
+int
+digest_journal_sync_mode(const char *mode_str)
+{
+    if(mode_str == NULL)
+        return -1;
+
+    if(strcasecmp(mode_str, "NONE") == 0)
+        return DIGEST_SYNC_NONE;
+    else if(strcasecmp(mode_str, "PERIODIC") == 0)
+        return DIGEST_SYNC_PERIODIC;
+    else if(strcasecmp(mode_str, "ALWAYS") == 0)
+        return DIGEST_SYNC_ALWAYS;
+
+    return -1;
+}
+
+/**
+ * Open (creating it if necessary) the digest cache file for appending and
+ * start the writer thread.  Returns NULL on failure.
+ */
+digest_journal_t *
+digest_journal_open(const char *path, const int sync_mode,
+        const int flush_interval_ms, const int batch_size)
+{
+    digest_journal_t   *journal = NULL;
+
+    if((journal = calloc(1, sizeof(digest_journal_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "digest_journal_open: memory allocation error");
+        return NULL;
+    }
+
+    if((journal->buf = malloc(DIGEST_JOURNAL_INIT_BUFSIZE)) == NULL)
+    {
+        log_msg(LOG_ERR, "digest_journal_open: memory allocation error");
+        free(journal);
+        return NULL;
+    }
+    journal->buf_size = DIGEST_JOURNAL_INIT_BUFSIZE;
+
+    if((journal->path = strdup(path)) == NULL)
+    {
+        log_msg(LOG_ERR, "digest_journal_open: memory allocation error");
+        free(journal->buf);
+        free(journal);
+        return NULL;
+    }
+
+    journal->fd = open(path, O_WRONLY|O_APPEND|O_CREAT, S_IRUSR|S_IWUSR);
+    if(journal->fd < 0)
+    {
+        log_msg(LOG_ERR, "digest_journal_open: could not open '%s': %s",
+            path, strerror(errno));
+        free(journal->path);
+        free(journal->buf);
+        free(journal);
+        return NULL;
+    }
+
+    journal->sync_mode         = sync_mode;
+    journal->flush_interval_ms = flush_interval_ms;
+    journal->batch_size        = batch_size > 0 ? batch_size : 1;
+    journal->owner_pid         = getpid();
+
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->wake_writer, NULL);
+    pthread_cond_init(&journal->written, NULL);
+
+    if(pthread_create(&journal->writer_thread, NULL,
+                journal_writer, journal) != 0)
+    {
+        log_msg(LOG_ERR, "digest_journal_open: could not start writer thread");
+        pthread_cond_destroy(&journal->written);
+        pthread_cond_destroy(&journal->wake_writer);
+        pthread_mutex_destroy(&journal->mutex);
+        close(journal->fd);
+        free(journal->path);
+        free(journal->buf);
+        free(journal);
+        return NULL;
+    }
+
+    return journal;
+}
+
+/**
+ * Queue an entry for the journal.  In ALWAYS mode this only returns once
+ * the entry has been written and synced.  Returns 0 on success, or -1 if
+ * the entry could not be queued or (ALWAYS mode) written.
+ */
+int
+digest_journal_append(digest_journal_t *journal, const char *entry,
+        const size_t entry_len)
+{
+    struct timeval  now;
+    size_t          new_size;
+    char           *new_buf;
+    uint64_t        seq;
+    int             errors, res = 0;
+
+    if(journal == NULL || entry == NULL || entry_len == 0)
+        return -1;
+
+    /* A forked child (the TCP server) has no writer thread
+    */
+    if(journal->owner_pid != getpid())
+        return -1;
+
+    pthread_mutex_lock(&journal->mutex);
+
+    if(journal->stop)
+    {
+        pthread_mutex_unlock(&journal->mutex);
+        return -1;
+    }
+
+    /* Apply back pressure if the writer has fallen far behind
+    */
+    while(journal->buf_len + entry_len > DIGEST_JOURNAL_MAX_BUFSIZE
+            && journal->buf_len > 0)
+    {
+        pthread_cond_signal(&journal->wake_writer);
+        pthread_cond_wait(&journal->written, &journal->mutex);
+    }
+
+    if(journal->buf_len + entry_len > journal->buf_size)
+    {
+        new_size = journal->buf_size ? journal->buf_size : DIGEST_JOURNAL_INIT_BUFSIZE;
+        while(new_size < journal->buf_len + entry_len)
+            new_size <<= 1;
+
+        if((new_buf = realloc(journal->buf, new_size)) == NULL)
+        {
+            pthread_mutex_unlock(&journal->mutex);
+            log_msg(LOG_ERR, "digest_journal_append: memory allocation error");
+            return -1;
+        }
+        journal->buf      = new_buf;
+        journal->buf_size = new_size;
+    }
+
+    memcpy(journal->buf + journal->buf_len, entry, entry_len);
+    journal->buf_len += entry_len;
+    seq = ++journal->append_seq;
+
+    if(journal->pending++ == 0)
+    {
+        gettimeofday(&now, NULL);
+        journal->first_pending.tv_sec  = now.tv_sec;
+        journal->first_pending.tv_nsec = (long)now.tv_usec * 1000L;
+        pthread_cond_signal(&journal->wake_writer);
+    }
+    else if(journal->pending >= journal->batch_size
+            || journal->sync_mode == DIGEST_SYNC_ALWAYS)
+        pthread_cond_signal(&journal->wake_writer);
+
+    if(journal->sync_mode == DIGEST_SYNC_ALWAYS)
+    {
+        errors = journal->write_errors;
+        while(journal->written_seq < seq)
+            pthread_cond_wait(&journal->written, &journal->mutex);
+        if(journal->write_errors != errors)
+            res = -1;
+    }
+
+    pthread_mutex_unlock(&journal->mutex);
+
+    return res;
+}
+
+/**
+ * Have the writer thread call rewrite_fn(path, arg) before it writes
+ * anything appended after this call.  rewrite_fn replaces the file at
+ * path (typically by renaming a new file over it) and returns 0 if it did,
+ * in which case the journal reopens path and keeps appending there.  A
+ * pending rewrite is still run when the journal is closed.  Returns 0 if
+ * the rewrite was queued, or -1 if one is already pending.
+ */
+int
+digest_journal_rewrite(digest_journal_t *journal,
+        digest_journal_rewrite_t rewrite_fn, void *arg)
+{
+    int     res = 0;
+
+    if(journal == NULL || rewrite_fn == NULL)
+        return -1;
+
+    if(journal->owner_pid != getpid())
+        return -1;
+
+    pthread_mutex_lock(&journal->mutex);
+
+    if(journal->stop || journal->rewrite_fn != NULL)
+        res = -1;
+    else
+    {
+        journal->rewrite_fn  = rewrite_fn;
+        journal->rewrite_arg = arg;
+        pthread_cond_signal(&journal->wake_writer);
+    }
+
+    pthread_mutex_unlock(&journal->mutex);
+
+    return res;
+}
+
+/**
+ * Flush anything still pending, stop the writer thread and close the file.
+ */
+void
+digest_journal_close(digest_journal_t *journal)
+{
+    if(journal == NULL)
+        return;
+
+    /* The writer thread only exists in the process that opened the
+     * journal, so a forked child just drops its copy of the file.
+    */
+    if(journal->owner_pid != getpid())
+    {
+        close(journal->fd);
+        free(journal->path);
+        free(journal->buf);
+        free(journal);
+        return;
+    }
+
+    pthread_mutex_lock(&journal->mutex);
+    journal->stop = 1;
+    pthread_cond_signal(&journal->wake_writer);
+    pthread_mutex_unlock(&journal->mutex);
+
+    pthread_join(journal->writer_thread, NULL);
+
+    if(journal->sync_mode != DIGEST_SYNC_NONE)
+        journal_sync(journal->fd);
+
+    close(journal->fd);
+
+    pthread_cond_destroy(&journal->written);
+    pthread_cond_destroy(&journal->wake_writer);
+    pthread_mutex_destroy(&journal->mutex);
+
+    free(journal->path);
+    free(journal->buf);
+    free(journal);
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,98 @@
+/*
+ *****************************************************************************
+ *
+ * File:    digest_journal.h
+ *
+ * Purpose: Header file for fwknopd digest_journal.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef DIGEST_JOURNAL_H
+#define DIGEST_JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Durability modes (DIGEST_CACHE_SYNC_MODE)
+*/
+enum {
+    DIGEST_SYNC_NONE = 0,   /* write(), let the kernel flush it */
+    DIGEST_SYNC_PERIODIC,   /* write() + fdatasync() once per batch */
+    DIGEST_SYNC_ALWAYS      /* fdatasync() before the append returns */
+};
+
+/* Pending entries are buffered in memory up to this size before appenders
+ * have to wait for the writer thread to catch up.
+*/
+#define DIGEST_JOURNAL_INIT_BUFSIZE     16384
+#define DIGEST_JOURNAL_MAX_BUFSIZE      (4 * 1024 * 1024)
+
+/* Called on the writer thread to replace the journal file, see
+ * digest_journal_rewrite().
+*/
+typedef int (*digest_journal_rewrite_t)(const char *path, void *arg);
+
+typedef struct digest_journal
+{
+    int                 fd;
+    char               *path;
+    int                 sync_mode;
+    int                 flush_interval_ms;
+    int                 batch_size;
+
+    pthread_t           writer_thread;
+    pid_t               owner_pid;
+    pthread_mutex_t     mutex;
+    pthread_cond_t      wake_writer;
+    pthread_cond_t      written;
+
+    char               *buf;            /* entries not yet handed to write() */
+    size_t              buf_len;
+    size_t              buf_size;
+    int                 pending;        /* number of entries in buf */
+    struct timespec     first_pending;  /* when buf became non-empty */
+
+    uint64_t            append_seq;     /* last entry appended */
+    uint64_t            written_seq;    /* last entry written (and synced) */
+    int                 write_errors;
+
+    digest_journal_rewrite_t rewrite_fn; /* pending rewrite, if any */
+    void               *rewrite_arg;
+    unsigned char       stop;
+} digest_journal_t;
+
+/* Prototypes
+*/
+int   digest_journal_sync_mode(const char *mode_str);
+digest_journal_t *digest_journal_open(const char *path, const int sync_mode,
+        const int flush_interval_ms, const int batch_size);
+int   digest_journal_append(digest_journal_t *journal, const char *entry,
+        const size_t entry_len);
+int   digest_journal_rewrite(digest_journal_t *journal,
+        digest_journal_rewrite_t rewrite_fn, void *arg);
+void  digest_journal_close(digest_journal_t *journal);
+
+#endif  /* DIGEST_JOURNAL_H */
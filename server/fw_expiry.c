@@ -0,0 +1,252 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_expiry.c
+ *
+ * Purpose: Expiry index for the firewall rules fwknopd adds itself.  The
+ *          rules are kept in a min-heap keyed by their expire time, so
+ *          finding the expired ones needs no firewall list command and
+ *          costs O(log n) per rule.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "common.h"
+#include "fw_expiry.h"
+
+static void
+swap_ents(fw_expiry_ent_t *a, fw_expiry_ent_t *b)
+{
+    fw_expiry_ent_t tmp = *a;
+
+    *a = *b;
+    *b = tmp;
+}
+
+static void
+sift_up(fw_expiry_t *heap, int i)
+{
+    int parent;
+
+    while(i > 0)
+    {
+        parent = (i - 1) / 2;
+        if(heap->ents[parent].expire <= heap->ents[i].expire)
+            break;
+        swap_ents(&heap->ents[parent], &heap->ents[i]);
+        i = parent;
+    }
+}
+
+static void
+sift_down(fw_expiry_t *heap, int i)
+{
+    int child;
+
+    while((child = 2 * i + 1) < heap->count)
+    {
+        if(child + 1 < heap->count
+                && heap->ents[child + 1].expire < heap->ents[child].expire)
+            child++;
+
+        if(heap->ents[i].expire <= heap->ents[child].expire)
+            break;
+
+        swap_ents(&heap->ents[i], &heap->ents[child]);
+        i = child;
+    }
+}
+
+/**
+ * Remember a rule that was just added.  Returns 0 on success or -1 if
+ * memory could not be allocated.
+ */
+int
+fw_expiry_add(fw_expiry_t *heap, const time_t expire, const int chain,
+        const char * const rule)
+{
+    fw_expiry_ent_t    *ents = NULL;
+    char               *rule_copy = NULL;
+    int                 size;
+
+    if(heap->count == heap->size)
+    {
+        size = heap->size ? heap->size * 2 : FW_EXPIRY_MIN_SIZE;
+        if((ents = realloc(heap->ents, size * sizeof(fw_expiry_ent_t))) == NULL)
+            return -1;
+        heap->ents = ents;
+        heap->size = size;
+    }
+
+    if((rule_copy = strdup(rule)) == NULL)
+        return -1;
+
+    heap->ents[heap->count].expire = expire;
+    heap->ents[heap->count].chain  = chain;
+    heap->ents[heap->count].rule   = rule_copy;
+    sift_up(heap, heap->count++);
+
+    return 0;
+}
+
+/**
+ * Take the rule with the earliest expire time off the heap if it has
+ * expired by now.  Returns 1 and fills in ent (the caller frees
+ * ent->rule), or 0 if no rule has expired.
+ */
+int
+fw_expiry_pop(fw_expiry_t *heap, const time_t now, fw_expiry_ent_t *ent)
+{
+    if(heap->count == 0 || heap->ents[0].expire > now)
+        return 0;
+
+    *ent = heap->ents[0];
+    heap->ents[0] = heap->ents[--heap->count];
+    sift_down(heap, 0);
+
+    return 1;
+}
+
+/**
+ * The earliest expire time of all indexed rules, or 0 if there are none.
+ */
+time_t
+fw_expiry_next(const fw_expiry_t *heap)
+{
+    return heap->count ? heap->ents[0].expire : 0;
+}
+
+/**
+ * Whether the same rule is already indexed.  This is a plain walk over
+ * the heap, which is still far cheaper than asking the firewall.
+ */
+int
+fw_expiry_exists(const fw_expiry_t *heap, const time_t expire,
+        const int chain, const char * const rule)
+{
+    int i;
+
+    for(i=0; i < heap->count; i++)
+        if(heap->ents[i].expire == expire && heap->ents[i].chain == chain
+                && strcmp(heap->ents[i].rule, rule) == 0)
+            return 1;
+
+    return 0;
+}
+
+void
+fw_expiry_clear(fw_expiry_t *heap)
+{
+    int i;
+
+    for(i=0; i < heap->count; i++)
+        free(heap->ents[i].rule);
+
+    free(heap->ents);
+    memset(heap, 0x0, sizeof(fw_expiry_t));
+    return;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_TEST_SUITE(fw_expiry, "Firewall rule expiry test suite");
+
+DECLARE_UTEST(pop_order, "rules come off the heap in expire order")
+{
+    fw_expiry_t         heap;
+    fw_expiry_ent_t     ent;
+    char                rule[32];
+    time_t              last = 0;
+    int                 i, ordered = 1, popped = 0;
+
+    memset(&heap, 0x0, sizeof(heap));
+    CU_ASSERT(fw_expiry_next(&heap) == 0);
+
+    srandom(1);
+    for(i=0; i < 1000; i++)
+    {
+        snprintf(rule, sizeof(rule), "rule %d", i);
+        CU_ASSERT(fw_expiry_add(&heap, 1000 + (random() % 500), i % 3, rule) == 0);
+    }
+    CU_ASSERT(heap.count == 1000);
+
+    /* Nothing has expired yet
+    */
+    CU_ASSERT(fw_expiry_pop(&heap, 999, &ent) == 0);
+
+    while(fw_expiry_pop(&heap, 1249, &ent) == 1)
+    {
+        if(ent.expire < last || ent.expire > 1249)
+            ordered = 0;
+        last = ent.expire;
+        free(ent.rule);
+        popped++;
+    }
+    CU_ASSERT(ordered == 1);
+    CU_ASSERT(popped > 0 && popped < 1000);
+    CU_ASSERT(fw_expiry_next(&heap) >= 1250);
+
+    while(fw_expiry_pop(&heap, 2000, &ent) == 1)
+    {
+        if(ent.expire < last)
+            ordered = 0;
+        last = ent.expire;
+        free(ent.rule);
+        popped++;
+    }
+    CU_ASSERT(ordered == 1);
+    CU_ASSERT(popped == 1000);
+    CU_ASSERT(fw_expiry_next(&heap) == 0);
+
+    fw_expiry_clear(&heap);
+}
+
+DECLARE_UTEST(clear, "clear frees the remaining rules")
+{
+    fw_expiry_t         heap;
+
+    memset(&heap, 0x0, sizeof(heap));
+    CU_ASSERT(fw_expiry_add(&heap, 10, 0, "-p 6 -s 10.0.0.1 -j ACCEPT") == 0);
+    CU_ASSERT(fw_expiry_add(&heap, 5, 1, "-p 6 -s 10.0.0.2 -j ACCEPT") == 0);
+    CU_ASSERT(fw_expiry_next(&heap) == 5);
+    CU_ASSERT(fw_expiry_exists(&heap, 5, 1, "-p 6 -s 10.0.0.2 -j ACCEPT") == 1);
+    CU_ASSERT(fw_expiry_exists(&heap, 5, 0, "-p 6 -s 10.0.0.2 -j ACCEPT") == 0);
+    CU_ASSERT(fw_expiry_exists(&heap, 10, 0, "-p 6 -s 10.0.0.2 -j ACCEPT") == 0);
+
+    fw_expiry_clear(&heap);
+    CU_ASSERT(heap.count == 0 && heap.ents == NULL);
+    CU_ASSERT(fw_expiry_next(&heap) == 0);
+}
+
+int register_ts_fw_expiry(void)
+{
+    ts_init(&TEST_SUITE(fw_expiry), TEST_SUITE_DESCR(fw_expiry), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(fw_expiry), UTEST_FCT(pop_order), UTEST_DESCR(pop_order));
+    ts_add_utest(&TEST_SUITE(fw_expiry), UTEST_FCT(clear), UTEST_DESCR(clear));
+
+    return register_ts(&TEST_SUITE(fw_expiry));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
@@ -0,0 +1,75 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_expiry.h
+ *
+ * Purpose: Header file for fwknopd fw_expiry.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FW_EXPIRY_H
+#define FW_EXPIRY_H
+
+#include <time.h>
+
+#define FW_EXPIRY_MIN_SIZE      64
+
+/* Expired rules are removed in batches of at most this many
+*/
+#define FW_EXPIRY_BATCH_SIZE    128
+
+/* A firewall rule fwknopd added and when it expires.  The rule string is
+ * owned by the heap (or by the caller once popped).
+*/
+typedef struct fw_expiry_ent
+{
+    time_t          expire;
+    int             chain;      /* chain type the rule was added to */
+    char           *rule;
+} fw_expiry_ent_t;
+
+/* Binary min-heap ordered by expire time
+*/
+typedef struct fw_expiry
+{
+    fw_expiry_ent_t    *ents;
+    int                 count;
+    int                 size;
+} fw_expiry_t;
+
+/* Prototypes
+*/
+int     fw_expiry_add(fw_expiry_t *heap, const time_t expire, const int chain,
+            const char * const rule);
+int     fw_expiry_pop(fw_expiry_t *heap, const time_t now, fw_expiry_ent_t *ent);
+time_t  fw_expiry_next(const fw_expiry_t *heap);
+int     fw_expiry_exists(const fw_expiry_t *heap, const time_t expire,
+            const int chain, const char * const rule);
+void    fw_expiry_clear(fw_expiry_t *heap);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_fw_expiry(void);
+#endif
+
+#endif  /* FW_EXPIRY_H */
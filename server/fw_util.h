@@ -45,6 +45,8 @@
   #include "fw_util_firewalld.h"
 #elif FIREWALL_IPTABLES
   #include "fw_util_iptables.h"
+#elif FIREWALL_NFTABLES
+  #include "fw_util_nftables.h"
 #elif FIREWALL_IPFW
   #include "fw_util_ipfw.h"
 #elif FIREWALL_PF
@@ -71,6 +73,8 @@ void check_firewall_rules(const fko_srv_options_t * const opts,
 int fw_dump_rules(const fko_srv_options_t * const opts);
 int process_spa_request(const fko_srv_options_t * const opts,
         const acc_stanza_t * const acc, spa_data_t * const spadat);
+int fw_apply_pending_rules(const fko_srv_options_t * const opts,
+        const int force);
 
 #endif /* FW_UTIL_H */
 
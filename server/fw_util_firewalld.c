@@ -999,6 +999,14 @@ fw_cleanup(const fko_srv_options_t * const opts)
     return(0);
 }
 
+/* Rules are added as soon as they are granted, nothing is ever queued.
+*/
+int
+fw_apply_pending_rules(const fko_srv_options_t * const opts, const int force)
+{
+    return(0);
+}
+
 static int
 create_rule(const fko_srv_options_t * const opts,
         const char * const fw_chain, const char * const fw_rule)
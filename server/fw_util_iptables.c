@@ -39,6 +39,9 @@
 #include "extcmd.h"
 #include "access.h"
 #include "service.h"
+#include "fw_expiry.h"
+
+#include <sys/time.h>
 
 static struct fw_config fwc;
 static char   cmd_buf[CMD_BUFSIZE];
@@ -50,6 +53,35 @@ static char   cmd_out[STANDARD_CMD_OUT_BUFSIZE];
 */
 static int have_ipt_chk_support = 1;
 
+/* Rules fwknopd added, in the order they expire.  This lets expired rules
+ * be removed without listing the chains (see check_firewall_rules()).
+*/
+static fw_expiry_t rule_expiry;
+
+/* Rules waiting to go out in one iptables-restore run, see
+ * IPT_BATCH_WINDOW and fw_apply_pending_rules().
+*/
+typedef struct pending_rule
+{
+    int             chain;
+    unsigned int    exp_ts;
+    char            rule[CMD_BUFSIZE];
+    char            added_msg[CMD_BUFSIZE];  /* logged once the rule is in */
+} pending_rule_t;
+
+static pending_rule_t   pending_rules[IPT_BATCH_MAX_RULES];
+static int              pending_count = 0;
+static struct timeval   pending_since;
+static long             batch_window_us = 0;
+
+/* Expire times of the rules that were already in each chain when fwknopd
+ * started (see seed_preexisting_rules()), sorted.  Those rules are not in
+ * rule_expiry, so a new rule expiring at one of these times is not batched
+ * but checked with rule_exists() first.
+*/
+static time_t          *preexisting_exp[NUM_FWKNOP_ACCESS_TYPES];
+static int              preexisting_count[NUM_FWKNOP_ACCESS_TYPES];
+
 static void
 zero_cmd_buffers(void)
 {
@@ -624,6 +656,110 @@ fw_dump_rules(const fko_srv_options_t * const opts)
 
 /* Quietly flush and delete all fwknop custom chains.
 */
+static void
+clear_preexisting_rules(void)
+{
+    int i;
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        free(preexisting_exp[i]);
+        preexisting_exp[i]   = NULL;
+        preexisting_count[i] = 0;
+    }
+    return;
+}
+
+static int
+cmp_exp(const void *a, const void *b)
+{
+    const time_t x = *(const time_t *)a;
+    const time_t y = *(const time_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* List each chain once and remember the expire times of the rules that are
+ * already in it, e.g. from before fwknopd was restarted.
+*/
+static void
+seed_preexisting_rules(const fko_srv_options_t * const opts)
+{
+    char            ipt_output_buf[STANDARD_CMD_OUT_BUFSIZE] = {0};
+    char           *ndx, *end;
+    struct fw_chain *ch = opts->fw_config->chain;
+    int             i, n, res;
+    time_t          rule_exp;
+
+    clear_preexisting_rules();
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        if(ch[i].table[0] == '\0' || ch[i].to_chain[0] == '\0')
+            continue;
+
+        zero_cmd_buffers();
+        memset(ipt_output_buf, 0x0, STANDARD_CMD_OUT_BUFSIZE);
+
+        snprintf(cmd_buf, CMD_BUFSIZE-1, "%s " IPT_LIST_RULES_ARGS,
+            opts->fw_config->fw_command,
+            ch[i].table,
+            ch[i].to_chain
+        );
+
+        res = run_extcmd(cmd_buf, ipt_output_buf, STANDARD_CMD_OUT_BUFSIZE,
+                WANT_STDERR, NO_TIMEOUT, &pid_status, opts);
+
+        log_msg(LOG_DEBUG, "seed_preexisting_rules() CMD: '%s' (res: %d)",
+            cmd_buf, res);
+
+        if(!EXTCMD_IS_SUCCESS(res))
+            continue;
+
+        n = 0;
+        for(ndx = strstr(ipt_output_buf, EXPIRE_COMMENT_PREFIX); ndx != NULL;
+                ndx = strstr(ndx + strlen(EXPIRE_COMMENT_PREFIX), EXPIRE_COMMENT_PREFIX))
+            n++;
+
+        if(n == 0)
+            continue;
+
+        if((preexisting_exp[i] = calloc(n, sizeof(time_t))) == NULL)
+        {
+            log_msg(LOG_ERR, "seed_preexisting_rules() calloc() failed");
+            continue;
+        }
+
+        for(ndx = strstr(ipt_output_buf, EXPIRE_COMMENT_PREFIX); ndx != NULL;
+                ndx = strstr(ndx, EXPIRE_COMMENT_PREFIX))
+        {
+            ndx += strlen(EXPIRE_COMMENT_PREFIX);
+            rule_exp = (time_t)strtoul(ndx, &end, 10);
+            if(end != ndx)
+                preexisting_exp[i][preexisting_count[i]++] = rule_exp;
+        }
+
+        qsort(preexisting_exp[i], preexisting_count[i], sizeof(time_t), cmp_exp);
+
+        log_msg(LOG_INFO, "%d rules were already in %s, new ones expiring at the same time are checked before they are added",
+            preexisting_count[i], ch[i].to_chain);
+    }
+
+    return;
+}
+
+static int
+preexisting_rule_exp(const int chain, const unsigned int exp_ts)
+{
+    time_t  key = exp_ts;
+
+    if(preexisting_count[chain] == 0)
+        return 0;
+
+    return bsearch(&key, preexisting_exp[chain], preexisting_count[chain],
+            sizeof(time_t), cmp_exp) != NULL;
+}
+
 static void
 delete_all_chains(const fko_srv_options_t * const opts)
 {
@@ -706,6 +842,11 @@ delete_all_chains(const fko_srv_options_t * const opts)
             log_msg(LOG_ERR, "delete_all_chains() Error %i from cmd:'%s': %s",
                     res, cmd_buf, err_buf);
     }
+
+    /* Whatever was indexed went away with the chains
+    */
+    fw_expiry_clear(&rule_expiry);
+    clear_preexisting_rules();
     return;
 }
 
@@ -875,12 +1016,28 @@ set_fw_chain_conf(const int type, const char * const conf_str)
 int
 fw_config_init(fko_srv_options_t * const opts)
 {
+    int is_err = FKO_SUCCESS;
+
     memset(&fwc, 0x0, sizeof(struct fw_config));
 
     /* Set our firewall exe command path (iptables in most cases).
     */
     strlcpy(fwc.fw_command, opts->config[CONF_FIREWALL_EXE], sizeof(fwc.fw_command));
 
+    /* iptables-restore is expected to live next to iptables, fw_initialize()
+     * checks that it is really there.
+    */
+    snprintf(fwc.fw_restore_command, sizeof(fwc.fw_restore_command),
+            "%s-restore", fwc.fw_command);
+
+    batch_window_us = 1000 * strtol_wrapper(opts->config[CONF_IPT_BATCH_WINDOW],
+            0, RCHK_MAX_IPT_BATCH_WINDOW, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid IPT_BATCH_WINDOW");
+        return 0;
+    }
+
 #if HAVE_LIBFIU
     fiu_return_on("fw_config_init", 0);
 #endif
@@ -952,6 +1109,19 @@ fw_initialize(const fko_srv_options_t * const opts)
     else
         ipt_chk_support(opts);
 
+    /* New rules (IPT_BATCH_WINDOW) and expired ones are applied in one go
+     * through iptables-restore when it is available, one iptables command
+     * per rule otherwise.
+    */
+    if(access(fwc.fw_restore_command, X_OK) != 0)
+    {
+        log_msg(LOG_INFO,
+                "'%s' is not available, rules are added and removed one at a time",
+                fwc.fw_restore_command);
+        fwc.fw_restore_command[0] = '\0';
+        batch_window_us = 0;
+    }
+
     /* Flush the chains (just in case) so we can start fresh.
     */
     if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_INIT], "Y", 1) == 0)
@@ -966,6 +1136,12 @@ fw_initialize(const fko_srv_options_t * const opts)
         res = 0;
     }
 
+    /* Batched rules are not checked with 'iptables -C', so find out once
+     * which ones could already be there.
+    */
+    if(batch_window_us > 0)
+        seed_preexisting_rules(opts);
+
     /* Make sure that the 'comment' match is available
     */
     if(strncasecmp(opts->config[CONF_ENABLE_IPT_COMMENT_CHECK], "Y", 1) == 0)
@@ -989,8 +1165,14 @@ fw_cleanup(const fko_srv_options_t * const opts)
 {
     if(strncasecmp(opts->config[CONF_FLUSH_IPT_AT_EXIT], "N", 1) == 0
             && opts->fw_flush == 0)
+    {
+        /* The rules stay, so don't lose the ones still queued
+        */
+        fw_apply_pending_rules(opts, 1);
         return(0);
+    }
 
+    pending_count = 0;
     delete_all_chains(opts);
     return(0);
 }
@@ -1026,6 +1208,270 @@ create_rule(const fko_srv_options_t * const opts,
     return res;
 }
 
+/* Turn a rule as handed to create_rule() into what iptables-restore
+ * expects after '-A <chain>' or '-D <chain>', i.e. without the leading
+ * '-t <table>' and the shell redirection.  Returns 0 for rules that don't
+ * look like that.
+*/
+static int
+restore_rule_spec(const char * const rule, const char * const table,
+        char * const spec, const size_t spec_len)
+{
+    size_t  table_len = strlen(table), redir_len = strlen(SH_REDIR), len;
+
+    if(strncmp(rule, "-t ", 3) != 0
+            || strncmp(rule+3, table, table_len) != 0
+            || rule[3+table_len] != ' ')
+        return 0;
+
+    if(strlcpy(spec, rule+4+table_len, spec_len) >= spec_len)
+        return 0;
+
+    len = strlen(spec);
+    if(redir_len > 0 && len >= redir_len
+            && strcmp(spec + len - redir_len, SH_REDIR) == 0)
+        spec[len - redir_len] = '\0';
+
+    return 1;
+}
+
+/* Apply 'op' ("-A" or "-D") to a set of rules with one
+ * 'iptables-restore --noflush' run per table.  iptables-restore commits a
+ * table all or nothing, so done[] tells which rules went in (or out) and
+ * the caller falls back to single iptables commands for the rest.
+*/
+static void
+restore_rules(const fko_srv_options_t * const opts, const char * const op,
+        const int * const chains, char * const * const rules, const int count,
+        int * const done)
+{
+    struct fw_chain *ch = opts->fw_config->chain;
+    char            *restore_buf, *p;
+    char             spec[CMD_BUFSIZE] = {0};
+    char             restore_cmd[CMD_BUFSIZE] = {0};
+    size_t           restore_len, left;
+    int              i, j, n, res, in_batch;
+
+    for(n=0; n < count; n++)
+        done[n] = 0;
+
+    res = snprintf(restore_cmd, sizeof(restore_cmd), "%s --noflush",
+            opts->fw_config->fw_restore_command);
+    if(res < 0 || (size_t)res >= sizeof(restore_cmd))
+    {
+        log_msg(LOG_WARNING, "restore_rules() '%s' does not fit in a command",
+                opts->fw_config->fw_restore_command);
+        return;
+    }
+
+    restore_len = count * (MAX_CHAIN_NAME_LEN + CMD_BUFSIZE + 8)
+        + MAX_TABLE_NAME_LEN + 16;
+
+    if((restore_buf = calloc(1, restore_len)) == NULL)
+    {
+        log_msg(LOG_ERR, "restore_rules() calloc() failed");
+        return;
+    }
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        if(ch[i].table[0] == '\0')
+            continue;
+
+        /* Each table is handled once, along with the chains of any later
+         * access types sharing it.
+        */
+        for(j=0; j < i; j++)
+            if(strcmp(ch[j].table, ch[i].table) == 0)
+                break;
+        if(j < i)
+            continue;
+
+        p        = restore_buf;
+        left     = restore_len;
+        in_batch = 0;
+
+        res   = snprintf(p, left, "*%s\n", ch[i].table);
+        p    += res;
+        left -= res;
+
+        for(n=0; n < count; n++)
+        {
+            if(strcmp(ch[chains[n]].table, ch[i].table) != 0
+                    || ! restore_rule_spec(rules[n], ch[i].table, spec, sizeof(spec)))
+                continue;
+
+            res   = snprintf(p, left, "%s %s %s\n", op, ch[chains[n]].to_chain, spec);
+            p    += res;
+            left -= res;
+
+            done[n] = -1;
+            in_batch++;
+        }
+
+        if(in_batch == 0)
+            continue;
+
+        snprintf(p, left, "COMMIT\n");
+
+        zero_cmd_buffers();
+
+        strlcpy(cmd_buf, restore_cmd, CMD_BUFSIZE);
+
+        res = run_extcmd_write(cmd_buf, restore_buf, &pid_status, opts);
+
+        log_msg(LOG_DEBUG, "restore_rules() CMD: '%s' (res: %d, input: %s)",
+            cmd_buf, res, restore_buf);
+
+        if(! EXTCMD_IS_SUCCESS(res))
+            log_msg(LOG_WARNING,
+                    "restore_rules() Error %i from cmd:'%s' for %i rules in table %s, retrying them one at a time",
+                    res, cmd_buf, in_batch, ch[i].table);
+
+        for(n=0; n < count; n++)
+            if(done[n] == -1)
+                done[n] = EXTCMD_IS_SUCCESS(res) ? 1 : 0;
+    }
+
+    free(restore_buf);
+    return;
+}
+
+/* Bookkeeping for a rule that made it into the firewall
+*/
+static void
+rule_added(struct fw_chain * const chain, const char * const rule_buf,
+        const unsigned int exp_ts, const time_t now, const char * const added_msg)
+{
+    log_msg(LOG_INFO, "%s", added_msg);
+
+    chain->active_rules++;
+
+    /* Reset the next expected expire time for this chain if it
+    * is warranted.
+    */
+    if(chain->next_expire < now || exp_ts < chain->next_expire)
+        chain->next_expire = exp_ts;
+
+    /* If the rule can't be indexed it is still picked up by the
+     * garbage collection pass in check_firewall_rules().
+    */
+    if(fw_expiry_add(&rule_expiry, exp_ts, chain->type, rule_buf) != 0)
+        log_msg(LOG_WARNING,
+                "Could not index rule in %s for expiry, leaving it to the periodic rule check",
+                chain->to_chain);
+
+    return;
+}
+
+/* Add everything that was queued by queue_rule() in one go.  Rules that
+ * could not be added that way are retried one at a time, so an error is
+ * reported for each rule that really failed.
+*/
+static void
+apply_pending_rules(const fko_srv_options_t * const opts)
+{
+    struct fw_chain *ch = opts->fw_config->chain;
+    int              chains[IPT_BATCH_MAX_RULES], done[IPT_BATCH_MAX_RULES];
+    char            *rules[IPT_BATCH_MAX_RULES];
+    int              i, j, count = pending_count;
+    time_t           now;
+
+    for(i=0; i < count; i++)
+    {
+        chains[i] = pending_rules[i].chain;
+        rules[i]  = pending_rules[i].rule;
+        done[i]   = 0;
+
+        /* Check to make sure that the chain and jump rule exist, once
+         * per chain in the batch.
+        */
+        for(j=0; j < i; j++)
+            if(chains[j] == chains[i])
+                break;
+        if(j == i)
+            mk_chain(opts, chains[i]);
+    }
+
+    if(count > 1)
+        restore_rules(opts, "-A", chains, rules, count, done);
+
+    time(&now);
+
+    for(i=0; i < count; i++)
+        if(done[i] || create_rule(opts, ch[chains[i]].to_chain, rules[i]))
+            rule_added(&ch[chains[i]], rules[i], pending_rules[i].exp_ts,
+                    now, pending_rules[i].added_msg);
+
+    pending_count = 0;
+    return;
+}
+
+/* Hold a rule back for the next batch.  Without a per rule 'iptables -C'
+ * check, the same rule asked for twice is caught here against the batch
+ * and the rules added since fwknopd started.  Rules that could match one
+ * from before that never get here (see seed_preexisting_rules()).
+*/
+static void
+queue_rule(const fko_srv_options_t * const opts, struct fw_chain * const chain,
+        const char * const rule_buf, const unsigned int exp_ts,
+        const char * const added_msg)
+{
+    int i;
+
+    for(i=0; i < pending_count; i++)
+    {
+        if(pending_rules[i].chain == chain->type
+                && strcmp(pending_rules[i].rule, rule_buf) == 0)
+            return;
+    }
+
+    if(fw_expiry_exists(&rule_expiry, exp_ts, chain->type, rule_buf))
+    {
+        log_msg(LOG_DEBUG, "queue_rule() Rule : '%s' in %s already exists",
+                rule_buf, chain->to_chain);
+        return;
+    }
+
+    if(pending_count == 0)
+        gettimeofday(&pending_since, NULL);
+
+    pending_rules[pending_count].chain  = chain->type;
+    pending_rules[pending_count].exp_ts = exp_ts;
+    strlcpy(pending_rules[pending_count].rule, rule_buf, CMD_BUFSIZE);
+    strlcpy(pending_rules[pending_count].added_msg, added_msg, CMD_BUFSIZE);
+    pending_count++;
+
+    if(pending_count == IPT_BATCH_MAX_RULES)
+        apply_pending_rules(opts);
+
+    return;
+}
+
+/* Add the queued rules once the batch window has passed (or right away
+ * with force).  Returns the number of microseconds until the queued rules
+ * are due, 0 if nothing is left waiting.
+*/
+int
+fw_apply_pending_rules(const fko_srv_options_t * const opts, const int force)
+{
+    struct timeval  tv;
+    long            elapsed;
+
+    if(pending_count == 0)
+        return 0;
+
+    gettimeofday(&tv, NULL);
+    elapsed = (tv.tv_sec - pending_since.tv_sec) * 1000000
+        + (tv.tv_usec - pending_since.tv_usec);
+
+    if(!force && elapsed >= 0 && elapsed < batch_window_us)
+        return batch_window_us - elapsed;
+
+    apply_pending_rules(opts);
+    return 0;
+}
+
 static void
 connmark_rule(const fko_srv_options_t * const opts,
         const char * const complete_rule_buf,
@@ -1044,6 +1490,7 @@ connmark_rule(const fko_srv_options_t * const opts,
         const char * const access_msg)
 {
     char rule_buf[CMD_BUFSIZE] = {0};
+    char added_msg[CMD_BUFSIZE] = {0};
 
     if(complete_rule_buf != NULL && complete_rule_buf[0] != 0x0)
     {
@@ -1064,6 +1511,21 @@ connmark_rule(const fko_srv_options_t * const opts,
         );
     }
 
+    snprintf(added_msg, CMD_BUFSIZE-1,
+            "Added %s rule to %s for %s -> %s port %d, expires at %u",
+            msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
+            port, exp_ts);
+
+    /* With IPT_BATCH_WINDOW set the rule goes out with the next batch
+     * instead (see fw_apply_pending_rules()), unless one of the rules
+     * from before fwknopd started could be the same.
+    */
+    if(batch_window_us > 0 && ! preexisting_rule_exp(chain->type, exp_ts))
+    {
+        queue_rule(opts, chain, rule_buf, exp_ts, added_msg);
+        return;
+    }
+
     /* Check to make sure that the chain and jump rule exist
     */
     mk_chain(opts, chain->type);
@@ -1072,20 +1534,7 @@ connmark_rule(const fko_srv_options_t * const opts,
                 dstip, port, nat_ip, nat_port, exp_ts, mark) == 0)
     {
         if(create_rule(opts, chain->to_chain, rule_buf))
-        {
-            log_msg(LOG_INFO, "Added %s rule to %s for %s -> %s port %d, expires at %u",
-                msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
-                port, exp_ts
-            );
-
-            chain->active_rules++;
-
-            /* Reset the next expected expire time for this chain if it
-            * is warranted.
-            */
-            if(chain->next_expire < now || exp_ts < chain->next_expire)
-                chain->next_expire = exp_ts;
-        }
+            rule_added(chain, rule_buf, exp_ts, now, added_msg);
     }
 
     return;
@@ -1110,6 +1559,7 @@ ipt_rule(const fko_srv_options_t * const opts,
         const char * const access_msg)
 {
     char rule_buf[CMD_BUFSIZE] = {0};
+    char added_msg[CMD_BUFSIZE] = {0};
 
     if(complete_rule_buf != NULL && complete_rule_buf[0] != 0x0)
     {
@@ -1130,6 +1580,21 @@ ipt_rule(const fko_srv_options_t * const opts,
         );
     }
 
+    snprintf(added_msg, CMD_BUFSIZE-1,
+            "Added %s rule to %s for %s -> %s port %d, expires at %u",
+            msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
+            port, exp_ts);
+
+    /* With IPT_BATCH_WINDOW set the rule goes out with the next batch
+     * instead (see fw_apply_pending_rules()), unless one of the rules
+     * from before fwknopd started could be the same.
+    */
+    if(batch_window_us > 0 && ! preexisting_rule_exp(chain->type, exp_ts))
+    {
+        queue_rule(opts, chain, rule_buf, exp_ts, added_msg);
+        return;
+    }
+
     /* Check to make sure that the chain and jump rule exist
     */
     mk_chain(opts, chain->type);
@@ -1138,20 +1603,7 @@ ipt_rule(const fko_srv_options_t * const opts,
                 dstip, port, nat_ip, nat_port, exp_ts, 0) == 0)
     {
         if(create_rule(opts, chain->to_chain, rule_buf))
-        {
-            log_msg(LOG_INFO, "Added %s rule to %s for %s -> %s port %d, expires at %u",
-                msg, chain->to_chain, srcip, (dstip == NULL) ? IPT_ANY_IP : dstip,
-                port, exp_ts
-            );
-
-            chain->active_rules++;
-
-            /* Reset the next expected expire time for this chain if it
-            * is warranted.
-            */
-            if(chain->next_expire < now || exp_ts < chain->next_expire)
-                chain->next_expire = exp_ts;
-        }
+            rule_added(chain, rule_buf, exp_ts, now, added_msg);
     }
 
     return;
@@ -1850,6 +2302,93 @@ rm_expired_rules(const fko_srv_options_t * const opts,
     return;
 }
 
+/* Remove one indexed rule with 'iptables -D <chain> <rule spec>'.
+*/
+static int
+del_indexed_rule(const fko_srv_options_t * const opts,
+        const fw_expiry_ent_t * const ent)
+{
+    int res;
+
+    zero_cmd_buffers();
+
+    res = snprintf(cmd_buf, CMD_BUFSIZE-1, "%s -D %s %s",
+            opts->fw_config->fw_command,
+            opts->fw_config->chain[ent->chain].to_chain,
+            ent->rule);
+    if(res < 0 || res >= CMD_BUFSIZE-1)
+    {
+        log_msg(LOG_ERR, "del_indexed_rule() command too long for rule: %s",
+                ent->rule);
+        return 0;
+    }
+
+    res = run_extcmd(cmd_buf, err_buf, CMD_BUFSIZE, WANT_STDERR,
+                NO_TIMEOUT, &pid_status, opts);
+    chop_newline(err_buf);
+
+    log_msg(LOG_DEBUG, "del_indexed_rule() CMD: '%s' (res: %d, err: %s)",
+        cmd_buf, res, err_buf);
+
+    if(EXTCMD_IS_SUCCESS(res))
+        return 1;
+
+    log_msg(LOG_ERR, "del_indexed_rule() Error %i from cmd:'%s': %s",
+            res, cmd_buf, err_buf);
+    return 0;
+}
+
+/* Pop every expired rule off the index and delete it.
+*/
+static void
+rm_indexed_expired_rules(const fko_srv_options_t * const opts, const time_t now)
+{
+    struct fw_chain *ch = opts->fw_config->chain;
+    fw_expiry_ent_t  expired[FW_EXPIRY_BATCH_SIZE];
+    int              chains[FW_EXPIRY_BATCH_SIZE], done[FW_EXPIRY_BATCH_SIZE];
+    char            *rules[FW_EXPIRY_BATCH_SIZE];
+    int              i, count;
+
+    do
+    {
+        count = 0;
+        while(count < FW_EXPIRY_BATCH_SIZE
+                && fw_expiry_pop(&rule_expiry, now, &expired[count]))
+        {
+            chains[count] = expired[count].chain;
+            rules[count]  = expired[count].rule;
+            done[count]   = 0;
+            count++;
+        }
+
+        if(count == 0)
+            break;
+
+        if(count > 1 && opts->fw_config->fw_restore_command[0] != '\0')
+            restore_rules(opts, "-D", chains, rules, count, done);
+
+        for(i=0; i < count; i++)
+        {
+            if(done[i] || del_indexed_rule(opts, &expired[i]))
+            {
+                log_msg(LOG_INFO, "Removed rule from %s with expire time of %u",
+                    ch[expired[i].chain].to_chain, expired[i].expire
+                );
+
+                if (ch[expired[i].chain].active_rules > 0)
+                    ch[expired[i].chain].active_rules--;
+            }
+            free(expired[i].rule);
+        }
+    } while(count == FW_EXPIRY_BATCH_SIZE);
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+        if(ch[i].active_rules < 1)
+            ch[i].next_expire = 0;
+
+    return;
+}
+
 /* Iterate over the configure firewall access chains and purge expired
  * firewall rules.
 */
@@ -1867,16 +2406,20 @@ check_firewall_rules(const fko_srv_options_t * const opts,
 
     time(&now);
 
+    /* Rules fwknopd added itself are removed straight from the expiry
+     * index, without listing any chain.
+    */
+    rm_indexed_expired_rules(opts, now);
+
+    /* Listing the chains is left to the periodic garbage collection pass.
+    */
+    if(!chk_rm_all)
+        return;
+
     /* Iterate over each chain and look for active rules to delete.
     */
     for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
     {
-        /* If there are no active rules or we have not yet
-         * reached our expected next expire time, continue.
-        */
-        if(!chk_rm_all && (ch[i].active_rules == 0 || ch[i].next_expire > now))
-            continue;
-
         if(ch[i].table[0] == '\0' || ch[i].to_chain[i] == '\0')
             continue;
 
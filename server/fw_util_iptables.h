@@ -35,6 +35,10 @@
 
 #define SNAT_TARGET_BUFSIZE         64
 
+/* Most rules held back for one iptables-restore run (IPT_BATCH_WINDOW)
+*/
+#define IPT_BATCH_MAX_RULES         64
+
 #if HAVE_EXECVPE
   #define SH_REDIR "" /* the shell is not used when execvpe() is available */
 #else
@@ -0,0 +1,1116 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_util_nftables.c
+ *
+ * Purpose: Fwknop routines for managing nftables firewall rules.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+
+#include "fwknopd_common.h"
+
+#ifdef FIREWALL_NFTABLES
+
+#include "fw_util.h"
+#include "utils.h"
+#include "log_msg.h"
+#include "extcmd.h"
+#include "access.h"
+
+#if HAVE_LIBNFTABLES
+  #include <nftables/libnftables.h>
+#endif
+
+/* Unlike the iptables module there are no rules per SPA request here.
+ * Each access type has a set (or a map) and one rule at the top of its
+ * chain that looks packets up in it.  Granting access is adding an element
+ * with a timeout, and the kernel removes it again once the timeout is up,
+ * so there is nothing to expire or garbage collect in fwknopd.
+*/
+
+/* One set and the rule looking it up
+*/
+struct nft_lookup {
+    char    set[MAX_NFT_SET_NAME_LEN + sizeof(NFT_ALL_SET_SUFFIX)];
+    char    key_type[NFT_TYPE_LEN];
+    char    data_type[NFT_TYPE_LEN];    /* empty for a set, a map otherwise */
+    char    stmt[NFT_STMT_LEN];
+};
+
+enum {
+    NFT_LOOKUP_MAIN,
+    NFT_LOOKUP_ALL,     /* FORWARD_ALL, only for forwarding and DNAT */
+    NFT_NUM_LOOKUPS
+};
+
+/* Elements of one SPA request waiting to go out in a single transaction
+*/
+typedef struct nft_grant
+{
+    int     count;
+    char    cmds[NFT_MAX_GRANT_ELEMS][NFT_ELEM_CMD_BUFSIZE];
+    char    added_msg[NFT_MAX_GRANT_ELEMS][CMD_BUFSIZE];  /* logged once the element is in */
+} nft_grant_t;
+
+static struct fw_config     fwc;
+static struct nft_lookup    lookups[NUM_FWKNOP_ACCESS_TYPES][NFT_NUM_LOOKUPS];
+static nft_grant_t          grant;
+static char                 cmd_buf[NFT_CMD_BUFSIZE];
+static char                 nft_out[NFT_LIST_BUFSIZE];
+static int                  pid_status = 0;
+
+#if HAVE_LIBNFTABLES
+static struct nft_ctx      *nft = NULL;
+#endif
+
+/* Base chain created when the configured chain does not exist yet
+*/
+static const char * const chain_spec[NUM_FWKNOP_ACCESS_TYPES] = {
+    "type filter hook input priority 0 ;",
+    "type filter hook output priority 0 ;",
+    "type filter hook forward priority 0 ;",
+    "type nat hook prerouting priority -100 ;"
+};
+
+/* Run nft commands (one per line) as a single transaction.  With out set,
+ * cmds must be a single command whose output (with rule handles) is
+ * copied to out.  Returns 1 on success, errors are logged unless quiet.
+*/
+static int
+nft_run(const fko_srv_options_t * const opts, const char * const cmds,
+        char * const out, const size_t out_len, const int quiet)
+{
+#if HAVE_LIBNFTABLES
+    const char *err;
+    int         res;
+
+    if(nft == NULL)
+    {
+        if((nft = nft_ctx_new(NFT_CTX_DEFAULT)) == NULL)
+        {
+            log_msg(LOG_ERR, "nft_run() nft_ctx_new() failed");
+            return 0;
+        }
+        nft_ctx_buffer_output(nft);
+        nft_ctx_buffer_error(nft);
+        nft_ctx_output_set_flags(nft, NFT_CTX_OUTPUT_HANDLE);
+    }
+
+    res = nft_run_cmd_from_buffer(nft, cmds);
+
+    /* Fetching the buffers also resets them for the next command
+    */
+    if(out != NULL)
+        strlcpy(out, nft_ctx_get_output_buffer(nft), out_len);
+    else
+        nft_ctx_get_output_buffer(nft);
+    err = nft_ctx_get_error_buffer(nft);
+
+    log_msg(LOG_DEBUG, "nft_run() CMD: '%s' (res: %d)", cmds, res);
+
+    if(res != 0)
+    {
+        if(! quiet)
+            log_msg(LOG_ERR, "nft_run() Error %i from cmd:'%s': %s",
+                    res, cmds, err);
+        return 0;
+    }
+    return 1;
+#else
+    int res;
+
+    memset(cmd_buf, 0x0, sizeof(cmd_buf));
+
+    if(out == NULL)
+        res = snprintf(cmd_buf, sizeof(cmd_buf), "%s -f -", fwc.fw_command);
+    else
+        res = snprintf(cmd_buf, sizeof(cmd_buf), "%s -a %s", fwc.fw_command, cmds);
+
+    if(res < 0 || (size_t)res >= sizeof(cmd_buf))
+    {
+        log_msg(LOG_ERR, "nft_run() command too long: '%s'", cmds);
+        return 0;
+    }
+
+    if(out == NULL)
+        res = run_extcmd_write(cmd_buf, cmds, &pid_status, opts);
+    else
+    {
+        memset(out, 0x0, out_len);
+        res = run_extcmd(cmd_buf, out, out_len, WANT_STDERR,
+                NO_TIMEOUT, &pid_status, opts);
+    }
+
+    log_msg(LOG_DEBUG, "nft_run() CMD: '%s' (res: %d, input: %s)",
+        cmd_buf, res, cmds);
+
+    if(! EXTCMD_IS_SUCCESS(res))
+    {
+        if(! quiet)
+            log_msg(LOG_ERR, "nft_run() Error %i from cmd:'%s': %s",
+                    res, cmd_buf, (out == NULL) ? cmds : out);
+        return 0;
+    }
+    return 1;
+#endif
+}
+
+static int
+lookup_in_use(const int type, const int n)
+{
+    return fwc.set[type].set[0] != '\0' && lookups[type][n].set[0] != '\0';
+}
+
+/* Work out the set key and the lookup rule for one access type.  Keys are
+ * built from the same fields the iptables module matches on.  Returns 1 on
+ * success, or 0 if a name is too long to fit.
+*/
+static int
+set_lookups(const int type)
+{
+    const struct fw_set * const s  = &(fwc.set[type]);
+    struct nft_lookup * const main = &(lookups[type][NFT_LOOKUP_MAIN]);
+    struct nft_lookup * const all  = &(lookups[type][NFT_LOOKUP_ALL]);
+
+    char        match[NFT_TYPE_LEN] = {0};
+    char        all_set[sizeof(all->set)] = {0};
+    const char *dnat_family = (strcmp(s->family, "inet") == 0) ? "ip " : "";
+    int         res;
+
+    memset(lookups[type], 0x0, sizeof(lookups[type]));
+
+    strlcpy(main->set, s->set, sizeof(main->set));
+
+    switch(type)
+    {
+        case NFT_INPUT_ACCESS:
+        case NFT_OUTPUT_ACCESS:
+        case NFT_DNAT_ACCESS:
+            snprintf(main->key_type, sizeof(main->key_type),
+                "ipv4_addr . %sinet_proto . inet_service",
+                fwc.use_destination ? "ipv4_addr . " : "");
+
+            if(type == NFT_OUTPUT_ACCESS)
+                snprintf(match, sizeof(match),
+                    "ip daddr . %smeta l4proto . th sport",
+                    fwc.use_destination ? "ip saddr . " : "");
+            else
+                snprintf(match, sizeof(match),
+                    "ip saddr . %smeta l4proto . th dport",
+                    fwc.use_destination ? "ip daddr . " : "");
+            break;
+
+        case NFT_FORWARD_ACCESS:
+            strlcpy(main->key_type, "ipv4_addr . ipv4_addr . inet_proto . inet_service",
+                    sizeof(main->key_type));
+            strlcpy(match, "ip saddr . ip daddr . meta l4proto . th dport",
+                    sizeof(match));
+            break;
+    }
+
+    /* The statements are built from the configured set name rather than
+     * from main->set, snprintf() must not read from what it writes to.
+    */
+    if(type == NFT_DNAT_ACCESS)
+    {
+        strlcpy(main->data_type, "ipv4_addr . inet_service", sizeof(main->data_type));
+        res = snprintf(main->stmt, sizeof(main->stmt), "dnat %sto %s map @%s",
+                dnat_family, match, s->set);
+    }
+    else if(fwc.use_ct_mark && type != NFT_OUTPUT_ACCESS)
+    {
+        /* The SDP ID is the element's value, and the lookup both matches
+         * and sets the connection mark
+        */
+        strlcpy(main->data_type, "mark", sizeof(main->data_type));
+        res = snprintf(main->stmt, sizeof(main->stmt), "ct mark set %s map @%s accept",
+                match, s->set);
+    }
+    else
+        res = snprintf(main->stmt, sizeof(main->stmt), "%s @%s accept",
+                match, s->set);
+
+    if(res < 0 || (size_t)res >= sizeof(main->stmt))
+        return 0;
+
+    if(type != NFT_FORWARD_ACCESS && type != NFT_DNAT_ACCESS)
+        return 1;
+
+    strlcpy(all_set, s->set, sizeof(all_set));
+    if(strlcat(all_set, NFT_ALL_SET_SUFFIX, sizeof(all_set)) >= sizeof(all_set))
+        return 0;
+    strlcpy(all->set, all_set, sizeof(all->set));
+
+    if(type == NFT_FORWARD_ACCESS)
+    {
+        strlcpy(all->key_type, "ipv4_addr", sizeof(all->key_type));
+        if(fwc.use_ct_mark)
+        {
+            strlcpy(all->data_type, "mark", sizeof(all->data_type));
+            res = snprintf(all->stmt, sizeof(all->stmt),
+                    "ct mark set ip saddr map @%s accept", all_set);
+        }
+        else
+            res = snprintf(all->stmt, sizeof(all->stmt),
+                    "ip saddr @%s accept", all_set);
+    }
+    else
+    {
+        snprintf(all->key_type, sizeof(all->key_type), "ipv4_addr%s",
+                fwc.use_destination ? " . ipv4_addr" : "");
+        strlcpy(all->data_type, "ipv4_addr", sizeof(all->data_type));
+        res = snprintf(all->stmt, sizeof(all->stmt), "dnat %sto ip saddr%s map @%s",
+                dnat_family, fwc.use_destination ? " . ip daddr" : "", all_set);
+    }
+
+    if(res < 0 || (size_t)res >= sizeof(all->stmt))
+        return 0;
+
+    return 1;
+}
+
+/* Delete the lookup rules fwknopd inserted into the chain of one access
+ * type, found by their comment.
+*/
+static void
+delete_lookup_rules(const fko_srv_options_t * const opts, const int type)
+{
+    const struct fw_set * const s = &(fwc.set[type]);
+
+    char        list_cmd[CMD_BUFSIZE] = {0};
+    char        del_buf[CMD_BUFSIZE * NFT_NUM_LOOKUPS] = {0};
+    char        needle[MAX_LINE_LEN];
+    char       *line, *ndx, *saveptr = NULL;
+    size_t      del_len = 0;
+    uint64_t    handle;
+    int         n, res;
+
+    snprintf(list_cmd, sizeof(list_cmd), NFT_LIST_CHAIN_CMD,
+            s->family, s->table, s->chain);
+
+    if(nft_run(opts, list_cmd, nft_out, sizeof(nft_out), 1) != 1)
+        return;
+
+    for(line = strtok_r(nft_out, "\n", &saveptr); line != NULL;
+            line = strtok_r(NULL, "\n", &saveptr))
+    {
+        for(n=0; n < NFT_NUM_LOOKUPS; n++)
+        {
+            if(! lookup_in_use(type, n))
+                continue;
+
+            res = snprintf(needle, sizeof(needle), "comment \"" NFT_RULE_COMMENT " %s\"",
+                    lookups[type][n].set);
+            if(res > 0 && (size_t)res < sizeof(needle) && strstr(line, needle) != NULL)
+                break;
+        }
+
+        if(n == NFT_NUM_LOOKUPS || (ndx = strstr(line, "# handle ")) == NULL)
+            continue;
+
+        handle = strtoull(ndx + strlen("# handle "), NULL, 10);
+        if(handle == 0)
+            continue;
+
+        del_len += snprintf(del_buf + del_len, sizeof(del_buf) - del_len,
+                NFT_DEL_RULE_CMD, s->family, s->table, s->chain, handle);
+        if(del_len >= sizeof(del_buf))
+            break;
+    }
+
+    if(del_buf[0] != '\0')
+        nft_run(opts, del_buf, NULL, 0, 0);
+
+    return;
+}
+
+/* Quietly remove everything fwknopd added: the lookup rules first, sets
+ * that are still referenced can't be deleted.
+*/
+static void
+delete_all_sets(const fko_srv_options_t * const opts)
+{
+    char    del_buf[CMD_BUFSIZE];
+    int     i, n, res;
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        if(fwc.set[i].set[0] == '\0')
+            continue;
+
+        delete_lookup_rules(opts, i);
+
+        for(n=0; n < NFT_NUM_LOOKUPS; n++)
+        {
+            if(! lookup_in_use(i, n))
+                continue;
+
+            res = snprintf(del_buf, sizeof(del_buf), NFT_DEL_SET_CMD,
+                    lookups[i][n].data_type[0] ? "map" : "set",
+                    fwc.set[i].family, fwc.set[i].table, lookups[i][n].set);
+
+            if(res > 0 && (size_t)res < sizeof(del_buf))
+                nft_run(opts, del_buf, NULL, 0, 1);
+        }
+    }
+    return;
+}
+
+/* Make sure the table, chain, sets and lookup rules for one access type
+ * exist.  Returns 1 on success.
+*/
+static int
+create_lookups(const fko_srv_options_t * const opts, const int type)
+{
+    const struct fw_set * const s = &(fwc.set[type]);
+
+    char        list_cmd[CMD_BUFSIZE] = {0};
+    char        add_buf[CMD_BUFSIZE * (NFT_NUM_LOOKUPS + 2)] = {0};
+    char        needle[MAX_LINE_LEN];
+    size_t      add_len = 0;
+    int         n, chain_exists;
+
+    snprintf(list_cmd, sizeof(list_cmd), NFT_LIST_CHAIN_CMD,
+            s->family, s->table, s->chain);
+    chain_exists = nft_run(opts, list_cmd, nft_out, sizeof(nft_out), 1);
+
+    add_len += snprintf(add_buf + add_len, sizeof(add_buf) - add_len,
+            NFT_ADD_TABLE_CMD, s->family, s->table);
+
+    if(! chain_exists)
+        add_len += snprintf(add_buf + add_len, sizeof(add_buf) - add_len,
+                NFT_ADD_CHAIN_CMD, s->family, s->table, s->chain,
+                chain_spec[type]);
+
+    for(n=0; n < NFT_NUM_LOOKUPS; n++)
+    {
+        if(! lookup_in_use(type, n))
+            continue;
+
+        if(lookups[type][n].data_type[0] != '\0')
+            add_len += snprintf(add_buf + add_len, sizeof(add_buf) - add_len,
+                    NFT_ADD_MAP_CMD, s->family, s->table, lookups[type][n].set,
+                    lookups[type][n].key_type, lookups[type][n].data_type);
+        else
+            add_len += snprintf(add_buf + add_len, sizeof(add_buf) - add_len,
+                    NFT_ADD_SET_CMD, s->family, s->table, lookups[type][n].set,
+                    lookups[type][n].key_type);
+    }
+
+    if(add_len >= sizeof(add_buf) || nft_run(opts, add_buf, NULL, 0, 0) != 1)
+        return 0;
+
+    /* Lookup rules left over from an earlier run (FLUSH_NFT_AT_INIT N) are
+     * kept, only missing ones are inserted.
+    */
+    if(nft_run(opts, list_cmd, nft_out, sizeof(nft_out), 0) != 1)
+        return 0;
+
+    memset(add_buf, 0x0, sizeof(add_buf));
+    add_len = 0;
+
+    for(n=0; n < NFT_NUM_LOOKUPS; n++)
+    {
+        if(! lookup_in_use(type, n))
+            continue;
+
+        snprintf(needle, sizeof(needle), "comment \"" NFT_RULE_COMMENT " %s\"",
+                lookups[type][n].set);
+        if(strstr(nft_out, needle) != NULL)
+            continue;
+
+        add_len += snprintf(add_buf + add_len, sizeof(add_buf) - add_len,
+                NFT_INSERT_RULE_CMD, s->family, s->table, s->chain,
+                lookups[type][n].stmt, lookups[type][n].set);
+    }
+
+    if(add_len == 0)
+        return 1;
+
+    if(add_len >= sizeof(add_buf))
+        return 0;
+
+    return nft_run(opts, add_buf, NULL, 0, 0);
+}
+
+/* Print all firewall rules currently instantiated by the running fwknopd
+ * daemon to stdout.
+*/
+int
+fw_dump_rules(const fko_srv_options_t * const opts)
+{
+    char    list_buf[CMD_BUFSIZE];
+    int     i, j, n, got_err = 0;
+
+    struct fw_set *s = opts->fw_config->set;
+
+    if (opts->fw_list_all == 1)
+    {
+        fprintf(stdout, "Listing all nftables rules in applicable tables...\n");
+        fflush(stdout);
+
+        for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+        {
+            if(s[i].set[0] == '\0')
+                continue;
+
+            /* Each table is listed once
+            */
+            for(j=0; j < i; j++)
+                if(s[j].set[0] != '\0'
+                        && strcmp(s[j].family, s[i].family) == 0
+                        && strcmp(s[j].table, s[i].table) == 0)
+                    break;
+            if(j < i)
+                continue;
+
+            snprintf(list_buf, sizeof(list_buf), NFT_LIST_TABLE_CMD,
+                    s[i].family, s[i].table);
+
+            if(nft_run(opts, list_buf, nft_out, sizeof(nft_out), 0) != 1)
+            {
+                got_err++;
+                continue;
+            }
+            fprintf(stdout, "\n%s", nft_out);
+            fflush(stdout);
+        }
+    }
+    else
+    {
+        fprintf(stdout, "Listing fwknopd nftables sets...\n");
+        fflush(stdout);
+
+        for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+        {
+            for(n=0; n < NFT_NUM_LOOKUPS; n++)
+            {
+                if(! lookup_in_use(i, n))
+                    continue;
+
+                snprintf(list_buf, sizeof(list_buf), NFT_LIST_SET_CMD,
+                        lookups[i][n].data_type[0] ? "map" : "set",
+                        s[i].family, s[i].table, lookups[i][n].set);
+
+                if(nft_run(opts, list_buf, nft_out, sizeof(nft_out), 0) != 1)
+                {
+                    got_err++;
+                    continue;
+                }
+                fprintf(stdout, "\n%s", nft_out);
+                fflush(stdout);
+            }
+        }
+    }
+
+    return(got_err);
+}
+
+/* Set the family, table, chain and set for one access type from its
+ * NFT_*_ACCESS config line.
+*/
+static int
+set_fw_set_conf(const int type, const char * const conf_str)
+{
+    int i, j;
+    char tbuf[MAX_LINE_LEN]  = {0};
+    const char *ndx          = conf_str;
+
+    char *set_fields[FW_NUM_SET_FIELDS];
+
+    struct fw_set *s = &(fwc.set[type]);
+
+    if(conf_str == NULL)
+    {
+        log_msg(LOG_ERR, "[*] NULL conf_str");
+        return 0;
+    }
+
+    s->type = type;
+
+    set_fields[0] = tbuf;
+
+    i = 0;
+    j = 1;
+    while(*ndx != '\0')
+    {
+        if(*ndx != ' ')
+        {
+            if(*ndx == ',')
+            {
+                if(j == FW_NUM_SET_FIELDS)
+                {
+                    j++;
+                    break;
+                }
+                tbuf[i] = '\0';
+                set_fields[j++] = &(tbuf[++i]);
+            }
+            else
+                tbuf[i++] = *ndx;
+        }
+        if(*ndx != '\0'
+                && *ndx != ' '
+                && *ndx != ','
+                && *ndx != '_'
+                && isalnum(*ndx) == 0)
+        {
+            log_msg(LOG_ERR, "[*] nftables access config parse error: "
+                "invalid character '%c' for access type %i, "
+                "line: %s", *ndx, type, conf_str);
+            return 0;
+        }
+        ndx++;
+    }
+
+    if(j != FW_NUM_SET_FIELDS)
+    {
+        log_msg(LOG_ERR, "[*] nftables access config parse error: "
+            "wrong number of fields for access type %i, "
+            "line: %s", type, conf_str);
+        return 0;
+    }
+
+    /* Sets are keyed on IPv4 addresses, so only tables that see IPv4
+     * traffic will do
+    */
+    if(strcmp(set_fields[0], "ip") != 0 && strcmp(set_fields[0], "inet") != 0)
+    {
+        log_msg(LOG_ERR, "[*] nftables family must be 'ip' or 'inet', "
+            "line: %s", conf_str);
+        return 0;
+    }
+
+    strlcpy(s->family, set_fields[0], sizeof(s->family));
+    strlcpy(s->table, set_fields[1], sizeof(s->table));
+    strlcpy(s->chain, set_fields[2], sizeof(s->chain));
+    strlcpy(s->set, set_fields[3], sizeof(s->set));
+
+    return 1;
+}
+
+int
+fw_config_init(fko_srv_options_t * const opts)
+{
+    int i;
+
+    memset(&fwc, 0x0, sizeof(struct fw_config));
+    memset(lookups, 0x0, sizeof(lookups));
+
+    /* Set our firewall exe command path, only used when fwknopd is not
+     * built against libnftables.
+    */
+    strlcpy(fwc.fw_command, opts->config[CONF_FIREWALL_EXE], sizeof(fwc.fw_command));
+
+#if HAVE_LIBFIU
+    fiu_return_on("fw_config_init", 0);
+#endif
+
+    if(strncasecmp(opts->config[CONF_ENABLE_DESTINATION_RULE], "Y", 1)==0)
+        fwc.use_destination = 1;
+
+    if(strncasecmp(opts->config[CONF_DISABLE_CONNECTION_TRACKING], "N", 1)==0)
+        fwc.use_ct_mark = 1;
+
+    /* NFT_INPUT_ACCESS is the only one that is required, the rest are
+     * optional.
+    */
+    if(set_fw_set_conf(NFT_INPUT_ACCESS, opts->config[CONF_NFT_INPUT_ACCESS]) != 1)
+        return 0;
+
+    if(strncasecmp(opts->config[CONF_ENABLE_NFT_OUTPUT], "Y", 1)==0)
+        if(set_fw_set_conf(NFT_OUTPUT_ACCESS, opts->config[CONF_NFT_OUTPUT_ACCESS]) != 1)
+            return 0;
+
+    if(strncasecmp(opts->config[CONF_ENABLE_NFT_FORWARDING], "Y", 1)==0
+            || strncasecmp(opts->config[CONF_ENABLE_NFT_LOCAL_NAT], "Y", 1)==0)
+    {
+        if(set_fw_set_conf(NFT_FORWARD_ACCESS, opts->config[CONF_NFT_FORWARD_ACCESS]) != 1)
+            return 0;
+
+        if(set_fw_set_conf(NFT_DNAT_ACCESS, opts->config[CONF_NFT_DNAT_ACCESS]) != 1)
+            return 0;
+    }
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        if(fwc.set[i].set[0] == '\0')
+            continue;
+
+        if(set_lookups(i) != 1)
+        {
+            log_msg(LOG_ERR, "[*] nftables set name '%s' is too long",
+                fwc.set[i].set);
+            return 0;
+        }
+    }
+
+    /* Let us find it via our opts struct as well.
+    */
+    opts->fw_config = &fwc;
+
+    return 1;
+}
+
+int
+fw_initialize(const fko_srv_options_t * const opts)
+{
+    int i, res = 1;
+
+    /* Start from empty sets (just in case).
+    */
+    if(strncasecmp(opts->config[CONF_FLUSH_NFT_AT_INIT], "Y", 1) == 0)
+        delete_all_sets(opts);
+
+    for(i=0; i < NUM_FWKNOP_ACCESS_TYPES; i++)
+    {
+        if(fwc.set[i].set[0] == '\0')
+            continue;
+
+        if(create_lookups(opts, i) != 1)
+        {
+            log_msg(LOG_WARNING,
+                    "fw_initialize() Warning: Errors detected creating nftables set %s in %s %s",
+                    fwc.set[i].set, fwc.set[i].family, fwc.set[i].table);
+            res = 0;
+        }
+    }
+
+    return(res);
+}
+
+int
+fw_cleanup(const fko_srv_options_t * const opts)
+{
+    if(strncasecmp(opts->config[CONF_FLUSH_NFT_AT_EXIT], "Y", 1) == 0
+            || opts->fw_flush != 0)
+        delete_all_sets(opts);
+
+#if HAVE_LIBNFTABLES
+    if(nft != NULL)
+    {
+        nft_ctx_free(nft);
+        nft = NULL;
+    }
+#endif
+
+    return(0);
+}
+
+/* Send out everything added by grant_access() in one transaction.  When
+ * that fails the elements are retried one at a time, so an error is
+ * reported for each one that really failed.
+*/
+static void
+commit_grants(const fko_srv_options_t * const opts)
+{
+    char   *batch_buf;
+    size_t  batch_len = 0;
+    int     n;
+
+    if(grant.count == 0)
+        return;
+
+    if(grant.count > 1
+            && (batch_buf = calloc(grant.count, NFT_ELEM_CMD_BUFSIZE)) != NULL)
+    {
+        for(n=0; n < grant.count; n++)
+            batch_len += strlcpy(batch_buf + batch_len, grant.cmds[n],
+                    grant.count * NFT_ELEM_CMD_BUFSIZE - batch_len);
+
+        if(nft_run(opts, batch_buf, NULL, 0, 1) == 1)
+        {
+            for(n=0; n < grant.count; n++)
+                log_msg(LOG_INFO, "%s", grant.added_msg[n]);
+            free(batch_buf);
+            grant.count = 0;
+            return;
+        }
+
+        log_msg(LOG_WARNING,
+                "commit_grants() nft transaction of %i elements failed, retrying them one at a time",
+                grant.count);
+        free(batch_buf);
+    }
+
+    for(n=0; n < grant.count; n++)
+        if(nft_run(opts, grant.cmds[n], NULL, 0, 0) == 1)
+            log_msg(LOG_INFO, "%s", grant.added_msg[n]);
+
+    grant.count = 0;
+    return;
+}
+
+/* Add one element to the set of an access type, with the SPA timeout as
+ * its timeout.  data is the map value, NULL for sets.
+*/
+static void
+grant_access(const fko_srv_options_t * const opts,
+        const int type, const int n,
+        const char * const key,
+        const char * const data,
+        const unsigned int timeout,
+        const char * const srcip,
+        const char * const dstip,
+        const unsigned int port,
+        const unsigned int exp_ts,
+        const char * const msg)
+{
+    const struct fw_set * const s      = &(fwc.set[type]);
+    const struct nft_lookup * const lk = &(lookups[type][n]);
+
+    const char *sep = (data == NULL) ? "" : " : ";
+
+    if(! lookup_in_use(type, n))
+        return;
+
+    if(grant.count == NFT_MAX_GRANT_ELEMS)
+        commit_grants(opts);
+
+    snprintf(grant.cmds[grant.count], NFT_ELEM_CMD_BUFSIZE, NFT_GRANT_ELEM_CMD,
+            s->family, s->table, lk->set, key, timeout, sep, (data == NULL) ? "" : data,
+            s->family, s->table, lk->set, key,
+            s->family, s->table, lk->set, key, timeout, sep, (data == NULL) ? "" : data);
+
+    snprintf(grant.added_msg[grant.count], CMD_BUFSIZE-1,
+            "Added %s element to %s for %s -> %s port %d, expires at %u",
+            msg, lk->set, srcip, (dstip == NULL) ? "0.0.0.0" : dstip,
+            port, exp_ts);
+
+    grant.count++;
+    return;
+}
+
+/* INPUT access (and OUTPUT along with it for non-NAT access)
+*/
+static void
+input_access(const fko_srv_options_t * const opts,
+        spa_data_t * const spadat,
+        const unsigned int proto,
+        const unsigned int port,
+        const int with_output,
+        const unsigned int exp_ts,
+        const char * const msg)
+{
+    char    key[MAX_LINE_LEN] = {0};
+    char    mark[MAX_SDP_ID_STR_LEN] = {0};
+    char   *dstip = fwc.use_destination ? spadat->pkt_destination_ip : NULL;
+
+    snprintf(key, sizeof(key), "%s . %s%s%u . %u", spadat->use_src_ip,
+            (dstip == NULL) ? "" : dstip, (dstip == NULL) ? "" : " . ",
+            proto, port);
+
+    snprintf(mark, sizeof(mark), "%" PRIu32, spadat->sdp_id);
+
+    grant_access(opts, NFT_INPUT_ACCESS, NFT_LOOKUP_MAIN, key,
+            fwc.use_ct_mark ? mark : NULL, spadat->fw_access_timeout,
+            spadat->use_src_ip, dstip, port, exp_ts, msg);
+
+    /* OUTPUT elements use the same key, see set_lookups()
+    */
+    if(with_output)
+        grant_access(opts, NFT_OUTPUT_ACCESS, NFT_LOOKUP_MAIN, key, NULL,
+                spadat->fw_access_timeout, spadat->use_src_ip, dstip, port,
+                exp_ts, "OUTPUT");
+    return;
+}
+
+static void
+forward_access(const fko_srv_options_t * const opts,
+        const acc_stanza_t * const acc,
+        spa_data_t * const spadat,
+        const char * const nat_ip,
+        const unsigned int nat_port,
+        const unsigned int proto,
+        const unsigned int exp_ts)
+{
+    char    key[MAX_LINE_LEN] = {0};
+    char    mark[MAX_SDP_ID_STR_LEN] = {0};
+
+    snprintf(mark, sizeof(mark), "%" PRIu32, spadat->sdp_id);
+
+    if(acc->forward_all)
+    {
+        grant_access(opts, NFT_FORWARD_ACCESS, NFT_LOOKUP_ALL,
+                spadat->use_src_ip, fwc.use_ct_mark ? mark : NULL,
+                spadat->fw_access_timeout, spadat->use_src_ip, NULL,
+                ANY_PORT, exp_ts, "FORWARD ALL");
+        return;
+    }
+
+    snprintf(key, sizeof(key), "%s . %s . %u . %u", spadat->use_src_ip,
+            nat_ip, proto, nat_port);
+
+    grant_access(opts, NFT_FORWARD_ACCESS, NFT_LOOKUP_MAIN, key,
+            fwc.use_ct_mark ? mark : NULL, spadat->fw_access_timeout,
+            spadat->use_src_ip, nat_ip, nat_port, exp_ts, "FORWARD");
+    return;
+}
+
+static void
+dnat_access(const fko_srv_options_t * const opts,
+        const acc_stanza_t * const acc,
+        spa_data_t * const spadat,
+        const char * const nat_ip,
+        const unsigned int nat_port,
+        const unsigned int fst_proto,
+        const unsigned int fst_port,
+        const unsigned int exp_ts)
+{
+    char    key[MAX_LINE_LEN]  = {0};
+    char    data[MAX_LINE_LEN] = {0};
+    char   *dstip = fwc.use_destination ? spadat->pkt_destination_ip : NULL;
+
+    if(acc->forward_all)
+    {
+        snprintf(key, sizeof(key), "%s%s%s", spadat->use_src_ip,
+                (dstip == NULL) ? "" : " . ", (dstip == NULL) ? "" : dstip);
+
+        grant_access(opts, NFT_DNAT_ACCESS, NFT_LOOKUP_ALL, key, nat_ip,
+                spadat->fw_access_timeout, spadat->use_src_ip, dstip,
+                ANY_PORT, exp_ts, "DNAT ALL");
+        return;
+    }
+
+    snprintf(key, sizeof(key), "%s . %s%s%u . %u", spadat->use_src_ip,
+            (dstip == NULL) ? "" : dstip, (dstip == NULL) ? "" : " . ",
+            fst_proto, fst_port);
+    snprintf(data, sizeof(data), "%s . %u", nat_ip, nat_port);
+
+    grant_access(opts, NFT_DNAT_ACCESS, NFT_LOOKUP_MAIN, key, data,
+            spadat->fw_access_timeout, spadat->use_src_ip, dstip,
+            fst_port, exp_ts, "DNAT");
+    return;
+}
+
+/****************************************************************************/
+
+/* Rule Processing - Create an access request...
+*/
+int
+process_spa_request(const fko_srv_options_t * const opts,
+        const acc_stanza_t * const acc, spa_data_t * const spadat)
+{
+    char            nat_ip[MAX_IPV4_STR_LEN] = {0};
+    unsigned int    nat_port = 0;
+    unsigned int    fst_proto;
+    unsigned int    fst_port;
+
+    const int       with_output = (fwc.set[NFT_OUTPUT_ACCESS].set[0] != '\0');
+    const int       with_fwd    = (fwc.set[NFT_FORWARD_ACCESS].set[0] != '\0');
+    const int       with_dnat   = (fwc.set[NFT_DNAT_ACCESS].set[0] != '\0');
+
+    acc_port_list_t *port_list = NULL;
+    acc_port_list_t *ple = NULL;
+
+    service_data_list_t *next_service = spadat->service_data_list;
+    service_data_t      *sd;
+
+    char            *ndx = NULL;
+    int             res = 0, is_err;
+    time_t          now;
+    unsigned int    exp_ts;
+
+    /* Set our expire time value, only for the log (the kernel keeps
+     * track of the timeouts).
+    */
+    time(&now);
+    exp_ts = now + spadat->fw_access_timeout;
+
+    if(acc->force_snat || acc->force_masquerade)
+        log_msg(LOG_WARNING,
+                "FORCE_SNAT/FORCE_MASQUERADE are not supported with nftables, ignoring");
+
+    // if SPA message requested service IDs
+    if(spadat->service_data_list != NULL)
+    {
+        while(next_service != NULL)
+        {
+            sd = next_service->service_data;
+
+            if(sd->nat_port != 0)
+            {
+                if(sd->nat_ip_str[0] == 0)
+                    input_access(opts, spadat, sd->proto, sd->nat_port,
+                            0, exp_ts, "local NAT");
+                else if(with_fwd)
+                    forward_access(opts, acc, spadat, sd->nat_ip_str,
+                            sd->nat_port, sd->proto, exp_ts);
+
+                if(with_dnat && !acc->disable_dnat)
+                    dnat_access(opts, acc, spadat, sd->nat_ip_str,
+                            sd->nat_port, sd->proto, sd->port, exp_ts);
+            }
+            else
+                input_access(opts, spadat, sd->proto, sd->port,
+                        with_output, exp_ts, "access");
+
+            next_service = next_service->next;
+        }
+
+        commit_grants(opts);
+        return res;
+    }
+
+    /* Parse and expand our access message.
+    */
+    if(expand_acc_port_list(&port_list, spadat->spa_message_remain) != 1)
+    {
+        log_msg(LOG_WARNING, "Failed to parse port list in SPA message");
+        free_acc_port_list(port_list);
+        return res;
+    }
+
+    /* Start at the top of the proto-port list...
+    */
+    ple = port_list;
+
+    /* Remember the first proto/port combo in case we need them
+     * for NAT access requests.
+    */
+    fst_proto = ple->proto;
+    fst_port  = ple->port;
+
+    /* deal with SPA packets that themselves request a NAT operation
+    */
+    if(spadat->message_type == FKO_LOCAL_NAT_ACCESS_MSG
+      || spadat->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG
+      || spadat->message_type == FKO_NAT_ACCESS_MSG
+      || spadat->message_type == FKO_CLIENT_TIMEOUT_NAT_ACCESS_MSG
+      || acc->force_nat)
+    {
+        if(acc->force_nat)
+        {
+            strlcpy(nat_ip, acc->force_nat_ip, sizeof(nat_ip));
+            nat_port = acc->force_nat_port;
+        }
+        else
+        {
+            ndx = strchr(spadat->nat_access, ',');
+            if(ndx != NULL)
+            {
+                strlcpy(nat_ip, spadat->nat_access, (ndx-spadat->nat_access)+1);
+                if (! is_valid_ipv4_addr(nat_ip))
+                {
+                    log_msg(LOG_INFO, "Invalid NAT IP in SPA message");
+                    free_acc_port_list(port_list);
+                    return res;
+                }
+
+                nat_port = strtol_wrapper(ndx+1, 0, MAX_PORT,
+                        NO_EXIT_UPON_ERR, &is_err);
+                if(is_err != FKO_SUCCESS)
+                {
+                    log_msg(LOG_INFO, "Invalid NAT port in SPA message");
+                    free_acc_port_list(port_list);
+                    res = is_err;
+                    return res;
+                }
+            }
+        }
+
+        if(spadat->message_type == FKO_LOCAL_NAT_ACCESS_MSG
+                || spadat->message_type == FKO_CLIENT_TIMEOUT_LOCAL_NAT_ACCESS_MSG)
+            input_access(opts, spadat, fst_proto, nat_port, 0, exp_ts, "local NAT");
+        else if(with_fwd)
+            forward_access(opts, acc, spadat, nat_ip, nat_port, fst_proto, exp_ts);
+
+        if(with_dnat && !acc->disable_dnat)
+            dnat_access(opts, acc, spadat, nat_ip, nat_port,
+                    fst_proto, fst_port, exp_ts);
+    }
+    else /* Non-NAT request - this is the typical case. */
+    {
+        while(ple != NULL)
+        {
+            input_access(opts, spadat, ple->proto, ple->port,
+                    with_output, exp_ts, "access");
+            ple = ple->next;
+        }
+    }
+
+    commit_grants(opts);
+
+    /* Done with the port list for access rules.
+    */
+    free_acc_port_list(port_list);
+
+    return(res);
+}
+
+/* Elements carry their own timeout and are removed by the kernel, there is
+ * nothing to check here.
+*/
+void
+check_firewall_rules(const fko_srv_options_t * const opts,
+        const int chk_rm_all)
+{
+    return;
+}
+
+/* Each SPA request is its own transaction, nothing is ever queued.
+*/
+int
+fw_apply_pending_rules(const fko_srv_options_t * const opts, const int force)
+{
+    return 0;
+}
+
+int
+validate_nft_access_conf(const char * const access_str)
+{
+    int         j, rv  = 1;
+    const char   *ndx  = access_str;
+
+    j = 1;
+    while(*ndx != '\0')
+    {
+        if(*ndx == ',')
+            j++;
+
+        if(*ndx != '\0'
+                && *ndx != ' '
+                && *ndx != ','
+                && *ndx != '_'
+                && isalnum(*ndx) == 0)
+        {
+            rv = 0;
+            break;
+        }
+        ndx++;
+    }
+
+    /* Sanity check - j should be the number of set fields
+     * (excluding the type).
+    */
+    if(j != FW_NUM_SET_FIELDS)
+        rv = 0;
+
+    return rv;
+}
+
+#endif /* FIREWALL_NFTABLES */
+
+/***EOF***/
@@ -0,0 +1,88 @@
+/*
+ *****************************************************************************
+ *
+ * File:    fw_util_nftables.h
+ *
+ * Purpose: Header file for fw_util_nftables.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef FW_UTIL_NFTABLES_H
+#define FW_UTIL_NFTABLES_H
+
+#include <inttypes.h>
+
+/* The lookup rules fwknopd inserts are tagged with this comment (followed
+ * by the set name) so they can be found again at exit or after a restart.
+*/
+#define NFT_RULE_COMMENT        "fwknopd"
+
+/* FORWARD_ALL grants and DNAT of all ports use a second set named after
+ * the configured one with this suffix.
+*/
+#define NFT_ALL_SET_SUFFIX      "_all"
+
+/* Most elements sent to nft in one transaction, larger SPA requests are
+ * split over several.
+*/
+#define NFT_MAX_GRANT_ELEMS     32
+
+/* Set key and data types, and the lookup rule statement (the longest is
+ * a DNAT map lookup followed by the set name)
+*/
+#define NFT_TYPE_LEN            64
+#define NFT_STMT_LEN            192
+#define NFT_ELEM_CMD_BUFSIZE    640
+#define NFT_LIST_BUFSIZE        (64 * 1024)
+
+/* The nft path (FIREWALL_EXE) followed by a list command
+*/
+#define NFT_CMD_BUFSIZE         (MAX_PATH_LEN + CMD_BUFSIZE)
+
+/* nft commands
+*/
+#define NFT_ADD_TABLE_CMD       "add table %s %s\n"
+#define NFT_LIST_CHAIN_CMD      "list chain %s %s %s"
+#define NFT_ADD_CHAIN_CMD       "add chain %s %s %s { %s }\n"
+#define NFT_ADD_SET_CMD         "add set %s %s %s { type %s ; flags timeout ; }\n"
+#define NFT_ADD_MAP_CMD         "add map %s %s %s { type %s : %s ; flags timeout ; }\n"
+#define NFT_LIST_SET_CMD        "list %s %s %s %s"
+#define NFT_DEL_SET_CMD         "delete %s %s %s %s\n"
+#define NFT_INSERT_RULE_CMD     "insert rule %s %s %s %s comment \"" NFT_RULE_COMMENT " %s\"\n"
+#define NFT_DEL_RULE_CMD        "delete rule %s %s %s handle %" PRIu64 "\n"
+#define NFT_LIST_TABLE_CMD      "list table %s %s"
+
+/* A grant is added, deleted and added again in the same transaction so
+ * that a repeated request restarts the timeout of an element still there
+ * ('add' alone would leave the old timeout in place).
+*/
+#define NFT_GRANT_ELEM_CMD      "add element %s %s %s { %s timeout %us%s%s }\n" \
+                                "delete element %s %s %s { %s }\n" \
+                                "add element %s %s %s { %s timeout %us%s%s }\n"
+
+int validate_nft_access_conf(const char * const access_str);
+
+#endif /* FW_UTIL_NFTABLES_H */
+
+/***EOF***/
@@ -189,6 +189,14 @@ fw_cleanup(const fko_srv_options_t * const opts)
     return(0);
 }
 
+/* Rules are added as soon as they are granted, nothing is ever queued.
+*/
+int
+fw_apply_pending_rules(const fko_srv_options_t * const opts, const int force)
+{
+    return(0);
+}
+
 /****************************************************************************/
 
 /* Rule Processing - Create an access request...
@@ -46,10 +46,12 @@
 #include "connection_tracker.h"
 #include "control_client.h"
 #include "service.h"
+#include "spa_pipeline.h"
 #include <pthread.h>
 
 #if USE_LIBPCAP
   #include "pcap_capture.h"
+  #include "afpacket_capture.h"
 #endif
 
 /* Prototypes
@@ -223,7 +225,7 @@ main(int argc, char **argv)
             // arriving here means the server received access data
             // from the controller, they are still connected so go
             // ahead and start the thread to continue listening
-            if(pthread_create( &(opts.ctrl_client_thread), NULL, control_client_thread_func, (void*)&opts))
+            if(start_control_client_thread(&opts) != FWKNOPD_SUCCESS)
             {
                 log_msg(LOG_ERR, "Failed to start SDP Control Client Thread. Aborting.");
                 clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
@@ -274,6 +276,12 @@ main(int argc, char **argv)
         if(!opts.test && opts.enable_fw && (fw_initialize(&opts) != 1))
             clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
 
+        /* Start the SPA verification workers (if SPA_VERIFY_WORKERS is
+         * set) before packets come in.
+        */
+        if(spa_pipeline_start(&opts) != FWKNOPD_SUCCESS)
+            clean_exit(&opts, FW_CLEANUP, EXIT_FAILURE);
+
         /* If we are to acquire SPA data via a UDP socket, start it up here.
         */
         if(opts.enable_udp_server ||
@@ -286,6 +294,7 @@ main(int argc, char **argv)
             }
             else
             {
+                spa_pipeline_stop(&opts);
                 break;
             }
         }
@@ -313,10 +322,20 @@ main(int argc, char **argv)
         if(!opts.enable_udp_server
                 && strncasecmp(opts.config[CONF_ENABLE_UDP_SERVER], "N", 1) == 0)
         {
+#if HAVE_AF_PACKET_CAPTURE
+            if(afpacket_threads(&opts) > 0)
+                afpacket_capture(&opts);
+            else
+#endif
             pcap_capture(&opts);
         }
 #endif
 
+        /* Anything already queued is still processed before the configs
+         * are re-read or fwknopd exits.
+        */
+        spa_pipeline_stop(&opts);
+
         /* Deal with any signals that we've received and break out
          * of the loop for any terminating signals
         */
@@ -637,12 +656,9 @@ static int handle_signals(fko_srv_options_t *opts)
             {
                 if(opts->ctrl_client_thread > 0)
                 {
-                    log_msg(LOG_WARNING, "Canceling ctrl client thread...");
-                    pthread_cancel(opts->ctrl_client_thread);
-                    log_msg(LOG_WARNING, "Joining ctrl client thread...");
-                    pthread_join(opts->ctrl_client_thread, NULL);
+                    log_msg(LOG_WARNING, "Stopping ctrl client thread...");
+                    stop_control_client_thread(opts);
                     log_msg(LOG_WARNING, "Ctrl client thread joined.");
-                    opts->ctrl_client_thread = 0;
                 }
                 sdp_ctrl_client_disconnect(opts->ctrl_client);
                 sdp_ctrl_client_destroy(opts->ctrl_client);
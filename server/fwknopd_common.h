@@ -33,6 +33,12 @@
 
 #include "common.h"
 #include "hash_table.h"
+#include "int_hash_table.h"
+#include "digest_index.h"
+#include "digest_journal.h"
+#include "digest_file.h"
+#include "acc_snapshot.h"
+#include "acc_addr_index.h"
 #include "sdp_ctrl_client.h"
 #include <pthread.h>
 
@@ -70,6 +76,8 @@
 #define DEF_ACCESS_FILE     DEF_CONF_DIR"/access.conf"
 #define DEF_CONN_ID_FILE    DEF_CONF_DIR"/last_conn_id.conf"
 #define DEF_CONN_REPORT_INTERVAL   "30"
+#define DEF_CONNTRACK_METHOD       "NETLINK"
+#define DEF_CONNTRACK_EVENTS       "Y"
 
 #ifndef DEF_RUN_DIR
   /* Our default run directory is based on LOCALSTATEDIR as set by the
@@ -83,6 +91,9 @@
 #define DEF_PID_FILENAME                MY_NAME".pid"
 #if USE_FILE_CACHE
   #define DEF_DIGEST_CACHE_FILENAME       "digest.cache"
+  #define DEF_DIGEST_CACHE_SYNC_MODE      "PERIODIC"
+  #define DEF_DIGEST_CACHE_FLUSH_INTERVAL "100"   /* milliseconds */
+  #define DEF_DIGEST_CACHE_BATCH_SIZE     "64"
 #else
   #define DEF_DIGEST_CACHE_DB_FILENAME    "digest_db.cache"
 #endif
@@ -93,10 +104,14 @@
 #define DEF_PCAP_DISPATCH_COUNT         "100"
 #define DEF_PCAP_LOOP_SLEEP             "100000" /* a tenth of a second (in microseconds) */
 #define DEF_ENABLE_PCAP_ANY_DIRECTION   "N"
+#define DEF_CAPTURE_METHOD              "PCAP"
+#define DEF_AF_PACKET_THREADS           "1"
+#define DEF_AF_PACKET_RING_BLOCKS       "16"  /* of 256KB each */
 #define DEF_EXIT_AT_INTF_DOWN           "Y"
 #define DEF_ENABLE_SPA_PACKET_AGING     "Y"
 #define DEF_MAX_SPA_PACKET_AGE          "120"
 #define DEF_ENABLE_DIGEST_PERSISTENCE   "Y"
+#define DEF_ENABLE_DIGEST_CACHE_EXPIRY  "N"
 #define DEF_RULES_CHECK_THRESHOLD       "20"
 #define DEF_MAX_SNIFF_BYTES             "1500"
 #define DEF_GPG_HOME_DIR                "/root/.gnupg"
@@ -120,6 +135,8 @@
 #endif
 #define DEF_UDPSERV_PORT                "62201"
 #define DEF_UDPSERV_SELECT_TIMEOUT      "500000" /* half a second (in microseconds) */
+#define DEF_UDPSERV_SOCKETS             "1"
+#define DEF_UDPSERV_RECV_BATCH          "32"
 #define DEF_SYSLOG_IDENTITY             MY_NAME
 #define DEF_SYSLOG_FACILITY             "LOG_DAEMON"
 #define DEF_ENABLE_DESTINATION_RULE     "N"
@@ -128,10 +145,22 @@
 #define DEF_DISABLE_SDP_CTRL_CLIENT     "N"
 #define DEF_DISABLE_CONNECTION_TRACKING "N"
 #define DEF_MAX_WAIT_ACC_DATA           "30"
+#define DEF_SPA_VERIFY_WORKERS          "0"  /* verify SPA packets in the capture loop */
+#define DEF_SPA_QUEUE_SIZE              "256"
 
 
 #define DEF_FW_ACCESS_TIMEOUT           30
 
+/* Every thread that verifies SPA packets takes an acc_epoch reader slot
+ * (see acc_snapshot.h) for its access stanza lookups, and the main thread
+ * keeps one for itself.  The applier never looks up a stanza, so it needs
+ * none.  The UDP server sockets, AF_PACKET threads and SPA verification
+ * workers all share what is left, which validate_int_var_ranges() checks
+ * as a whole.
+*/
+#define ACC_EPOCH_MAIN_READERS          1
+#define RCHK_MAX_ACC_READER_THREADS     (ACC_EPOCH_MAX_READERS - ACC_EPOCH_MAIN_READERS)
+
 /* For integer variable range checking
 */
 #define RCHK_MAX_PCAP_LOOP_SLEEP        (2 << 22)
@@ -140,12 +169,22 @@
 #define RCHK_MAX_TCPSERV_PORT           ((2 << 16) - 1)
 #define RCHK_MAX_UDPSERV_PORT           ((2 << 16) - 1)
 #define RCHK_MAX_UDPSERV_SELECT_TIMEOUT (2 << 22)
+#define RCHK_MAX_UDPSERV_SOCKETS        RCHK_MAX_ACC_READER_THREADS
+#define RCHK_MAX_UDPSERV_RECV_BATCH     1024
 #define RCHK_MAX_PCAP_DISPATCH_COUNT    (2 << 22)
+#define RCHK_MAX_AF_PACKET_THREADS      RCHK_MAX_ACC_READER_THREADS
+#define RCHK_MIN_AF_PACKET_RING_BLOCKS  2
+#define RCHK_MAX_AF_PACKET_RING_BLOCKS  1024
 #define RCHK_MAX_FW_TIMEOUT             (2 << 22) /* seconds */
 #define RCHK_MAX_CMD_CYCLE_TIMER        (2 << 22) /* seconds */
 #define RCHK_MIN_CMD_CYCLE_TIMER        1
 #define RCHK_MAX_RULES_CHECK_THRESHOLD  ((2 << 16) - 1)
 #define RCHK_MAX_WAIT_ACC_DATA          60
+#define RCHK_MAX_DIGEST_CACHE_FLUSH_INTERVAL 60000  /* milliseconds */
+#define RCHK_MAX_DIGEST_CACHE_BATCH_SIZE     65535
+#define RCHK_MAX_SPA_VERIFY_WORKERS     RCHK_MAX_ACC_READER_THREADS
+#define RCHK_MIN_SPA_QUEUE_SIZE         16
+#define RCHK_MAX_SPA_QUEUE_SIZE         65536
 
 #define MIN_ACC_STANZA_HASH_TABLE_LENGTH  10
 #define MAX_ACC_STANZA_HASH_TABLE_LENGTH  10000
@@ -187,6 +226,7 @@
   #define DEF_ENABLE_IPT_SNAT           "N"
   #define DEF_ENABLE_IPT_OUTPUT         "N"
   #define DEF_ENABLE_IPT_COMMENT_CHECK  "Y"
+  #define DEF_IPT_BATCH_WINDOW          "0"  /* milliseconds, 0 disables batching */
   #define DEF_IPT_INPUT_ACCESS          "ACCEPT, filter, INPUT, 1, FWKNOP_INPUT, 1"
   #define DEF_IPT_OUTPUT_ACCESS         "ACCEPT, filter, OUTPUT, 1, FWKNOP_OUTPUT, 1"
   #define DEF_IPT_FORWARD_ACCESS        "ACCEPT, filter, FORWARD, 1, FWKNOP_FORWARD, 1"
@@ -195,6 +235,21 @@
   #define DEF_IPT_MASQUERADE_ACCESS     "MASQUERADE, nat, POSTROUTING, 1, FWKNOP_MASQUERADE, 1"
 
   #define RCHK_MAX_IPT_RULE_NUM         (2 << 15)
+  #define RCHK_MAX_IPT_BATCH_WINDOW     1000
+
+/* nftables-specific defines
+*/
+#elif FIREWALL_NFTABLES
+
+  #define DEF_FLUSH_NFT_AT_INIT         "Y"
+  #define DEF_FLUSH_NFT_AT_EXIT         "Y"
+  #define DEF_ENABLE_NFT_FORWARDING     "N"
+  #define DEF_ENABLE_NFT_LOCAL_NAT      "N"
+  #define DEF_ENABLE_NFT_OUTPUT         "N"
+  #define DEF_NFT_INPUT_ACCESS          "inet, filter, input, fwknop_input"
+  #define DEF_NFT_OUTPUT_ACCESS         "inet, filter, output, fwknop_output"
+  #define DEF_NFT_FORWARD_ACCESS        "inet, filter, forward, fwknop_forward"
+  #define DEF_NFT_DNAT_ACCESS           "ip, nat, prerouting, fwknop_dnat"
 
 /* Ipfw-specific defines
 */
@@ -258,11 +313,15 @@ enum {
     CONF_PCAP_DISPATCH_COUNT,
     CONF_PCAP_LOOP_SLEEP,
     CONF_ENABLE_PCAP_ANY_DIRECTION,
+    CONF_CAPTURE_METHOD,
+    CONF_AF_PACKET_THREADS,
+    CONF_AF_PACKET_RING_BLOCKS,
     CONF_EXIT_AT_INTF_DOWN,
     CONF_MAX_SNIFF_BYTES,
     CONF_ENABLE_SPA_PACKET_AGING,
     CONF_MAX_SPA_PACKET_AGE,
     CONF_ENABLE_DIGEST_PERSISTENCE,
+    CONF_ENABLE_DIGEST_CACHE_EXPIRY,
     CONF_RULES_CHECK_THRESHOLD,
     CONF_CMD_EXEC_TIMEOUT,
     //CONF_BLACKLIST,
@@ -272,6 +331,8 @@ enum {
     CONF_ENABLE_UDP_SERVER,
     CONF_UDPSERV_PORT,
     CONF_UDPSERV_SELECT_TIMEOUT,
+    CONF_UDPSERV_SOCKETS,
+    CONF_UDPSERV_RECV_BATCH,
     CONF_LOCALE,
     CONF_SYSLOG_IDENTITY,
     CONF_SYSLOG_FACILITY,
@@ -313,6 +374,17 @@ enum {
     CONF_IPT_SNAT_ACCESS,
     CONF_IPT_MASQUERADE_ACCESS,
     CONF_ENABLE_IPT_COMMENT_CHECK,
+    CONF_IPT_BATCH_WINDOW,
+#elif FIREWALL_NFTABLES
+    CONF_ENABLE_NFT_FORWARDING,
+    CONF_ENABLE_NFT_LOCAL_NAT,
+    CONF_ENABLE_NFT_OUTPUT,
+    CONF_FLUSH_NFT_AT_INIT,
+    CONF_FLUSH_NFT_AT_EXIT,
+    CONF_NFT_INPUT_ACCESS,
+    CONF_NFT_OUTPUT_ACCESS,
+    CONF_NFT_FORWARD_ACCESS,
+    CONF_NFT_DNAT_ACCESS,
 #elif FIREWALL_IPFW
     CONF_FLUSH_IPFW_AT_INIT,
     CONF_FLUSH_IPFW_AT_EXIT,
@@ -334,6 +406,9 @@ enum {
     CONF_FWKNOP_PID_FILE,
 #if USE_FILE_CACHE
     CONF_DIGEST_FILE,
+    CONF_DIGEST_CACHE_SYNC_MODE,
+    CONF_DIGEST_CACHE_FLUSH_INTERVAL,
+    CONF_DIGEST_CACHE_BATCH_SIZE,
 #else
     CONF_DIGEST_DB_FILE,
 #endif
@@ -354,6 +429,10 @@ enum {
     CONF_DISABLE_CONNECTION_TRACKING,
     CONF_CONN_ID_FILE,
     CONF_CONN_REPORT_INTERVAL,
+    CONF_CONNTRACK_METHOD,
+    CONF_CONNTRACK_EVENTS,
+    CONF_SPA_VERIFY_WORKERS,
+    CONF_SPA_QUEUE_SIZE,
     CONF_MAX_WAIT_ACC_DATA,
     CONF_SDP_CTRL_CLIENT_CONF,
     CONF_FWKNOP_CLIENT_CONF,
@@ -399,6 +478,17 @@ typedef struct acc_service_list
     struct acc_service_list *next;
 } acc_service_list_t;
 
+/* Sorted, duplicate free ids compiled from a stanza's service or
+ * proto/port list when the stanza is loaded, so SPA requests can be
+ * checked against it with a binary search and no allocation.  Port
+ * entries are stored as (proto << 16) | port.
+*/
+typedef struct acc_id_set
+{
+    uint32_t            *ids;
+    unsigned int         count;
+} acc_id_set_t;
+
 /* Access stanza list struct.
 */
 typedef struct acc_stanza
@@ -406,14 +496,17 @@ typedef struct acc_stanza
     uint32_t             sdp_id;
     char                *service_list_str;
     acc_service_list_t  *service_list;
+    acc_id_set_t         service_set;
     char                *source;
     acc_int_list_t      *source_list;
     char                *destination;
     acc_int_list_t      *destination_list;
     char                *open_ports;
     acc_port_list_t     *oport_list;
+    acc_id_set_t         oport_set;
     char                *restrict_ports;
     acc_port_list_t     *rport_list;
+    acc_id_set_t         rport_set;
     char                *key;
     int                  key_len;
     char                *key_base64;
@@ -421,6 +514,7 @@ typedef struct acc_stanza
     int                  hmac_key_len;
     char                *hmac_key_base64;
     int                  hmac_type;
+    fko_hmac_key_t       hmac_key_sched;
     unsigned char        use_rijndael;
     int                  fw_access_timeout;
     unsigned char        enable_cmd_exec;
@@ -468,6 +562,11 @@ typedef struct acc_stanza
     char                *force_snat_ip;
     unsigned char        force_masquerade;
 
+    /* Hash of the controller's json for this stanza, 0 if it came from
+     * the access file
+    */
+    uint64_t             json_hash;
+
     struct acc_stanza   *next;
 } acc_stanza_t;
 
@@ -573,9 +672,59 @@ typedef struct cmd_cycle_list
       struct fw_chain chain[NUM_FWKNOP_ACCESS_TYPES];
       char            fw_command[MAX_PATH_LEN];
 
+      /* iptables-restore next to fw_command, empty if it is not there
+      */
+      char            fw_restore_command[MAX_PATH_LEN + sizeof("-restore")];
+
+      /* Flag for setting destination field in rule
+      */
+      unsigned char   use_destination;
+  };
+
+#elif FIREWALL_NFTABLES
+
+  #define MAX_NFT_FAMILY_LEN      16
+  #define MAX_TABLE_NAME_LEN      64
+  #define MAX_CHAIN_NAME_LEN      64
+  #define MAX_NFT_SET_NAME_LEN    64
+
+  /* Access types, each one is a set (or map) in an nftables table
+  */
+  enum {
+      NFT_INPUT_ACCESS,
+      NFT_OUTPUT_ACCESS,
+      NFT_FORWARD_ACCESS,
+      NFT_DNAT_ACCESS,
+      NUM_FWKNOP_ACCESS_TYPES  /* Leave this entry last */
+  };
+
+  /* Where the elements for one access type go.  A single rule at the top
+   * of 'chain' looks packets up in 'set', and granting access is adding an
+   * element with a timeout, which the kernel expires by itself.
+  */
+  struct fw_set {
+      int     type;
+      char    family[MAX_NFT_FAMILY_LEN];
+      char    table[MAX_TABLE_NAME_LEN];
+      char    chain[MAX_CHAIN_NAME_LEN];
+      char    set[MAX_NFT_SET_NAME_LEN];
+  };
+
+  /* Based on the fw_set fields (not counting type)
+  */
+  #define FW_NUM_SET_FIELDS 4
+
+  struct fw_config {
+      struct fw_set   set[NUM_FWKNOP_ACCESS_TYPES];
+      char            fw_command[MAX_PATH_LEN];
+
       /* Flag for setting destination field in rule
       */
       unsigned char   use_destination;
+
+      /* Mark connections with the SDP ID (DISABLE_CONNECTION_TRACKING N)
+      */
+      unsigned char   use_ct_mark;
   };
 
 #elif FIREWALL_IPFW
@@ -643,9 +792,24 @@ typedef struct spa_pkt_info
     unsigned short  packet_dst_port;
     uint32_t        sdp_id;
     char            sdp_id_str[MAX_SDP_ID_STR_LEN];
+    int             hmac_verified;  /* set by hmac_check() */
     unsigned char   packet_data[MAX_SPA_PACKET_LEN+1];
 } spa_pkt_info_t;
 
+/* The stages of the pre-authentication filter, each counting the packets
+ * it turned away before any decryption was attempted.
+*/
+enum {
+    SPA_REJECT_LENGTH = 0,      /* too short or too long */
+    SPA_REJECT_PREFIX,          /* carries a Rijndael or GnuPG prefix */
+    SPA_REJECT_BASE64,          /* not base64 */
+    SPA_REJECT_SDP_ID,          /* SDP ID does not decode, or is zero */
+    SPA_REJECT_UNKNOWN_ID,      /* no access stanza for the SDP ID */
+    SPA_REJECT_HMAC,            /* HMAC does not match the stanza key */
+    SPA_REJECT_REPLAY,          /* digest already seen */
+    SPA_REJECT_STAGES
+};
+
 /* Struct for (processed and verified) SPA data used by the server.
 */
 typedef struct spa_data
@@ -719,10 +883,20 @@ typedef struct fko_srv_options
     int  hmac_type;
 
 #if USE_FILE_CACHE
-    struct digest_cache_list *digest_cache;   /* In-memory digest cache list */
+    struct digest_cache_gen *digest_cache;    /* In-memory digest cache, newest generation first */
+    struct digest_rec_slab  *digest_slabs;    /* Records added since DIGEST_FILE was mapped */
+    digest_file_map_t digest_map;             /* DIGEST_FILE as last mapped */
+    digest_index_t *digest_index;             /* Hashed lookup into the cache */
+    digest_journal_t *digest_journal;         /* Appends to DIGEST_FILE */
+    struct digest_compaction *digest_compaction; /* Pending rewrite of DIGEST_FILE */
+    unsigned int    digest_file_entries;      /* Entries in DIGEST_FILE, including expired ones */
 #endif
+    int             digest_expire_age;        /* Seconds digests are kept, 0 for forever */
+    time_t          digest_next_expire;
 
     spa_pkt_info_t  spa_pkt;            /* The current SPA packet */
+    struct spa_pipeline *spa_pipeline;  /* SPA verification workers, NULL when not running */
+    uint64_t        spa_rejects[SPA_REJECT_STAGES];  /* Pre-authentication filter counters */
 
     /* Counter set from the command line to exit after the specified
      * number of SPA packets are processed.
@@ -736,10 +910,14 @@ typedef struct fko_srv_options
     char           *config[NUMBER_OF_CONFIG_ENTRIES];
 
     acc_stanza_t   *acc_stanzas;       /* List of access stanzas for legacy mode */
-    hash_table_t   *acc_stanza_hash_tbl;  /* List of access stanzas for sdp mode */
-    pthread_mutex_t acc_hash_tbl_mutex;
-
-    hash_table_t   *service_hash_tbl;
+    acc_addr_index_t *acc_addr_index;  /* SOURCE/DESTINATION lookup for acc_stanzas */
+    int_hash_table_t *acc_stanza_hash_tbl; /* Access stanzas by SDP ID for sdp mode */
+    pthread_mutex_t acc_hash_tbl_mutex;   /* Serializes changes to the table */
+    acc_snapshot_t *acc_snapshot;     /* Published SDP ID lookup table */
+    acc_epoch_t     acc_epoch;        /* Grace periods for acc_snapshot readers */
+    int             acc_reader_slot;  /* Epoch slot of the SPA processing thread */
+
+    int_hash_table_t *service_hash_tbl;  /* Services by service ID */
     pthread_mutex_t service_hash_tbl_mutex;
     hash_table_t   *reverse_service_hash_tbl;
 
@@ -747,6 +925,8 @@ typedef struct fko_srv_options
      */
     sdp_ctrl_client_t ctrl_client;
     pthread_t ctrl_client_thread;
+    int ctrl_client_wake_fd[2];   /* Pipe that wakes the thread to stop it */
+    int ctrl_client_done;         /* Set by the thread just before it exits */
 
     /* Firewall config info.
     */
@@ -2,6 +2,12 @@
 
 #include "fwknopd_common.h"
 #include "access.h"
+#include "digest_index.h"
+#include "digest_file.h"
+#include "acc_snapshot.h"
+#include "acc_addr_index.h"
+#include "int_hash_table.h"
+#include "fw_expiry.h"
 
 /**
  * Register test suites from FKO files.
@@ -12,6 +18,12 @@
 static void register_test_suites(void)
 {
     register_ts_access();
+    register_ts_digest_index();
+    register_ts_digest_file();
+    register_ts_acc_snapshot();
+    register_ts_acc_addr_index();
+    register_ts_int_hash_table();
+    register_ts_fw_expiry();
 }
 
 /* The main() function for setting up and running the tests.
@@ -45,22 +45,30 @@
 #include "fw_util.h"
 #include "fwknopd_errors.h"
 #include "replay_cache.h"
-#include "bstrlib.h"
+#include "spa_pipeline.h"
 
 #define CTX_DUMP_BUFSIZE            4096                /*!< Maximum size allocated to a FKO context dump */
 #define KEEP_SEARCHING 1
 #define STOP_SEARCHING 0
 
+static void
+spa_reject(fko_srv_options_t *opts, const int stage)
+{
+    __atomic_add_fetch(&(opts->spa_rejects[stage]), 1, __ATOMIC_RELAXED);
+    return;
+}
+
 /* Validate and in some cases preprocess/reformat the SPA data.  Return an
  * error code value if there is any indication the data is not valid spa data.
+ * Nothing is allocated here, so junk costs no more than these checks.
 */
 static int
-preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
+preprocess_spa_data(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
 {
 
     char    *ndx = (char *)&(spa_pkt->packet_data);
-    char    *decoded_sdp_id = NULL;
-    char    *encoded_sdp_id = NULL;
+    char     encoded_sdp_id[B64_SDP_ID_STR_LEN+1];
+    unsigned char decoded_sdp_id[FKO_SDP_ID_SIZE*2];
     int      i, pkt_data_len = 0;
     uint32_t sdp_id = 0;
 
@@ -75,11 +83,11 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
     /* These two checks are already done in process_packet(), but this is a
      * defensive measure to run them again here
     */
-    if(pkt_data_len < MIN_SPA_DATA_SIZE)
-        return(SPA_MSG_BAD_DATA);
-
-    if(pkt_data_len > MAX_SPA_PACKET_LEN)
+    if(pkt_data_len < MIN_SPA_DATA_SIZE || pkt_data_len > MAX_SPA_PACKET_LEN)
+    {
+        spa_reject(opts, SPA_REJECT_LENGTH);
         return(SPA_MSG_BAD_DATA);
+    }
 
     /* Ignore any SPA packets that contain the Rijndael or GnuPG prefixes
      * since an attacker might have tacked them on to a previously seen
@@ -88,12 +96,13 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
      * a prefix after the outer one is stripped off won't decrypt properly
      * anyway because libfko would not add a new one.
     */
-    if(constant_runtime_cmp(ndx, B64_RIJNDAEL_SALT, B64_RIJNDAEL_SALT_STR_LEN) == 0)
-        return(SPA_MSG_BAD_DATA);
-
-    if(pkt_data_len > MIN_GNUPG_MSG_SIZE
-            && constant_runtime_cmp(ndx, B64_GPG_PREFIX, B64_GPG_PREFIX_STR_LEN) == 0)
+    if(constant_runtime_cmp(ndx, B64_RIJNDAEL_SALT, B64_RIJNDAEL_SALT_STR_LEN) == 0
+            || (pkt_data_len > MIN_GNUPG_MSG_SIZE
+                && constant_runtime_cmp(ndx, B64_GPG_PREFIX, B64_GPG_PREFIX_STR_LEN) == 0))
+    {
+        spa_reject(opts, SPA_REJECT_PREFIX);
         return(SPA_MSG_BAD_DATA);
+    }
 
     /* Detect and parse out SPA data from an HTTP request. If the SPA data
      * starts with "GET /" and the user agent starts with "Fwknop", then
@@ -130,7 +139,10 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
         }
 
         if(i < MIN_SPA_DATA_SIZE)
+        {
+            spa_reject(opts, SPA_REJECT_LENGTH);
             return(SPA_MSG_BAD_DATA);
+        }
 
         spa_pkt->packet_data_len = pkt_data_len = i;
     }
@@ -138,7 +150,10 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
     /* Require base64-encoded data
     */
     if(! is_base64(spa_pkt->packet_data, pkt_data_len))
+    {
+        spa_reject(opts, SPA_REJECT_BASE64);
         return(SPA_MSG_NOT_SPA_DATA);
+    }
 
 
     /* If we made it here, we have no reason to assume this is not SPA data.
@@ -150,34 +165,28 @@ preprocess_spa_data(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt)
      */
     if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
     {
-        // make space for the decoded string, really need 5 bytes, but 8 will work
-        decoded_sdp_id = calloc(1, FKO_SDP_ID_SIZE*2);
-        if(decoded_sdp_id == NULL)
-            return(FKO_ERROR_MEMORY_ALLOCATION);
-
         // Copy out the SDP client ID, NOT extracting yet
-        encoded_sdp_id = strndup((char *)(spa_pkt->packet_data), B64_SDP_ID_STR_LEN);
+        memcpy(encoded_sdp_id, spa_pkt->packet_data, B64_SDP_ID_STR_LEN);
+        encoded_sdp_id[B64_SDP_ID_STR_LEN] = '\0';
 
-        // decode from b64 to original data
-        if(1 > fko_base64_decode(encoded_sdp_id, (unsigned char*)decoded_sdp_id))
+        // decode from b64 to original data, really need 5 bytes, but 8 will work
+        memset(decoded_sdp_id, 0x0, sizeof(decoded_sdp_id));
+        if(1 > fko_base64_decode(encoded_sdp_id, decoded_sdp_id))
         {
             // decode returned error or at least a zero-length string
-            free(encoded_sdp_id);
-            free(decoded_sdp_id);
+            spa_reject(opts, SPA_REJECT_SDP_ID);
             return(SPA_MSG_NOT_SPA_DATA);
         }
-        free(encoded_sdp_id);
 
         // copy to a proper uint32_t
         memcpy((void*)(&sdp_id), decoded_sdp_id, FKO_SDP_ID_SIZE);
         if(sdp_id == 0)
         {
             // client ID must not be zero
-            free(decoded_sdp_id);
+            spa_reject(opts, SPA_REJECT_SDP_ID);
             return(SPA_MSG_NOT_SPA_DATA);
         }
         spa_pkt->sdp_id = sdp_id;
-        free(decoded_sdp_id);
 
         // make a string version too
         snprintf(spa_pkt->sdp_id_str, MAX_SDP_ID_STR_LEN, "%"PRIu32, sdp_id);
@@ -371,33 +380,53 @@ check_stanza_expiration(acc_stanza_t *acc, spa_data_t *spadat,
     return 1;
 }
 
-/* Check for access.conf stanza SOURCE match based on SPA packet
- * source IP
+/* Look up the access.conf stanzas whose SOURCE and DESTINATION match the
+ * SPA packet addresses.  *ids starts out as the caller's stack buffer
+ * (room for ACC_ADDR_INDEX_STACK_IDS ids); if there are more candidates
+ * than that it is replaced with an allocated buffer that the caller must
+ * free.
 */
 static int
-src_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, spa_data_t *spadat)
+src_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, spa_data_t *spadat,
+        uint32_t **ids, int *num_ids)
 {
-    acc_stanza_t *acc = opts->acc_stanzas;
+    const uint32_t  src = ntohl(spa_pkt->packet_src_ip);
+    const uint32_t  dst = ntohl(spa_pkt->packet_dst_ip);
+    uint32_t       *buf = *ids;
+    int             n = 0;
 
-    while (acc)
-    {
-        if(compare_addr_list(acc->source_list, ntohl(spa_pkt->packet_src_ip)))
-            return 1;
+    if(opts->acc_addr_index != NULL)
+        n = acc_addr_index_lookup(opts->acc_addr_index, src, dst, buf,
+                ACC_ADDR_INDEX_STACK_IDS);
 
-        acc = acc->next;
+    if(n > ACC_ADDR_INDEX_STACK_IDS)
+    {
+        if((buf = malloc(n * sizeof(uint32_t))) == NULL)
+        {
+            log_msg(LOG_ERR, "[*] [%s] Memory allocation error for stanza candidates",
+                    spadat->pkt_source_ip);
+            return 0;
+        }
+        *ids = buf;
+        n = acc_addr_index_lookup(opts->acc_addr_index, src, dst, buf, n);
     }
 
-    log_msg(LOG_WARNING, "No access data found for source IP: %s", spadat->pkt_source_ip);
-    return 0;
+    *num_ids = n;
+    if(n == 0)
+    {
+        log_msg(LOG_WARNING, "No access data found for source IP: %s", spadat->pkt_source_ip);
+        return 0;
+    }
+    return 1;
 }
 
-/* Look for the SDP Client ID in the hash table
+/* Look for the SDP Client ID in the published access snapshot.  No lock is
+ * taken; the caller must be inside an acc_epoch read section for as long
+ * as it uses the returned stanza.
  */
 static int
 sdp_id_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, acc_stanza_t **acc)
 {
-    bstring sdp_id = NULL;
-
     if(spa_pkt->sdp_id == 0)
     {
         log_msg(LOG_WARNING,
@@ -406,33 +435,52 @@ sdp_id_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, acc_stanza_t **ac
         return 0;
     }
 
-    sdp_id = bfromcstr(spa_pkt->sdp_id_str);
-    if(sdp_id == NULL)
-    {
-        log_msg(LOG_ERR, "Failed to convert sdp_id_str to bstring. Value: %s", spa_pkt->sdp_id_str);
-        return 0;
-    }
-
-    // lock the hash table mutex
-    if(pthread_mutex_lock(&(opts->acc_hash_tbl_mutex)))
-    {
-        log_msg(LOG_ERR, "Mutex lock error.");
-        return 0;
-    }
-
-    *acc = hash_table_get(opts->acc_stanza_hash_tbl, sdp_id);
-    pthread_mutex_unlock(&(opts->acc_hash_tbl_mutex));
-
-    bdestroy(sdp_id);
+    *acc = acc_snapshot_find(acc_snapshot_current(&(opts->acc_snapshot)),
+            spa_pkt->sdp_id);
     if(*acc)
         return 1;  //found what we were looking for
 
+    spa_reject(opts, SPA_REJECT_UNKNOWN_ID);
     log_msg(LOG_WARNING,
         "No access data found for SDP Client ID: %"PRIu32,
         spa_pkt->sdp_id);
     return 0;
 }
 
+/* In SDP mode the SDP ID leads to the one stanza (and HMAC key) a packet
+ * can match, so a bad HMAC is caught here on the encoded data, before the
+ * replay digest or any FKO context is computed.  A packet that passes is
+ * marked so that new_ctx_with_data() does not verify it again.
+*/
+static int
+hmac_check(fko_srv_options_t *opts, acc_stanza_t *acc,
+        spa_pkt_info_t *spa_pkt, spa_data_t *spadat)
+{
+    int     res;
+
+    if(acc->hmac_key == NULL || acc->hmac_key_len <= 0)
+        return 1;
+
+    if(acc->hmac_key_sched != NULL)
+        res = fko_verify_hmac_data_key(acc->hmac_key_sched,
+                (char *)spa_pkt->packet_data,
+                strnlen((char *)spa_pkt->packet_data, MAX_SPA_PACKET_LEN));
+    else
+        res = fko_verify_hmac_data((char *)spa_pkt->packet_data,
+                strnlen((char *)spa_pkt->packet_data, MAX_SPA_PACKET_LEN),
+                acc->hmac_key, acc->hmac_key_len, acc->hmac_type);
+    if(res != FKO_SUCCESS)
+    {
+        spa_reject(opts, SPA_REJECT_HMAC);
+        log_msg(LOG_WARNING,
+            "[%s] SPA HMAC verification failed for SDP Client ID %"PRIu32": %s",
+            spadat->pkt_source_ip, spa_pkt->sdp_id, fko_errstr(res));
+        return 0;
+    }
+
+    spa_pkt->hmac_verified = 1;
+    return 1;
+}
 
 static int
 replay_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, char **raw_digest)
@@ -448,8 +496,9 @@ replay_check(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt, char **raw_digest
         if (*raw_digest == NULL)
             return 0;
 
-        if (is_replay(opts, *raw_digest) != SPA_MSG_SUCCESS)
+        if (is_replay(opts, spa_pkt, *raw_digest) != SPA_MSG_SUCCESS)
         {
+            spa_reject(opts, SPA_REJECT_REPLAY);
             return 0;
         }
     }
@@ -625,6 +674,30 @@ check_mode_ctx(spa_data_t *spadat, fko_ctx_t *ctx, int attempted_decrypt,
     return 1;
 }
 
+/* Set up the FKO context for a packet, checking the HMAC with the key
+ * precomputed for the stanza if there is one, unless hmac_check() did
+ * already.
+*/
+static int
+new_ctx_with_data(fko_ctx_t *ctx, acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
+        const char * const dec_key, const int dec_key_len,
+        const int encryption_mode)
+{
+    if(spa_pkt->hmac_verified)
+        return fko_new_with_data_hmac_verified(ctx,
+                (char *)spa_pkt->packet_data, dec_key, dec_key_len,
+                encryption_mode, acc->hmac_type, spa_pkt->sdp_id);
+
+    if(acc->hmac_key_sched != NULL)
+        return fko_new_with_data_hmac_key(ctx, (char *)spa_pkt->packet_data,
+                dec_key, dec_key_len, encryption_mode, acc->hmac_key_sched,
+                spa_pkt->sdp_id);
+
+    return fko_new_with_data(ctx, (char *)spa_pkt->packet_data, dec_key,
+            dec_key_len, encryption_mode, acc->hmac_key, acc->hmac_key_len,
+            acc->hmac_type, spa_pkt->sdp_id);
+}
+
 static void
 handle_rijndael_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
         spa_data_t *spadat, fko_ctx_t *ctx, int *attempted_decrypt,
@@ -633,9 +706,8 @@ handle_rijndael_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
 {
     if(enc_type == FKO_ENCRYPTION_RIJNDAEL || acc->enable_cmd_exec)
     {
-        *res = fko_new_with_data(ctx, (char *)spa_pkt->packet_data,
-            acc->key, acc->key_len, acc->encryption_mode, acc->hmac_key,
-            acc->hmac_key_len, acc->hmac_type, spa_pkt->sdp_id);
+        *res = new_ctx_with_data(ctx, acc, spa_pkt, acc->key, acc->key_len,
+                acc->encryption_mode);
         *attempted_decrypt = 1;
         if(*res == FKO_SUCCESS)
             *cmd_exec_success = 1;
@@ -656,9 +728,8 @@ handle_gpg_enc(acc_stanza_t *acc, spa_pkt_info_t *spa_pkt,
         */
         if(acc->gpg_decrypt_pw != NULL || acc->gpg_allow_no_pw)
         {
-            *res = fko_new_with_data(ctx, (char *)spa_pkt->packet_data, NULL,
-                    0, FKO_ENC_MODE_ASYMMETRIC, acc->hmac_key,
-                    acc->hmac_key_len, acc->hmac_type, spa_pkt->sdp_id);
+            *res = new_ctx_with_data(ctx, acc, spa_pkt, NULL, 0,
+                    FKO_ENC_MODE_ASYMMETRIC);
 
             if(*res != FKO_SUCCESS)
             {
@@ -876,6 +947,9 @@ check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
 #elif FIREWALL_IPTABLES
         if(strncasecmp(opts->config[CONF_ENABLE_IPT_FORWARDING], "Y", 1)!=0)
             not_enabled = 1;
+#elif FIREWALL_NFTABLES
+        if(strncasecmp(opts->config[CONF_ENABLE_NFT_FORWARDING], "Y", 1)!=0)
+            not_enabled = 1;
 #else
         unsupported = 1;
 #endif
@@ -889,6 +963,9 @@ check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
 #elif FIREWALL_IPTABLES
         if(strncasecmp(opts->config[CONF_ENABLE_IPT_LOCAL_NAT], "Y", 1)!=0)
             not_enabled = 1;
+#elif FIREWALL_NFTABLES
+        if(strncasecmp(opts->config[CONF_ENABLE_NFT_LOCAL_NAT], "Y", 1)!=0)
+            not_enabled = 1;
 #else
         unsupported = 1;
 #endif
@@ -916,14 +993,15 @@ check_nat_access_types(fko_srv_options_t *opts, acc_stanza_t *acc,
 
 static int
 add_replay_cache(fko_srv_options_t *opts, acc_stanza_t *acc,
-        spa_data_t *spadat, char *raw_digest, int *added_replay_digest,
+        spa_pkt_info_t *spa_pkt, spa_data_t *spadat, char *raw_digest,
+        int *added_replay_digest,
         const int stanza_num, int *res)
 {
     if (!opts->test && *added_replay_digest == 0
             && strncasecmp(opts->config[CONF_ENABLE_DIGEST_PERSISTENCE], "Y", 1) == 0)
     {
 
-        *res = add_replay(opts, raw_digest);
+        *res = add_replay(opts, spa_pkt, raw_digest);
         if (*res != SPA_MSG_SUCCESS)
         {
             log_msg(LOG_WARNING, "[%s] (stanza #%d) Could not add digest to replay cache",
@@ -997,6 +1075,57 @@ check_port_proto(acc_stanza_t *acc, spa_data_t *spadat, const int stanza_num)
     return 1;
 }
 
+/* Carry out what an authenticated SPA packet asked for.  With SPA
+ * verification workers this only ever runs on the pipeline's applier
+ * thread, so firewall and command cycle state is never touched by two
+ * threads at once.
+*/
+int
+run_spa_action(fko_srv_options_t *opts, spa_action_t *act)
+{
+    switch(act->type)
+    {
+        case SPA_ACTION_CMD_CYCLE:
+            return cmd_cycle_open(opts, act->acc, act->spadat,
+                    act->stanza_num, &(act->res));
+
+        case SPA_ACTION_CMD_MSG:
+            return process_cmd_msg(opts, act->acc, act->spadat,
+                    act->stanza_num, &(act->res));
+
+        default:
+            process_spa_request(opts, act->acc, act->spadat);
+            return 1;
+    }
+}
+
+/* Run the action right away, or hand it to the applier thread and wait
+ * for it when the SPA pipeline is running.  Waiting keeps acc and spadat
+ * valid until the action is done.
+*/
+static int
+apply_spa_action(fko_srv_options_t *opts, const int type, acc_stanza_t *acc,
+        spa_data_t *spadat, const int stanza_num, int *res)
+{
+    spa_action_t    act;
+    int             rv;
+
+    memset(&act, 0x0, sizeof(act));
+    act.type       = type;
+    act.acc        = acc;
+    act.spadat     = spadat;
+    act.stanza_num = stanza_num;
+    act.res        = *res;
+
+    if(opts->spa_pipeline != NULL)
+        rv = spa_pipeline_apply(opts, &act);
+    else
+        rv = run_spa_action(opts, &act);
+
+    *res = act.res;
+    return rv;
+}
+
 /* Handle grant request
  */
 static int
@@ -1056,7 +1185,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
 
     /* Add this SPA packet into the replay detection cache
     */
-    if(! add_replay_cache(opts, acc, spadat, raw_digest,
+    if(! add_replay_cache(opts, acc, spa_pkt, spadat, raw_digest,
                 &added_replay_digest, stanza_num, &res))
     {
         return KEEP_SEARCHING;
@@ -1193,7 +1322,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     */
     if(acc->cmd_cycle_open != NULL)
     {
-        if(cmd_cycle_open(opts, acc, spadat, stanza_num, &res))
+        if(apply_spa_action(opts, SPA_ACTION_CMD_CYCLE, acc, spadat, stanza_num, &res))
             return STOP_SEARCHING; /* successfully processed a matching access stanza */
         else
         {
@@ -1202,7 +1331,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     }
     else if(spadat->message_type == FKO_COMMAND_MSG)
     {
-        if(process_cmd_msg(opts, acc, spadat, stanza_num, &res))
+        if(apply_spa_action(opts, SPA_ACTION_CMD_MSG, acc, spadat, stanza_num, &res))
         {
             /* we processed the command on a matching access stanza, so we
              * don't look for anything else to do with this SPA packet
@@ -1255,7 +1384,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
     {
         if(acc->cmd_cycle_open != NULL)
         {
-            if(cmd_cycle_open(opts, acc, spadat, stanza_num, &res))
+            if(apply_spa_action(opts, SPA_ACTION_CMD_CYCLE, acc, spadat, stanza_num, &res))
                 return STOP_SEARCHING; /* successfully processed a matching access stanza */
             else
             {
@@ -1264,7 +1393,7 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
         }
         else
         {
-            process_spa_request(opts, acc, spadat);
+            apply_spa_action(opts, SPA_ACTION_ACCESS, acc, spadat, stanza_num, &res);
         }
     }
 
@@ -1272,10 +1401,12 @@ process_spa_data(fko_srv_options_t *opts, fko_ctx_t *ctx, acc_stanza_t *acc, spa
 }
 
 
-/* Process the SPA packet data
+/* Process the SPA packet data.  reader_slot is the acc_epoch slot of the
+ * calling thread.
 */
 void
-incoming_spa(fko_srv_options_t *opts)
+process_spa_pkt(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const int reader_slot)
 {
     /* Always a good idea to initialize ctx to null if it will be used
      * repeatedly (especially when using fko_new_with_data()).
@@ -1284,10 +1415,12 @@ incoming_spa(fko_srv_options_t *opts)
 
     char            *raw_digest = NULL;
     int             stanza_num=0;
+    uint32_t        cand_buf[ACC_ADDR_INDEX_STACK_IDS];
+    uint32_t       *cand = cand_buf;
+    int             num_cand = 0, c;
     int             is_err;
     int             conf_pkt_age = 0;
-
-    spa_pkt_info_t *spa_pkt = &(opts->spa_pkt);
+    int             sdp_mode = 0;
 
     /* This will hold our pertinent SPA data.
     */
@@ -1295,9 +1428,19 @@ incoming_spa(fko_srv_options_t *opts)
 
     acc_stanza_t        *acc = NULL;
 
-    log_msg(LOG_DEBUG, "incoming_spa() : just arrived, stay tuned");
+    log_msg(LOG_DEBUG, "process_spa_pkt() : just arrived, stay tuned");
 
     spadat.service_data_list = NULL;
+    spa_pkt->hmac_verified   = 0;
+
+    /* The stanza found by sdp_id_check() is used until we are done with
+     * this packet, so keep the control client from freeing it until then.
+    */
+    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0)
+    {
+        sdp_mode = 1;
+        acc_epoch_enter(&(opts->acc_epoch), reader_slot);
+    }
 
     inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
         spadat.pkt_source_ip, sizeof(spadat.pkt_source_ip));
@@ -1312,20 +1455,24 @@ incoming_spa(fko_srv_options_t *opts)
     if(! precheck_pkt(opts, spa_pkt, &spadat))
         goto cleanup;
 
-    if(! replay_check(opts, spa_pkt, &raw_digest))
-        goto cleanup;
-
-    if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
-    {
-        if(! src_check(opts, spa_pkt, &spadat))
-            goto cleanup;
-    }
-    else
+    /* Unknown SDP IDs and bad HMACs are turned away before the replay
+     * digest is computed.
+    */
+    if(sdp_mode)
     {
         if(! sdp_id_check(opts, spa_pkt, &acc))
             goto cleanup;
+
+        if(! hmac_check(opts, acc, spa_pkt, &spadat))
+            goto cleanup;
     }
 
+    if(! replay_check(opts, spa_pkt, &raw_digest))
+        goto cleanup;
+
+    if(! sdp_mode && ! src_check(opts, spa_pkt, &spadat, &cand, &num_cand))
+        goto cleanup;
+
     if(strncasecmp(opts->config[CONF_ENABLE_SPA_PACKET_AGING], "Y", 1) == 0)
     {
         conf_pkt_age = strtol_wrapper(opts->config[CONF_MAX_SPA_PACKET_AGE],
@@ -1344,12 +1491,13 @@ incoming_spa(fko_srv_options_t *opts)
 
     if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "Y", 1) == 0)
     {
-        acc = opts->acc_stanzas;
-        /* Loop through all access stanzas looking for a match
+        /* Loop through the stanzas whose SOURCE and DESTINATION match,
+         * in access.conf order, looking for a match
         */
-        while(acc)
+        for(c=0; c < num_cand; c++)
         {
-            stanza_num++;
+            acc = opts->acc_addr_index->stanzas[cand[c]];
+            stanza_num = cand[c] + 1;
 
             if( process_spa_data(opts, &ctx, acc, spa_pkt, &spadat, stanza_num,
                     raw_digest, conf_pkt_age) == KEEP_SEARCHING )
@@ -1363,8 +1511,6 @@ incoming_spa(fko_srv_options_t *opts)
                         );
                     ctx = NULL;
                 }
-
-                acc = acc->next;
             }
             else
             {
@@ -1381,6 +1527,9 @@ cleanup:
     if (raw_digest != NULL)
         free(raw_digest);
 
+    if(cand != cand_buf)
+        free(cand);
+
     if(ctx != NULL)
     {
         if(fko_destroy(ctx) == FKO_ERROR_ZERO_OUT_DATA)
@@ -1396,6 +1545,38 @@ cleanup:
 		free_service_data_list(spadat.service_data_list);
 	}
 
+    if(sdp_mode)
+        acc_epoch_exit(&(opts->acc_epoch), reader_slot);
+
+    return;
+}
+
+void
+spa_filter_log_stats(fko_srv_options_t *opts)
+{
+    uint64_t    n[SPA_REJECT_STAGES];
+    int         i;
+
+    for(i=0; i < SPA_REJECT_STAGES; i++)
+        n[i] = __atomic_load_n(&(opts->spa_rejects[i]), __ATOMIC_RELAXED);
+
+    log_msg(LOG_INFO,
+        "SPA pre-authentication rejects: length %"PRIu64", prefix %"PRIu64", "
+        "base64 %"PRIu64", SDP ID %"PRIu64", unknown SDP ID %"PRIu64", "
+        "HMAC %"PRIu64", replay %"PRIu64,
+        n[SPA_REJECT_LENGTH], n[SPA_REJECT_PREFIX], n[SPA_REJECT_BASE64],
+        n[SPA_REJECT_SDP_ID], n[SPA_REJECT_UNKNOWN_ID], n[SPA_REJECT_HMAC],
+        n[SPA_REJECT_REPLAY]);
+
+    return;
+}
+
+/* Process the SPA packet the capture loop left in opts->spa_pkt
+*/
+void
+incoming_spa(fko_srv_options_t *opts)
+{
+    process_spa_pkt(opts, &(opts->spa_pkt), opts->acc_reader_slot);
     return;
 }
 
@@ -31,8 +31,14 @@
 #ifndef INCOMING_SPA_H
 #define INCOMING_SPA_H
 
+#include "spa_pipeline.h"
+
 /* Prototypes
 */
 void incoming_spa(fko_srv_options_t *opts);
+void process_spa_pkt(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const int reader_slot);
+int run_spa_action(fko_srv_options_t *opts, spa_action_t *act);
+void spa_filter_log_stats(fko_srv_options_t *opts);
 
 #endif  /* INCOMING_SPA_H */
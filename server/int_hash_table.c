@@ -0,0 +1,429 @@
+/*
+ *****************************************************************************
+ *
+ * File:    int_hash_table.c
+ *
+ * Purpose: Hash table for integer keys (SDP IDs, service IDs).  Unlike
+ *          hash_table.c there is no key to allocate, format or compare
+ *          byte by byte, and the nodes live inline in one open addressing
+ *          slot array that grows as needed instead of a fixed number of
+ *          chained buckets.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "common.h"
+#include "int_hash_table.h"
+
+static uint32_t
+key_slot(uint64_t key, const uint32_t mask)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53ULL;
+    key ^= key >> 33;
+
+    return (uint32_t)key & mask;
+}
+
+static int_hash_table_node_t *
+find_node(int_hash_table_node_t *nodes, const uint32_t mask, const uint64_t key)
+{
+    uint32_t    i;
+
+    if(nodes == NULL)
+        return NULL;
+
+    /* Deleted slots are passed over, only an empty one ends the probe
+    */
+    for(i = key_slot(key, mask); nodes[i].state != INT_HASH_TABLE_EMPTY;
+            i = (i + 1) & mask)
+    {
+        if(nodes[i].state == INT_HASH_TABLE_USED && nodes[i].key == key)
+            return &nodes[i];
+    }
+    return NULL;
+}
+
+/* Put a key that is known not to be in the table into the current array
+*/
+static void
+place_node(int_hash_table_t *tbl, const uint64_t key, void *data)
+{
+    uint32_t    i = key_slot(key, tbl->mask);
+
+    while(tbl->nodes[i].state == INT_HASH_TABLE_USED)
+        i = (i + 1) & tbl->mask;
+
+    if(tbl->nodes[i].state == INT_HASH_TABLE_EMPTY)
+        tbl->used++;
+
+    tbl->nodes[i].key   = key;
+    tbl->nodes[i].data  = data;
+    tbl->nodes[i].state = INT_HASH_TABLE_USED;
+    return;
+}
+
+/* Move up to steps slots of the old array into the current one, and free
+ * the old array once it has been walked all the way.  The moved nodes are
+ * marked deleted so that probes for the rest still work.
+*/
+static void
+migrate_nodes(int_hash_table_t *tbl, uint32_t steps)
+{
+    int_hash_table_node_t  *node;
+
+    while(tbl->old_nodes != NULL && steps-- > 0)
+    {
+        node = &(tbl->old_nodes[tbl->migrate_pos]);
+        if(node->state == INT_HASH_TABLE_USED)
+        {
+            place_node(tbl, node->key, node->data);
+            node->state = INT_HASH_TABLE_DELETED;
+        }
+
+        if(tbl->migrate_pos++ == tbl->old_mask)
+        {
+            free(tbl->old_nodes);
+            tbl->old_nodes   = NULL;
+            tbl->old_mask    = 0;
+            tbl->migrate_pos = 0;
+        }
+    }
+    return;
+}
+
+/* Allocate a new slot array that is at most half full with the current
+ * nodes and start moving them.  The table never shrinks, so the moves
+ * always finish before the new array fills up.
+*/
+static int
+start_resize(int_hash_table_t *tbl)
+{
+    int_hash_table_node_t  *nodes;
+    uint32_t                slots = tbl->mask + 1;
+
+    while(slots / 2 < tbl->count + 1 && slots < (1U << 31))
+        slots <<= 1;
+
+    if((nodes = calloc(slots, sizeof(int_hash_table_node_t))) == NULL)
+        return -1;
+
+    tbl->old_nodes   = tbl->nodes;
+    tbl->old_mask    = tbl->mask;
+    tbl->migrate_pos = 0;
+
+    tbl->nodes = nodes;
+    tbl->mask  = slots - 1;
+    tbl->used  = 0;
+
+    return 0;
+}
+
+/**
+ * Allocate an empty table with room for expected_entries nodes before it
+ * has to grow.  delete_cb (may be NULL) is called for every node that is
+ * deleted, replaced or still in the table when it is destroyed.  Returns
+ * NULL on allocation failure.
+ */
+int_hash_table_t *
+int_hash_table_create(const uint32_t expected_entries,
+        int_hash_table_delete_cb delete_cb)
+{
+    int_hash_table_t   *tbl = NULL;
+    uint32_t            slots = INT_HASH_TABLE_MIN_SLOTS;
+
+    while(slots / 2 < expected_entries && slots < (1U << 31))
+        slots <<= 1;
+
+    if((tbl = calloc(1, sizeof(int_hash_table_t))) == NULL)
+        return NULL;
+
+    if((tbl->nodes = calloc(slots, sizeof(int_hash_table_node_t))) == NULL)
+    {
+        free(tbl);
+        return NULL;
+    }
+    tbl->mask      = slots - 1;
+    tbl->delete_cb = delete_cb;
+
+    return tbl;
+}
+
+static void
+destroy_nodes(int_hash_table_t *tbl, int_hash_table_node_t *nodes,
+        const uint32_t mask)
+{
+    uint32_t    i;
+
+    if(nodes == NULL)
+        return;
+
+    if(tbl->delete_cb != NULL)
+        for(i=0; i <= mask; i++)
+            if(nodes[i].state == INT_HASH_TABLE_USED)
+                tbl->delete_cb(&nodes[i]);
+
+    free(nodes);
+    return;
+}
+
+void
+int_hash_table_destroy(int_hash_table_t *tbl)
+{
+    if(tbl == NULL)
+        return;
+
+    destroy_nodes(tbl, tbl->old_nodes, tbl->old_mask);
+    destroy_nodes(tbl, tbl->nodes, tbl->mask);
+    free(tbl);
+    return;
+}
+
+/**
+ * Store data under key.  If the key is already present, the delete
+ * callback is run on the old node first.  Returns 0 on success or -1 on
+ * allocation failure.
+ */
+int
+int_hash_table_set(int_hash_table_t *tbl, const uint64_t key, void *data)
+{
+    int_hash_table_node_t  *node;
+
+    if((node = find_node(tbl->nodes, tbl->mask, key)) == NULL)
+        node = find_node(tbl->old_nodes, tbl->old_mask, key);
+
+    if(node != NULL)
+    {
+        if(tbl->delete_cb != NULL)
+            tbl->delete_cb(node);
+        node->key  = key;
+        node->data = data;
+        return 0;
+    }
+
+    /* Keep the current array at most three quarters full (counting the
+     * deleted slots).  A resize still in progress is finished first.
+    */
+    if((tbl->used + 1) * 4 > (tbl->mask + 1) * 3)
+    {
+        migrate_nodes(tbl, tbl->old_mask + 1);
+
+        if((tbl->used + 1) * 4 > (tbl->mask + 1) * 3
+                && start_resize(tbl) != 0
+                && tbl->used + 1 > tbl->mask)
+            return -1;
+    }
+
+    migrate_nodes(tbl, INT_HASH_TABLE_MIGRATE_STEP);
+
+    place_node(tbl, key, data);
+    tbl->count++;
+
+    return 0;
+}
+
+void *
+int_hash_table_get(const int_hash_table_t *tbl, const uint64_t key)
+{
+    int_hash_table_node_t  *node;
+
+    if((node = find_node(tbl->nodes, tbl->mask, key)) == NULL
+            && (node = find_node(tbl->old_nodes, tbl->old_mask, key)) == NULL)
+        return NULL;
+
+    return node->data;
+}
+
+/**
+ * Run the delete callback on the node for key and remove it.  Returns 0,
+ * or -1 if the key is not in the table.
+ */
+int
+int_hash_table_delete(int_hash_table_t *tbl, const uint64_t key)
+{
+    int_hash_table_node_t  *node;
+
+    if((node = find_node(tbl->nodes, tbl->mask, key)) == NULL
+            && (node = find_node(tbl->old_nodes, tbl->old_mask, key)) == NULL)
+        return -1;
+
+    if(tbl->delete_cb != NULL)
+        tbl->delete_cb(node);
+
+    node->data  = NULL;
+    node->state = INT_HASH_TABLE_DELETED;
+    tbl->count--;
+
+    return 0;
+}
+
+/**
+ * Call traverse_cb for every node.  The callback may delete nodes from
+ * this table (deleting never moves anything) but must not add any.
+ * Returns 0, or the first nonzero value returned by the callback.
+ */
+int
+int_hash_table_traverse(int_hash_table_t *tbl,
+        int_hash_table_traverse_cb traverse_cb, void *cb_arg)
+{
+    int_hash_table_node_t  *nodes[2] = {tbl->old_nodes, tbl->nodes};
+    uint32_t                masks[2] = {tbl->old_mask, tbl->mask};
+    uint32_t                i;
+    int                     n, rc;
+
+    for(n=0; n < 2; n++)
+    {
+        if(nodes[n] == NULL)
+            continue;
+
+        for(i=0; i <= masks[n]; i++)
+        {
+            if(nodes[n][i].state != INT_HASH_TABLE_USED)
+                continue;
+
+            if((rc = traverse_cb(&nodes[n][i], cb_arg)) != 0)
+                return rc;
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_C_UNIT_TESTS
+
+DECLARE_TEST_SUITE(int_hash_table, "Integer key hash table test suite");
+
+static int utest_deleted = 0;
+
+static void
+utest_delete_cb(int_hash_table_node_t *node)
+{
+    utest_deleted++;
+    return;
+}
+
+static int
+utest_delete_odd_cb(int_hash_table_node_t *node, void *arg)
+{
+    int_hash_table_t   *tbl = (int_hash_table_t *)arg;
+
+    (*(int *)node->data)++;
+    if(node->key & 1)
+        int_hash_table_delete(tbl, node->key);
+    return 0;
+}
+
+DECLARE_UTEST(set_get_delete, "set, replace, get and delete integer keys")
+{
+    int_hash_table_t   *tbl = NULL;
+    int                 a = 1, b = 2;
+
+    utest_deleted = 0;
+    tbl = int_hash_table_create(0, utest_delete_cb);
+    CU_ASSERT(tbl != NULL);
+    CU_ASSERT(tbl->mask + 1 == INT_HASH_TABLE_MIN_SLOTS);
+
+    CU_ASSERT(int_hash_table_get(tbl, 7) == NULL);
+    CU_ASSERT(int_hash_table_set(tbl, 7, &a) == 0);
+    CU_ASSERT(int_hash_table_set(tbl, 0, &b) == 0);
+    CU_ASSERT(int_hash_table_set(tbl, UINT64_MAX, &b) == 0);
+    CU_ASSERT(int_hash_table_get(tbl, 7) == &a);
+    CU_ASSERT(int_hash_table_get(tbl, 0) == &b);
+    CU_ASSERT(int_hash_table_get(tbl, UINT64_MAX) == &b);
+    CU_ASSERT(tbl->count == 3);
+
+    /* Same key again replaces the data
+    */
+    CU_ASSERT(int_hash_table_set(tbl, 7, &b) == 0);
+    CU_ASSERT(int_hash_table_get(tbl, 7) == &b);
+    CU_ASSERT(tbl->count == 3);
+    CU_ASSERT(utest_deleted == 1);
+
+    CU_ASSERT(int_hash_table_delete(tbl, 7) == 0);
+    CU_ASSERT(int_hash_table_delete(tbl, 7) == -1);
+    CU_ASSERT(int_hash_table_get(tbl, 7) == NULL);
+    CU_ASSERT(tbl->count == 2);
+    CU_ASSERT(utest_deleted == 2);
+
+    int_hash_table_destroy(tbl);
+    CU_ASSERT(utest_deleted == 4);
+}
+
+DECLARE_UTEST(grow, "all keys stay reachable while the table grows")
+{
+    int_hash_table_t   *tbl = NULL;
+    int                 data[5000];
+    int                 i, j, found = 1, visits = 1;
+
+    utest_deleted = 0;
+    tbl = int_hash_table_create(0, utest_delete_cb);
+
+    for(i=0; i < 5000; i++)
+    {
+        data[i] = 0;
+        CU_ASSERT(int_hash_table_set(tbl, (uint64_t)i << 32 | i, &data[i]) == 0);
+
+        /* Check everything so far every time a resize is underway
+        */
+        if(tbl->old_nodes != NULL)
+            for(j=0; j <= i; j++)
+                if(int_hash_table_get(tbl, (uint64_t)j << 32 | j) != &data[j])
+                    found = 0;
+    }
+    CU_ASSERT(found == 1);
+    CU_ASSERT(tbl->count == 5000);
+    CU_ASSERT(tbl->used * 4 <= (tbl->mask + 1) * 3);
+
+    /* Every node is visited once, even the ones deleted along the way
+    */
+    CU_ASSERT(int_hash_table_traverse(tbl, utest_delete_odd_cb, tbl) == 0);
+    for(i=0; i < 5000; i++)
+        if(data[i] != 1)
+            visits = 0;
+    CU_ASSERT(visits == 1);
+    CU_ASSERT(tbl->count == 2500);
+    CU_ASSERT(utest_deleted == 2500);
+
+    for(i=0; i < 5000; i++)
+        if(int_hash_table_get(tbl, (uint64_t)i << 32 | i)
+                != ((i & 1) ? NULL : &data[i]))
+            found = 0;
+    CU_ASSERT(found == 1);
+
+    int_hash_table_destroy(tbl);
+    CU_ASSERT(utest_deleted == 5000);
+}
+
+int register_ts_int_hash_table(void)
+{
+    ts_init(&TEST_SUITE(int_hash_table), TEST_SUITE_DESCR(int_hash_table), NULL, NULL);
+    ts_add_utest(&TEST_SUITE(int_hash_table), UTEST_FCT(set_get_delete), UTEST_DESCR(set_get_delete));
+    ts_add_utest(&TEST_SUITE(int_hash_table), UTEST_FCT(grow), UTEST_DESCR(grow));
+
+    return register_ts(&TEST_SUITE(int_hash_table));
+}
+
+#endif /* HAVE_C_UNIT_TESTS */
+
+/***EOF***/
@@ -0,0 +1,92 @@
+/*
+ *****************************************************************************
+ *
+ * File:    int_hash_table.h
+ *
+ * Purpose: Header file for fwknopd int_hash_table.c functions.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef INT_HASH_TABLE_H
+#define INT_HASH_TABLE_H
+
+#include <stdint.h>
+
+/* Smallest table, and how many old slots are moved into the new array on
+ * every insert while the table is being resized
+*/
+#define INT_HASH_TABLE_MIN_SLOTS        16
+#define INT_HASH_TABLE_MIGRATE_STEP     16
+
+/* Nodes are stored inline in the slot array.  A node pointer handed to a
+ * callback is only good until the table is next modified.
+*/
+typedef struct int_hash_table_node
+{
+    uint64_t        key;
+    void           *data;
+    uint8_t         state;      /* INT_HASH_TABLE_EMPTY, _USED or _DELETED */
+} int_hash_table_node_t;
+
+#define INT_HASH_TABLE_EMPTY    0
+#define INT_HASH_TABLE_USED     1
+#define INT_HASH_TABLE_DELETED  2
+
+typedef void (*int_hash_table_delete_cb)(int_hash_table_node_t *node);
+typedef int (*int_hash_table_traverse_cb)(int_hash_table_node_t *node, void *cb_arg);
+
+/* Open addressing table keyed on a uint32/uint64 value.  When it fills
+ * up a bigger slot array is allocated and the nodes are moved over a few
+ * at a time by later inserts, so no single insert pays for the whole
+ * rehash.  Until then lookups check both arrays.
+*/
+typedef struct int_hash_table
+{
+    int_hash_table_node_t  *nodes;
+    uint32_t                mask;       /* number of slots - 1 (power of two) */
+    uint32_t                used;       /* live and deleted slots in nodes */
+    uint32_t                count;      /* live nodes in both arrays */
+
+    int_hash_table_node_t  *old_nodes;  /* array being moved, or NULL */
+    uint32_t                old_mask;
+    uint32_t                migrate_pos;
+
+    int_hash_table_delete_cb delete_cb;
+} int_hash_table_t;
+
+int_hash_table_t *int_hash_table_create(const uint32_t expected_entries,
+        int_hash_table_delete_cb delete_cb);
+void  int_hash_table_destroy(int_hash_table_t *tbl);
+
+int   int_hash_table_set(int_hash_table_t *tbl, const uint64_t key, void *data);
+void *int_hash_table_get(const int_hash_table_t *tbl, const uint64_t key);
+int   int_hash_table_delete(int_hash_table_t *tbl, const uint64_t key);
+int   int_hash_table_traverse(int_hash_table_t *tbl,
+        int_hash_table_traverse_cb traverse_cb, void *cb_arg);
+
+#ifdef HAVE_C_UNIT_TESTS
+int register_ts_int_hash_table(void);
+#endif
+
+#endif  /* INT_HASH_TABLE_H */
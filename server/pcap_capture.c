@@ -71,6 +71,7 @@ pcap_capture(fko_srv_options_t *opts)
     int                 max_sniff_bytes;
     int                 is_err;
     int                 chk_rm_all = 0;
+    int                 fw_pending_us;
     pid_t               child_pid;
 
 #if FIREWALL_IPFW
@@ -332,7 +333,12 @@ pcap_capture(fko_srv_options_t *opts)
         else
             pcap_errcnt = 0;
 
-        if(!opts->test)
+        fw_pending_us = 0;
+
+        /* With SPA verification workers, the applier thread takes care
+         * of this.
+        */
+        if(!opts->test && opts->spa_pipeline == NULL)
         {
             if(opts->enable_fw)
             {
@@ -349,6 +355,10 @@ pcap_capture(fko_srv_options_t *opts)
                 }
                 check_firewall_rules(opts, chk_rm_all);
                 chk_rm_all = 0;
+
+                /* Add the rules granted during the last batch window
+                */
+                fw_pending_us = fw_apply_pending_rules(opts, 0);
             }
 
             /* See if any CMD_CYCLE_CLOSE commands need to be executed.
@@ -360,7 +370,7 @@ pcap_capture(fko_srv_options_t *opts)
         /* Purge expired rules that no longer have any corresponding
          * dynamic rules.
         */
-        if(opts->fw_config->total_rules > 0)
+        if(opts->spa_pipeline == NULL && opts->fw_config->total_rules > 0)
         {
             time(&now);
             if(opts->fw_config->last_purge < (now - opts->fw_config->purge_interval))
@@ -371,7 +381,12 @@ pcap_capture(fko_srv_options_t *opts)
         }
 #endif
 
-        usleep(useconds);
+        /* Don't sleep past the point where queued rules are due
+        */
+        if(fw_pending_us > 0 && fw_pending_us < useconds)
+            usleep(fw_pending_us);
+        else
+            usleep(useconds);
     }
 
     pcap_close(pcap);
@@ -45,9 +45,13 @@
 
 #if USE_LIBPCAP
 
-void
-process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
-    const unsigned char *packet)
+/* Find the SPA payload of a captured frame.  The fields of frame point
+ * into the packet, nothing is copied.  Returns 0 if this is not an IPv4
+ * TCP, UDP or ICMP packet that could carry SPA data.
+*/
+int
+spa_frame_parse(const unsigned char *packet, const unsigned int caplen,
+    const unsigned int len, const int data_link_offset, spa_frame_t *frame)
 {
     struct ether_header *eth_p;
     struct iphdr        *iph_p;
@@ -63,19 +67,15 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     unsigned int        ip_hdr_words;
 
     unsigned char       proto;
-    unsigned int        src_ip;
-    unsigned int        dst_ip;
 
     unsigned short      src_port = 0;
     unsigned short      dst_port = 0;
 
     unsigned short      eth_type;
 
-    fko_srv_options_t   *opts = (fko_srv_options_t *)args;
+    int                 offset = data_link_offset;
 
-    int                 offset = opts->data_link_offset;
-
-    unsigned short      pkt_len = packet_header->len;
+    unsigned short      pkt_len = len;
 
     /* This is a hack to determine if we are using the linux cooked
      * interface.  We base it on the offset being 16 which is the
@@ -86,7 +86,7 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
 
     /* Determine packet end.
     */
-    fr_end = (unsigned char *) packet + packet_header->caplen;
+    fr_end = (unsigned char *) packet + caplen;
 
     /* The ethernet header.
     */
@@ -94,8 +94,8 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
 
     /* Gotta have a complete ethernet header.
     */
-    if (packet_header->caplen < ETHER_HDR_LEN)
-        return;
+    if (caplen < ETHER_HDR_LEN)
+        return 0;
 
     eth_type = ntohs(*((unsigned short*)&eth_p->ether_type));
 
@@ -121,7 +121,7 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     /* Make sure the packet length is still valid.
     */
     if (! ETHER_IS_VALID_LEN(pkt_len) )
-        return;
+        return 0;
 
     /* Pull the IP header.
     */
@@ -130,7 +130,7 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     /* If IP header is past calculated packet end, bail.
     */
     if ((unsigned char*)(iph_p + 1) > fr_end)
-        return;
+        return 0;
 
     /* ip_hdr_words is the number of 32 bit words in the IP header. After
      * masking of the IPV4 version bits, the number *must* be at least
@@ -139,7 +139,7 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     ip_hdr_words = iph_p->ihl & IPV4_VER_MASK;
 
     if (ip_hdr_words < MIN_IPV4_WORDS)
-        return;
+        return 0;
 
     /* Make sure to calculate the packet end based on the length in the
      * IP header. This allows additional bytes that may be added to the
@@ -148,13 +148,10 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
     */
     pkt_end = ((unsigned char*)iph_p)+ntohs(iph_p->tot_len);
     if(pkt_end > fr_end)
-        return;
+        return 0;
 
     /* Now, find the packet data payload (depending on IPPROTO).
     */
-    src_ip = iph_p->saddr;
-    dst_ip = iph_p->daddr;
-
     proto = iph_p->protocol;
 
     if (proto == IPPROTO_TCP)
@@ -194,9 +191,27 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
 
     else
     {
-        return;
+        return 0;
     }
 
+    frame->data     = pkt_data;
+    frame->data_len = pkt_data_len;
+    frame->proto    = proto;
+    frame->src_ip   = iph_p->saddr;
+    frame->dst_ip   = iph_p->daddr;
+    frame->src_port = src_port;
+    frame->dst_port = dst_port;
+
+    return 1;
+}
+
+/* Copy the payload of a parsed frame into spa_pkt.  This is the only copy
+ * a packet sees: the SPA checks rewrite the data in place.  Returns 0 if
+ * the payload cannot be an SPA packet.
+*/
+int
+spa_frame_to_pkt(const spa_frame_t *frame, spa_pkt_info_t *spa_pkt)
+{
     /*
      * Now we have data. For now, we are not checking IP or port values. We
      * are relying on the pcap filter. This may change so we do retain the IP
@@ -208,26 +223,49 @@ process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
      * will weed out a lot of things like small TCP ACK's if the user has a
      * permissive pcap filter
     */
-    if(pkt_data_len < MIN_SPA_DATA_SIZE)
-        return;
+    if(frame->data_len < MIN_SPA_DATA_SIZE)
+        return 0;
 
     /* Expect the data to not be too large
     */
-    if(pkt_data_len > MAX_SPA_PACKET_LEN)
-        return;
+    if(frame->data_len > MAX_SPA_PACKET_LEN)
+        return 0;
 
-    /* Copy the packet for SPA processing
+    /* Copy the packet for SPA processing.  The payload is not terminated
+     * in the capture buffer (which may be a ring shared with the kernel),
+     * so don't look past data_len.
     */
-    strlcpy((char *)opts->spa_pkt.packet_data, (char *)pkt_data, pkt_data_len+1);
-    opts->spa_pkt.packet_data_len = pkt_data_len;
-    opts->spa_pkt.packet_proto    = proto;
-    opts->spa_pkt.packet_src_ip   = src_ip;
-    opts->spa_pkt.packet_dst_ip   = dst_ip;
-    opts->spa_pkt.packet_src_port = src_port;
-    opts->spa_pkt.packet_dst_port = dst_port;
-    opts->spa_pkt.sdp_id = 0;
-
-    incoming_spa(opts);
+    memcpy(spa_pkt->packet_data, frame->data, frame->data_len);
+    spa_pkt->packet_data[frame->data_len] = 0x0;
+    spa_pkt->packet_data_len = frame->data_len;
+    spa_pkt->packet_proto    = frame->proto;
+    spa_pkt->packet_src_ip   = frame->src_ip;
+    spa_pkt->packet_dst_ip   = frame->dst_ip;
+    spa_pkt->packet_src_port = frame->src_port;
+    spa_pkt->packet_dst_port = frame->dst_port;
+    spa_pkt->sdp_id = 0;
+
+    return 1;
+}
+
+void
+process_packet(unsigned char *args, const struct pcap_pkthdr *packet_header,
+    const unsigned char *packet)
+{
+    fko_srv_options_t   *opts = (fko_srv_options_t *)args;
+    spa_frame_t          frame;
+
+    if(! spa_frame_parse(packet, packet_header->caplen, packet_header->len,
+            opts->data_link_offset, &frame))
+        return;
+
+    if(! spa_frame_to_pkt(&frame, &(opts->spa_pkt)))
+        return;
+
+    if(opts->spa_pipeline != NULL)
+        spa_pipeline_submit(opts, &(opts->spa_pkt));
+    else
+        incoming_spa(opts);
 
     return;
 }
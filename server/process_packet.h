@@ -43,9 +43,25 @@
   #define ETHER_HDR_LEN 14
 #endif
 
+/* The SPA payload of a captured frame and where it came from
+*/
+typedef struct spa_frame
+{
+    const unsigned char *data;      /* points into the captured frame */
+    unsigned short      data_len;
+    unsigned char       proto;
+    unsigned int        src_ip;
+    unsigned int        dst_ip;
+    unsigned short      src_port;
+    unsigned short      dst_port;
+} spa_frame_t;
+
 /* Prototypes
 */
 #if USE_LIBPCAP
+int spa_frame_parse(const unsigned char *packet, const unsigned int caplen,
+        const unsigned int len, const int data_link_offset, spa_frame_t *frame);
+int spa_frame_to_pkt(const spa_frame_t *frame, spa_pkt_info_t *spa_pkt);
 void process_packet(unsigned char *args,
         const struct pcap_pkthdr *packet_header, const unsigned char *packet);
 #endif
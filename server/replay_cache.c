@@ -48,6 +48,9 @@
   #define MY_DBM_STORE(d, k, v, m)  gdbm_store(d, k, v, m)
   #define MY_DBM_STRERROR(x)        gdbm_strerror(x)
   #define MY_DBM_CLOSE(d)           gdbm_close(d)
+  #define MY_DBM_DELETE(d, k)       gdbm_delete(d, k)
+
+  typedef GDBM_FILE                 MY_DBM_FILE;
 
   #define MY_DBM_REPLACE            GDBM_REPLACE
   #define MY_DBM_INSERT             GDBM_INSERT
@@ -59,6 +62,9 @@
   #define MY_DBM_STORE(d, k, v, m)  dbm_store(d, k, v, m)
   #define MY_DBM_STRERROR(x)        strerror(x)
   #define MY_DBM_CLOSE(d)           dbm_close(d)
+  #define MY_DBM_DELETE(d, k)       dbm_delete(d, k)
+
+  typedef DBM                      *MY_DBM_FILE;
 
   #define MY_DBM_REPLACE            DBM_REPLACE
   #define MY_DBM_INSERT             DBM_INSERT
@@ -77,7 +83,21 @@
 #include <fcntl.h>
 
 #define DATE_LEN 18
-#define MAX_DIGEST_SIZE 64
+
+/* Don't bother rewriting the digest file until it has at least this many
+ * entries and more than half of them have expired.
+*/
+#define DIGEST_FILE_COMPACT_MIN_ENTRIES 1024
+
+/* Width (in seconds) of a digest cache generation - digests created within
+ * the same window are expired together.
+*/
+#define DIGEST_GEN_WIDTH(o) ((o)->digest_expire_age / 2 > 0 ? (o)->digest_expire_age / 2 : 1)
+
+/* SPA verification workers (see spa_pipeline.c) check and add digests
+ * concurrently, so lookups and inserts are serialized here.
+*/
+static pthread_mutex_t replay_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 /* Rotate the digest file by simply renaming it.
 */
@@ -139,7 +159,8 @@ rotate_digest_cache_file(fko_srv_options_t *opts)
 }
 
 static void
-replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
+replay_warning(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        digest_cache_info_t *digest_info)
 {
     char        src_ip[INET_ADDRSTRLEN+1] = {0};
     char        orig_src_ip[INET_ADDRSTRLEN+1] = {0};
@@ -151,7 +172,7 @@ replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
 
     /* Convert the IPs to a human readable form
     */
-    inet_ntop(AF_INET, &(opts->spa_pkt.packet_src_ip),
+    inet_ntop(AF_INET, &(spa_pkt->packet_src_ip),
         src_ip, INET_ADDRSTRLEN);
     inet_ntop(AF_INET, &(digest_info->src_ip), orig_src_ip, INET_ADDRSTRLEN);
 
@@ -189,8 +210,8 @@ replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
         "Replay count: %i",
 #endif
         src_ip,
-        opts->spa_pkt.packet_proto,
-        opts->spa_pkt.packet_dst_port,
+        spa_pkt->packet_proto,
+        spa_pkt->packet_dst_port,
         orig_src_ip,
         digest_info->proto,
         digest_info->dst_port,
@@ -208,22 +229,273 @@ replay_warning(fko_srv_options_t *opts, digest_cache_info_t *digest_info)
 }
 
 #if USE_FILE_CACHE
+/* Key callback for the digest index - entries are digest file records.
+*/
+static const char *
+digest_rec_key(const void *data, int *key_len)
+{
+    const digest_file_rec_t *rec = data;
+
+    *key_len = rec->digest_len;
+    return (const char *)rec->digest;
+}
+
+/* Generation a digest created at 'created' belongs to.  Without expiry
+ * everything lives in a single generation.
+*/
+static time_t
+digest_gen_id(const fko_srv_options_t *opts, const time_t created)
+{
+    if(opts->digest_expire_age <= 0)
+        return 0;
+
+    return created / DIGEST_GEN_WIDTH(opts);
+}
+
+/* A generation can be dropped once its newest possible digest is older
+ * than the expiry age.
+*/
 static int
-replay_file_cache_init(fko_srv_options_t *opts)
+digest_gen_expired(const fko_srv_options_t *opts, const time_t gen_id,
+        const time_t now)
+{
+    if(opts->digest_expire_age <= 0)
+        return 0;
+
+    return (gen_id + 1) * DIGEST_GEN_WIDTH(opts)
+        + opts->digest_expire_age <= now;
+}
+
+/* Find (or create) the generation for 'gen_id'.  The list is kept newest
+ * first and with expiry enabled it only ever holds a few generations.
+*/
+static struct digest_cache_gen *
+digest_gen_get(struct digest_cache_gen **gens, const time_t gen_id)
+{
+    struct digest_cache_gen **gen_ptr = gens;
+    struct digest_cache_gen  *gen     = NULL;
+
+    while(*gen_ptr != NULL && (*gen_ptr)->gen_id > gen_id)
+        gen_ptr = &((*gen_ptr)->next);
+
+    if(*gen_ptr != NULL && (*gen_ptr)->gen_id == gen_id)
+        return *gen_ptr;
+
+    if((gen = calloc(1, sizeof(struct digest_cache_gen))) == NULL)
+        return NULL;
+
+    gen->gen_id = gen_id;
+    gen->next   = *gen_ptr;
+    *gen_ptr    = gen;
+
+    return gen;
+}
+
+/* Add a record to an index and to its generation.  Returns one of the
+ * DIGEST_INDEX_* codes, the record is only referenced on success.
+*/
+static int
+digest_cache_insert(const fko_srv_options_t *opts,
+        struct digest_cache_gen **gens, digest_index_t *index,
+        const digest_file_rec_t *rec)
+{
+    struct digest_cache_gen  *gen = NULL;
+    const digest_file_rec_t **recs = NULL;
+    unsigned int              size;
+    int                       res;
+
+    gen = digest_gen_get(gens, digest_gen_id(opts, rec->created));
+    if(gen == NULL)
+        return DIGEST_INDEX_ERROR;
+
+    if(gen->count == gen->size)
+    {
+        size = gen->size ? gen->size * 2 : 64;
+        if((recs = realloc(gen->recs, size * sizeof(*recs))) == NULL)
+            return DIGEST_INDEX_ERROR;
+        gen->recs = recs;
+        gen->size = size;
+    }
+
+    res = digest_index_add(index, (const char *)rec->digest,
+            rec->digest_len, (void *)rec);
+    if(res != DIGEST_INDEX_SUCCESS)
+        return res;
+
+    gen->recs[gen->count++] = rec;
+
+    return DIGEST_INDEX_SUCCESS;
+}
+
+/* Records for digests added since the digest file was mapped are carved
+ * out of slabs, which are released when the file is compacted and mapped
+ * again.
+*/
+static digest_file_rec_t *
+digest_rec_alloc(fko_srv_options_t *opts)
+{
+    struct digest_rec_slab *slab = opts->digest_slabs;
+
+    if(slab == NULL || slab->used == DIGEST_REC_SLAB_SIZE)
+    {
+        if((slab = calloc(1, sizeof(struct digest_rec_slab))) == NULL)
+            return NULL;
+        slab->next = opts->digest_slabs;
+        opts->digest_slabs = slab;
+    }
+
+    memset(&(slab->recs[slab->used]), 0x0, sizeof(digest_file_rec_t));
+
+    return &(slab->recs[slab->used++]);
+}
+
+/* Give back the record handed out by the last digest_rec_alloc() call
+*/
+static void
+digest_rec_unalloc(fko_srv_options_t *opts)
+{
+    opts->digest_slabs->used--;
+    return;
+}
+
+static void
+free_digest_gens(struct digest_cache_gen *gen)
+{
+    struct digest_cache_gen *next = NULL;
+
+    while(gen != NULL)
+    {
+        next = gen->next;
+        free(gen->recs);
+        free(gen);
+        gen = next;
+    }
+    return;
+}
+
+static void
+free_digest_slabs(struct digest_rec_slab *slab)
 {
-    FILE           *digest_file_ptr = NULL;
-    unsigned int    num_lines = 0, digest_ctr = 0;
-    char            line_buf[MAX_LINE_LEN]    = {0};
-    char            src_ip[INET_ADDRSTRLEN+1] = {0};
-    char            dst_ip[INET_ADDRSTRLEN+1] = {0};
-    long int        time_tmp;
-    int             digest_file_fd = -1;
-    char            digest_header[] = "# <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>\n";
+    struct digest_rec_slab  *next = NULL;
 
-    struct digest_cache_list *digest_elm = NULL;
+    while(slab != NULL)
+    {
+        next = slab->next;
+        free(slab);
+        slab = next;
+    }
+    return;
+}
+
+static void
+free_digest_cache(fko_srv_options_t *opts)
+{
+    digest_index_destroy(opts->digest_index);
+    opts->digest_index = NULL;
+
+    free_digest_gens(opts->digest_cache);
+    opts->digest_cache = NULL;
+
+    free_digest_slabs(opts->digest_slabs);
+    opts->digest_slabs = NULL;
+
+    digest_file_unmap(&(opts->digest_map));
+    opts->digest_file_entries = 0;
+
+    return;
+}
+
+static int
+open_digest_journal(fko_srv_options_t *opts)
+{
+    int     res = FKO_SUCCESS;
+
+    /* New digests are appended to the file by the journal writer thread
+    */
+    opts->digest_journal = digest_journal_open(opts->config[CONF_DIGEST_FILE],
+        digest_journal_sync_mode(opts->config[CONF_DIGEST_CACHE_SYNC_MODE]),
+        strtol_wrapper(opts->config[CONF_DIGEST_CACHE_FLUSH_INTERVAL],
+            1, RCHK_MAX_DIGEST_CACHE_FLUSH_INTERVAL, NO_EXIT_UPON_ERR, &res),
+        strtol_wrapper(opts->config[CONF_DIGEST_CACHE_BATCH_SIZE],
+            1, RCHK_MAX_DIGEST_CACHE_BATCH_SIZE, NO_EXIT_UPON_ERR, &res));
+
+    if(opts->digest_journal == NULL)
+    {
+        log_msg(LOG_WARNING, "Could not open digest cache for writing: %s",
+            opts->config[CONF_DIGEST_FILE]);
+        return(-1);
+    }
+    return(0);
+}
+
+/* Index the records of a mapped digest file that have not expired.
+ * Returns the number of digests indexed or -1 on error.
+*/
+static int
+index_digest_map(const fko_srv_options_t *opts, const digest_file_map_t *map,
+        struct digest_cache_gen **gens, digest_index_t **index)
+{
+    const digest_file_rec_t *rec = NULL;
+    unsigned int             i;
+    int                      digest_ctr = 0, res;
+    time_t                   now = time(NULL);
+
+    *gens  = NULL;
+    *index = digest_index_create(map->num_recs, digest_rec_key);
+    if(*index == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Could not allocate digest cache index");
+        return(-1);
+    }
+
+    for(i=0; i < map->num_recs; i++)
+    {
+        rec = &(map->recs[i]);
+
+        if(rec->digest_len == 0 || rec->digest_len > DIGEST_FILE_MAX_RAW)
+        {
+            log_msg(LOG_INFO,
+                "*Skipping invalid digest file entry in %s at record %u.",
+                opts->config[CONF_DIGEST_FILE], i);
+            continue;
+        }
+
+        /* Expired digests stay in the file until it is compacted, but
+         * there is no need to index them
+        */
+        if(digest_gen_expired(opts, digest_gen_id(opts, rec->created), now))
+            continue;
+
+        /* Duplicate records are harmless, just keep the first one
+        */
+        res = digest_cache_insert(opts, gens, *index, rec);
+        if(res == DIGEST_INDEX_SUCCESS)
+            digest_ctr++;
+        else if(res == DIGEST_INDEX_ERROR)
+        {
+            log_msg(LOG_ERR, "[*] Could not add digest to the digest cache index");
+            free_digest_gens(*gens);
+            digest_index_destroy(*index);
+            *gens  = NULL;
+            *index = NULL;
+            return(-1);
+        }
+    }
+
+    return(digest_ctr);
+}
+
+/* Map the digest file (creating it, or converting it from the old text
+ * format, if necessary) and index the records that have not expired.
+ * Returns the number of digests loaded or -1 on error.
+*/
+static int
+replay_file_cache_load(fko_srv_options_t *opts)
+{
+    int     digest_ctr;
 
     /* if the file exists, import the previous SPA digests into
-     * the cache list
+     * the cache
     */
     if (access(opts->config[CONF_DIGEST_FILE], F_OK) == 0)
     {
@@ -236,123 +508,294 @@ replay_file_cache_init(fko_srv_options_t *opts)
             return(-1);
         }
     }
-    else
-    {
-        /* the file does not exist yet, so it will be created when the first
-         * successful SPA packet digest is written to disk
-        */
-        digest_file_fd = open(opts->config[CONF_DIGEST_FILE],
-                O_WRONLY|O_CREAT|O_EXCL, S_IRUSR|S_IWUSR);
+    else if(digest_file_create(opts->config[CONF_DIGEST_FILE]) != 0)
+        return(-1);
 
-        if (digest_file_fd == -1)
-        {
-            log_msg(LOG_WARNING, "Could not create digest cache: %s: %s",
-                opts->config[CONF_DIGEST_FILE], strerror(errno));
-            return(-1);
-        }
-        else
-        {
-            if(write(digest_file_fd, digest_header, strlen(digest_header))
-                    != strlen(digest_header)) {
-                log_msg(LOG_WARNING,
-                    "Did not write expected number of bytes to digest cache: %s",
-                    opts->config[CONF_DIGEST_FILE]);
-            }
-            close(digest_file_fd);
+    if(verify_file_perms_ownership(opts->config[CONF_DIGEST_FILE]) != 1)
+        return(-1);
 
-            return(0);
-        }
+    switch(digest_file_is_binary(opts->config[CONF_DIGEST_FILE]))
+    {
+        case 1:
+            break;
+        case 0:
+            if(digest_file_convert_text(opts->config[CONF_DIGEST_FILE]) < 0)
+                return(-1);
+            break;
+        default:
+            log_msg(LOG_WARNING, "Could not open digest cache: %s",
+                opts->config[CONF_DIGEST_FILE]);
+            return(-1);
     }
 
-    if(verify_file_perms_ownership(opts->config[CONF_DIGEST_FILE]) != 1)
+    if(digest_file_map(opts->config[CONF_DIGEST_FILE], &(opts->digest_map)) != 0)
         return(-1);
 
-    /* File exists, and we have access - create in-memory digest cache
-    */
-    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "r")) == NULL)
+    opts->digest_file_entries = opts->digest_map.num_recs;
+
+    digest_ctr = index_digest_map(opts, &(opts->digest_map),
+            &(opts->digest_cache), &(opts->digest_index));
+    if(digest_ctr < 0)
+        return(-1);
+
+    if(opts->verbose > 3)
+        log_msg(LOG_DEBUG, "DIGEST FILE: %s, %u records, %d loaded",
+            opts->config[CONF_DIGEST_FILE], opts->digest_map.num_recs,
+            digest_ctr);
+
+    return(digest_ctr);
+}
+
+static void
+free_digest_compaction(struct digest_compaction *compaction)
+{
+    free(compaction->recs);
+    free_digest_gens(compaction->gens);
+    digest_index_destroy(compaction->index);
+    digest_file_unmap(&(compaction->map));
+    free(compaction);
+    return;
+}
+
+/* Journal rewrite callback, runs on the journal writer thread.  Writes a
+ * new digest file with the digests that were cached when compaction was
+ * requested, renames it into place, then maps and indexes it so that
+ * add_replay() only has to swap the new cache in.  This must not take
+ * replay_mutex since appenders hold it while waiting on the writer.
+*/
+static int
+compact_digest_file(const char *path, void *arg)
+{
+    struct digest_compaction *compaction = arg;
+    digest_file_writer_t      writer;
+    unsigned int              i;
+    int                       state = DIGEST_COMPACT_FAILED;
+
+    if(digest_file_writer_open(&writer, path) != 0)
     {
-        log_msg(LOG_WARNING, "Could not open digest cache: %s",
-            opts->config[CONF_DIGEST_FILE]);
+        __atomic_store_n(&(compaction->state), state, __ATOMIC_RELEASE);
         return(-1);
     }
 
-    /* Line format:
-     * <digest> <proto> <src_ip> <src_port> <dst_ip> <dst_port> <time>
-     * Example:
-     * 7XgadOyqv0tF5xG8uhg2iIrheeNKglCWKmxQDgYP1dY 17 127.0.0.1 40305 127.0.0.1 62201 1313283481
-    */
-    while ((fgets(line_buf, MAX_LINE_LEN, digest_file_ptr)) != NULL)
+    for(i=0; i < compaction->num_recs; i++)
+        digest_file_writer_add(&writer, &(compaction->recs[i]));
+
+    if(digest_file_writer_commit(&writer) != 0)
     {
-        num_lines++;
-        line_buf[MAX_LINE_LEN-1] = '\0';
+        __atomic_store_n(&(compaction->state), state, __ATOMIC_RELEASE);
+        return(-1);
+    }
 
-        if(IS_EMPTY_LINE(line_buf[0]))
-            continue;
+    compaction->committed = 1;
 
-        /* Initialize a digest cache list element, and add it into the list if
-         * valid.
-        */
-        if ((digest_elm = calloc(1, sizeof(struct digest_cache_list))) == NULL)
-        {
-            log_msg(LOG_ERR, "[*] Could not allocate digest list element");
-            continue;
-        }
-        if ((digest_elm->cache_info.digest = calloc(1, MAX_DIGEST_SIZE+1)) == NULL)
-        {
-            free(digest_elm);
-            log_msg(LOG_ERR, "[*] Could not allocate digest string");
-            continue;
-        }
-        src_ip[0] = '\0';
-        dst_ip[0] = '\0';
-
-        if(sscanf(line_buf, "%64s %hhu %16s %hu %16s %hu %ld",
-            digest_elm->cache_info.digest,  /* %64s, buffer size is MAX_DIGEST_SIZE+1 */
-            &(digest_elm->cache_info.proto),
-            src_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
-            &(digest_elm->cache_info.src_port),
-            dst_ip,  /* %16s, buffer size is INET_ADDRSTRLEN+1 */
-            &(digest_elm->cache_info.dst_port),
-            &time_tmp) != 7)
+    log_msg(LOG_INFO, "Compacted digest cache %s from %u to %u entries",
+        path, compaction->file_entries, writer.num_recs);
+
+    if(digest_file_map(path, &(compaction->map)) != 0)
+        log_msg(LOG_ERR, "Could not map compacted digest cache %s, keeping the current one",
+            path);
+    else if(index_digest_map(compaction->opts, &(compaction->map),
+                &(compaction->gens), &(compaction->index)) < 0)
+        log_msg(LOG_ERR, "Could not index compacted digest cache %s, keeping the current one",
+            path);
+    else
+        state = DIGEST_COMPACT_DONE;
+
+    __atomic_store_n(&(compaction->state), state, __ATOMIC_RELEASE);
+
+    return(0);
+}
+
+/* Hand a rewrite of the digest file to the journal writer thread.  The
+ * digests cached right now are copied out, anything added from here on is
+ * appended to the new file by the journal and carried over into the new
+ * cache when it is swapped in.
+*/
+static void
+start_digest_compaction(fko_srv_options_t *opts)
+{
+    struct digest_compaction *compaction = NULL;
+    struct digest_cache_gen  *gen = NULL;
+    unsigned int              i;
+
+    if((compaction = calloc(1, sizeof(struct digest_compaction))) == NULL)
+        return;
+
+    if(opts->digest_index->count > 0)
+    {
+        compaction->recs = malloc(opts->digest_index->count
+                * sizeof(digest_file_rec_t));
+        if(compaction->recs == NULL)
         {
-            log_msg(LOG_INFO,
-                "*Skipping invalid digest file entry in %s at line %i.\n - %s",
-                opts->config[CONF_DIGEST_FILE], num_lines, line_buf
-            );
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
+            free(compaction);
+            return;
         }
-        digest_elm->cache_info.created = time_tmp;
+    }
+
+    for(gen = opts->digest_cache; gen != NULL; gen = gen->next)
+        for(i=0; i < gen->count; i++)
+            compaction->recs[compaction->num_recs++] = *(gen->recs[i]);
+
+    compaction->opts         = opts;
+    compaction->file_entries = opts->digest_file_entries;
+    compaction->slab_mark    = opts->digest_slabs;
+    if(opts->digest_slabs != NULL)
+        compaction->slab_mark_used = opts->digest_slabs->used;
+    compaction->state        = DIGEST_COMPACT_PENDING;
+
+    if(digest_journal_rewrite(opts->digest_journal,
+                compact_digest_file, compaction) != 0)
+    {
+        free_digest_compaction(compaction);
+        return;
+    }
+
+    opts->digest_compaction = compaction;
+    return;
+}
 
+/* Add the records allocated since compaction was requested to the new
+ * cache.  They live in the slabs up to and including the mark.
+*/
+static int
+carry_over_digests(fko_srv_options_t *opts,
+        struct digest_compaction *compaction, const time_t now)
+{
+    struct digest_rec_slab  *slab = NULL;
+    digest_file_rec_t       *rec  = NULL;
+    unsigned int             i;
+
+    for(slab = opts->digest_slabs; slab != NULL; slab = slab->next)
+    {
+        i = (slab == compaction->slab_mark) ? compaction->slab_mark_used : 0;
 
-        if (inet_pton(AF_INET, src_ip, &(digest_elm->cache_info.src_ip)) != 1)
+        for(; i < slab->used; i++)
         {
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
-            continue;
+            rec = &(slab->recs[i]);
+            if(digest_gen_expired(opts, digest_gen_id(opts, rec->created), now))
+                continue;
+            if(digest_cache_insert(opts, &(compaction->gens), compaction->index,
+                        rec) == DIGEST_INDEX_ERROR)
+                return(-1);
         }
 
-        if (inet_pton(AF_INET, dst_ip, &(digest_elm->cache_info.dst_ip)) != 1)
+        if(slab == compaction->slab_mark)
+            break;
+    }
+    return(0);
+}
+
+/* Swap in the cache built from the compacted digest file once the journal
+ * writer has finished with it.  On any failure the current cache is kept.
+*/
+static void
+finish_digest_compaction(fko_srv_options_t *opts, const time_t now)
+{
+    struct digest_compaction *compaction = opts->digest_compaction;
+    struct digest_rec_slab   *old_slabs  = NULL;
+    int                       state;
+
+    state = __atomic_load_n(&(compaction->state), __ATOMIC_ACQUIRE);
+    if(state == DIGEST_COMPACT_PENDING)
+        return;
+
+    opts->digest_compaction = NULL;
+
+    /* The file now only holds the copied digests plus whatever has been
+     * appended since
+    */
+    if(compaction->committed)
+        opts->digest_file_entries = compaction->num_recs
+            + (opts->digest_file_entries - compaction->file_entries);
+
+    if(state != DIGEST_COMPACT_DONE
+            || carry_over_digests(opts, compaction, now) != 0)
+    {
+        free_digest_compaction(compaction);
+        return;
+    }
+
+    /* Slabs older than the mark only hold copied digests
+    */
+    if(compaction->slab_mark != NULL)
+    {
+        old_slabs = compaction->slab_mark->next;
+        compaction->slab_mark->next = NULL;
+    }
+
+    digest_index_destroy(opts->digest_index);
+    free_digest_gens(opts->digest_cache);
+    free_digest_slabs(old_slabs);
+    digest_file_unmap(&(opts->digest_map));
+
+    opts->digest_index = compaction->index;
+    opts->digest_cache = compaction->gens;
+    opts->digest_map   = compaction->map;
+
+    compaction->index = NULL;
+    compaction->gens  = NULL;
+    memset(&(compaction->map), 0x0, sizeof(compaction->map));
+    free_digest_compaction(compaction);
+
+    return;
+}
+
+/* Drop every generation that is past the expiry age, and compact the
+ * digest file once it is mostly made up of expired entries.
+*/
+static void
+expire_replay_file_cache(fko_srv_options_t *opts, const time_t now)
+{
+    struct digest_cache_gen **gen_ptr = &(opts->digest_cache);
+    struct digest_cache_gen  *gen     = NULL;
+    unsigned int              i, num_expired = 0;
+
+    while(*gen_ptr != NULL)
+    {
+        gen = *gen_ptr;
+        if(! digest_gen_expired(opts, gen->gen_id, now))
         {
-            free(digest_elm->cache_info.digest);
-            free(digest_elm);
+            gen_ptr = &(gen->next);
             continue;
         }
 
-        digest_elm->next   = opts->digest_cache;
-        opts->digest_cache = digest_elm;
-        digest_ctr++;
+        *gen_ptr = gen->next;
 
-        if(opts->verbose > 3)
-            log_msg(LOG_DEBUG,
-                "DIGEST FILE: %s, VALID LINE: %s",
-                opts->config[CONF_DIGEST_FILE], line_buf
-            );
+        for(i=0; i < gen->count; i++)
+            digest_index_remove(opts->digest_index,
+                    (const char *)gen->recs[i]->digest, gen->recs[i]->digest_len);
 
+        num_expired += gen->count;
+        free(gen->recs);
+        free(gen);
     }
 
-    fclose(digest_file_ptr);
+    if(num_expired > 0 && opts->verbose)
+        log_msg(LOG_DEBUG, "Expired %u digests from the digest cache",
+            num_expired);
+
+    if(opts->digest_compaction == NULL
+            && opts->digest_file_entries > DIGEST_FILE_COMPACT_MIN_ENTRIES
+            && opts->digest_file_entries / 2 > opts->digest_index->count)
+        start_digest_compaction(opts);
+
+    return;
+}
+
+static int
+replay_file_cache_init(fko_srv_options_t *opts)
+{
+    int     digest_ctr;
+
+    /* Start from a clean slate (we may get here again after a SIGHUP)
+    */
+    free_replay_list(opts);
+
+    if((digest_ctr = replay_file_cache_load(opts)) < 0)
+        return(digest_ctr);
+
+    if(open_digest_journal(opts) != 0)
+        return(-1);
 
     return(digest_ctr);
 }
@@ -424,102 +867,199 @@ replay_db_cache_init(fko_srv_options_t *opts)
 
 #if USE_FILE_CACHE
 static int
-is_replay_file_cache(fko_srv_options_t *opts, char *digest)
+is_replay_file_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
 {
-    int         digest_len = 0;
+    const digest_file_rec_t *rec = NULL;
+    unsigned char            raw_digest[DIGEST_FILE_MAX_RAW];
+    int                      raw_len;
 
-    struct digest_cache_list *digest_list_ptr = NULL;
+    digest_cache_info_t      digest_info;
 
-    digest_len = strlen(digest);
+    if((raw_len = digest_file_decode_digest(digest, raw_digest,
+                    sizeof(raw_digest))) < 0)
+    {
+        log_msg(LOG_WARNING, "Invalid SPA packet digest: %s", digest);
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
 
     /* Check the cache for the SPA packet digest
     */
-    for (digest_list_ptr = opts->digest_cache;
-            digest_list_ptr != NULL;
-            digest_list_ptr = digest_list_ptr->next) {
+    rec = digest_index_find(opts->digest_index, (const char *)raw_digest, raw_len);
 
-        if (constant_runtime_cmp(digest_list_ptr->cache_info.digest,
-                    digest, digest_len) == 0) {
+    if(rec != NULL)
+    {
+        memset(&digest_info, 0x0, sizeof(digest_info));
+        digest_info.src_ip   = rec->src_ip;
+        digest_info.dst_ip   = rec->dst_ip;
+        digest_info.src_port = rec->src_port;
+        digest_info.dst_port = rec->dst_port;
+        digest_info.proto    = rec->proto;
+        digest_info.created  = rec->created;
 
-            replay_warning(opts, &(digest_list_ptr->cache_info));
+        replay_warning(opts, spa_pkt, &digest_info);
 
-            return(SPA_MSG_REPLAY);
-        }
+        return(SPA_MSG_REPLAY);
     }
     return(SPA_MSG_SUCCESS);
 }
 
 static int
-add_replay_file_cache(fko_srv_options_t *opts, char *digest)
+add_replay_file_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
 {
-    FILE       *digest_file_ptr = NULL;
-    int         digest_len = 0;
-    char        src_ip[INET_ADDRSTRLEN+1] = {0};
-    char        dst_ip[INET_ADDRSTRLEN+1] = {0};
+    digest_file_rec_t  *rec = NULL;
+    int                 raw_len;
+    time_t              now = time(NULL);
 
-    struct digest_cache_list *digest_elm = NULL;
+    /* Pick up the cache rebuilt by a finished compaction, then age out old
+     * digests before adding another one
+    */
+    if(opts->digest_compaction != NULL)
+        finish_digest_compaction(opts, now);
 
-    digest_len = strlen(digest);
+    if(opts->digest_expire_age > 0 && now >= opts->digest_next_expire
+            && opts->digest_index != NULL)
+    {
+        expire_replay_file_cache(opts, now);
+        opts->digest_next_expire = now + DIGEST_GEN_WIDTH(opts);
+    }
 
-    if ((digest_elm = calloc(1, sizeof(struct digest_cache_list))) == NULL)
+    if(opts->digest_index == NULL)
     {
-        log_msg(LOG_WARNING, "Error calloc() returned NULL for digest cache element",
+        log_msg(LOG_WARNING, "Could not add digest to the digest cache index");
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
+
+    if ((rec = digest_rec_alloc(opts)) == NULL)
+    {
+        log_msg(LOG_WARNING, "Error calloc() returned NULL for digest cache record",
             fko_errstr(SPA_MSG_ERROR));
 
         return(SPA_MSG_ERROR);
     }
-    if ((digest_elm->cache_info.digest = calloc(1, digest_len+1)) == NULL)
+
+    if((raw_len = digest_file_decode_digest(digest, rec->digest,
+                    sizeof(rec->digest))) < 0)
     {
-        log_msg(LOG_WARNING, "Error calloc() returned NULL for digest cache string",
-            fko_errstr(SPA_MSG_ERROR));
-        free(digest_elm);
-        return(SPA_MSG_ERROR);
+        log_msg(LOG_WARNING, "Invalid SPA packet digest: %s", digest);
+        digest_rec_unalloc(opts);
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
     }
 
-    strlcpy(digest_elm->cache_info.digest, digest, digest_len+1);
-    digest_elm->cache_info.proto    = opts->spa_pkt.packet_proto;
-    digest_elm->cache_info.src_ip   = opts->spa_pkt.packet_src_ip;
-    digest_elm->cache_info.dst_ip   = opts->spa_pkt.packet_dst_ip;
-    digest_elm->cache_info.src_port = opts->spa_pkt.packet_src_port;
-    digest_elm->cache_info.dst_port = opts->spa_pkt.packet_dst_port;
-    digest_elm->cache_info.created = time(NULL);
+    rec->digest_len = raw_len;
+    rec->proto      = spa_pkt->packet_proto;
+    rec->src_ip     = spa_pkt->packet_src_ip;
+    rec->dst_ip     = spa_pkt->packet_dst_ip;
+    rec->src_port   = spa_pkt->packet_src_port;
+    rec->dst_port   = spa_pkt->packet_dst_port;
+    rec->created    = now;
 
-    /* First, add the digest at the head of the in-memory list
+    /* First, add the digest to the index and to the in-memory cache
     */
-    digest_elm->next = opts->digest_cache;
-    opts->digest_cache = digest_elm;
+    if(digest_cache_insert(opts, &(opts->digest_cache), opts->digest_index,
+                rec) != DIGEST_INDEX_SUCCESS)
+    {
+        log_msg(LOG_WARNING, "Could not add digest to the digest cache index");
+        digest_rec_unalloc(opts);
+        return(SPA_MSG_DIGEST_CACHE_ERROR);
+    }
 
-    /* Now, write the digest to disk
+    /* Now, queue the record to be written to disk
     */
-    if ((digest_file_ptr = fopen(opts->config[CONF_DIGEST_FILE], "a")) == NULL)
+    if(digest_journal_append(opts->digest_journal,
+                (const char *)rec, sizeof(digest_file_rec_t)) != 0)
     {
-        log_msg(LOG_WARNING, "Could not open digest cache: %s",
+        log_msg(LOG_WARNING, "Could not write to digest cache: %s",
             opts->config[CONF_DIGEST_FILE]);
         return(SPA_MSG_DIGEST_CACHE_ERROR);
     }
-
-    inet_ntop(AF_INET, &(digest_elm->cache_info.src_ip),
-        src_ip, INET_ADDRSTRLEN);
-    inet_ntop(AF_INET, &(digest_elm->cache_info.dst_ip),
-        dst_ip, INET_ADDRSTRLEN);
-    fprintf(digest_file_ptr, "%s %d %s %d %s %d %d\n",
-        digest,
-        digest_elm->cache_info.proto,
-        src_ip,
-        (int) digest_elm->cache_info.src_port,
-        dst_ip,
-        digest_elm->cache_info.dst_port,
-        (int) digest_elm->cache_info.created);
-
-    fclose(digest_file_ptr);
+    opts->digest_file_entries++;
 
     return(SPA_MSG_SUCCESS);
 }
 #endif /* USE_FILE_CACHE */
 
 #if !USE_FILE_CACHE
+#ifndef NO_DIGEST_CACHE
+/* Delete every digest that is past the expiry age.  Keys are collected
+ * first since the dbm may not be modified while walking its keys.
+*/
+static void
+expire_replay_dbm_cache(fko_srv_options_t *opts, MY_DBM_FILE rpdb,
+        const time_t now)
+{
+    datum       db_key, db_ent;
+#ifdef HAVE_LIBGDBM
+    datum       db_next_key;
+#endif
+    datum      *expired = NULL, *tmp = NULL;
+    int         num_expired = 0, expired_size = 0, i;
+
+    digest_cache_info_t dc_info;
+
+#ifdef HAVE_LIBGDBM
+    for (db_key = gdbm_firstkey(rpdb); db_key.dptr != NULL; db_key = db_next_key)
+#elif HAVE_LIBNDBM
+    for (db_key = dbm_firstkey(rpdb); db_key.dptr != NULL; db_key = dbm_nextkey(rpdb))
+#endif
+    {
+        db_ent = MY_DBM_FETCH(rpdb, db_key);
+
+        if(db_ent.dptr != NULL && db_ent.dsize == sizeof(digest_cache_info_t))
+        {
+            memcpy(&dc_info, db_ent.dptr, sizeof(digest_cache_info_t));
+
+            if(dc_info.created + opts->digest_expire_age < now)
+            {
+                if(num_expired == expired_size)
+                {
+                    expired_size = expired_size ? expired_size * 2 : 64;
+                    if((tmp = realloc(expired, expired_size * sizeof(datum))) == NULL)
+                    {
+                        log_msg(LOG_ERR, "expire_replay_dbm_cache: memory allocation error");
+#ifdef HAVE_LIBGDBM
+                        free(db_ent.dptr);
+                        free(db_key.dptr);
+#endif
+                        break;
+                    }
+                    expired = tmp;
+                }
+                if((expired[num_expired].dptr = malloc(db_key.dsize)) != NULL)
+                {
+                    memcpy(expired[num_expired].dptr, db_key.dptr, db_key.dsize);
+                    expired[num_expired].dsize = db_key.dsize;
+                    num_expired++;
+                }
+            }
+        }
+#ifdef HAVE_LIBGDBM
+        if(db_ent.dptr != NULL)
+            free(db_ent.dptr);
+        db_next_key = gdbm_nextkey(rpdb, db_key);
+        free(db_key.dptr);
+#endif
+    }
+
+    for(i=0; i < num_expired; i++)
+    {
+        MY_DBM_DELETE(rpdb, expired[i]);
+        free(expired[i].dptr);
+    }
+    free(expired);
+
+    if(num_expired > 0 && opts->verbose)
+        log_msg(LOG_DEBUG, "Expired %d digests from the digest cache",
+            num_expired);
+
+    return;
+}
+#endif /* NO_DIGEST_CACHE */
+
 static int
-is_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
+is_replay_dbm_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return 0;
@@ -566,7 +1106,7 @@ is_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
     */
     if(db_ent.dptr != NULL)
     {
-        replay_warning(opts, (digest_cache_info_t *)db_ent.dptr);
+        replay_warning(opts, spa_pkt, (digest_cache_info_t *)db_ent.dptr);
 
         /* Save it back to the digest cache
         */
@@ -589,7 +1129,8 @@ is_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
 }
 
 static int
-add_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
+add_replay_dbm_cache(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt,
+        char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return 0;
@@ -639,11 +1180,11 @@ add_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
     {
         /* This is a new SPA packet that needs to be added to the cache.
         */
-        dc_info.src_ip   = opts->spa_pkt.packet_src_ip;
-        dc_info.dst_ip   = opts->spa_pkt.packet_dst_ip;
-        dc_info.src_port = opts->spa_pkt.packet_src_port;
-        dc_info.dst_port = opts->spa_pkt.packet_dst_port;
-        dc_info.proto    = opts->spa_pkt.packet_proto;
+        dc_info.src_ip   = spa_pkt->packet_src_ip;
+        dc_info.dst_ip   = spa_pkt->packet_dst_ip;
+        dc_info.src_port = spa_pkt->packet_src_port;
+        dc_info.dst_port = spa_pkt->packet_dst_port;
+        dc_info.proto    = spa_pkt->packet_proto;
         dc_info.created  = time(NULL);
         dc_info.first_replay = dc_info.last_replay = dc_info.replay_count = 0;
 
@@ -664,6 +1205,14 @@ add_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
     else
         res = SPA_MSG_DIGEST_CACHE_ERROR;
 
+    /* Age out old digests while we have the db open
+    */
+    if(opts->digest_expire_age > 0 && time(NULL) >= opts->digest_next_expire)
+    {
+        expire_replay_dbm_cache(opts, rpdb, time(NULL));
+        opts->digest_next_expire = time(NULL) + DIGEST_GEN_WIDTH(opts);
+    }
+
     MY_DBM_CLOSE(rpdb);
 
     return(res);
@@ -677,8 +1226,6 @@ add_replay_dbm_cache(fko_srv_options_t *opts, char *digest)
 void
 free_replay_list(fko_srv_options_t *opts)
 {
-    struct digest_cache_list *digest_list_ptr = NULL, *digest_tmp = NULL;
-
 #ifdef NO_DIGEST_CACHE
     return;
 #endif
@@ -688,22 +1235,59 @@ free_replay_list(fko_srv_options_t *opts)
         return;
 #endif
 
-    if (opts->digest_cache == NULL)
+    /* Flush any pending digests before the cache goes away.  This also
+     * waits for a compaction the journal writer is working on.
+    */
+    digest_journal_close(opts->digest_journal);
+    opts->digest_journal = NULL;
+
+    /* A forked child may have copied a compaction half way through, just
+     * leave that one alone
+    */
+    if(opts->digest_compaction != NULL
+            && __atomic_load_n(&(opts->digest_compaction->state),
+                __ATOMIC_ACQUIRE) != DIGEST_COMPACT_PENDING)
+        free_digest_compaction(opts->digest_compaction);
+    opts->digest_compaction = NULL;
+
+    free_digest_cache(opts);
+
+    return;
+}
+#endif
+
+#ifndef NO_DIGEST_CACHE
+/* Work out how long digests need to be kept.  An SPA packet is accepted if
+ * its timestamp is within MAX_SPA_PACKET_AGE of the current time, so a
+ * replayed copy of a packet can no longer get through once its digest is
+ * twice that age - the original may have carried a timestamp up to
+ * MAX_SPA_PACKET_AGE seconds in the future.  Without packet aging there is
+ * no such bound and digests are kept forever.
+*/
+static void
+replay_cache_expiry_init(fko_srv_options_t *opts)
+{
+    int     is_err = FKO_SUCCESS;
+
+    opts->digest_expire_age  = 0;
+    opts->digest_next_expire = 0;
+
+    if(strncasecmp(opts->config[CONF_ENABLE_DIGEST_CACHE_EXPIRY], "Y", 1) != 0)
         return;
 
-    digest_list_ptr = opts->digest_cache;
-    while (digest_list_ptr != NULL)
+    if(strncasecmp(opts->config[CONF_ENABLE_SPA_PACKET_AGING], "Y", 1) != 0)
     {
-        digest_tmp = digest_list_ptr->next;
-        if (digest_list_ptr->cache_info.digest != NULL
-                && digest_list_ptr->cache_info.digest[0] != '\0')
-        {
-            free(digest_list_ptr->cache_info.digest);
-        }
-        free(digest_list_ptr);
-        digest_list_ptr = digest_tmp;
+        log_msg(LOG_WARNING,
+            "ENABLE_DIGEST_CACHE_EXPIRY requires ENABLE_SPA_PACKET_AGING, digests will not be expired");
+        return;
     }
 
+    opts->digest_expire_age = 2 * strtol_wrapper(opts->config[CONF_MAX_SPA_PACKET_AGE],
+            1, RCHK_MAX_SPA_PACKET_AGE, NO_EXIT_UPON_ERR, &is_err);
+
+    if(is_err != FKO_SUCCESS)
+        opts->digest_expire_age = 0;
+
     return;
 }
 #endif
@@ -720,6 +1304,8 @@ replay_cache_init(fko_srv_options_t *opts)
     if(opts->rotate_digest_cache)
         rotate_digest_cache_file(opts);
 
+    replay_cache_expiry_init(opts);
+
 #if USE_FILE_CACHE
     return replay_file_cache_init(opts);
 #else
@@ -730,11 +1316,12 @@ replay_cache_init(fko_srv_options_t *opts)
 }
 
 int
-add_replay(fko_srv_options_t *opts, char *digest)
+add_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return(-1);
 #else
+    int res;
 
     if(digest == NULL)
     {
@@ -742,11 +1329,15 @@ add_replay(fko_srv_options_t *opts, char *digest)
         return(SPA_MSG_DIGEST_CACHE_ERROR);
     }
 
+    pthread_mutex_lock(&replay_mutex);
 #if USE_FILE_CACHE
-    return add_replay_file_cache(opts, digest);
+    res = add_replay_file_cache(opts, spa_pkt, digest);
 #else
-    return add_replay_dbm_cache(opts, digest);
+    res = add_replay_dbm_cache(opts, spa_pkt, digest);
 #endif
+    pthread_mutex_unlock(&replay_mutex);
+
+    return(res);
 #endif /* NO_DIGEST_CACHE */
 }
 
@@ -754,17 +1345,22 @@ add_replay(fko_srv_options_t *opts, char *digest)
  * replay db (digest cache).
 */
 int
-is_replay(fko_srv_options_t *opts, char *digest)
+is_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest)
 {
 #ifdef NO_DIGEST_CACHE
     return(-1);
 #else
+    int res;
 
+    pthread_mutex_lock(&replay_mutex);
 #if USE_FILE_CACHE
-    return is_replay_file_cache(opts, digest);
+    res = is_replay_file_cache(opts, spa_pkt, digest);
 #else
-    return is_replay_dbm_cache(opts, digest);
+    res = is_replay_dbm_cache(opts, spa_pkt, digest);
 #endif
+    pthread_mutex_unlock(&replay_mutex);
+
+    return(res);
 #endif /* NO_DIGEST_CACHE */
 }
 
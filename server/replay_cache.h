@@ -50,17 +50,56 @@ typedef struct digest_cache_info {
 } digest_cache_info_t;
 
 #if USE_FILE_CACHE
-struct digest_cache_list {
-    digest_cache_info_t cache_info;
-    struct digest_cache_list *next;
+/* Cached digests are grouped into generations by creation time so that
+ * expired digests can be dropped a whole generation at a time.  The
+ * records themselves live in the mapped digest file or in a slab.
+*/
+struct digest_cache_gen {
+    time_t          gen_id;
+    unsigned int    count;
+    unsigned int    size;
+    const digest_file_rec_t **recs;
+    struct digest_cache_gen  *next;     /* next older generation */
+};
+
+#define DIGEST_REC_SLAB_SIZE    1024
+
+struct digest_rec_slab {
+    struct digest_rec_slab *next;
+    unsigned int            used;
+    digest_file_rec_t       recs[DIGEST_REC_SLAB_SIZE];
+};
+
+/* A rewrite of the digest file without its expired entries.  The journal
+ * writer thread writes, maps and indexes the new file, add_replay() swaps
+ * the result in once state is no longer pending.
+*/
+enum {
+    DIGEST_COMPACT_PENDING = 0,
+    DIGEST_COMPACT_DONE,
+    DIGEST_COMPACT_FAILED
+};
+
+struct digest_compaction {
+    const fko_srv_options_t  *opts;
+    digest_file_rec_t        *recs;             /* digests cached when requested */
+    unsigned int              num_recs;
+    unsigned int              file_entries;     /* digest_file_entries when requested */
+    struct digest_rec_slab   *slab_mark;        /* newer records are not in recs */
+    unsigned int              slab_mark_used;
+    digest_file_map_t         map;              /* the compacted file and its cache */
+    struct digest_cache_gen  *gens;
+    digest_index_t           *index;
+    int                       committed;        /* the new file has replaced the old */
+    int                       state;
 };
 #endif
 
 /* Prototypes
 */
 int replay_cache_init(fko_srv_options_t *opts);
-int is_replay(fko_srv_options_t *opts, char *digest);
-int add_replay(fko_srv_options_t *opts, char *digest);
+int is_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest);
+int add_replay(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt, char *digest);
 #ifdef USE_FILE_CACHE
 void free_replay_list(fko_srv_options_t *opts);
 #endif
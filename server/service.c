@@ -9,6 +9,7 @@
 #include "fwknopd_common.h"
 #include "log_msg.h"
 #include "hash_table.h"
+#include "int_hash_table.h"
 #include "fwknopd_errors.h"
 #include "sdp_ctrl_client.h"
 #include "bstrlib.h"
@@ -24,9 +25,8 @@
 //}
 
 
-static void destroy_service_hash_node_cb(hash_table_node_t *node)
+static void destroy_service_hash_node_cb(int_hash_table_node_t *node)
 {
-    if(node->key != NULL) bdestroy((bstring)(node->key));
     if(node->data != NULL)
     {
         //free_service_data((service_data_t*)(node->data));
@@ -45,7 +45,7 @@ static void destroy_reverse_service_hash_node_cb(hash_table_node_t *node)
 }
 
 
-static int traverse_dump_service_cb(hash_table_node_t *node, void *dest)
+static int traverse_dump_service_cb(int_hash_table_node_t *node, void *dest)
 {
     service_data_t *service_data = (service_data_t *)(node->data);
 
@@ -96,8 +96,8 @@ int create_service_table(fko_srv_options_t *opts)
         return FWKNOPD_ERROR_BAD_CONFIG;
     }
 
-    opts->service_hash_tbl = hash_table_create(hash_table_len,
-            NULL, NULL, destroy_service_hash_node_cb);
+    opts->service_hash_tbl = int_hash_table_create(hash_table_len,
+            destroy_service_hash_node_cb);
 
     if(opts->service_hash_tbl == NULL)
     {
@@ -134,7 +134,7 @@ void destroy_service_table(fko_srv_options_t *opts)
         }
         else
         {
-            hash_table_destroy(opts->service_hash_tbl);
+            int_hash_table_destroy(opts->service_hash_tbl);
             opts->service_hash_tbl = NULL;
             hash_table_destroy(opts->reverse_service_hash_tbl);
             opts->reverse_service_hash_tbl = NULL;
@@ -353,9 +353,7 @@ static int modify_service_table(fko_srv_options_t *opts, int service_array_len,
     int idx = 0;
     int nodes = 0;
     json_object *jservice = NULL;
-    bstring key = NULL;
     service_data_t *new_service = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
 
     // walk through the access array
     for(idx = 0; idx < service_array_len; idx++)
@@ -373,16 +371,11 @@ static int modify_service_table(fko_srv_options_t *opts, int service_array_len,
             continue;
         }
 
-        // convert the service id integer to a bstring
-        snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%"PRIu32, new_service->service_id);
-        key = bfromcstr(id);
-
-        if( hash_table_set(opts->service_hash_tbl, key, new_service) != FKO_SUCCESS )
+        if( int_hash_table_set(opts->service_hash_tbl, new_service->service_id, new_service) != FKO_SUCCESS )
         {
             log_msg(LOG_ERR,
                 "Fatal error creating service hash table node"
             );
-            bdestroy(key);
             free(new_service);
             return FWKNOPD_ERROR_MEMORY_ALLOCATION;
         }
@@ -415,8 +408,6 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
     int idx;
     int service_id = 0;
     json_object *jentry = NULL;
-    bstring key = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
     service_data_t *service_data = NULL;
 
     // walk through the access array
@@ -429,12 +420,8 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
             continue;
         }
 
-        // convert the service id integer to a bstring
-        snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%d", service_id);
-        key = bfromcstr(id);
-
         // first get the data in order to find and delete the reverse lookup node
-        if((service_data = hash_table_get(opts->service_hash_tbl, key)) == NULL)
+        if((service_data = int_hash_table_get(opts->service_hash_tbl, (uint32_t)service_id)) == NULL)
         {
             log_msg(LOG_WARNING, "Did not find hash table node with service ID %d to remove. Continuing.", service_id);
             continue;
@@ -444,7 +431,7 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
             modify_reverse_service_table(opts, 1, service_data);
         }
 
-        if( hash_table_delete(opts->service_hash_tbl, key) != FKO_SUCCESS )
+        if( int_hash_table_delete(opts->service_hash_tbl, (uint32_t)service_id) != FKO_SUCCESS )
         {
             log_msg(LOG_WARNING, "Did not find hash table node with service ID %d to remove. Continuing.", service_id);
         }
@@ -452,8 +439,6 @@ static void remove_service_data_nodes(fko_srv_options_t *opts, int service_array
         {
             log_msg(LOG_NOTICE, "Removed access stanza for service ID %d from service list.", service_id);
         }
-
-        bdestroy(key);
     }
 }
 
@@ -512,7 +497,7 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
         if(opts->service_hash_tbl != NULL)
         {
             // destroy the table
-            hash_table_destroy(opts->service_hash_tbl);
+            int_hash_table_destroy(opts->service_hash_tbl);
             opts->service_hash_tbl = NULL;
         }
     }
@@ -546,28 +531,20 @@ int process_service_msg(fko_srv_options_t *opts, int action, json_object *jdata)
 int get_service_data(fko_srv_options_t *opts, uint32_t service_id, service_data_t**r_service_data)
 {
     int rv = FWKNOPD_SUCCESS;
-    bstring key = NULL;
     service_data_t *service_data = NULL;
     service_data_t *copy_service_data = NULL;
-    char id[SDP_MAX_SERVICE_ID_STR_LEN + 1] = {0};
-
-    // convert the service id integer to a bstring
-    snprintf(id, SDP_MAX_SERVICE_ID_STR_LEN, "%"PRIu32, service_id);
-    key = bfromcstr(id);
 
     // lock the hash table mutex
     if(pthread_mutex_lock(&(opts->service_hash_tbl_mutex)))
     {
         log_msg(LOG_ERR, "Service table mutex lock error.");
-        bdestroy(key);
         *r_service_data = NULL;
         return FWKNOPD_ERROR_BAD_SERVICE_DATA;
     }
 
-    service_data = hash_table_get(opts->service_hash_tbl, key);
+    service_data = int_hash_table_get(opts->service_hash_tbl, service_id);
 
     pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
-    bdestroy(key);
 
     if( service_data == NULL )
     {
@@ -831,7 +808,7 @@ void dump_service_list(fko_srv_options_t *opts)
             return;
         }
 
-        hash_table_traverse(opts->service_hash_tbl, traverse_dump_service_cb, dest);
+        int_hash_table_traverse(opts->service_hash_tbl, traverse_dump_service_cb, dest);
 
         pthread_mutex_unlock(&(opts->service_hash_tbl_mutex));
     }
@@ -34,6 +34,8 @@
 #include "service.h"
 #include "access.h"
 #include "config_init.h"
+#include "spa_pipeline.h"
+#include "incoming_spa.h"
 
 #if HAVE_SYS_WAIT_H
   #include <sys/wait.h>
@@ -170,6 +172,8 @@ sig_do_stop(fko_srv_options_t * const opts)
             dump_config(opts);
             dump_service_list(opts);
             dump_access_list(opts);
+            spa_pipeline_log_stats(opts);
+            spa_filter_log_stats(opts);
         }
         else if(got_sigusr2)
         {
@@ -0,0 +1,686 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_pipeline.c
+ *
+ * Purpose: Verify SPA packets on a pool of worker threads.
+ *
+ *          The capture loop copies each packet into the ring of one of
+ *          SPA_VERIFY_WORKERS workers and goes back to reading packets.
+ *          Each ring has a single producer (the capture thread) and a
+ *          single consumer (its worker), so handing a packet over takes no
+ *          lock unless the worker is asleep.  Workers decrypt, authenticate
+ *          and check packets against the replay cache and access stanzas.
+ *          The firewall changes and commands of authenticated packets are
+ *          serialized on one applier thread, which also does the periodic
+ *          rule expiry the capture loop does when there are no workers.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#include "fwknopd_common.h"
+#include "spa_pipeline.h"
+#include "incoming_spa.h"
+#include "fw_util.h"
+#include "cmd_cycle.h"
+#include "log_msg.h"
+#include "utils.h"
+#include "udp_server.h"
+#include "afpacket_capture.h"
+#include "fwknopd_errors.h"
+
+#include <signal.h>
+#include <time.h>
+
+/* The head of a ring is only written by the capture thread and the tail
+ * only by the worker, so they are kept on separate cache lines.
+*/
+typedef struct spa_worker
+{
+    unsigned int        head;
+    unsigned int        queued_max;
+    char                pad1[64 - 2 * sizeof(unsigned int)];
+
+    unsigned int        tail;
+    int                 sleeping;   /* set while waiting on cond */
+    char                pad2[64 - sizeof(unsigned int) - sizeof(int)];
+
+    unsigned int        mask;       /* number of slots - 1 (power of two) */
+    spa_pkt_info_t     *slots;
+    int                 reader_slot;
+
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    pthread_t           thread;
+    int                 running;
+
+    struct spa_pipeline *pl;
+} spa_worker_t;
+
+struct spa_pipeline
+{
+    fko_srv_options_t  *opts;
+
+    spa_worker_t       *workers;
+    int                 num_workers;
+    unsigned int        next_worker;
+    int                 stop;
+
+    uint64_t            submitted;
+    uint64_t            dropped;
+    time_t              last_drop_warn;
+
+    /* Actions waiting for the applier
+    */
+    pthread_mutex_t     act_lock;
+    pthread_cond_t      act_cond;   /* a new action, or stop */
+    pthread_cond_t      done_cond;  /* an action was run */
+    spa_action_t       *act_head;
+    spa_action_t       *act_tail;
+    unsigned int        act_queued;
+    unsigned int        act_queued_max;
+    uint64_t            applied;
+    int                 applier_stop;
+    pthread_t           applier;
+    int                 applier_running;
+
+    int                 rules_chk_threshold;
+    int                 chk_rm_all;
+};
+
+static unsigned int
+ring_slots(const unsigned int queue_size, const int num_workers)
+{
+    unsigned int    want = (queue_size + num_workers - 1) / num_workers;
+    unsigned int    n = 2;
+
+    while(n < want)
+        n <<= 1;
+
+    return n;
+}
+
+static void
+timespec_add_us(struct timespec *ts, const long us)
+{
+    ts->tv_sec  += us / 1000000;
+    ts->tv_nsec += (us % 1000000) * 1000;
+    if(ts->tv_nsec >= 1000000000)
+    {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000;
+    }
+    return;
+}
+
+static int
+timespec_passed(const struct timespec *now, const struct timespec *ts)
+{
+    return now->tv_sec > ts->tv_sec
+        || (now->tv_sec == ts->tv_sec && now->tv_nsec >= ts->tv_nsec);
+}
+
+/* Everything the capture loop does between packets when there are no
+ * workers.  Returns how many microseconds until queued rules are due, or
+ * 0 if there are none.
+*/
+static int
+applier_housekeeping(struct spa_pipeline *pl)
+{
+    fko_srv_options_t  *opts = pl->opts;
+    int                 pending_us = 0;
+#if FIREWALL_IPFW
+    time_t              now;
+#endif
+
+    if(opts->test)
+        return 0;
+
+    if(opts->enable_fw)
+    {
+        if(pl->rules_chk_threshold > 0)
+        {
+            opts->check_rules_ctr++;
+            if((opts->check_rules_ctr % pl->rules_chk_threshold) == 0)
+            {
+                pl->chk_rm_all = 1;
+                opts->check_rules_ctr = 0;
+            }
+        }
+        check_firewall_rules(opts, pl->chk_rm_all);
+        pl->chk_rm_all = 0;
+
+        pending_us = fw_apply_pending_rules(opts, 0);
+    }
+
+    cmd_cycle_close(opts);
+
+#if FIREWALL_IPFW
+    if(opts->fw_config->total_rules > 0)
+    {
+        time(&now);
+        if(opts->fw_config->last_purge < (now - opts->fw_config->purge_interval))
+        {
+            ipfw_purge_expired_rules(opts);
+            opts->fw_config->last_purge = now;
+        }
+    }
+#endif
+
+    return pending_us;
+}
+
+static void *
+applier_thread(void *arg)
+{
+    struct spa_pipeline    *pl = (struct spa_pipeline *)arg;
+    spa_action_t           *act;
+    struct timespec         now, next_run, wait_until;
+    int                     pending_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &next_run);
+
+    pthread_mutex_lock(&pl->act_lock);
+    while(1)
+    {
+        while((act = pl->act_head) != NULL)
+        {
+            if((pl->act_head = act->next) == NULL)
+                pl->act_tail = NULL;
+            pl->act_queued--;
+            pthread_mutex_unlock(&pl->act_lock);
+
+            act->rv = run_spa_action(pl->opts, act);
+
+            pthread_mutex_lock(&pl->act_lock);
+            act->done = 1;
+            pl->applied++;
+            pthread_cond_broadcast(&pl->done_cond);
+        }
+
+        if(pl->applier_stop)
+            break;
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if(timespec_passed(&now, &next_run))
+        {
+            pthread_mutex_unlock(&pl->act_lock);
+            pending_us = applier_housekeeping(pl);
+            pthread_mutex_lock(&pl->act_lock);
+
+            next_run = now;
+            if(pending_us > 0 && pending_us < SPA_APPLIER_INTERVAL_US)
+                timespec_add_us(&next_run, pending_us);
+            else
+                timespec_add_us(&next_run, SPA_APPLIER_INTERVAL_US);
+        }
+
+        if(pl->act_head == NULL && !pl->applier_stop)
+        {
+            /* cond waits are against the realtime clock
+            */
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            clock_gettime(CLOCK_REALTIME, &wait_until);
+            if(! timespec_passed(&now, &next_run))
+                timespec_add_us(&wait_until,
+                    (next_run.tv_sec - now.tv_sec) * 1000000
+                    + (next_run.tv_nsec - now.tv_nsec) / 1000);
+            pthread_cond_timedwait(&pl->act_cond, &pl->act_lock, &wait_until);
+        }
+    }
+    pthread_mutex_unlock(&pl->act_lock);
+
+    return NULL;
+}
+
+static void *
+worker_thread(void *arg)
+{
+    spa_worker_t           *w = (spa_worker_t *)arg;
+    struct spa_pipeline    *pl = w->pl;
+    spa_pkt_info_t          spa_pkt;
+    unsigned int            tail = w->tail;
+
+    while(1)
+    {
+        if(__atomic_load_n(&w->head, __ATOMIC_ACQUIRE) == tail)
+        {
+            /* Only leave once the ring is drained
+            */
+            if(__atomic_load_n(&pl->stop, __ATOMIC_ACQUIRE))
+                break;
+
+            /* Announce that we are going to sleep before looking at the
+             * head one last time.  The capture thread stores the head
+             * before it looks at sleeping, so one of us sees the other.
+            */
+            pthread_mutex_lock(&w->lock);
+            __atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+            while(__atomic_load_n(&w->head, __ATOMIC_SEQ_CST) == tail
+                    && ! __atomic_load_n(&pl->stop, __ATOMIC_SEQ_CST))
+                pthread_cond_wait(&w->cond, &w->lock);
+            __atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&w->lock);
+            continue;
+        }
+
+        memcpy(&spa_pkt, &w->slots[tail & w->mask], sizeof(spa_pkt));
+        __atomic_store_n(&w->tail, ++tail, __ATOMIC_RELEASE);
+
+        process_spa_pkt(pl->opts, &spa_pkt, w->reader_slot);
+    }
+
+    return NULL;
+}
+
+static void
+wake_worker(spa_worker_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    return;
+}
+
+static void
+free_pipeline(struct spa_pipeline *pl)
+{
+    int     i;
+
+    if(pl->workers != NULL)
+    {
+        for(i=0; i < pl->num_workers; i++)
+        {
+            free(pl->workers[i].slots);
+            pthread_mutex_destroy(&pl->workers[i].lock);
+            pthread_cond_destroy(&pl->workers[i].cond);
+        }
+        free(pl->workers);
+    }
+    pthread_mutex_destroy(&pl->act_lock);
+    pthread_cond_destroy(&pl->act_cond);
+    pthread_cond_destroy(&pl->done_cond);
+    free(pl);
+    return;
+}
+
+static int
+is_pipeline_thread(struct spa_pipeline *pl)
+{
+    pthread_t   self = pthread_self();
+    int         i;
+
+    if(pl->applier_running && pthread_equal(self, pl->applier))
+        return 1;
+
+    for(i=0; i < pl->num_workers; i++)
+        if(pl->workers[i].running && pthread_equal(self, pl->workers[i].thread))
+            return 1;
+
+    return 0;
+}
+
+/* Wait for the workers to finish the packets they have, then for the
+ * applier to run what they asked for.
+*/
+void
+spa_pipeline_stop(fko_srv_options_t *opts)
+{
+    struct spa_pipeline    *pl = opts->spa_pipeline;
+    int                     i;
+
+    if(pl == NULL)
+        return;
+
+    /* clean_exit() from one of our own threads, nothing to join then
+    */
+    if(is_pipeline_thread(pl))
+        return;
+
+    __atomic_store_n(&pl->stop, 1, __ATOMIC_SEQ_CST);
+
+    for(i=0; i < pl->num_workers; i++)
+    {
+        if(! pl->workers[i].running)
+            continue;
+        wake_worker(&pl->workers[i]);
+        pthread_join(pl->workers[i].thread, NULL);
+        pl->workers[i].running = 0;
+    }
+
+    if(pl->applier_running)
+    {
+        pthread_mutex_lock(&pl->act_lock);
+        pl->applier_stop = 1;
+        pthread_cond_signal(&pl->act_cond);
+        pthread_mutex_unlock(&pl->act_lock);
+        pthread_join(pl->applier, NULL);
+        pl->applier_running = 0;
+    }
+
+    spa_pipeline_log_stats(opts);
+
+    opts->spa_pipeline = NULL;
+    free_pipeline(pl);
+    return;
+}
+
+int
+spa_pipeline_start(fko_srv_options_t *opts)
+{
+    struct spa_pipeline    *pl;
+    spa_worker_t           *w;
+    sigset_t                all, old;
+    unsigned int            queue_size, nslots;
+    int                     num_workers, is_err, i;
+    int                     sdp_mode, capture_threads = 0;
+    const char             *capture_opt = NULL;
+
+    num_workers = strtol_wrapper(opts->config[CONF_SPA_VERIFY_WORKERS],
+            0, RCHK_MAX_SPA_VERIFY_WORKERS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid SPA_VERIFY_WORKERS");
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    /* With several UDP server sockets, or AF_PACKET capture, each
+     * receiving thread verifies its own packets (see run_udp_receivers()
+     * and afpacket_capture()), only the applier is needed.
+    */
+    if(opts->enable_udp_server
+            || strncasecmp(opts->config[CONF_ENABLE_UDP_SERVER], "Y", 1) == 0)
+    {
+        if((capture_threads = udp_server_sockets(opts)) == 1)
+            capture_threads = 0;
+        else
+            capture_opt = "UDPSERV_SOCKETS";
+    }
+#if HAVE_AF_PACKET_CAPTURE
+    else if((capture_threads = afpacket_threads(opts)) > 0)
+        capture_opt = "AF_PACKET_THREADS";
+#endif
+
+    if(capture_threads > 0)
+    {
+        if(num_workers > 0)
+            log_msg(LOG_INFO,
+                "SPA_VERIFY_WORKERS is not used with %s %d, each capture thread verifies its own packets",
+                capture_opt, capture_threads);
+        num_workers = 0;
+    }
+    else if(num_workers == 0)
+        return FWKNOPD_SUCCESS;
+
+    queue_size = strtol_wrapper(opts->config[CONF_SPA_QUEUE_SIZE],
+            RCHK_MIN_SPA_QUEUE_SIZE, RCHK_MAX_SPA_QUEUE_SIZE,
+            NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid SPA_QUEUE_SIZE");
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    if((pl = calloc(1, sizeof(struct spa_pipeline))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error for SPA pipeline");
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+
+    pl->opts = opts;
+    pthread_mutex_init(&pl->act_lock, NULL);
+    pthread_cond_init(&pl->act_cond, NULL);
+    pthread_cond_init(&pl->done_cond, NULL);
+
+    pl->rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
+            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
+        free_pipeline(pl);
+        return FWKNOPD_ERROR_BAD_CONFIG;
+    }
+
+    if(num_workers > 0
+            && (pl->workers = calloc(num_workers, sizeof(spa_worker_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "[*] Fatal memory allocation error for SPA workers");
+        free_pipeline(pl);
+        return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+    }
+    pl->num_workers = num_workers;
+
+    for(i=0; i < num_workers; i++)
+    {
+        pthread_mutex_init(&pl->workers[i].lock, NULL);
+        pthread_cond_init(&pl->workers[i].cond, NULL);
+    }
+
+    sdp_mode = strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0;
+    nslots   = ring_slots(queue_size, num_workers);
+
+    for(i=0; i < num_workers; i++)
+    {
+        w = &pl->workers[i];
+        w->pl   = pl;
+        w->mask = nslots - 1;
+        w->reader_slot = -1;
+
+        if((w->slots = calloc(nslots, sizeof(spa_pkt_info_t))) == NULL)
+        {
+            log_msg(LOG_ERR, "[*] Fatal memory allocation error for SPA queue");
+            free_pipeline(pl);
+            return FWKNOPD_ERROR_MEMORY_ALLOCATION;
+        }
+
+        /* Workers look up access stanzas like the capture thread does
+        */
+        if(sdp_mode
+                && (w->reader_slot = acc_epoch_register(&(opts->acc_epoch))) < 0)
+        {
+            log_msg(LOG_ERR,
+                "[*] No access snapshot reader slot left for SPA worker %d", i);
+            free_pipeline(pl);
+            return FWKNOPD_ERROR;
+        }
+    }
+
+    /* Signals are for the capture thread, so the threads started here
+     * block them all.
+    */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    opts->spa_pipeline = pl;
+
+    if(pthread_create(&pl->applier, NULL, applier_thread, pl) != 0)
+    {
+        log_msg(LOG_ERR, "[*] Failed to start the SPA applier thread");
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        opts->spa_pipeline = NULL;
+        free_pipeline(pl);
+        return FWKNOPD_ERROR;
+    }
+    pl->applier_running = 1;
+
+    for(i=0; i < num_workers; i++)
+    {
+        w = &pl->workers[i];
+        if(pthread_create(&w->thread, NULL, worker_thread, w) != 0)
+        {
+            log_msg(LOG_ERR, "[*] Failed to start SPA worker %d", i);
+            pthread_sigmask(SIG_SETMASK, &old, NULL);
+            spa_pipeline_stop(opts);
+            return FWKNOPD_ERROR;
+        }
+        w->running = 1;
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(num_workers > 0)
+        log_msg(LOG_INFO, "Started %d SPA verification workers (%u packets queued each)",
+            num_workers, nslots);
+
+    return FWKNOPD_SUCCESS;
+}
+
+/* Called by the capture loop for each packet.  The packet is copied, so
+ * spa_pkt can be reused as soon as this returns.
+*/
+int
+spa_pipeline_submit(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt)
+{
+    struct spa_pipeline    *pl = opts->spa_pipeline;
+    spa_worker_t           *w;
+    unsigned int            head, depth;
+    uint64_t                dropped;
+    time_t                  now;
+    int                     i;
+
+    for(i=0; i < pl->num_workers; i++)
+    {
+        w = &pl->workers[pl->next_worker];
+        if(++pl->next_worker == (unsigned int)pl->num_workers)
+            pl->next_worker = 0;
+
+        head  = w->head;
+        depth = head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+        if(depth > w->mask)
+            continue;   /* this worker is full, try the next one */
+
+        memcpy(&w->slots[head & w->mask], spa_pkt, sizeof(spa_pkt_info_t));
+        __atomic_store_n(&w->head, head + 1, __ATOMIC_SEQ_CST);
+
+        if(depth + 1 > w->queued_max)
+            __atomic_store_n(&w->queued_max, depth + 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&pl->submitted, 1, __ATOMIC_RELAXED);
+
+        if(__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+            wake_worker(w);
+
+        return FWKNOPD_SUCCESS;
+    }
+
+    dropped = __atomic_add_fetch(&pl->dropped, 1, __ATOMIC_RELAXED);
+
+    now = time(NULL);
+    if(now - pl->last_drop_warn >= SPA_DROP_WARN_INTERVAL)
+    {
+        log_msg(LOG_WARNING,
+            "SPA queue full, %"PRIu64" packets dropped so far (SPA_QUEUE_SIZE %s, SPA_VERIFY_WORKERS %d)",
+            dropped, opts->config[CONF_SPA_QUEUE_SIZE], pl->num_workers);
+        pl->last_drop_warn = now;
+    }
+
+    return FWKNOPD_ERROR;
+}
+
+/* Called by a worker for an authenticated packet.  Returns once the
+ * applier has run the action.
+*/
+int
+spa_pipeline_apply(fko_srv_options_t *opts, spa_action_t *act)
+{
+    struct spa_pipeline    *pl = opts->spa_pipeline;
+
+    act->done = 0;
+    act->next = NULL;
+
+    pthread_mutex_lock(&pl->act_lock);
+
+    if(pl->act_tail != NULL)
+        pl->act_tail->next = act;
+    else
+        pl->act_head = act;
+    pl->act_tail = act;
+
+    if(++pl->act_queued > pl->act_queued_max)
+        pl->act_queued_max = pl->act_queued;
+
+    pthread_cond_signal(&pl->act_cond);
+
+    while(! act->done)
+        pthread_cond_wait(&pl->done_cond, &pl->act_lock);
+
+    pthread_mutex_unlock(&pl->act_lock);
+
+    return act->rv;
+}
+
+void
+spa_pipeline_get_stats(fko_srv_options_t *opts, spa_pipeline_stats_t *stats)
+{
+    struct spa_pipeline    *pl = opts->spa_pipeline;
+    spa_worker_t           *w;
+    unsigned int            max;
+    int                     i;
+
+    memset(stats, 0x0, sizeof(spa_pipeline_stats_t));
+    if(pl == NULL)
+        return;
+
+    stats->submitted = __atomic_load_n(&pl->submitted, __ATOMIC_RELAXED);
+    stats->dropped   = __atomic_load_n(&pl->dropped, __ATOMIC_RELAXED);
+
+    for(i=0; i < pl->num_workers; i++)
+    {
+        w = &pl->workers[i];
+        stats->queued += __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)
+            - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE);
+        max = __atomic_load_n(&w->queued_max, __ATOMIC_RELAXED);
+        if(max > stats->queued_max)
+            stats->queued_max = max;
+    }
+
+    pthread_mutex_lock(&pl->act_lock);
+    stats->applied            = pl->applied;
+    stats->actions_queued     = pl->act_queued;
+    stats->actions_queued_max = pl->act_queued_max;
+    pthread_mutex_unlock(&pl->act_lock);
+
+    return;
+}
+
+void
+spa_pipeline_log_stats(fko_srv_options_t *opts)
+{
+    spa_pipeline_stats_t    stats;
+
+    if(opts->spa_pipeline == NULL)
+        return;
+
+    spa_pipeline_get_stats(opts, &stats);
+
+    log_msg(LOG_INFO,
+        "SPA pipeline: %d workers, %"PRIu64" packets queued, %"PRIu64" dropped, "
+        "%u waiting (max %u per worker), %"PRIu64" actions applied, "
+        "%u waiting (max %u)",
+        opts->spa_pipeline->num_workers, stats.submitted, stats.dropped,
+        stats.queued, stats.queued_max, stats.applied,
+        stats.actions_queued, stats.actions_queued_max);
+
+    return;
+}
+
+/***EOF***/
@@ -0,0 +1,87 @@
+/*
+ *****************************************************************************
+ *
+ * File:    spa_pipeline.h
+ *
+ * Purpose: Header file for spa_pipeline.c.
+ *
+ *  Fwknop is developed primarily by the people listed in the file 'AUTHORS'.
+ *  Copyright (C) 2009-2014 fwknop developers and contributors. For a full
+ *  list of contributors, see the file 'CREDITS'.
+ *
+ *  License (GNU General Public License):
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  as published by the Free Software Foundation; either version 2
+ *  of the License, or (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ *****************************************************************************
+*/
+#ifndef SPA_PIPELINE_H
+#define SPA_PIPELINE_H
+
+#include "fwknopd_common.h"
+
+/* How often the applier thread expires rules and closes command cycles
+ * when no SPA packets come in (microseconds).
+*/
+#define SPA_APPLIER_INTERVAL_US     100000
+
+/* At most one warning about dropped SPA packets per this many seconds
+*/
+#define SPA_DROP_WARN_INTERVAL      60
+
+/* What an authenticated SPA packet asks for
+*/
+enum {
+    SPA_ACTION_ACCESS,      /* firewall access, see process_spa_request() */
+    SPA_ACTION_CMD_MSG,     /* SPA command message */
+    SPA_ACTION_CMD_CYCLE    /* CMD_CYCLE_OPEN of the access stanza */
+};
+
+typedef struct spa_action
+{
+    int                 type;
+    acc_stanza_t       *acc;
+    spa_data_t         *spadat;
+    int                 stanza_num;
+    int                 res;        /* status left by the command handlers */
+    int                 rv;         /* what run_spa_action() returned */
+    int                 done;
+    struct spa_action  *next;
+} spa_action_t;
+
+typedef struct spa_pipeline_stats
+{
+    uint64_t        submitted;      /* packets handed to the workers */
+    uint64_t        dropped;        /* packets dropped on a full queue */
+    uint64_t        applied;        /* actions run by the applier */
+    unsigned int    queued;         /* packets waiting right now */
+    unsigned int    queued_max;     /* most packets ever waiting for one worker */
+    unsigned int    actions_queued;
+    unsigned int    actions_queued_max;
+} spa_pipeline_stats_t;
+
+/* Prototypes
+*/
+int  spa_pipeline_start(fko_srv_options_t *opts);
+void spa_pipeline_stop(fko_srv_options_t *opts);
+int  spa_pipeline_submit(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt);
+int  spa_pipeline_apply(fko_srv_options_t *opts, spa_action_t *act);
+void spa_pipeline_get_stats(fko_srv_options_t *opts, spa_pipeline_stats_t *stats);
+void spa_pipeline_log_stats(fko_srv_options_t *opts);
+
+#endif  /* SPA_PIPELINE_H */
+
+/***EOF***/
@@ -35,6 +35,7 @@
 #include "fw_util.h"
 #include "cmd_cycle.h"
 #include "utils.h"
+#include "udp_server.h"
 #include <errno.h>
 
 #if HAVE_SYS_SOCKET_H
@@ -48,48 +49,181 @@
 #endif
 
 #include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/select.h>
 
-int
-run_udp_server(fko_srv_options_t *opts)
+/* How long a receiver thread waits in poll() before it looks at the stop
+ * flag again (milliseconds).
+*/
+#define UDP_RECEIVER_POLL_MS    200
+
+/* Datagrams read from a socket with one recvmmsg() call
+*/
+typedef struct udp_batch
 {
-    int                 s_sock, sfd_flags, selval, pkt_len;
-    int                 is_err, s_timeout, rv=1, chk_rm_all=0;
-    int                 rules_chk_threshold;
-    fd_set              sfd_set;
-    struct sockaddr_in  saddr, caddr;
-    struct timeval      tv;
-    char                sipbuf[MAX_IPV4_STR_LEN] = {0};
-    char                dgram_msg[MAX_SPA_PACKET_LEN+1] = {0};
-    unsigned short      port;
-    socklen_t           clen;
+    int                 size;
+    int                *lens;
+    struct sockaddr_in *addrs;
+    char               *bufs;       /* size buffers of MAX_SPA_PACKET_LEN+1 bytes */
+#if HAVE_RECVMMSG
+    struct mmsghdr     *msgs;
+    struct iovec       *iovs;
+#endif
+} udp_batch_t;
 
-    port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
-            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
+#define UDP_BATCH_BUF(b, i)     ((b)->bufs + (size_t)(i) * (MAX_SPA_PACKET_LEN+1))
+
+/* One SO_REUSEPORT socket and the thread that reads and verifies the
+ * datagrams the kernel hands to it.
+*/
+typedef struct udp_receiver
+{
+    fko_srv_options_t  *opts;
+    int                 sock;
+    struct sockaddr_in  saddr;
+    int                 reader_slot;
+    udp_batch_t         batch;
+    int                *stop;
+    pthread_t           thread;
+    int                 running;
+} udp_receiver_t;
+
+static int
+udp_batch_init(udp_batch_t *b, const int size)
+{
+#if HAVE_RECVMMSG
+    int     i;
+#endif
+
+    memset(b, 0x0, sizeof(udp_batch_t));
+    b->size = size;
+
+    if((b->lens = calloc(size, sizeof(int))) == NULL
+            || (b->addrs = calloc(size, sizeof(struct sockaddr_in))) == NULL
+            || (b->bufs = calloc(size, MAX_SPA_PACKET_LEN+1)) == NULL)
+        return 0;
+
+#if HAVE_RECVMMSG
+    if((b->msgs = calloc(size, sizeof(struct mmsghdr))) == NULL
+            || (b->iovs = calloc(size, sizeof(struct iovec))) == NULL)
+        return 0;
+
+    for(i=0; i < size; i++)
     {
-        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_PORT value.");
-        return -1;
+        b->iovs[i].iov_base = UDP_BATCH_BUF(b, i);
+        b->iovs[i].iov_len  = MAX_SPA_PACKET_LEN;
+        b->msgs[i].msg_hdr.msg_iov     = &b->iovs[i];
+        b->msgs[i].msg_hdr.msg_iovlen  = 1;
+        b->msgs[i].msg_hdr.msg_name    = &b->addrs[i];
     }
-    s_timeout = strtol_wrapper(opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
-            1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
+#endif
+
+    return 1;
+}
+
+static void
+udp_batch_free(udp_batch_t *b)
+{
+    free(b->lens);
+    free(b->addrs);
+    free(b->bufs);
+#if HAVE_RECVMMSG
+    free(b->msgs);
+    free(b->iovs);
+#endif
+    memset(b, 0x0, sizeof(udp_batch_t));
+    return;
+}
+
+/* Read up to b->size datagrams without blocking.  Returns how many were
+ * read, or -1 on a socket error.
+*/
+static int
+udp_recv_batch(const int sock, udp_batch_t *b)
+{
+    int         n;
+#if HAVE_RECVMMSG
+    int         i;
+#else
+    socklen_t   clen;
+#endif
+
+#if HAVE_RECVMMSG
+    for(i=0; i < b->size; i++)
+        b->msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    n = recvmmsg(sock, b->msgs, b->size, MSG_DONTWAIT, NULL);
+    if(n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+
+    for(i=0; i < n; i++)
+        b->lens[i] = b->msgs[i].msg_len;
+#else
+    for(n=0; n < b->size; n++)
     {
-        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_SELECT_TIMEOUT value.");
-        return -1;
+        clen = sizeof(struct sockaddr_in);
+        b->lens[n] = recvfrom(sock, UDP_BATCH_BUF(b, n), MAX_SPA_PACKET_LEN,
+                MSG_DONTWAIT, (struct sockaddr *)&b->addrs[n], &clen);
+        if(b->lens[n] < 0)
+        {
+            if(n == 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                return -1;
+            break;
+        }
     }
-    rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
-            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
-    if(is_err != FKO_SUCCESS)
+#endif
+
+    return n;
+}
+
+/* Copy datagram i of the batch into spa_pkt.  Returns 0 for datagrams
+ * that cannot be SPA packets.
+*/
+static int
+udp_to_spa_pkt(const fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        udp_batch_t *b, const int i, const struct sockaddr_in *saddr)
+{
+    char    sipbuf[MAX_IPV4_STR_LEN] = {0};
+    char   *dgram_msg = UDP_BATCH_BUF(b, i);
+    int     pkt_len = b->lens[i];
+
+    if(pkt_len <= 0 || pkt_len > MAX_SPA_PACKET_LEN)
+        return 0;
+
+    dgram_msg[pkt_len] = 0x0;
+
+    if(opts->verbose)
     {
-        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
-        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+        inet_ntop(AF_INET, &(b->addrs[i].sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
+        log_msg(LOG_INFO, "udp_server: Got UDP datagram (%d bytes) from: %s",
+                pkt_len, sipbuf);
     }
 
-    log_msg(LOG_INFO, "Kicking off UDP server to listen on port %i.", port);
+    strlcpy((char *)spa_pkt->packet_data, dgram_msg, pkt_len+1);
+    spa_pkt->packet_data_len = pkt_len;
+    spa_pkt->packet_proto    = IPPROTO_UDP;
+    spa_pkt->packet_src_ip   = b->addrs[i].sin_addr.s_addr;
+    spa_pkt->packet_dst_ip   = saddr->sin_addr.s_addr;
+    spa_pkt->packet_src_port = ntohs(b->addrs[i].sin_port);
+    spa_pkt->packet_dst_port = ntohs(saddr->sin_port);
+    spa_pkt->sdp_id          = 0;
+
+    return 1;
+}
+
+/* Create a non-blocking UDP socket bound to port on all addresses
+*/
+static int
+udp_open_socket(const unsigned short port, const int reuseport,
+        struct sockaddr_in *saddr)
+{
+    int     s_sock, sfd_flags;
+#ifdef SO_REUSEPORT
+    int     on = 1;
+#endif
 
-    /* Now, let's make a UDP server
-    */
     if ((s_sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: socket() failed: %s",
@@ -118,14 +252,27 @@ run_udp_server(fko_srv_options_t *opts)
         return -1;
     }
 
+#ifdef SO_REUSEPORT
+    /* The kernel spreads datagrams over all sockets bound to the port,
+     * by source address and port.
+    */
+    if(reuseport && setsockopt(s_sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+    {
+        log_msg(LOG_ERR, "run_udp_server: setsockopt SO_REUSEPORT failed: %s",
+            strerror(errno));
+        close(s_sock);
+        return -1;
+    }
+#endif
+
     /* Construct local address structure */
-    memset(&saddr, 0x0, sizeof(saddr));
-    saddr.sin_family      = AF_INET;           /* Internet address family */
-    saddr.sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
-    saddr.sin_port        = htons(port);       /* Local port */
+    memset(saddr, 0x0, sizeof(struct sockaddr_in));
+    saddr->sin_family      = AF_INET;           /* Internet address family */
+    saddr->sin_addr.s_addr = htonl(INADDR_ANY); /* Any incoming interface */
+    saddr->sin_port        = htons(port);       /* Local port */
 
     /* Bind to the local address */
-    if (bind(s_sock, (struct sockaddr *) &saddr, sizeof(saddr)) < 0)
+    if (bind(s_sock, (struct sockaddr *) saddr, sizeof(struct sockaddr_in)) < 0)
     {
         log_msg(LOG_ERR, "run_udp_server: bind() failed: %s",
             strerror(errno));
@@ -133,6 +280,296 @@ run_udp_server(fko_srv_options_t *opts)
         return -1;
     }
 
+    return s_sock;
+}
+
+static uint64_t
+monotonic_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Expire rules, add pending ones and close command cycles.  Returns how
+ * many microseconds until queued rules are due, or 0 if there are none.
+*/
+static int
+udp_housekeeping(fko_srv_options_t *opts, const int rules_chk_threshold)
+{
+    int     chk_rm_all = 0, pending_us = 0;
+
+    /* Check for any expired firewall rules and deal with them.
+    */
+    if(opts->enable_fw)
+    {
+        if(rules_chk_threshold > 0)
+        {
+            opts->check_rules_ctr++;
+            if ((opts->check_rules_ctr % rules_chk_threshold) == 0)
+            {
+                chk_rm_all = 1;
+                opts->check_rules_ctr = 0;
+            }
+        }
+        check_firewall_rules(opts, chk_rm_all);
+
+        /* Add the rules granted during the last batch window
+        */
+        pending_us = fw_apply_pending_rules(opts, 0);
+    }
+
+    /* See if any CMD_CYCLE_CLOSE commands need to be executed.
+    */
+    cmd_cycle_close(opts);
+
+    return pending_us;
+}
+
+/* Number of sockets the UDP server listens on
+*/
+int
+udp_server_sockets(const fko_srv_options_t *opts)
+{
+    int     n, is_err;
+
+    n = strtol_wrapper(opts->config[CONF_UDPSERV_SOCKETS],
+            1, RCHK_MAX_UDPSERV_SOCKETS, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+        return 1;
+
+#ifndef SO_REUSEPORT
+    if(n > 1)
+        return 1;
+#endif
+
+    return n;
+}
+
+static void *
+udp_receiver_thread(void *arg)
+{
+    udp_receiver_t     *r = (udp_receiver_t *)arg;
+    spa_pkt_info_t      spa_pkt;
+    struct pollfd       pfd;
+    int                 i, n;
+
+    pfd.fd     = r->sock;
+    pfd.events = POLLIN;
+
+    while(! __atomic_load_n(r->stop, __ATOMIC_ACQUIRE))
+    {
+        if(poll(&pfd, 1, UDP_RECEIVER_POLL_MS) <= 0)
+            continue;
+
+        if((n = udp_recv_batch(r->sock, &r->batch)) < 0)
+        {
+            log_msg(LOG_ERR, "udp_server: receive error: %s", strerror(errno));
+            continue;
+        }
+
+        for(i=0; i < n; i++)
+        {
+            if(udp_to_spa_pkt(r->opts, &spa_pkt, &r->batch, i, &r->saddr))
+                process_spa_pkt(r->opts, &spa_pkt, r->reader_slot);
+
+            __atomic_add_fetch(&r->opts->packet_ctr, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    return NULL;
+}
+
+/* Several SO_REUSEPORT sockets, each read and verified by its own thread.
+ * Firewall changes go through the SPA pipeline's applier thread, which
+ * also does the housekeeping, so this thread only waits for signals.
+*/
+static int
+run_udp_receivers(fko_srv_options_t *opts, const unsigned short port,
+        const int num_socks, const int batch_size, const int s_timeout)
+{
+    udp_receiver_t     *rx;
+    struct timespec     tv;
+    sigset_t            all, old;
+    int                 i, stop = 0, rv = 1;
+
+    if(opts->spa_pipeline == NULL)
+    {
+        log_msg(LOG_ERR, "run_udp_server: the SPA applier thread is not running");
+        return -1;
+    }
+
+    if((rx = calloc(num_socks, sizeof(udp_receiver_t))) == NULL)
+    {
+        log_msg(LOG_ERR, "run_udp_server: memory allocation error");
+        return -1;
+    }
+
+    for(i=0; i < num_socks; i++)
+        rx[i].sock = -1;
+
+    for(i=0; i < num_socks; i++)
+    {
+        rx[i].opts        = opts;
+        rx[i].stop        = &stop;
+        rx[i].reader_slot = -1;
+
+        if((rx[i].sock = udp_open_socket(port, 1, &rx[i].saddr)) < 0)
+        {
+            rv = -1;
+            goto cleanup;
+        }
+
+        if(! udp_batch_init(&rx[i].batch, batch_size))
+        {
+            log_msg(LOG_ERR, "run_udp_server: memory allocation error");
+            rv = -1;
+            goto cleanup;
+        }
+
+        if(strncasecmp(opts->config[CONF_DISABLE_SDP_MODE], "N", 1) == 0
+                && (rx[i].reader_slot = acc_epoch_register(&(opts->acc_epoch))) < 0)
+        {
+            log_msg(LOG_ERR,
+                "run_udp_server: no access snapshot reader slot left for socket %d", i);
+            rv = -1;
+            goto cleanup;
+        }
+    }
+
+    /* Initialize our signal handlers, and keep the signals away from the
+     * receiver threads.
+    */
+    if(set_sig_handlers() > 0)
+        log_msg(LOG_ERR, "Errors encountered when setting signal handlers.");
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    for(i=0; i < num_socks; i++)
+    {
+        if(pthread_create(&rx[i].thread, NULL, udp_receiver_thread, &rx[i]) != 0)
+        {
+            log_msg(LOG_ERR, "run_udp_server: failed to start receiver %d", i);
+            rv = -1;
+            break;
+        }
+        rx[i].running = 1;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if(rv > 0)
+        log_msg(LOG_INFO,
+            "Kicking off UDP server to listen on port %i with %d sockets.",
+            port, num_socks);
+
+    while(rv > 0)
+    {
+        if(sig_do_stop(opts))
+        {
+            if(opts->verbose)
+                log_msg(LOG_INFO,
+                        "udp_server: terminating signal received, will stop.");
+            break;
+        }
+
+        if (opts->packet_ctr_limit
+                && __atomic_load_n(&opts->packet_ctr, __ATOMIC_RELAXED) >= opts->packet_ctr_limit)
+        {
+            log_msg(LOG_WARNING,
+                "* Incoming packet count limit of %i reached",
+                opts->packet_ctr_limit
+            );
+            break;
+        }
+
+        tv.tv_sec  = s_timeout / 1000000;
+        tv.tv_nsec = (s_timeout % 1000000) * 1000;
+        nanosleep(&tv, NULL);
+    }
+
+    __atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+    for(i=0; i < num_socks; i++)
+        if(rx[i].running)
+            pthread_join(rx[i].thread, NULL);
+
+    if(opts->foreground == 1 && opts->verbose > 2)
+        log_msg(LOG_DEBUG, "run_udp_server() processed: %d packets",
+                opts->packet_ctr);
+
+cleanup:
+    for(i=0; i < num_socks; i++)
+    {
+        if(rx[i].sock >= 0)
+            close(rx[i].sock);
+        udp_batch_free(&rx[i].batch);
+    }
+    free(rx);
+
+    return rv;
+}
+
+int
+run_udp_server(fko_srv_options_t *opts)
+{
+    int                 s_sock, selval, done = 0;
+    int                 is_err, s_timeout, rv=1;
+    int                 pending_us, num_socks, batch_size, i, n;
+    int                 rules_chk_threshold;
+    uint64_t            now, next_hk = 0, wait_us;
+    fd_set              sfd_set;
+    struct sockaddr_in  saddr;
+    struct timeval      tv;
+    udp_batch_t         batch;
+    unsigned short      port;
+
+    port = strtol_wrapper(opts->config[CONF_UDPSERV_PORT],
+            1, MAX_PORT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_PORT value.");
+        return -1;
+    }
+    s_timeout = strtol_wrapper(opts->config[CONF_UDPSERV_SELECT_TIMEOUT],
+            1, RCHK_MAX_UDPSERV_SELECT_TIMEOUT, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid max UDPSERV_SELECT_TIMEOUT value.");
+        return -1;
+    }
+    batch_size = strtol_wrapper(opts->config[CONF_UDPSERV_RECV_BATCH],
+            1, RCHK_MAX_UDPSERV_RECV_BATCH, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] Invalid UDPSERV_RECV_BATCH value.");
+        return -1;
+    }
+    rules_chk_threshold = strtol_wrapper(opts->config[CONF_RULES_CHECK_THRESHOLD],
+            0, RCHK_MAX_RULES_CHECK_THRESHOLD, NO_EXIT_UPON_ERR, &is_err);
+    if(is_err != FKO_SUCCESS)
+    {
+        log_msg(LOG_ERR, "[*] invalid RULES_CHECK_THRESHOLD");
+        clean_exit(opts, FW_CLEANUP, EXIT_FAILURE);
+    }
+
+    if((num_socks = udp_server_sockets(opts)) > 1)
+        return run_udp_receivers(opts, port, num_socks, batch_size, s_timeout);
+
+    log_msg(LOG_INFO, "Kicking off UDP server to listen on port %i.", port);
+
+    /* Now, let's make a UDP server
+    */
+    if((s_sock = udp_open_socket(port, 0, &saddr)) < 0)
+        return -1;
+
+    if(! udp_batch_init(&batch, batch_size))
+    {
+        log_msg(LOG_ERR, "run_udp_server: memory allocation error");
+        udp_batch_free(&batch);
+        close(s_sock);
+        return -1;
+    }
+
     /* Initialize our signal handlers. You can check the return value for
      * the number of signals that were *not* set.  Those that were not set
      * will be listed in the log/stderr output.
@@ -154,38 +591,37 @@ run_udp_server(fko_srv_options_t *opts)
             break;
         }
 
-        if(!opts->test)
+        /* Set our select timeout to (500ms by default).
+        */
+        wait_us = s_timeout;
+
+        /* Housekeeping runs on its own timer rather than after every
+         * datagram.  With SPA verification workers, the applier thread
+         * takes care of it.
+        */
+        if(!opts->test && opts->spa_pipeline == NULL)
         {
-            /* Check for any expired firewall rules and deal with them.
-            */
-            if(opts->enable_fw)
+            now = monotonic_us();
+            if(now >= next_hk)
             {
-                if(rules_chk_threshold > 0)
-                {
-                    opts->check_rules_ctr++;
-                    if ((opts->check_rules_ctr % rules_chk_threshold) == 0)
-                    {
-                        chk_rm_all = 1;
-                        opts->check_rules_ctr = 0;
-                    }
-                }
-                check_firewall_rules(opts, chk_rm_all);
-                chk_rm_all = 0;
-            }
+                pending_us = udp_housekeeping(opts, rules_chk_threshold);
 
-            /* See if any CMD_CYCLE_CLOSE commands need to be executed.
-            */
-            cmd_cycle_close(opts);
+                /* ...but don't sit on rules that are waiting to be added
+                */
+                if(pending_us > 0 && pending_us < s_timeout)
+                    next_hk = now + pending_us;
+                else
+                    next_hk = now + s_timeout;
+            }
+            wait_us = next_hk - now;
         }
 
         /* Initialize and setup the socket for select.
         */
         FD_SET(s_sock, &sfd_set);
 
-        /* Set our select timeout to (500ms by default).
-        */
-        tv.tv_sec = 0;
-        tv.tv_usec = s_timeout;
+        tv.tv_sec  = wait_us / 1000000;
+        tv.tv_usec = wait_us % 1000000;
 
         selval = select(s_sock+1, &sfd_set, NULL, NULL, &tv);
 
@@ -213,57 +649,60 @@ run_udp_server(fko_srv_options_t *opts)
         if(! FD_ISSET(s_sock, &sfd_set))
             continue;
 
-        /* If we make it here then there is a datagram to process
+        /* If we make it here then there are datagrams to process
         */
-        clen = sizeof(caddr);
-
-        pkt_len = recvfrom(s_sock, dgram_msg, MAX_SPA_PACKET_LEN,
-                0, (struct sockaddr *)&caddr, &clen);
-
-        if(pkt_len > 0 && pkt_len <= MAX_SPA_PACKET_LEN)
+        if((n = udp_recv_batch(s_sock, &batch)) < 0)
         {
-            dgram_msg[pkt_len] = 0x0;
+            log_msg(LOG_ERR, "run_udp_server: receive error: %s",
+                strerror(errno));
+            continue;
+        }
 
-            if(opts->verbose)
+        for(i=0; i < n; i++)
+        {
+            /* Copy the packet for SPA processing
+            */
+            if(udp_to_spa_pkt(opts, &(opts->spa_pkt), &batch, i, &saddr))
             {
-                memset(sipbuf, 0x0, MAX_IPV4_STR_LEN);
-                inet_ntop(AF_INET, &(caddr.sin_addr.s_addr), sipbuf, MAX_IPV4_STR_LEN);
-                log_msg(LOG_INFO, "udp_server: Got UDP datagram (%d bytes) from: %s",
-                        pkt_len, sipbuf);
+                if(opts->spa_pipeline != NULL)
+                    spa_pipeline_submit(opts, &(opts->spa_pkt));
+                else
+                    incoming_spa(opts);
             }
 
-            /* Copy the packet for SPA processing
-            */
-            strlcpy((char *)opts->spa_pkt.packet_data, dgram_msg, pkt_len+1);
-            opts->spa_pkt.packet_data_len = pkt_len;
-            opts->spa_pkt.packet_proto    = IPPROTO_UDP;
-            opts->spa_pkt.packet_src_ip   = caddr.sin_addr.s_addr;
-            opts->spa_pkt.packet_dst_ip   = saddr.sin_addr.s_addr;
-            opts->spa_pkt.packet_src_port = ntohs(caddr.sin_port);
-            opts->spa_pkt.packet_dst_port = ntohs(saddr.sin_port);
-            opts->spa_pkt.sdp_id   = 0;
-
-            incoming_spa(opts);
-        }
+            opts->packet_ctr += 1;
+            if(opts->foreground == 1 && opts->verbose > 2)
+                log_msg(LOG_DEBUG, "run_udp_server() processed: %d packets",
+                        opts->packet_ctr);
 
-        memset(dgram_msg, 0x0, sizeof(dgram_msg));
+            if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+            {
+                log_msg(LOG_WARNING,
+                    "* Incoming packet count limit of %i reached",
+                    opts->packet_ctr_limit
+                );
+                done = 1;
+                break;
+            }
+        }
 
-        opts->packet_ctr += 1;
-        if(opts->foreground == 1 && opts->verbose > 2)
-            log_msg(LOG_DEBUG, "run_udp_server() processed: %d packets",
-                    opts->packet_ctr);
+        if(done)
+            break;
 
-        if (opts->packet_ctr_limit && opts->packet_ctr >= opts->packet_ctr_limit)
+        /* Rules granted by this batch are due before the next
+         * housekeeping run
+        */
+        if(!opts->test && opts->spa_pipeline == NULL && opts->enable_fw)
         {
-            log_msg(LOG_WARNING,
-                "* Incoming packet count limit of %i reached",
-                opts->packet_ctr_limit
-            );
-            break;
+            pending_us = fw_apply_pending_rules(opts, 0);
+            now = monotonic_us();
+            if(pending_us > 0 && now + pending_us < next_hk)
+                next_hk = now + pending_us;
         }
 
     } /* infinite while loop */
 
+    udp_batch_free(&batch);
     close(s_sock);
     return rv;
 }
@@ -34,6 +34,7 @@
 /* Function prototypes
 */
 int run_udp_server(fko_srv_options_t *opts);
+int udp_server_sockets(const fko_srv_options_t *opts);
 
 #endif /* UDP_SERVER_H */
 
@@ -33,6 +33,8 @@
 #include "fw_util.h"
 #include "cmd_cycle.h"
 #include "connection_tracker.h"
+#include "control_client.h"
+#include "spa_pipeline.h"
 
 #include <stdarg.h>
 
@@ -375,6 +377,10 @@ clean_exit(fko_srv_options_t *opts, unsigned int fw_cleanup_flag, unsigned int e
 
     destroy_connection_tracker(opts);
 
+    /* Let the applier finish before the firewall is cleaned up
+    */
+    spa_pipeline_stop(opts);
+
     if(!opts->test && opts->enable_fw && (fw_cleanup_flag == FW_CLEANUP))
         fw_cleanup(opts);
 
@@ -384,12 +390,7 @@ clean_exit(fko_srv_options_t *opts, unsigned int fw_cleanup_flag, unsigned int e
 
     if(opts->ctrl_client != NULL)
     {
-        if(opts->ctrl_client_thread > 0)
-        {
-            pthread_cancel(opts->ctrl_client_thread);
-            pthread_join(opts->ctrl_client_thread, NULL);
-            opts->ctrl_client_thread = 0;
-        }
+        stop_control_client_thread(opts);
 
         sdp_ctrl_client_destroy(opts->ctrl_client);
     }
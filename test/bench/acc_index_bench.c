@@ -0,0 +1,131 @@
+/*
+ * Benchmark for the legacy mode SOURCE / DESTINATION stanza lookup.
+ *
+ * Builds a set of access stanzas with random SOURCE CIDR lists (and an
+ * optional DESTINATION) and times finding the stanzas that match random
+ * packet addresses, once by walking every stanza's list the way
+ * compare_addr_list() does and once with acc_addr_index_lookup().
+ *
+ * Usage: ./acc_index_bench [stanzas] [ranges per stanza] [lookups]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fwknopd_common.h"
+#include "acc_addr_index.h"
+
+static uint32_t rand_state = 0x2545f491;
+
+static uint32_t
+rnd(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+list_match(const acc_int_list_t *l, const uint32_t ip)
+{
+    for(; l != NULL; l = l->next)
+        if((ip & l->mask) == (l->maddr & l->mask))
+            return 1;
+    return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+    int                 num_stanzas = 5000, ranges = 4, lookups = 200000;
+    int                 i, j, n, max, lin_hits = 0, idx_hits = 0;
+    acc_int_list_t     *src, **dst;
+    acc_addr_index_t   *idx;
+    uint32_t           *ids, *addrs, len;
+    double              t0, lin_s, idx_s;
+
+    if(argc > 1)
+        num_stanzas = atoi(argv[1]);
+    if(argc > 2)
+        ranges = atoi(argv[2]);
+    if(argc > 3)
+        lookups = atoi(argv[3]);
+
+    if(num_stanzas <= 0 || ranges <= 0 || lookups <= 0)
+    {
+        fprintf(stderr, "Usage: %s [stanzas] [ranges per stanza] [lookups]\n",
+                argv[0]);
+        return 1;
+    }
+
+    src   = calloc((size_t)num_stanzas * ranges, sizeof(acc_int_list_t));
+    dst   = calloc(num_stanzas, sizeof(acc_int_list_t *));
+    ids   = calloc(num_stanzas, sizeof(uint32_t));
+    addrs = calloc(lookups, sizeof(uint32_t));
+    idx   = acc_addr_index_create();
+    if(src == NULL || dst == NULL || ids == NULL || addrs == NULL || idx == NULL)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+
+    for(i=0; i < num_stanzas; i++)
+    {
+        for(j=0; j < ranges; j++)
+        {
+            acc_int_list_t *e = &src[i * ranges + j];
+
+            len = 16 + rnd() % 17;
+            e->mask  = len == 32 ? 0xffffffff : 0xffffffff << (32 - len);
+            e->maddr = (0x0a000000 | (rnd() & 0x00ffffff)) & e->mask;
+            e->next  = (j + 1 < ranges) ? e + 1 : NULL;
+        }
+        if(acc_addr_index_add(idx, NULL, &src[i * ranges], dst[i]) != 0)
+        {
+            fprintf(stderr, "acc_addr_index_add failed\n");
+            return 1;
+        }
+    }
+    acc_addr_index_finish(idx);
+
+    for(i=0; i < lookups; i++)
+        addrs[i] = 0x0a000000 | (rnd() & 0x00ffffff);
+
+    t0 = now_s();
+    for(i=0; i < lookups; i++)
+        for(j=0; j < num_stanzas; j++)
+            if(list_match(&src[j * ranges], addrs[i]))
+                lin_hits++;
+    lin_s = now_s() - t0;
+
+    max = num_stanzas;
+    t0 = now_s();
+    for(i=0; i < lookups; i++)
+    {
+        n = acc_addr_index_lookup(idx, addrs[i], 0, ids, max);
+        idx_hits += n;
+    }
+    idx_s = now_s() - t0;
+
+    printf("%d stanzas x %d SOURCE ranges, %d lookups (%d / %d matches)\n",
+            num_stanzas, ranges, lookups, lin_hits, idx_hits);
+    printf("  linear walk: %10.0f lookups/s\n", lookups / lin_s);
+    printf("  index:       %10.0f lookups/s\n", lookups / idx_s);
+
+    acc_addr_index_free(idx);
+    free(src);
+    free(dst);
+    free(ids);
+    free(addrs);
+    return lin_hits != idx_hits;
+}
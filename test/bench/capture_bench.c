@@ -0,0 +1,423 @@
+/*
+ * Replay benchmark for packet capture.
+ *
+ * Loads the frames of an Ethernet pcap file and sends them in a loop on an
+ * interface (lo by default) through a PF_PACKET socket, while the frames
+ * are captured back with libpcap (pcap_dispatch(), as pcap_capture() does)
+ * and then with AF_PACKET rings (as afpacket_capture() does), with one
+ * and with several fanout threads.  Every captured frame goes through
+ * spa_frame_parse() and spa_frame_to_pkt(), the work fwknopd does before
+ * SPA verification.  For each mode the frames per second seen by the
+ * capture side, the number that made it to SPA processing and the kernel
+ * drop counters are reported.
+ *
+ * The flows in the pcap file decide how fanout spreads the load: a file
+ * with a single flow keeps every frame on one thread.
+ *
+ * SPA verification and everything else past the capture path are
+ * replaced by the stubs below.  Needs root (or CAP_NET_RAW).
+ *
+ * Usage: ./run.sh ./capture_bench <pcap file> [interface] [seconds]
+ *            [threads] [filter]
+*/
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <pcap.h>
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include "fwknopd_common.h"
+#include "fwknopd_errors.h"
+#include "process_packet.h"
+#include "afpacket_capture.h"
+#include "incoming_spa.h"
+#include "sig_handler.h"
+#include "tcp_server.h"
+
+#define RING_BLOCKS     16
+
+typedef struct frame
+{
+    unsigned char  *data;
+    unsigned int    len;
+} frame_t;
+
+static frame_t         *frames;
+static unsigned long    num_frames;
+static const char      *intf = "lo";
+static const char      *filter = DEF_PCAP_FILTER;
+static int              stop_inject;
+
+typedef struct counter
+{
+    unsigned long   frames;
+    unsigned long   spa;
+    spa_pkt_info_t  spa_pkt;
+} counter_t;
+
+/* Everything the capture path talks to past the parser
+*/
+sig_atomic_t got_sigchld;
+
+void
+incoming_spa(fko_srv_options_t *opts)
+{
+    return;
+}
+
+int
+spa_pipeline_submit(fko_srv_options_t *opts, const spa_pkt_info_t *spa_pkt)
+{
+    return 1;
+}
+
+void
+process_spa_pkt(fko_srv_options_t *opts, spa_pkt_info_t *spa_pkt,
+        const int reader_slot)
+{
+    return;
+}
+
+int
+acc_epoch_register(acc_epoch_t *epoch)
+{
+    return 0;
+}
+
+int
+set_sig_handlers(void)
+{
+    return 0;
+}
+
+int
+sig_do_stop(fko_srv_options_t * const opts)
+{
+    return 0;
+}
+
+int
+run_tcp_server(fko_srv_options_t *opts)
+{
+    return 0;
+}
+
+void
+log_msg(int level, char* msg, ...)
+{
+    va_list ap;
+
+    va_start(ap, msg);
+    vfprintf(stderr, msg, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+void
+clean_exit(fko_srv_options_t *opts, unsigned int fw_cleanup_flag,
+        unsigned int exit_status)
+{
+    exit(exit_status);
+}
+
+static void
+load_frames(const char *file)
+{
+    char                errstr[PCAP_ERRBUF_SIZE] = {0};
+    struct pcap_pkthdr *hdr;
+    const unsigned char *data;
+    unsigned long       max = 0;
+    pcap_t             *pcap;
+
+    if((pcap = pcap_open_offline(file, errstr)) == NULL)
+    {
+        fprintf(stderr, "pcap_open_offline() error: %s\n", errstr);
+        exit(1);
+    }
+
+    if(pcap_datalink(pcap) != DLT_EN10MB)
+    {
+        fprintf(stderr, "%s: only Ethernet captures can be replayed\n", file);
+        exit(1);
+    }
+
+    while(pcap_next_ex(pcap, &hdr, &data) == 1)
+    {
+        if(hdr->caplen != hdr->len || hdr->len < ETHER_HDR_LEN)
+            continue;
+
+        if(num_frames == max)
+        {
+            max = max ? max * 2 : 1024;
+            if((frames = realloc(frames, max * sizeof(*frames))) == NULL)
+            {
+                fprintf(stderr, "realloc failed for %lu frames\n", max);
+                exit(1);
+            }
+        }
+
+        if((frames[num_frames].data = malloc(hdr->len)) == NULL)
+        {
+            fprintf(stderr, "malloc failed\n");
+            exit(1);
+        }
+        memcpy(frames[num_frames].data, data, hdr->len);
+        frames[num_frames++].len = hdr->len;
+    }
+
+    pcap_close(pcap);
+
+    if(num_frames == 0)
+    {
+        fprintf(stderr, "%s: no complete frames\n", file);
+        exit(1);
+    }
+}
+
+/* Send the frames on the interface over and over until told to stop
+*/
+static void *
+inject_thread(void *arg)
+{
+    struct sockaddr_ll  sll;
+    unsigned long       i = 0;
+    int                 sock;
+
+    if((sock = socket(AF_PACKET, SOCK_RAW, 0)) < 0)
+    {
+        perror("PF_PACKET socket");
+        exit(1);
+    }
+
+    memset(&sll, 0x0, sizeof(sll));
+    sll.sll_family  = AF_PACKET;
+    sll.sll_ifindex = if_nametoindex(intf);
+    if(bind(sock, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+    {
+        perror("bind");
+        exit(1);
+    }
+
+    while(! __atomic_load_n(&stop_inject, __ATOMIC_ACQUIRE))
+    {
+        send(sock, frames[i].data, frames[i].len, 0);
+        if(++i == num_frames)
+            i = 0;
+    }
+
+    close(sock);
+    return NULL;
+}
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+count_frame(counter_t *c, const unsigned char *packet,
+        const unsigned int caplen, const unsigned int len)
+{
+    spa_frame_t     frame;
+
+    c->frames++;
+    if(spa_frame_parse(packet, caplen, len, ETHER_HDR_LEN, &frame)
+            && spa_frame_to_pkt(&frame, &c->spa_pkt))
+        c->spa++;
+}
+
+static void
+report(const char *mode, const int threads, const double secs,
+        const unsigned long nframes, const unsigned long nspa,
+        const unsigned long drops)
+{
+    printf("%10s %8d %14.0f %12lu %12lu\n", mode, threads,
+            nframes / secs, nspa, drops);
+}
+
+/* libpcap, the way pcap_capture() reads packets
+*/
+static void
+pcap_handler_cb(unsigned char *arg, const struct pcap_pkthdr *hdr,
+        const unsigned char *packet)
+{
+    count_frame((counter_t *)arg, packet, hdr->caplen, hdr->len);
+}
+
+static void
+run_pcap(const int secs)
+{
+    char                errstr[PCAP_ERRBUF_SIZE] = {0};
+    struct bpf_program  fp;
+    struct pcap_stat    ps;
+    counter_t           c;
+    pcap_t             *pcap;
+    double              t0, t;
+
+    memset(&c, 0x0, sizeof(c));
+
+    if((pcap = pcap_open_live(intf, atoi(DEF_MAX_SNIFF_BYTES), 0, 100,
+                    errstr)) == NULL)
+    {
+        fprintf(stderr, "pcap_open_live() error: %s\n", errstr);
+        exit(1);
+    }
+
+    if(pcap_compile(pcap, &fp, (char *)filter, 1, 0) == -1
+            || pcap_setfilter(pcap, &fp) == -1)
+    {
+        fprintf(stderr, "pcap filter error: %s\n", pcap_geterr(pcap));
+        exit(1);
+    }
+    pcap_freecode(&fp);
+    pcap_setdirection(pcap, PCAP_D_IN);
+
+    t0 = now_s();
+    while((t = now_s() - t0) < secs)
+        pcap_dispatch(pcap, atoi(DEF_PCAP_DISPATCH_COUNT), pcap_handler_cb,
+                (unsigned char *)&c);
+
+    memset(&ps, 0x0, sizeof(ps));
+    pcap_stats(pcap, &ps);
+    report("pcap", 1, t, c.frames, c.spa, ps.ps_drop);
+
+    pcap_close(pcap);
+}
+
+/* AF_PACKET rings, the way afpacket_capture() reads packets
+*/
+typedef struct afp_bench
+{
+    afp_ring_t      ring;
+    counter_t       c;
+    int             secs;
+    double          elapsed;
+    pthread_t       thread;
+} afp_bench_t;
+
+static void
+afp_cb(const unsigned char *frame, const unsigned int caplen,
+        const unsigned int len, void *arg)
+{
+    count_frame((counter_t *)arg, frame, caplen, len);
+}
+
+static void *
+afp_thread(void *arg)
+{
+    afp_bench_t    *b = (afp_bench_t *)arg;
+    double          t0 = now_s();
+
+    while((b->elapsed = now_s() - t0) < b->secs)
+        afp_ring_read(&b->ring, AFP_POLL_MS, afp_cb, &b->c);
+
+    return NULL;
+}
+
+static void
+run_afpacket(const int secs, const int threads)
+{
+    struct bpf_program  fp;
+    afp_bench_t        *b;
+    unsigned long       nframes = 0, nspa = 0, drops = 0;
+    unsigned int        packets, dropped;
+    double              elapsed = 0;
+    int                 i;
+
+    if((b = calloc(threads, sizeof(*b))) == NULL)
+    {
+        fprintf(stderr, "calloc failed\n");
+        exit(1);
+    }
+
+    if(afp_compile_filter(filter, atoi(DEF_MAX_SNIFF_BYTES), &fp)
+            != FWKNOPD_SUCCESS)
+        exit(1);
+
+    for(i=0; i < threads; i++)
+    {
+        b[i].secs = secs;
+        if(afp_ring_open(&b[i].ring, intf, &fp, 0, 1, RING_BLOCKS,
+                    threads > 1 ? (getpid() & 0xffff) : -1) != FWKNOPD_SUCCESS)
+            exit(1);
+    }
+    pcap_freecode(&fp);
+
+    for(i=0; i < threads; i++)
+        pthread_create(&b[i].thread, NULL, afp_thread, &b[i]);
+
+    for(i=0; i < threads; i++)
+    {
+        pthread_join(b[i].thread, NULL);
+
+        nframes += b[i].c.frames;
+        nspa    += b[i].c.spa;
+        if(b[i].elapsed > elapsed)
+            elapsed = b[i].elapsed;
+        if(afp_ring_stats(&b[i].ring, &packets, &dropped) == FWKNOPD_SUCCESS)
+            drops += dropped;
+
+        afp_ring_close(&b[i].ring);
+    }
+
+    report("af_packet", threads, elapsed, nframes, nspa, drops);
+    free(b);
+}
+
+int
+main(int argc, char **argv)
+{
+    pthread_t   injector;
+    int         secs = 5, threads = 4;
+
+    if(argc < 2)
+    {
+        fprintf(stderr,
+            "Usage: %s <pcap file> [interface] [seconds] [threads] [filter]\n",
+            argv[0]);
+        return 1;
+    }
+
+    if(argc > 2)
+        intf = argv[2];
+    if(argc > 3)
+        secs = atoi(argv[3]);
+    if(argc > 4)
+        threads = atoi(argv[4]);
+    if(argc > 5)
+        filter = argv[5];
+
+    if(secs <= 0 || threads <= 0 || threads > RCHK_MAX_AF_PACKET_THREADS)
+    {
+        fprintf(stderr, "bad seconds or threads value\n");
+        return 1;
+    }
+
+    load_frames(argv[1]);
+
+    printf("replaying %lu frames on %s, filter '%s'\n", num_frames, intf, filter);
+    printf("%10s %8s %14s %12s %12s\n", "mode", "threads", "frames/sec",
+            "spa", "drops");
+
+    pthread_create(&injector, NULL, inject_thread, NULL);
+
+    run_pcap(secs);
+    run_afpacket(secs, 1);
+    if(threads > 1)
+        run_afpacket(secs, threads);
+
+    __atomic_store_n(&stop_inject, 1, __ATOMIC_RELEASE);
+    pthread_join(injector, NULL);
+
+    return 0;
+}
@@ -0,0 +1,319 @@
+/*
+ * Replay benchmark for connection tracking.
+ *
+ * Keeps a fake conntrack table of N marked flows (100k by default) spread
+ * over a number of SDP IDs, and on every cycle destroys a few of them and
+ * creates as many new ones.  update_connections() runs against the
+ * replayed table twice: first comparing a full dump on every cycle
+ * (CONNTRACK_EVENTS N), then following the replayed NEW/DESTROY events
+ * (CONNTRACK_EVENTS Y).  The CPU time of the first (full) update and the
+ * average per following cycle are reported for both, along with the
+ * number of connections each mode reported to the controller.  Following
+ * events reports a few more: flows that were opened and closed again
+ * between two updates never show up in a dump.
+ *
+ * The conntrack_nl_*() functions, the controller and the service lookup
+ * are replaced by the stubs below, so no kernel or controller is needed.
+ *
+ * Usage: ./run.sh ./conn_tracker_bench [flows] [churn_per_cycle] [cycles]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include "fwknopd_common.h"
+#include "fwknopd_errors.h"
+#include "extcmd.h"
+#include "service.h"
+#include "conntrack_nl.h"
+#include "connection_tracker.h"
+
+#define SDP_IDS         1000
+#define SERVICE_ID      1
+#define SERVICE_PORT    22
+#define GATEWAY_ADDR    0x0a01a8c0  /* 192.168.1.10, network byte order */
+
+static conntrack_nl_entry_t *flows;
+static unsigned long         num_flows;
+static uint32_t              next_flow;
+
+static conntrack_nl_entry_t *events;
+static unsigned long         num_events;
+static unsigned long         max_events;
+
+static conntrack_nl_t        dump_nl, event_nl;
+static unsigned long         reported;
+
+/* Flows differ by source address and port, SDP IDs are handed out
+ * round robin.
+*/
+static void
+make_flow(conntrack_nl_entry_t *flow)
+{
+    uint32_t n = next_flow++;
+
+    memset(flow, 0x0, sizeof(*flow));
+    flow->proto       = PROTO_TCP;
+    flow->mark        = 1 + (n % SDP_IDS);
+    flow->orig_src    = htonl(0x0a000000 | (n >> 4));
+    flow->orig_dst    = GATEWAY_ADDR;
+    flow->orig_sport  = 1024 + (n & 0xf);
+    flow->orig_dport  = SERVICE_PORT;
+    flow->reply_src   = flow->orig_dst;
+    flow->reply_dst   = flow->orig_src;
+    flow->reply_sport = flow->orig_dport;
+    flow->reply_dport = flow->orig_sport;
+}
+
+static void
+queue_event(const conntrack_nl_entry_t *flow, const int event)
+{
+    if(event_nl.groups == 0)
+        return;
+
+    if(num_events == max_events)
+    {
+        max_events = max_events ? max_events * 2 : 1024;
+        if((events = realloc(events, max_events * sizeof(*events))) == NULL)
+        {
+            fprintf(stderr, "realloc failed for %lu events\n", max_events);
+            exit(1);
+        }
+    }
+
+    events[num_events] = *flow;
+    events[num_events++].event = event;
+}
+
+static void
+churn(const unsigned long count)
+{
+    unsigned long i, slot;
+
+    for(i=0; i < count; i++)
+    {
+        slot = random() % num_flows;
+        queue_event(&flows[slot], CONNTRACK_NL_EVENT_DESTROY);
+        make_flow(&flows[slot]);
+        queue_event(&flows[slot], CONNTRACK_NL_EVENT_NEW);
+    }
+}
+
+/* Replayed conntrack
+*/
+conntrack_nl_t *
+conntrack_nl_open(const unsigned int event_groups)
+{
+    if(event_groups == 0)
+        return &dump_nl;
+
+    event_nl.groups = event_groups;
+    return &event_nl;
+}
+
+void
+conntrack_nl_close(conntrack_nl_t *nl)
+{
+    nl->groups = 0;
+}
+
+int
+conntrack_nl_dump(conntrack_nl_t *nl, const uint32_t mark,
+        conntrack_nl_cb cb, void *arg)
+{
+    unsigned long i;
+
+    for(i=0; i < num_flows; i++)
+        if((mark == 0 || flows[i].mark == mark) && cb(&flows[i], arg) != 0)
+            return CONNTRACK_NL_STOPPED;
+
+    return CONNTRACK_NL_SUCCESS;
+}
+
+int
+conntrack_nl_delete(conntrack_nl_t *nl, const conntrack_nl_entry_t *entry)
+{
+    return CONNTRACK_NL_SUCCESS;
+}
+
+int
+conntrack_nl_read_events(conntrack_nl_t *nl, conntrack_nl_cb cb, void *arg)
+{
+    unsigned long i, n = num_events;
+
+    num_events = 0;
+    for(i=0; i < n; i++)
+        if(cb(&events[i], arg) != 0)
+            return CONNTRACK_NL_STOPPED;
+
+    return CONNTRACK_NL_SUCCESS;
+}
+
+/* Everything else connection tracking talks to
+*/
+int
+get_service_id_by_details(fko_srv_options_t *opts, char *protocol, int port,
+        char *nat_ip, int nat_port, uint32_t *r_id)
+{
+    *r_id = SERVICE_ID;
+    return FWKNOPD_SUCCESS;
+}
+
+int
+acc_service_permitted(acc_stanza_t *acc, const uint32_t service_id)
+{
+    return service_id == SERVICE_ID;
+}
+
+int
+sdp_ctrl_client_send_message(sdp_ctrl_client_t client, char *action,
+        json_object *data)
+{
+    reported += json_object_array_length(data);
+    return SDP_SUCCESS;
+}
+
+int
+run_extcmd(const char *cmd, char *so_buf, const size_t so_buf_sz,
+        const int want_stderr, const int timeout, int *pid_status,
+        const fko_srv_options_t * const opts)
+{
+    return EXTCMD_EXECUTION_ERROR;
+}
+
+void
+chop_newline(char *str)
+{
+    return;
+}
+
+void
+log_msg(int level, char* msg, ...)
+{
+    return;
+}
+
+void
+clean_exit(fko_srv_options_t *opts, unsigned int fw_cleanup_flag,
+        unsigned int exit_status)
+{
+    exit(exit_status);
+}
+
+static void
+setup_access(fko_srv_options_t *opts)
+{
+    acc_snapshot_t     *snap = acc_snapshot_create(SDP_IDS);
+    acc_stanza_t       *acc;
+    uint32_t            id;
+
+    for(id=1; id <= SDP_IDS; id++)
+    {
+        acc = calloc(1, sizeof(*acc));
+        acc_snapshot_add(snap, acc, id);
+    }
+
+    acc_snapshot_publish(&opts->acc_snapshot, snap);
+}
+
+static double
+cpu_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void
+run(fko_srv_options_t *opts, char *events_opt, const unsigned long churn_count,
+        const int cycles)
+{
+    unsigned long   i;
+    double          t0, first_us, cycle_us = 0;
+    int             c;
+
+    opts->config[CONF_CONNTRACK_EVENTS] = events_opt;
+
+    /* same replay for both modes
+    */
+    srandom(1);
+    next_flow = 0;
+    num_events = 0;
+    reported = 0;
+    for(i=0; i < num_flows; i++)
+        make_flow(&flows[i]);
+
+    if(init_connection_tracker(opts) != FWKNOPD_SUCCESS)
+    {
+        fprintf(stderr, "init_connection_tracker() failed\n");
+        exit(1);
+    }
+
+    t0 = cpu_us();
+    if(update_connections(opts) != FWKNOPD_SUCCESS)
+        fprintf(stderr, "update_connections() failed\n");
+    first_us = cpu_us() - t0;
+    consider_reporting_connections(opts);
+
+    for(c=0; c < cycles; c++)
+    {
+        churn(churn_count);
+
+        t0 = cpu_us();
+        if(update_connections(opts) != FWKNOPD_SUCCESS)
+            fprintf(stderr, "update_connections() failed\n");
+        cycle_us += cpu_us() - t0;
+
+        consider_reporting_connections(opts);
+    }
+
+    printf("%8s %10lu %8lu %14.0f %14.0f %12lu\n",
+            events_opt[0] == 'Y' ? "events" : "dump", num_flows, churn_count,
+            first_us, cycle_us / cycles, reported);
+
+    destroy_connection_tracker(opts);
+}
+
+int
+main(int argc, char **argv)
+{
+    fko_srv_options_t  *opts;
+    unsigned long       churn_count = 1000;
+    int                 cycles = 20;
+
+    num_flows = 100000;
+    if(argc > 1)
+        num_flows = strtoul(argv[1], NULL, 10);
+    if(argc > 2)
+        churn_count = strtoul(argv[2], NULL, 10);
+    if(argc > 3)
+        cycles = atoi(argv[3]);
+
+    if(num_flows == 0 || cycles <= 0)
+    {
+        fprintf(stderr, "Usage: %s [flows] [churn_per_cycle] [cycles]\n", argv[0]);
+        return 1;
+    }
+
+    if((flows = calloc(num_flows, sizeof(*flows))) == NULL
+            || (opts = calloc(1, sizeof(*opts))) == NULL)
+    {
+        fprintf(stderr, "calloc failed for %lu flows\n", num_flows);
+        return 1;
+    }
+
+    opts->config[CONF_ACC_STANZA_HASH_TABLE_LENGTH] = "1000";
+    opts->config[CONF_CONN_REPORT_INTERVAL]         = "1";
+    opts->config[CONF_CONNTRACK_METHOD]             = "NETLINK";
+    setup_access(opts);
+
+    printf("%8s %10s %8s %14s %14s %12s\n", "mode", "flows", "churn",
+            "first cpu us", "cycle cpu us", "reported");
+
+    run(opts, "N", churn_count, cycles);
+    run(opts, "Y", churn_count, cycles);
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Micro-benchmark for Rijndael SPA decryption.
+ *
+ * Builds one SPA packet per encryption mode and decrypts it over and over
+ * the way fwknopd does: a context is set up for the packet, then the data
+ * is decrypted and decoded with fko_decrypt_spa_data().  The cost of
+ * setting up the context alone is measured as well, so that it can be
+ * taken out.  Packets per second and the decryption time per packet
+ * (without the context setup) are reported.
+ *
+ * Usage: ./run.sh ./decrypt_bench [iterations]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fko.h"
+
+#define ENC_KEY         "bench encryption key"
+
+static const struct {
+    const char *name;
+    int         mode;
+} modes[] = {
+    { "cbc",    FKO_ENC_MODE_CBC },
+    { "ctr",    FKO_ENC_MODE_CTR },
+    { "cfb",    FKO_ENC_MODE_CFB },
+    { "ofb",    FKO_ENC_MODE_OFB },
+    { "ecb",    FKO_ENC_MODE_ECB },
+    { "legacy", FKO_ENC_MODE_CBC_LEGACY_IV },
+};
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+must(const int res, const char *what)
+{
+    if(res != FKO_SUCCESS)
+    {
+        fprintf(stderr, "%s: %s\n", what, fko_errstr(res));
+        exit(1);
+    }
+}
+
+static void
+make_packet(const int mode, char *buf, const size_t buf_len)
+{
+    fko_ctx_t   ctx;
+    char       *spa_data;
+
+    must(fko_new(&ctx), "fko_new()");
+    must(fko_set_disable_sdp_mode(ctx, 1), "fko_set_disable_sdp_mode()");
+    must(fko_set_spa_message(ctx, "1.2.3.4,tcp/22"), "fko_set_spa_message()");
+    must(fko_set_spa_encryption_mode(ctx, mode),
+            "fko_set_spa_encryption_mode()");
+    must(fko_spa_data_final(ctx, ENC_KEY, strlen(ENC_KEY), NULL, 0),
+            "fko_spa_data_final()");
+    must(fko_get_spa_data(ctx, &spa_data), "fko_get_spa_data()");
+
+    snprintf(buf, buf_len, "%s", spa_data);
+    fko_destroy(ctx);
+}
+
+static void
+run(const char *name, const int mode, const long iterations)
+{
+    char                pkt[1500];
+    fko_ctx_t           ctx;
+    double              t0, ctx_s, dec_s;
+    long                i;
+
+    make_packet(mode, pkt, sizeof(pkt));
+
+    t0 = now_s();
+    for(i=0; i < iterations; i++)
+    {
+        must(fko_new_with_data(&ctx, pkt, NULL, 0, mode, NULL, 0,
+                    FKO_HMAC_UNKNOWN, 0), "fko_new_with_data()");
+        fko_destroy(ctx);
+    }
+    ctx_s = now_s() - t0;
+
+    t0 = now_s();
+    for(i=0; i < iterations; i++)
+    {
+        must(fko_new_with_data(&ctx, pkt, NULL, 0, mode, NULL, 0,
+                    FKO_HMAC_UNKNOWN, 0), "fko_new_with_data()");
+        must(fko_decrypt_spa_data(ctx, ENC_KEY, strlen(ENC_KEY)),
+                "fko_decrypt_spa_data()");
+        fko_destroy(ctx);
+    }
+    dec_s = now_s() - t0;
+
+    printf("%8s %12.0f %12.0f %12.2f\n", name,
+            iterations / ctx_s, iterations / dec_s,
+            (dec_s - ctx_s) * 1e6 / iterations);
+}
+
+int
+main(int argc, char **argv)
+{
+    long    iterations = 200000;
+    size_t  i;
+
+    if(argc > 1)
+        iterations = strtol(argv[1], NULL, 10);
+
+    if(iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %12s %12s %12s\n", "mode", "ctx pps", "pps",
+            "decrypt us");
+
+    for(i=0; i < sizeof(modes)/sizeof(modes[0]); i++)
+        run(modes[i].name, modes[i].mode, iterations);
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Micro-benchmark for the replay cache digest index.
+ *
+ * Populates the index with N random base64 SHA256-sized digests for N
+ * from 1k to 10M and reports the average cost of a lookup for digests
+ * that are (replays) and are not (new packets) in the cache.  The
+ * per-lookup cost should stay flat as N grows.
+ *
+ * Usage: ./run.sh ./digest_index_bench [max_entries]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "digest_index.h"
+
+#define DIGEST_LEN      43      /* base64 SHA256 without padding */
+#define LOOKUPS         1000000
+
+static const char b64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static const char *
+bench_key_cb(const void *data, int *key_len)
+{
+    *key_len = DIGEST_LEN;
+    return (const char *)data;
+}
+
+static void
+rand_digest(char *buf)
+{
+    int i;
+
+    for(i=0; i < DIGEST_LEN; i++)
+        buf[i] = b64[random() & 63];
+    buf[DIGEST_LEN] = '\0';
+}
+
+static double
+elapsed_ns(const struct timespec *start, const struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec) * 1e9
+        + (end->tv_nsec - start->tv_nsec);
+}
+
+int
+main(int argc, char **argv)
+{
+    digest_index_t  *idx;
+    char            *digests, miss[DIGEST_LEN+1];
+    unsigned long    n, i, max_n = 10000000, hits;
+    struct timespec  t0, t1;
+    double           hit_ns, miss_ns;
+
+    if(argc > 1)
+        max_n = strtoul(argv[1], NULL, 10);
+
+    srandom(1);
+
+    printf("%12s %14s %14s %12s\n", "entries", "hit ns/lookup",
+            "miss ns/lookup", "slots");
+
+    for(n = 1000; n <= max_n; n *= 10)
+    {
+        if((digests = malloc(n * (DIGEST_LEN+1))) == NULL)
+        {
+            fprintf(stderr, "malloc failed for %lu entries\n", n);
+            return 1;
+        }
+
+        idx = digest_index_create(0, bench_key_cb);
+        for(i=0; i < n; i++)
+        {
+            rand_digest(digests + i * (DIGEST_LEN+1));
+            digest_index_add(idx, digests + i * (DIGEST_LEN+1),
+                    DIGEST_LEN, digests + i * (DIGEST_LEN+1));
+        }
+
+        hits = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(i=0; i < LOOKUPS; i++)
+            if(digest_index_find(idx,
+                    digests + (random() % n) * (DIGEST_LEN+1), DIGEST_LEN) != NULL)
+                hits++;
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        hit_ns = elapsed_ns(&t0, &t1) / LOOKUPS;
+
+        rand_digest(miss);
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for(i=0; i < LOOKUPS; i++)
+        {
+            miss[i % DIGEST_LEN] = b64[i & 63];
+            if(digest_index_find(idx, miss, DIGEST_LEN) != NULL)
+                hits++;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        miss_ns = elapsed_ns(&t0, &t1) / LOOKUPS;
+
+        printf("%12lu %14.1f %14.1f %12u\n", n, hit_ns, miss_ns, idx->mask + 1);
+
+        if(hits < LOOKUPS)
+            fprintf(stderr, "unexpected lookup misses: %lu\n", LOOKUPS - hits);
+
+        digest_index_destroy(idx);
+        free(digests);
+    }
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+/*
+ * Lookup benchmark for the SDP ID / service ID tables.
+ *
+ * Fills a table with N integer IDs and times random lookups (90% hits),
+ * once through hash_table.c the way the callers used it (format the ID,
+ * bfromcstr() it, look it up, bdestroy() it) and once through
+ * int_hash_table.c with the ID itself as the key.
+ *
+ * Usage: ./hash_table_bench [ids] [lookups] [buckets]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+#include "bstrlib.h"
+#include "hash_table.h"
+#include "int_hash_table.h"
+
+static uint32_t rand_state = 0x2545f491;
+
+static uint32_t
+rnd(void)
+{
+    rand_state ^= rand_state << 13;
+    rand_state ^= rand_state >> 17;
+    rand_state ^= rand_state << 5;
+    return rand_state;
+}
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+delete_str_cb(hash_table_node_t *node)
+{
+    bdestroy((bstring)(node->key));
+}
+
+static bstring
+id_key(const uint32_t id)
+{
+    char    buf[16];
+
+    snprintf(buf, sizeof(buf), "%"PRIu32, id);
+    return bfromcstr(buf);
+}
+
+int
+main(int argc, char **argv)
+{
+    int                 num_ids = 10000, lookups = 2000000, buckets = 100;
+    int                 i, str_hits = 0, int_hits = 0;
+    uint32_t           *ids, *probes;
+    hash_table_t       *str_tbl;
+    int_hash_table_t   *int_tbl;
+    bstring             key;
+    double              t0, str_s, int_s;
+
+    if(argc > 1)
+        num_ids = atoi(argv[1]);
+    if(argc > 2)
+        lookups = atoi(argv[2]);
+    if(argc > 3)
+        buckets = atoi(argv[3]);
+
+    if(num_ids <= 0 || lookups <= 0 || buckets <= 0 || buckets >= MAX_NUMBER_OF_BUCKETS)
+    {
+        fprintf(stderr, "Usage: %s [ids] [lookups] [buckets < %d]\n",
+                argv[0], MAX_NUMBER_OF_BUCKETS);
+        return 1;
+    }
+
+    ids     = calloc(num_ids, sizeof(uint32_t));
+    probes  = calloc(lookups, sizeof(uint32_t));
+    str_tbl = hash_table_create(buckets, NULL, NULL, delete_str_cb);
+    int_tbl = int_hash_table_create(buckets, NULL);
+    if(ids == NULL || probes == NULL || str_tbl == NULL || int_tbl == NULL)
+    {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+
+    /* Unique random IDs, the odd ones so that even probes always miss
+    */
+    for(i=0; i < num_ids; i++)
+    {
+        do {
+            ids[i] = rnd() | 1;
+        } while(int_hash_table_get(int_tbl, ids[i]) != NULL);
+
+        hash_table_set(str_tbl, id_key(ids[i]), &ids[i]);
+        int_hash_table_set(int_tbl, ids[i], &ids[i]);
+    }
+
+    for(i=0; i < lookups; i++)
+        probes[i] = (rnd() % 10) ? ids[rnd() % num_ids] : (rnd() & ~1U);
+
+    t0 = now_s();
+    for(i=0; i < lookups; i++)
+    {
+        key = id_key(probes[i]);
+        if(hash_table_get(str_tbl, key) != NULL)
+            str_hits++;
+        bdestroy(key);
+    }
+    str_s = now_s() - t0;
+
+    t0 = now_s();
+    for(i=0; i < lookups; i++)
+        if(int_hash_table_get(int_tbl, probes[i]) != NULL)
+            int_hits++;
+    int_s = now_s() - t0;
+
+    if(str_hits != int_hits)
+    {
+        fprintf(stderr, "MISMATCH: bstring table found %d, integer table found %d\n",
+                str_hits, int_hits);
+        return 1;
+    }
+
+    printf("%10s %10s %10s %14s %14s\n", "ids", "buckets", "hits",
+            "bstring ns/op", "integer ns/op");
+    printf("%10d %10d %10d %14.1f %14.1f\n", num_ids, buckets, int_hits,
+            str_s * 1e9 / lookups, int_s * 1e9 / lookups);
+
+    hash_table_destroy(str_tbl);
+    int_hash_table_destroy(int_tbl);
+    free(ids);
+    free(probes);
+    return 0;
+}
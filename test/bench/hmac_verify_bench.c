@@ -0,0 +1,140 @@
+/*
+ * Micro-benchmark for SPA HMAC verification.
+ *
+ * Builds one SPA packet per HMAC digest type and verifies it over and
+ * over, first with the raw HMAC key and then with a key set up once by
+ * fko_new_hmac_key().  Two paths are measured for each: the context path
+ * fwknopd takes through fko_new_with_data() (fko_verify_hmac() and
+ * fko_verify_hmac_key(), decryption left out) and the context free
+ * fko_verify_hmac_data() and fko_verify_hmac_data_key().  Packets per
+ * second are reported for each.
+ *
+ * Usage: ./run.sh ./hmac_verify_bench [iterations]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fko.h"
+
+#define ENC_KEY         "bench encryption key"
+#define HMAC_KEY        "bench hmac key, not the encryption key"
+
+static const char *hmac_names[] = {
+    "", "md5", "sha1", "sha256", "sha384", "sha512"
+};
+
+static double
+now_s(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+must(const int res, const char *what)
+{
+    if(res != FKO_SUCCESS)
+    {
+        fprintf(stderr, "%s: %s\n", what, fko_errstr(res));
+        exit(1);
+    }
+}
+
+static void
+make_packet(const int hmac_type, char *buf, const size_t buf_len)
+{
+    fko_ctx_t   ctx;
+    char       *spa_data;
+
+    must(fko_new(&ctx), "fko_new()");
+    must(fko_set_disable_sdp_mode(ctx, 1), "fko_set_disable_sdp_mode()");
+    must(fko_set_spa_message(ctx, "1.2.3.4,tcp/22"), "fko_set_spa_message()");
+    must(fko_set_spa_hmac_type(ctx, hmac_type), "fko_set_spa_hmac_type()");
+    must(fko_spa_data_final(ctx, ENC_KEY, strlen(ENC_KEY),
+                HMAC_KEY, strlen(HMAC_KEY)), "fko_spa_data_final()");
+    must(fko_get_spa_data(ctx, &spa_data), "fko_get_spa_data()");
+
+    snprintf(buf, buf_len, "%s", spa_data);
+    fko_destroy(ctx);
+}
+
+static void
+run(const int hmac_type, const long iterations)
+{
+    char            pkt[1500];
+    fko_ctx_t       ctx;
+    fko_hmac_key_t  hmac_key;
+    double          t0, ctx_raw, ctx_key, data_raw, data_key;
+    int             pkt_len;
+    long            i;
+
+    make_packet(hmac_type, pkt, sizeof(pkt));
+    pkt_len = strlen(pkt);
+
+    t0 = now_s();
+    for(i=0; i < iterations; i++)
+    {
+        must(fko_new_with_data(&ctx, pkt, NULL, 0, FKO_ENC_MODE_CBC,
+                    HMAC_KEY, strlen(HMAC_KEY), hmac_type, 0),
+                "fko_new_with_data()");
+        fko_destroy(ctx);
+    }
+    ctx_raw = iterations / (now_s() - t0);
+
+    t0 = now_s();
+    for(i=0; i < iterations; i++)
+        must(fko_verify_hmac_data(pkt, pkt_len, HMAC_KEY, strlen(HMAC_KEY),
+                    hmac_type), "fko_verify_hmac_data()");
+    data_raw = iterations / (now_s() - t0);
+
+    must(fko_new_hmac_key(&hmac_key, HMAC_KEY, strlen(HMAC_KEY), hmac_type),
+            "fko_new_hmac_key()");
+
+    t0 = now_s();
+    for(i=0; i < iterations; i++)
+    {
+        must(fko_new_with_data_hmac_key(&ctx, pkt, NULL, 0,
+                    FKO_ENC_MODE_CBC, hmac_key, 0),
+                "fko_new_with_data_hmac_key()");
+        fko_destroy(ctx);
+    }
+    ctx_key = iterations / (now_s() - t0);
+
+    t0 = now_s();
+    for(i=0; i < iterations; i++)
+        must(fko_verify_hmac_data_key(hmac_key, pkt, pkt_len),
+                "fko_verify_hmac_data_key()");
+    data_key = iterations / (now_s() - t0);
+
+    fko_destroy_hmac_key(hmac_key);
+
+    printf("%8s %6d %14.0f %14.0f %14.0f %14.0f\n", hmac_names[hmac_type],
+            pkt_len, ctx_raw, ctx_key, data_raw, data_key);
+}
+
+int
+main(int argc, char **argv)
+{
+    long    iterations = 1000000;
+    int     hmac_type;
+
+    if(argc > 1)
+        iterations = strtol(argv[1], NULL, 10);
+
+    if(iterations <= 0)
+    {
+        fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+        return 1;
+    }
+
+    printf("%8s %6s %14s %14s %14s %14s\n", "hmac", "bytes",
+            "ctx raw pps", "ctx key pps", "data raw pps", "data key pps");
+
+    for(hmac_type = FKO_HMAC_MD5; hmac_type < FKO_LAST_HMAC_MODE; hmac_type++)
+        run(hmac_type, iterations);
+
+    return 0;
+}
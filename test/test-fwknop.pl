@@ -5669,6 +5669,24 @@ sub digest_cache_structure() {
         &write_test_file("[+] DBM digest file format, " .
             "assuming this is valid.\n", $APPEND_RESULTS,
             $curr_test_file);
+    } elsif (-s $default_digest_file >= 24) {
+
+        ### binary format: 24 byte header ("FKODGST\0", version,
+        ### record size, byte order marker) followed by whole records
+        open D1, "< $default_digest_file" or
+            die "[*] could not open $default_digest_file: $!";
+        binmode D1;
+        my $hdr = '';
+        read D1, $hdr, 24;
+        close D1;
+        my ($magic, $version, $rec_size, $byte_order) = unpack('a8 L L L', $hdr);
+        if ($magic ne "FKODGST\0" or $byte_order != 0x01020304
+                or $rec_size == 0
+                or ((-s $default_digest_file) - 24) % $rec_size != 0) {
+            &write_test_file("[-] invalid binary digest.cache header or size.\n",
+                $curr_test_file);
+            $rv = 0;
+        }
     } else {
         ### don't know what kind of file the digest.cache is
         &write_test_file("[-] unrecognized file type for " .